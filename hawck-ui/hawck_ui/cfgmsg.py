@@ -1,6 +1,7 @@
 import struct
 import os
 import json
+import socket
 from functools import partial
 from .os_open import OSOpen
 from .privesc import getSudoMethod
@@ -16,9 +17,40 @@ def sendcfg(path, opath, cfg):
         json_str = fd.read(sz).decode("utf-8")
         return json.loads(json_str)
 
-sendMacroD = partial(sendcfg,
-                     os.path.expandvars("$HOME/.local/share/hawck/lua-comm.fifo"),
-                     os.path.expandvars("$HOME/.local/share/hawck/json-comm.fifo"))
+CONTROL_REPLY = 0
+
+def recvexact(sock, sz):
+    buf = b""
+    while len(buf) < sz:
+        got = sock.recv(sz - len(buf))
+        if not got:
+            raise ConnectionError("Control socket closed")
+        buf += got
+    return buf
+
+def sendsock(path, cfg):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(path)
+        msg = bytes(cfg, "utf-8")
+        sock.sendall(struct.pack("I", len(msg)) + msg)
+        while True:
+            (sz, kind) = struct.unpack("II", recvexact(sock, 8))
+            json_str = recvexact(sock, sz).decode("utf-8")
+            if kind == CONTROL_REPLY:
+                return json.loads(json_str)
+
+def sendMacroD(cfg):
+    path = os.path.expandvars("$XDG_RUNTIME_DIR/hawck/control.sock")
+    if os.path.exists(path):
+        try:
+            return sendsock(path, cfg)
+        except (ConnectionRefusedError, FileNotFoundError):
+            # Left behind by a MacroD that did not exit cleanly, or by one
+            # without the control socket.
+            pass
+    return sendcfg(os.path.expandvars("$HOME/.local/share/hawck/lua-comm.fifo"),
+                   os.path.expandvars("$HOME/.local/share/hawck/json-comm.fifo"),
+                   cfg)
 
 @su.do("hawck-input")
 def sendInputD(cfg):
@@ -26,7 +26,15 @@
  * =====================================================================================
  */
 
+extern "C" {
+    #include <fcntl.h>
+    #include <string.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+}
+
 #include "CSV.hpp"
+#include "SystemError.hpp"
 #include <algorithm>
 #include <tuple>
 
@@ -140,3 +148,100 @@ vector<const string *> *CSV::getRowCells(int row_n) {
     }
     return vec;
 }
+
+CSVView::CSVView(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw SystemError("Unable to open " + path + ": ", errno);
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw SystemError("Unable to stat " + path + ": ", err);
+    }
+    // The file may change size while it is read, so this is only a hint.
+    buf.reserve(stbuf.st_size);
+    char chunk[4096];
+    for (;;) {
+        ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            int err = errno;
+            ::close(fd);
+            throw SystemError("Unable to read " + path + ": ", err);
+        }
+        if (n == 0)
+            break;
+        buf.append(chunk, n);
+    }
+    ::close(fd);
+    data = buf.data();
+    size = buf.size();
+
+    const char *nl = size ? (const char *) memchr(data, '\n', size) : nullptr;
+    size_t end = nl ? size_t(nl - data) : size;
+    string_view line(data, end);
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+    header = splitLine(line);
+    body = min(end + 1, size);
+}
+
+CSVView::~CSVView() {}
+
+/**
+ * Strip the quotes from a cell, unescaping doubled quotes into `scratch`
+ * if there are any.
+ */
+static string_view unquote(string_view cell, string &scratch) {
+    if (cell.size() < 2 || cell.front() != '"' || cell.back() != '"')
+        return cell;
+    cell = cell.substr(1, cell.size() - 2);
+    if (cell.find('"') == string_view::npos)
+        return cell;
+    scratch.clear();
+    for (size_t i = 0; i < cell.size(); i++) {
+        scratch += cell[i];
+        if (cell[i] == '"' && i + 1 < cell.size() && cell[i + 1] == '"')
+            i++;
+    }
+    return scratch;
+}
+
+/** Find the end of the cell starting at `beg`, quoted commas don't count. */
+static size_t cellEnd(string_view line, size_t beg) {
+    bool in_quot = false;
+    for (size_t i = beg; i < line.size(); i++) {
+        if (line[i] == '"')
+            in_quot = !in_quot;
+        else if (line[i] == ',' && !in_quot)
+            return i;
+    }
+    return line.size();
+}
+
+string_view CSVView::cellAt(string_view line, int col, string &scratch) {
+    size_t beg = 0;
+    for (int i = 0; i < col; i++) {
+        size_t end = cellEnd(line, beg);
+        if (end == line.size())
+            return string_view();
+        beg = end + 1;
+    }
+    return unquote(line.substr(beg, cellEnd(line, beg) - beg), scratch);
+}
+
+vector<string> CSVView::splitLine(string_view line) {
+    vector<string> cells;
+    string scratch;
+    size_t beg = 0;
+    for (;;) {
+        size_t end = cellEnd(line, beg);
+        cells.emplace_back(unquote(line.substr(beg, end - beg), scratch));
+        if (end == line.size())
+            break;
+        beg = end + 1;
+    }
+    return cells;
+}
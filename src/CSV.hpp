@@ -31,7 +31,12 @@
  * @brief CSV reading library.
  */
 
+#pragma once
+
+#include <charconv>
+#include <cstring>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <iostream>
 #include <fstream>
@@ -163,3 +168,105 @@ public:
     /** See _write */
     inline void write(std::ostream &s) { _write(s); }
 };
+
+/**
+ * Read-only view of a csv file that is read into memory at once.
+ *
+ * Unlike CSV, no cells are copied: columns are extracted by scanning the
+ * file, and cells are handed out as string_views into the buffer. Only
+ * quoted cells with escaped quotes in them need to be copied.
+ *
+ * The file is not mapped, InputD reads files that users edit, and one
+ * that is truncated while it is mapped would kill it with SIGBUS.
+ *
+ * @throws SystemError If the file cannot be read.
+ */
+class CSVView {
+private:
+    std::string buf;
+    const char *data = nullptr;
+    size_t size = 0;
+    std::vector<std::string> header;
+    /** Offset of the first row after the header */
+    size_t body = 0;
+
+    /**
+     * Find cell `col` of a line.
+     *
+     * @param scratch Storage for the cell, if it has to be unescaped.
+     * @return The cell, empty if the line has no such cell.
+     */
+    static std::string_view cellAt(std::string_view line, int col, std::string &scratch);
+
+    /** Split a line into all of its cells. */
+    static std::vector<std::string> splitLine(std::string_view line);
+
+public:
+    explicit CSVView(const std::string &path);
+
+    CSVView(const CSVView &) = delete;
+    CSVView &operator=(const CSVView &) = delete;
+
+    ~CSVView();
+
+    /**
+     * Get the column index given a column name.
+     *
+     * @return column index, or -1 if no such name is found.
+     */
+    inline int getColIndex(std::string_view name) const noexcept {
+        for (size_t i = 0; i < header.size(); i++)
+            if (header[i] == name)
+                return i;
+        return -1;
+    }
+
+    /** Get the number of columns in the header. */
+    inline int nCols() const noexcept { return header.size(); }
+
+    /**
+     * Call `fn` with cell `col` of every row after the header, rows that
+     * are too short give an empty cell.
+     *
+     * The string_view is only valid during the call.
+     */
+    template <class Fn>
+    void forEachCell(int col, Fn fn) const {
+        std::string scratch;
+        size_t pos = body;
+        while (pos < size) {
+            const char *nl = (const char *) memchr(data + pos, '\n', size - pos);
+            size_t end = nl ? size_t(nl - data) : size;
+            std::string_view line(data + pos, end - pos);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            fn(cellAt(line, col, scratch));
+            pos = end + 1;
+        }
+    }
+
+    /**
+     * Call `fn` with cell `col` of every row parsed as a number, cells that
+     * are not numbers are skipped.
+     *
+     * @return The number of skipped cells.
+     */
+    template <class T, class Fn>
+    size_t forEachNumber(int col, Fn fn) const {
+        size_t invalid = 0;
+        forEachCell(col, [&](std::string_view cell) {
+            while (!cell.empty() && (cell.front() == ' ' || cell.front() == '\t'))
+                cell.remove_prefix(1);
+            while (!cell.empty() && (cell.back() == ' ' || cell.back() == '\t'))
+                cell.remove_suffix(1);
+            T num;
+            auto [end, err] = std::from_chars(cell.data(), cell.data() + cell.size(), num);
+            if (cell.empty() || err != std::errc() || end != cell.data() + cell.size()) {
+                invalid++;
+                return;
+            }
+            fn(num);
+        });
+        return invalid;
+    }
+};
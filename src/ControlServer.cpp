@@ -0,0 +1,209 @@
+extern "C" {
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <stdio.h>
+    #include <string.h>
+    #include <sys/eventfd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <syslog.h>
+    #include <unistd.h>
+}
+
+#include "ControlServer.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+
+ControlServer::ControlServer(const string &addr, Handler handler)
+    : srv(addr),
+      handler(handler)
+{
+    if (chmod(addr.c_str(), 0600) == -1)
+        throw SystemError("Unable to chmod control socket: ", errno);
+    if ((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        throw SystemError("Unable to create eventfd: ", errno);
+}
+
+ControlServer::~ControlServer() {
+    running = false;
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) == -1)
+        syslog(LOG_ERR, "Unable to wake up control server: %s", strerror(errno));
+    if (thread.joinable())
+        thread.join();
+    for (auto &client : clients)
+        ::close(client.fd);
+    ::close(wake_fd);
+}
+
+void ControlServer::start() {
+    thread = std::thread([this]() { run(); });
+}
+
+void ControlServer::broadcast(const string &json) {
+    {
+        lock_guard<mutex> lock(events_mtx);
+        events.push_back(json);
+    }
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        syslog(LOG_ERR, "Unable to wake up control server: %s", strerror(errno));
+}
+
+void ControlServer::queue(Client &client, FrameKind kind, const string &json) {
+    Header hdr = {uint32_t(json.size()), kind};
+    client.out.append((const char *) &hdr, sizeof(hdr));
+    client.out.append(json);
+}
+
+bool ControlServer::receive(Client &client) {
+    char buf[4096];
+    // The rest is read once poll() returns again, so that the buffer stays
+    // bounded however fast the client sends.
+    while (client.in.size() < max_buffered) {
+        ssize_t n = ::read(client.fd, buf, sizeof(buf));
+        if (n == 0)
+            return false;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+        client.in.append(buf, n);
+    }
+
+    size_t pos = 0;
+    while (client.in.size() - pos >= sizeof(uint32_t)) {
+        uint32_t sz;
+        memcpy(&sz, client.in.data() + pos, sizeof(sz));
+        if (sz == 0 || sz >= max_request) {
+            syslog(LOG_WARNING, "Dropping control client, bad request size: %u", sz);
+            return false;
+        }
+        if (client.in.size() - pos - sizeof(sz) < sz)
+            break;
+        // The handler expects a NUL-terminated string.
+        string msg = client.in.substr(pos + sizeof(sz), sz);
+        pos += sizeof(sz) + sz;
+        string reply;
+        try {
+            reply = handler(msg.c_str(), msg.size());
+        } catch (const std::exception &e) {
+            syslog(LOG_ERR, "Error in control request: %s", e.what());
+        }
+        queue(client, CONTROL_REPLY, reply);
+    }
+    client.in.erase(0, pos);
+    return client.out.size() <= max_pending;
+}
+
+bool ControlServer::flush(Client &client) {
+    while (!client.out.empty()) {
+        ssize_t n = ::send(client.fd, client.out.data(), client.out.size(),
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.out.erase(0, n);
+    }
+    return true;
+}
+
+void ControlServer::run() {
+    vector<struct pollfd> pfds;
+    vector<string> pending;
+
+    while (running) {
+        pfds.clear();
+        pfds.push_back({srv.getfd(), POLLIN, 0});
+        pfds.push_back({wake_fd, POLLIN, 0});
+        for (const auto &client : clients)
+            pfds.push_back({client.fd, short(POLLIN | (client.out.empty() ? 0 : POLLOUT)), 0});
+
+        if (::poll(pfds.data(), pfds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Control server stopped, error in poll(): %s", strerror(errno));
+            return;
+        }
+        if (!running)
+            break;
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t cnt;
+            if (::read(wake_fd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+                syslog(LOG_ERR, "Unable to read from eventfd: %s", strerror(errno));
+            {
+                lock_guard<mutex> lock(events_mtx);
+                pending.swap(events);
+            }
+            for (auto &client : clients)
+                for (const auto &json : pending)
+                    queue(client, CONTROL_EVENT, json);
+            pending.clear();
+        }
+
+        vector<Client> alive;
+        alive.reserve(clients.size());
+        for (size_t i = 0; i < clients.size(); i++) {
+            Client &client = clients[i];
+            short revents = pfds[i + 2].revents;
+            bool ok = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                ok = receive(client);
+            if (ok)
+                ok = flush(client) && client.out.size() <= max_pending;
+            if (ok) {
+                alive.push_back(std::move(client));
+            } else {
+                syslog(LOG_INFO, "Control client disconnected");
+                ::close(client.fd);
+            }
+        }
+        clients.swap(alive);
+
+        if (pfds[0].revents & POLLIN) {
+            try {
+                int fd = srv.accept();
+                if (clients.size() >= max_clients) {
+                    syslog(LOG_WARNING, "Too many control clients, refusing connection");
+                    ::close(fd);
+                } else {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    clients.push_back({fd, "", ""});
+                }
+            } catch (const SocketError &e) {
+                syslog(LOG_ERR, "Control server: %s", e.what());
+            }
+        }
+    }
+}
+
+string ControlServer::jsonString(const string &s) {
+    string out = "\"";
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
@@ -0,0 +1,99 @@
+/** @file ControlServer.hpp
+ *
+ * @brief Control socket that serves the LuaConfig protocol to many
+ *        clients at once.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "UNIXSocket.hpp"
+
+/**
+ * Persistent replacement for the lua-comm/json-comm FIFO pair.
+ *
+ * Requests have the same framing as on lua-comm.fifo, a 32 bit length
+ * followed by Lua code. Everything sent by the server starts with a
+ * ControlServer::Header, followed by JSON. Replies are sent in the order
+ * that requests arrived in, so a client may send several requests without
+ * waiting, while events sent with broadcast() can arrive at any point in
+ * between replies.
+ */
+class ControlServer {
+public:
+    using Handler = std::function<std::string(const char *msg, size_t sz)>;
+
+    enum FrameKind : uint32_t {
+        /** Reply to a request, the JSON returned by the handler. */
+        CONTROL_REPLY = 0,
+        /** Event pushed to every client, a JSON object. */
+        CONTROL_EVENT = 1,
+    };
+
+    struct Header {
+        uint32_t len;
+        uint32_t kind;
+    };
+
+    static constexpr uint32_t max_request = 16384;
+    /** Bytes read from a client before its requests are handled. */
+    static constexpr size_t max_buffered = 4 * max_request;
+    static constexpr size_t max_clients = 16;
+    /** Clients with more unsent data than this are dropped. */
+    static constexpr size_t max_pending = 1 << 20;
+
+private:
+    struct Client {
+        int fd;
+        std::string in;
+        std::string out;
+    };
+
+    UNIXServer srv;
+    Handler handler;
+    std::vector<Client> clients;
+    /** eventfd used to wake up the server thread */
+    int wake_fd = -1;
+    std::mutex events_mtx;
+    std::vector<std::string> events;
+    std::atomic<bool> running{true};
+    std::thread thread;
+
+    void run();
+
+    /** Read from a client and handle all the complete requests.
+     *  @return False if the client should be dropped. */
+    bool receive(Client &client);
+
+    /** @return False if the client should be dropped. */
+    bool flush(Client &client);
+
+    static void queue(Client &client, FrameKind kind, const std::string &json);
+
+public:
+    /**
+     * Listen on a socket, only the owner is allowed to connect.
+     *
+     * @param addr Path of the socket.
+     * @param handler Called with every request, from the server thread.
+     */
+    ControlServer(const std::string &addr, Handler handler);
+
+    ~ControlServer();
+
+    /** Start serving clients in a new thread. */
+    void start();
+
+    /** Send an event to all connected clients, safe to call from any
+     *  thread. */
+    void broadcast(const std::string &json);
+
+    /** Quote a string for use in JSON. */
+    static std::string jsonString(const std::string &s);
+};
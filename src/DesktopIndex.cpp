@@ -0,0 +1,197 @@
+extern "C" {
+    #include <stdlib.h>
+    #include <syslog.h>
+    #include <sys/inotify.h>
+    #include <sys/stat.h>
+}
+
+#include <filesystem>
+#include <fstream>
+
+#include "DesktopIndex.hpp"
+#include "SystemError.hpp"
+#include "utils.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+DesktopIndex::DesktopIndex(vector<string> dirs) : dirs(std::move(dirs)) {}
+
+DesktopIndex::~DesktopIndex() {
+    if (builder.joinable())
+        builder.join();
+}
+
+vector<string> DesktopIndex::defaultDirs() {
+    vector<string> data_dirs;
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    if (data_home && *data_home)
+        data_dirs.push_back(data_home);
+    else if (home)
+        data_dirs.push_back(pathJoin(home, ".local/share"));
+
+    const char *env = getenv("XDG_DATA_DIRS");
+    string rest = (env && *env) ? env : "/usr/local/share:/usr/share";
+    size_t pos = 0;
+    while (pos <= rest.size()) {
+        size_t end = rest.find(':', pos);
+        if (end == string::npos)
+            end = rest.size();
+        if (end > pos)
+            data_dirs.push_back(rest.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    for (auto &dir : data_dirs)
+        dir = pathJoin(dir, "applications");
+    return data_dirs;
+}
+
+static string trim(const string &s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == string::npos)
+        return "";
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+DesktopEntry DesktopIndex::parse(const string &path) {
+    ifstream in(path);
+    if (!in)
+        throw SystemError("Unable to open " + path + ": ", errno);
+
+    static const string action_prefix = "[Desktop Action ";
+    DesktopEntry ent;
+    ent.path = path;
+    DesktopEntry::Group *group = nullptr;
+    string line;
+    while (getline(in, line)) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (line[0] == '[') {
+            if (line == "[Desktop Entry]")
+                group = &ent.entry;
+            else if (stringStartsWith(line, action_prefix) && line.back() == ']')
+                group = &ent.actions[line.substr(action_prefix.size(),
+                                                 line.size() - action_prefix.size() - 1)];
+            else
+                group = nullptr;
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (!group || eq == string::npos)
+            continue;
+        (*group)[trim(line.substr(0, eq))] = trim(line.substr(eq + 1));
+    }
+    if (in.bad())
+        throw SystemError("Unable to read " + path + ": ", errno);
+    return ent;
+}
+
+void DesktopIndex::build() {
+    auto tbl = mkuniq(new Table());
+    for (const auto &dir : dirs) {
+        error_code ec;
+        fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            const fs::path &path = it->path();
+            if (path.extension() != ".desktop" || !it->is_regular_file(ec))
+                continue;
+            // The id is the path below applications/, with the slashes
+            // turned into dashes.
+            string id = path.lexically_relative(dir).replace_extension().string();
+            replace(id.begin(), id.end(), '/', '-');
+            if (tbl->count(id))
+                continue;
+            try {
+                (*tbl)[id] = parse(path);
+            } catch (const SystemError &e) {
+                syslog(LOG_WARNING, "Unable to index desktop file: %s", e.what());
+            }
+        }
+    }
+    table.replace(std::move(tbl));
+    setReady();
+}
+
+void DesktopIndex::setReady() noexcept {
+    lock_guard<mutex> lock(ready_mtx);
+    ready = true;
+    ready_cond.notify_all();
+}
+
+void DesktopIndex::watchTree(const string &dir) noexcept {
+    try {
+        fsw.add(dir);
+    } catch (const SystemError &) {
+        // Directories that don't exist hold no applications.
+        return;
+    }
+    error_code ec;
+    fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_directory(ec))
+            continue;
+        try {
+            fsw.add(it->path());
+        } catch (const SystemError &) {
+            // It is gone already.
+        }
+    }
+}
+
+void DesktopIndex::start() {
+    builder = thread([this]() {
+        // Packages are installed with a flurry of writes and renames, the
+        // index is only built again once they have settled, and only once
+        // for all the files that changed.
+        fsw.setAutoAdd(false);
+        fsw.setWatchDirs(true);
+        fsw.setCoalesce(500);
+        // Subdirectories like kde4/ hold applications too.
+        for (const auto &dir : dirs)
+            watchTree(dir);
+        try {
+            build();
+        } catch (const exception &e) {
+            syslog(LOG_ERR, "Unable to index desktop files: %s", e.what());
+            setReady();
+        }
+        syslog(LOG_INFO, "Indexed %zu desktop files", size());
+        fsw.setFlushCallback([this]() {
+            if (!dirty)
+                return;
+            dirty = false;
+            try {
+                build();
+            } catch (const exception &e) {
+                syslog(LOG_ERR, "Unable to index desktop files: %s", e.what());
+            }
+        });
+        fsw.asyncWatch([this](FSEvent &ev) {
+            if (S_ISDIR(ev.stbuf.st_mode) && (ev.mask & (IN_CREATE | IN_MOVED_TO)))
+                watchTree(ev.path);
+            dirty = true;
+            return true;
+        });
+    });
+}
+
+bool DesktopIndex::find(const string &id, DesktopEntry *out) {
+    if (!ready) {
+        unique_lock<mutex> lock(ready_mtx);
+        ready_cond.wait(lock, [this]() { return bool(ready); });
+    }
+    auto tbl = table.read();
+    auto it = tbl->find(id);
+    if (it == tbl->end())
+        return false;
+    *out = it->second;
+    return true;
+}
+
+size_t DesktopIndex::size() noexcept {
+    return table.read()->size();
+}
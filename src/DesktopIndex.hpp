@@ -0,0 +1,100 @@
+/** @file DesktopIndex.hpp
+ *
+ * @brief Index of the freedesktop .desktop files of installed applications.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+
+#include "RCU.hpp"
+#include "FSWatcher.hpp"
+
+/** A parsed .desktop file. */
+struct DesktopEntry {
+    using Group = std::unordered_map<std::string, std::string>;
+
+    std::string path;
+    /** The keys of [Desktop Entry] */
+    Group entry;
+    /** The keys of each [Desktop Action <name>], by name. */
+    std::unordered_map<std::string, Group> actions;
+};
+
+/**
+ * Desktop entries of all applications in the applications/ directories of
+ * the XDG data dirs, by desktop file id, i.e "firefox" for firefox.desktop
+ * and "kde4-kate" for kde4/kate.desktop. Like the menus of desktop
+ * environments, a file in an earlier directory hides files with the same
+ * id in later ones.
+ *
+ * The index is shared by all scripts, and kept current with inotify once
+ * start() has been called. Lookups take no locks.
+ */
+class DesktopIndex {
+    using Table = std::unordered_map<std::string, DesktopEntry>;
+
+    std::vector<std::string> dirs;
+    RCUPtr<Table> table;
+
+    std::mutex ready_mtx;
+    std::condition_variable ready_cond;
+    std::atomic<bool> ready {false};
+
+    std::thread builder;
+    FSWatcher fsw;
+    /** Whether anything changed in the batch of events being delivered,
+     *  only used by the watcher thread. */
+    bool dirty = false;
+
+    /** Publish the first table, and let lookups that waited for it in. */
+    void setReady() noexcept;
+
+    /** Watch a directory and all directories below it. */
+    void watchTree(const std::string &dir) noexcept;
+
+public:
+    /** @param dirs Directories to look for .desktop files in, in order of
+     *              precedence. */
+    explicit DesktopIndex(std::vector<std::string> dirs);
+
+    ~DesktopIndex();
+
+    /** The applications/ directories of $XDG_DATA_HOME and $XDG_DATA_DIRS */
+    static std::vector<std::string> defaultDirs();
+
+    /**
+     * Parse a .desktop file, groups other than [Desktop Entry] and
+     * [Desktop Action <name>] are left out.
+     *
+     * @throws SystemError If the file could not be read.
+     */
+    static DesktopEntry parse(const std::string &path);
+
+    /** Index all desktop files again, files that cannot be read are
+     *  skipped. */
+    void build();
+
+    /** Build the index in the background, and rebuild it whenever the
+     *  directories change. */
+    void start();
+
+    /**
+     * Look up an application, waiting for the index to be built if it
+     * has not been yet.
+     *
+     * @param id Desktop file id, without .desktop
+     * @param out Where to put a copy of the entry.
+     * @return False if there is no such application.
+     */
+    bool find(const std::string &id, DesktopEntry *out);
+
+    /** Number of indexed applications. */
+    size_t size() noexcept;
+};
@@ -0,0 +1,176 @@
+/** @file DropFilter.hpp
+ *
+ * @brief Recovery from the events that evdev drops when a reader falls
+ *        behind.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <string.h>
+    #include <linux/input.h>
+}
+
+#include <algorithm>
+#include <vector>
+
+#include "KeyState.hpp"
+
+/**
+ * Filters the events read from an evdev device, the way libevdev does.
+ * After a SYN_DROPPED everything up to the next SYN_REPORT is thrown away,
+ * the real state of the keys is then asked for, and events for the keys
+ * that changed in the meantime go out before anything that was read after
+ * the drop. Key events that repeat the state that the keys are already in
+ * are left out.
+ *
+ * The events are filtered in place, so that the caller can read straight
+ * into its buffer.
+ */
+class DropFilter {
+    /** Set from a SYN_DROPPED until the SYN_REPORT that ends it, the
+     *  events in between are thrown away. */
+    bool dropping = false;
+    /** Events that bring the output up to date after a SYN_DROPPED, they
+     *  go out before anything that was read after it, see resync() */
+    std::vector<struct input_event> resync_events;
+    /** Events that were read after a SYN_DROPPED, held back until the
+     *  resync events have been handed out. */
+    std::vector<struct input_event> unread;
+    /** Number of SYN_DROPPED events read from the device. */
+    uint64_t num_drops = 0;
+    uint64_t num_resyncs = 0;
+    size_t last_corrected = 0;
+
+    /** Queue up events for the keys that differ between `keys` and
+     *  `real`, and update `keys` to match. */
+    void resync(KeyState &keys, const KeyState &real, const struct timeval &time) {
+        auto correct = [&](bool down) {
+            for (int code = 0; code < KEY_CNT; code++) {
+                if (real.isDown(code) != down || keys.isDown(code) == down)
+                    continue;
+                struct input_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.time = time;
+                ev.type = EV_KEY;
+                ev.code = code;
+                ev.value = down;
+                resync_events.push_back(ev);
+                keys.set(code, down);
+            }
+        };
+        // Releases go first, so that nothing is briefly held down together
+        // with keys that were let go of during the drop.
+        correct(false);
+        correct(true);
+
+        last_corrected = resync_events.size();
+        if (!resync_events.empty()) {
+            struct input_event syn;
+            memset(&syn, 0, sizeof(syn));
+            syn.time = time;
+            syn.type = EV_SYN;
+            syn.code = SYN_REPORT;
+            resync_events.push_back(syn);
+        }
+    }
+
+public:
+    /**
+     * Filter `num` events at `buf` in place.
+     *
+     * @param keys Keys held down, updated from the events that are kept.
+     * @param real_keys Called with a KeyState to fill in with the real
+     *                  state of the keys after a drop, e.g from EVIOCGKEY.
+     *                  If it returns false the keys are not corrected.
+     * @return Number of events kept at the start of `buf`.
+     */
+    template <class Fn>
+    size_t filter(struct input_event *buf, size_t num, KeyState &keys, Fn real_keys) {
+        size_t out = 0;
+        for (size_t i = 0; i < num; i++) {
+            const struct input_event ev = buf[i];
+            if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+                dropping = true;
+                num_drops++;
+                continue;
+            }
+            if (dropping) {
+                if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+                    dropping = false;
+                    num_resyncs++;
+                    last_corrected = 0;
+                    KeyState real;
+                    if (real_keys(&real))
+                        resync(keys, real, ev.time);
+                    // What was read after the drop waits for the resync events.
+                    unread.insert(unread.begin(), buf + i + 1, buf + num);
+                    break;
+                }
+                continue;
+            }
+            // Events that were read before a resync may repeat what it
+            // already reported, like libevdev these are left out.
+            if (ev.type == EV_KEY && ev.code < KEY_CNT && (ev.value == 0 || ev.value == 1) &&
+                keys.isDown(ev.code) == bool(ev.value))
+                continue;
+            keys.update(ev);
+            buf[out++] = ev;
+        }
+        return out;
+    }
+
+    /**
+     * Hand out events that were held back, the resync events first. Call
+     * this instead of reading more while hasHeld().
+     *
+     * @param space Number of events that fit in `buf`.
+     * @return Number of events put at `buf`, see filter() for the rest.
+     */
+    template <class Fn>
+    size_t takeHeld(struct input_event *buf, size_t space, KeyState &keys, Fn real_keys) {
+        // The resync events are already accounted for in keys.
+        if (!resync_events.empty()) {
+            size_t num = std::min(space, resync_events.size());
+            memcpy(buf, resync_events.data(), num * sizeof(buf[0]));
+            resync_events.erase(resync_events.begin(), resync_events.begin() + num);
+            return num;
+        }
+        size_t num = std::min(space, unread.size());
+        memcpy(buf, unread.data(), num * sizeof(buf[0]));
+        unread.erase(unread.begin(), unread.begin() + num);
+        return filter(buf, num, keys, real_keys);
+    }
+
+    /** Whether events are waiting to be handed out by takeHeld(). */
+    inline bool hasHeld() const noexcept {
+        return !resync_events.empty() || !unread.empty();
+    }
+
+    /** Whether events are being thrown away until a SYN_REPORT. */
+    inline bool isDropping() const noexcept {
+        return dropping;
+    }
+
+    inline uint64_t numDrops() const noexcept {
+        return num_drops;
+    }
+
+    /** Number of times that a drop has ended, and the number of keys that
+     *  were corrected the last time. */
+    inline uint64_t numResyncs() const noexcept {
+        return num_resyncs;
+    }
+
+    inline size_t lastCorrected() const noexcept {
+        return last_corrected;
+    }
+
+    /** Forget about a drop in progress, e.g when the device is reopened. */
+    inline void clear() noexcept {
+        dropping = false;
+        resync_events.clear();
+        unread.clear();
+    }
+};
@@ -0,0 +1,154 @@
+extern "C" {
+    #include <fcntl.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <time.h>
+    #include <unistd.h>
+}
+
+#include "EventTrace.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+
+static void writeAll(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw SystemError("Unable to write event trace: ", errno);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+EventTraceWriter::EventTraceWriter(const string &path, bool redact)
+    : redacted(redact)
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        throw SystemError("Unable to create event trace " + path + ": ", errno);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    EventTraceHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = EVENT_TRACE_MAGIC;
+    hdr.version = EVENT_TRACE_VERSION;
+    hdr.flags = redacted ? EVENT_TRACE_REDACTED : 0;
+    hdr.record_size = sizeof(EventTraceRecord);
+    hdr.start_realtime = uint64_t(ts.tv_sec) * 1000000000ULL + uint64_t(ts.tv_nsec);
+    try {
+        writeAll(fd, &hdr, sizeof(hdr));
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    buf.reserve(buf_records);
+}
+
+EventTraceWriter::~EventTraceWriter() {
+    try {
+        flush();
+    } catch (const SystemError &) {}
+    close(fd);
+}
+
+bool EventTraceWriter::redact(uint16_t type, uint16_t *code, int32_t *value) noexcept {
+    if (type == EV_MSC && *code == MSC_SCAN) {
+        *value = 0;
+        return true;
+    }
+    if (type != EV_KEY)
+        return false;
+    uint16_t c = *code;
+    bool types_text = (c >= KEY_1 && c <= KEY_EQUAL) ||
+                      (c >= KEY_Q && c <= KEY_RIGHTBRACE) ||
+                      (c >= KEY_A && c <= KEY_GRAVE) ||
+                      (c >= KEY_BACKSLASH && c <= KEY_SLASH) ||
+                      (c >= KEY_KP7 && c <= KEY_KPDOT) ||
+                      c == KEY_KPASTERISK || c == KEY_SPACE ||
+                      c == KEY_102ND || c == KEY_KPSLASH;
+    if (types_text)
+        *code = KEY_UNKNOWN;
+    return types_text;
+}
+
+void EventTraceWriter::record(const KBDAction &action) {
+    if (first_time == 0)
+        first_time = action.ts.read;
+
+    EventTraceRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time = action.ts.read > first_time ? action.ts.read - first_time : 0;
+    rec.dev_id = action.dev_id;
+    rec.type = action.ev.type;
+    rec.code = action.ev.code;
+    rec.value = action.ev.value;
+    if (redacted)
+        redact(rec.type, &rec.code, &rec.value);
+    buf.push_back(rec);
+
+    if (buf.size() >= buf_records)
+        flush();
+}
+
+void EventTraceWriter::flush() {
+    if (buf.empty())
+        return;
+    // The buffer is dropped even if the write fails, so that a full disk
+    // does not make it grow without bounds.
+    vector<EventTraceRecord> out;
+    out.reserve(buf_records);
+    out.swap(buf);
+    writeAll(fd, out.data(), out.size() * sizeof(EventTraceRecord));
+}
+
+EventTraceReader::EventTraceReader(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw SystemError("Unable to open " + path + ": ", errno);
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) == -1) {
+        int err = errno;
+        close(fd);
+        throw SystemError("Unable to stat " + path + ": ", err);
+    }
+    if (size_t(stbuf.st_size) < sizeof(EventTraceHeader)) {
+        close(fd);
+        throw SystemError("Event trace is truncated: " + path);
+    }
+
+    mem_size = stbuf.st_size;
+    mem = mmap(nullptr, mem_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw SystemError("Unable to mmap() " + path + ": ", err);
+
+    hdr = (const EventTraceHeader *) mem;
+    if (hdr->magic != EVENT_TRACE_MAGIC || hdr->version != EVENT_TRACE_VERSION ||
+        hdr->record_size != sizeof(EventTraceRecord))
+    {
+        munmap(mem, mem_size);
+        throw SystemError("Not a supported event trace: " + path);
+    }
+    records = (const EventTraceRecord *) (hdr + 1);
+    // A trace that was cut off in the middle of a record is still usable.
+    num_records = (mem_size - sizeof(EventTraceHeader)) / sizeof(EventTraceRecord);
+}
+
+EventTraceReader::~EventTraceReader() {
+    munmap(mem, mem_size);
+}
+
+size_t EventTraceReader::frameEnd(size_t begin) const noexcept {
+    for (size_t i = begin; i < num_records; i++)
+        if (records[i].type == EV_SYN && records[i].code == SYN_REPORT)
+            return i + 1;
+    return num_records;
+}
@@ -0,0 +1,142 @@
+/** @file EventTrace.hpp
+ *
+ * @brief Recording and replaying of the events read by InputD.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <linux/input.h>
+}
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "KBDAction.hpp"
+
+/** "HWKT" */
+static constexpr uint32_t EVENT_TRACE_MAGIC = 0x544b5748;
+static constexpr uint16_t EVENT_TRACE_VERSION = 1;
+
+enum EventTraceFlags : uint16_t {
+    /** The keys that type text were replaced, see EventTraceWriter. */
+    EVENT_TRACE_REDACTED = 1 << 0,
+};
+
+/** Start of a trace file, followed by an array of EventTraceRecord. */
+struct EventTraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    /** Bitwise or of EventTraceFlags */
+    uint16_t flags;
+    /** sizeof(EventTraceRecord) */
+    uint32_t record_size;
+    uint32_t reserved;
+    /** CLOCK_REALTIME when the trace started, in nanoseconds. */
+    uint64_t start_realtime;
+};
+
+/** An event as read from a keyboard. */
+struct EventTraceRecord {
+    /** Nanoseconds since the first event of the trace. */
+    uint64_t time;
+    struct input_id dev_id;
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+static_assert(sizeof(EventTraceHeader) == 24, "EventTraceHeader is part of the file format");
+static_assert(sizeof(EventTraceRecord) == 24, "EventTraceRecord is part of the file format");
+
+/**
+ * Writes the events that InputD reads to a trace file.
+ *
+ * Traces are redacted by default, the key codes of letters, digits and
+ * symbols are replaced with KEY_UNKNOWN and scan codes are zeroed, so that
+ * they never contain what was typed. Modifiers and other keys are kept, as
+ * well as the timing, which is what matters when reproducing latency
+ * problems. Like DANGER_DANGER_LOG_KEYS, keeping the key codes should only
+ * ever be done while debugging.
+ */
+class EventTraceWriter {
+    int fd = -1;
+    bool redacted;
+    uint64_t first_time = 0;
+    std::vector<EventTraceRecord> buf;
+
+    static constexpr size_t buf_records = 256;
+
+public:
+    /**
+     * Create a trace file, which is only readable by the owner.
+     *
+     * @param path Path of the file, it is replaced if it exists.
+     * @param redact Whether to redact the events.
+     */
+    EventTraceWriter(const std::string &path, bool redact = true);
+
+    EventTraceWriter(const EventTraceWriter &) = delete;
+    EventTraceWriter &operator=(const EventTraceWriter &) = delete;
+
+    ~EventTraceWriter();
+
+    /** Add an event, with ts.read as its time. Buffered until flush(). */
+    void record(const KBDAction &action);
+
+    /** Write out the buffered events. */
+    void flush();
+
+    /**
+     * Remove what was typed from an event.
+     *
+     * @return True if the event was changed.
+     */
+    static bool redact(uint16_t type, uint16_t *code, int32_t *value) noexcept;
+};
+
+/** A trace file mapped into memory. */
+class EventTraceReader {
+    void *mem = nullptr;
+    size_t mem_size = 0;
+    const EventTraceHeader *hdr = nullptr;
+    const EventTraceRecord *records = nullptr;
+    size_t num_records = 0;
+
+public:
+    /**
+     * @throws SystemError If the file could not be read, or if it is not
+     *                     a trace file with a supported version.
+     */
+    explicit EventTraceReader(const std::string &path);
+
+    EventTraceReader(const EventTraceReader &) = delete;
+    EventTraceReader &operator=(const EventTraceReader &) = delete;
+
+    ~EventTraceReader();
+
+    inline size_t size() const noexcept {
+        return num_records;
+    }
+
+    inline const EventTraceRecord &operator[](size_t idx) const noexcept {
+        return records[idx];
+    }
+
+    inline bool isRedacted() const noexcept {
+        return hdr->flags & EVENT_TRACE_REDACTED;
+    }
+
+    inline const EventTraceHeader &header() const noexcept {
+        return *hdr;
+    }
+
+    /**
+     * Find the end of the frame that starts at `begin`, i.e one past its
+     * SYN_REPORT, or the end of the trace if the frame was cut off.
+     */
+    size_t frameEnd(size_t begin) const noexcept;
+};
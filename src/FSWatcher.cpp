@@ -28,6 +28,8 @@
 #include <sstream>
 #include <functional>
 #include <fstream>
+#include <chrono>
+#include <algorithm>
 
 extern "C" {
     #include <sys/stat.h>
@@ -41,6 +43,7 @@ extern "C" {
 
 #include "FSWatcher.hpp"
 #include "SystemError.hpp"
+#include "utils.hpp"
 
 using namespace std;
 
@@ -104,7 +107,9 @@ void FSWatcher::add(string path) {
                                | IN_DELETE
                                | IN_DELETE_SELF
                                | IN_ATTRIB
-                               | IN_CREATE);
+                               | IN_CREATE
+                               | IN_MOVED_TO
+                               | IN_MOVED_FROM);
     if (wd == -1) {
         throw SystemError("Error in inotify_add_watch() for path: " + path);
     }
@@ -164,8 +169,9 @@ vector<FSEvent> *FSWatcher::addFrom(string dir_path) {
 FSEvent *FSWatcher::handleEvent(struct inotify_event *ev) {
     FSEvent *fs_ev = nullptr;
 
-    // File creation, needs to be added.
-    if (ev->mask & IN_CREATE) {
+    // File creation, needs to be added. Package managers and some editors
+    // write a temporary file and rename it into place.
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
         // Assemble directory and name into a full path
         string dir_path = wd_to_path[ev->wd];
         stringstream path;
@@ -177,7 +183,7 @@ FSEvent *FSWatcher::handleEvent(struct inotify_event *ev) {
                 return nullptr;
             }
         fs_ev = new FSEvent(ev, path.str());
-    } else if (ev->mask & (IN_MODIFY | IN_DELETE | IN_DELETE_SELF)) {
+    } else if (ev->mask & (IN_MODIFY | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM)) {
         // File modified, save event.
         if (wd_to_path.find(ev->wd) == wd_to_path.end()) {
             throw SystemError("Received watch descriptor for file that we are not watching.");
@@ -198,25 +204,80 @@ FSEvent *FSWatcher::handleEvent(struct inotify_event *ev) {
     return nullptr;
 }
 
+void FSWatcher::coalesce(const FSEvent &ev) {
+    // Events on a directory about one of its files are merged with the
+    // events reported on the file itself.
+    string path = ev.path;
+    if (!ev.name.empty() && pathBasename(path) != ev.name)
+        path = pathJoin(path, ev.name);
+
+    auto it = coalesced_idx.find(path);
+    if (it == coalesced_idx.end()) {
+        coalesced_idx[path] = coalesced.size();
+        coalesced.push_back(ev);
+        coalesced.back().path = path;
+        coalesced.back().name = pathBasename(path);
+        return;
+    }
+    coalesced[it->second].mask |= ev.mask;
+}
+
+bool FSWatcher::flushCoalesced(const FSWatchFn &callback) {
+    vector<FSEvent> evs;
+    evs.swap(coalesced);
+    coalesced_idx.clear();
+
+    for (auto &ev : evs) {
+        if (stat(ev.path.c_str(), &ev.stbuf) == -1) {
+            memset(&ev.stbuf, 0, sizeof(ev.stbuf));
+            // It ended up deleted or moved away, whatever happened to it
+            // before that.
+            if (ev.mask & (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM))
+                ev.mask &= ~(IN_CREATE | IN_MODIFY | IN_ATTRIB);
+        } else {
+            // It was deleted or moved away, and then created again.
+            ev.mask &= ~(IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM);
+        }
+        if (ev.mask == 0)
+            continue;
+        if (!callback(ev))
+            return false;
+    }
+    if (flush_callback)
+        flush_callback();
+    return true;
+}
+
 void FSWatcher::watch(const function<bool(FSEvent &ev)> &callback) {
     // Local `running`, is set by the callback
     // Instance-wide `running` set by FSWatcher::stop()
     struct pollfd pfd;
+    auto last_event = chrono::steady_clock::now();
     while (running == RunState::RUNNING) {
         pfd.fd = this->fd;
         pfd.events = POLLIN;
-        poll(&pfd, 1, 128);
+
+        // Poll with a timeout of at most 128 ms, this is so that we can check
+        // `running` continuously.
+        int timeout = 128;
+        if (!coalesced.empty()) {
+            auto since = chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - last_event).count();
+            timeout = std::max<int>(0, std::min<int>(timeout, coalesce_ms - since));
+        }
 
         try {
-            // Poll with a timeout of 128 ms, this is so that we can check
-            // `running` continuously.
             errno = 0;
-            switch (poll(&pfd, 1, 128)) {
+            switch (poll(&pfd, 1, timeout)) {
                 case -1:
                     throw SystemError("Error in poll() on inotify fd: ", (int) errno);
 
                 case 0:
-                    // Timeout
+                    // Timeout, coalesced events are due once it has been
+                    // quiet for long enough.
+                    if (!coalesced.empty() && timeout < 128 &&
+                        !flushCoalesced(callback))
+                        running = RunState::STOPPING;
                     break;
 
                 default: {
@@ -241,8 +302,12 @@ void FSWatcher::watch(const function<bool(FSEvent &ev)> &callback) {
                         ev = (struct inotify_event *) p;
                         FSEvent *fs_ev = handleEvent(ev);
                         if (fs_ev != nullptr) {
-                            if (!callback(*fs_ev))
+                            if (coalesce_ms > 0) {
+                                coalesce(*fs_ev);
+                                last_event = chrono::steady_clock::now();
+                            } else if (!callback(*fs_ev)) {
                                 running = RunState::STOPPING;
+                            }
                             delete fs_ev;
                         }
                         if (running != RunState::RUNNING) {
@@ -172,12 +172,32 @@ private:
      *       want to miss out then you should probably not leave the
      *       FSW instance hanging around for too long. */
     size_t backup_num_read = 0;
+    /** Quiet window in milliseconds, see setCoalesce() */
+    std::atomic<int> coalesce_ms = 0;
+    /** Events being coalesced, in the order of their first occurrence. */
+    std::vector<FSEvent> coalesced;
+    /** Index of each file in `coalesced` */
+    std::unordered_map<std::string, size_t> coalesced_idx;
+    /** See setFlushCallback() */
+    std::function<void()> flush_callback;
 
     static std::atomic<int> num_instances;
 
     /** Handle an event. */
     FSEvent *handleEvent(struct inotify_event *ev);
 
+    /** Merge an event into the coalesced events. */
+    void coalesce(const FSEvent &ev);
+
+    /**
+     * Pass all coalesced events to the callback, with their final stat()
+     * and with the masks of deletions and creations that cancel
+     * out removed.
+     *
+     * @return False if the callback asked to stop.
+     */
+    bool flushCoalesced(const FSWatchFn &callback);
+
 public:
     /** Initialize inotify file descriptor.
      */
@@ -289,6 +309,30 @@ public:
         this->watch_dirs = w;
     }
 
+    /**
+     * Coalesce the events of each file until no event has arrived for
+     * `ms` milliseconds. The callback is then called once per file with
+     * all the masks or'ed together, and `path` set to the file itself even
+     * for events that were reported on its directory.
+     *
+     * Editors save files with several writes, renames and chmods, this
+     * turns all of that into a single event.
+     *
+     * @param ms The quiet window, 0 to deliver every event immediately.
+     */
+    inline void setCoalesce(int ms) {
+        this->coalesce_ms = ms;
+    }
+
+    /**
+     * Call `fn` once all the events of a batch of coalesced events have
+     * been passed to the callback, e.g to rebuild something once instead
+     * of once per file. Set it before watching starts.
+     */
+    inline void setFlushCallback(std::function<void()> fn) {
+        this->flush_callback = std::move(fn);
+    }
+
     /** Set whether or not to automatically add new files to the
      *  watch list */
     inline void setAutoAdd(bool auto_add) {
@@ -0,0 +1,231 @@
+extern "C" {
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <string.h>
+    #include <sys/eventfd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <syslog.h>
+    #include <unistd.h>
+}
+
+#include "Handover.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+static constexpr uint32_t handover_magic = 0x4857484f;
+/** Bumped whenever the layout of the messages below changes, InputDs of
+ *  different versions don't hand over to each other. */
+static constexpr uint32_t handover_version = 1;
+
+enum HandoverFlags : uint32_t {
+    HANDOVER_POINTERS = 1 << 0,
+};
+
+/** The most file descriptors that the kernel passes in one message. */
+static constexpr size_t max_handover_fds = 253;
+
+/** Sent first, together with the file descriptors of the udevice, its
+ *  event device and then of every keyboard. The new InputD sends it back
+ *  once it has taken over. */
+struct HandoverHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num_kbds;
+};
+
+/** Header of the keyboard and client frames that follow the hello. */
+struct HandoverFrame {
+    uint32_t count;
+};
+
+static constexpr size_t key_bitmap_len = KEY_CNT / 8;
+
+struct HandoverKeyboardRecord {
+    uint32_t state;
+    uint8_t keys[key_bitmap_len];
+};
+
+struct HandoverClientRecord {
+    char path[sizeof(sockaddr_un::sun_path)];
+    uint8_t keys_down[key_bitmap_len];
+    uint8_t direct_held[key_bitmap_len];
+};
+
+static void packBits(const bitset<KEY_CNT> &bits, uint8_t *out) noexcept {
+    memset(out, 0, key_bitmap_len);
+    for (size_t i = 0; i < KEY_CNT; i++)
+        if (bits[i])
+            out[i / 8] |= 1 << (i % 8);
+}
+
+static void unpackBits(const uint8_t *in, bitset<KEY_CNT> *bits) noexcept {
+    bits->reset();
+    for (size_t i = 0; i < KEY_CNT; i++)
+        if (in[i / 8] & (1 << (i % 8)))
+            bits->set(i);
+}
+
+void sendHandover(int fd, const HandoverState &state, int timeout) {
+    UNIXSocket<HandoverHello> com(fd);
+    if (state.kbds.size() + 2 > max_handover_fds)
+        throw SocketError("Too many keyboards to hand over: " + to_string(state.kbds.size()));
+
+    HandoverHello hello;
+    hello.magic = handover_magic;
+    hello.version = handover_version;
+    hello.flags = state.pointers ? uint32_t(HANDOVER_POINTERS) : 0;
+    hello.num_kbds = state.kbds.size();
+    vector<int> fds = {state.ufd, state.dfd};
+    vector<HandoverKeyboardRecord> kbds(state.kbds.size());
+    for (size_t i = 0; i < state.kbds.size(); i++) {
+        fds.push_back(state.kbds[i].fd);
+        kbds[i].state = state.kbds[i].state;
+        state.kbds[i].keys.toBitmap(kbds[i].keys, sizeof(kbds[i].keys));
+    }
+    vector<HandoverClientRecord> clients(state.clients.size());
+    for (size_t i = 0; i < state.clients.size(); i++) {
+        const HandoverClient &c = state.clients[i];
+        if (c.path.size() >= sizeof(clients[i].path))
+            throw SocketError("MacroD socket path is too long: " + c.path);
+        memset(clients[i].path, 0, sizeof(clients[i].path));
+        memcpy(clients[i].path, c.path.data(), c.path.size());
+        packBits(c.keys_down, clients[i].keys_down);
+        packBits(c.direct_held, clients[i].direct_held);
+    }
+
+    com.sendFds(&hello, sizeof(hello), fds);
+    com.sendFrame(HandoverFrame{0}, kbds.data(), kbds.size());
+    com.sendFrame(HandoverFrame{0}, clients.data(), clients.size());
+
+    HandoverHello ack;
+    com.recv(&ack, milliseconds(timeout));
+    if (ack.magic != handover_magic || ack.num_kbds != hello.num_kbds)
+        throw SocketError("Invalid acknowledgement of handover");
+}
+
+bool receiveHandover(const string &path, bool pointers, HandoverState *state, int timeout) {
+    UNIXSocket<HandoverHello> com(path, false);
+    if (!com.tryRecon())
+        return false;
+
+    HandoverHello hello;
+    vector<int> fds;
+    com.recvFds(&hello, sizeof(hello), &fds, max_handover_fds, timeout);
+    try {
+        if (hello.magic != handover_magic || hello.version != handover_version)
+            throw SocketError("Unsupported handover version: " + to_string(hello.version));
+        if (fds.size() != hello.num_kbds + 2)
+            throw SocketError("Expected " + to_string(hello.num_kbds + 2) +
+                              " file descriptors, got " + to_string(fds.size()));
+        if (bool(hello.flags & HANDOVER_POINTERS) != pointers)
+            throw SocketError(pointers ? "The running udevice does not support pointers"
+                                       : "The running udevice supports pointers, use --pointers");
+
+        HandoverFrame hdr;
+        vector<HandoverKeyboardRecord> kbds;
+        vector<HandoverClientRecord> clients;
+        com.recvFrame(&hdr, &kbds, milliseconds(timeout));
+        com.recvFrame(&hdr, &clients, milliseconds(timeout));
+        if (kbds.size() != hello.num_kbds)
+            throw SocketError("Expected " + to_string(hello.num_kbds) +
+                              " keyboards, got " + to_string(kbds.size()));
+
+        state->pointers = pointers;
+        state->ufd = fds[0];
+        state->dfd = fds[1];
+        state->kbds.resize(kbds.size());
+        for (size_t i = 0; i < kbds.size(); i++) {
+            state->kbds[i].fd = fds[i + 2];
+            state->kbds[i].state = kbds[i].state == KBDState::LOCKED  ? KBDState::LOCKED
+                                 : kbds[i].state == KBDState::LOCKING ? KBDState::LOCKING
+                                                                      : KBDState::OPEN;
+            state->kbds[i].keys.setFromBitmap(kbds[i].keys, sizeof(kbds[i].keys));
+        }
+        state->clients.resize(clients.size());
+        for (size_t i = 0; i < clients.size(); i++) {
+            auto &path = clients[i].path;
+            state->clients[i].path = string(path, strnlen(path, sizeof(path)));
+            unpackBits(clients[i].keys_down, &state->clients[i].keys_down);
+            unpackBits(clients[i].direct_held, &state->clients[i].direct_held);
+        }
+
+        com.send(&hello);
+    } catch (const SocketError &) {
+        for (int fd : fds)
+            ::close(fd);
+        throw;
+    }
+    return true;
+}
+
+HandoverServer::HandoverServer(const string &addr) : srv(addr) {
+    if (chmod(addr.c_str(), 0600) == -1)
+        throw SystemError("Unable to chmod handover socket: ", errno);
+    if ((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        throw SystemError("Unable to create eventfd: ", errno);
+}
+
+HandoverServer::~HandoverServer() {
+    running = false;
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) == -1)
+        syslog(LOG_ERR, "Unable to wake up handover server: %s", strerror(errno));
+    if (thread.joinable())
+        thread.join();
+    ::close(wake_fd);
+    int fd = take();
+    if (fd != -1)
+        ::close(fd);
+}
+
+void HandoverServer::start() {
+    thread = std::thread([this]() { run(); });
+}
+
+void HandoverServer::run() {
+    while (running) {
+        struct pollfd pfds[] = {
+            {srv.getfd(), POLLIN, 0},
+            {wake_fd, POLLIN, 0},
+        };
+        if (::poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Handover server stopped, error in poll(): %s", strerror(errno));
+            return;
+        }
+        if (!running || (pfds[1].revents & POLLIN))
+            break;
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
+        int fd;
+        try {
+            fd = srv.accept();
+        } catch (const SocketError &e) {
+            syslog(LOG_ERR, "Handover server: %s", e.what());
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+            (cred.uid != getuid() && cred.uid != 0))
+        {
+            syslog(LOG_WARNING, "Refusing handover to a process of another user");
+            ::close(fd);
+            continue;
+        }
+        syslog(LOG_NOTICE, "Process %d asked to take over the devices", int(cred.pid));
+        // Only the most recent InputD to ask gets the devices.
+        int old = waiting.exchange(fd);
+        if (old != -1)
+            ::close(old);
+    }
+}
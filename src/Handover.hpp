@@ -0,0 +1,122 @@
+/** @file Handover.hpp
+ *
+ * @brief Hand the devices of a running InputD over to the one replacing it.
+ *
+ * Restarting InputD normally destroys the udevice and ungrabs every
+ * keyboard, the new process then has to wait for keys to be released
+ * before it can grab them again. With a handover the old process instead
+ * passes its open file descriptors to the new one with SCM_RIGHTS, a grab
+ * belongs to the open file and not to the process, so the keyboards stay
+ * grabbed and the udevice stays where it is. Events that arrive in the
+ * meantime wait in the kernel until the new process reads them.
+ *
+ * The new process connects to the handover socket of the old one, which
+ * sends everything once it is idle, and exits as soon as the new process
+ * has acknowledged it.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Keyboard.hpp"
+#include "KeyState.hpp"
+#include "UNIXSocket.hpp"
+
+/** A grabbed keyboard, or one that is waiting for keys to be released
+ *  before it is grabbed. */
+struct HandoverKeyboard {
+    int fd = -1;
+    KBDState state = KBDState::OPEN;
+    /** Keys held down as of the last event that was read, the kernel may
+     *  already know about events that are still waiting to be read. */
+    KeyState keys;
+};
+
+/** Keys that were held down on the udevice on behalf of a MacroD. */
+struct HandoverClient {
+    /** Socket of the MacroD. */
+    std::string path;
+    std::bitset<KEY_CNT> keys_down;
+    std::bitset<KEY_CNT> direct_held;
+};
+
+/** Everything a new InputD takes over from the old one. */
+struct HandoverState {
+    /** Whether the udevice was created with pointer support. */
+    bool pointers = false;
+    /** The uinput device, and its event device. */
+    int ufd = -1;
+    int dfd = -1;
+    std::vector<HandoverKeyboard> kbds;
+    std::vector<HandoverClient> clients;
+};
+
+/**
+ * Send the devices to the new InputD, and wait for it to acknowledge them.
+ * The file descriptors are not closed, if this fails the caller can keep
+ * on using them.
+ *
+ * @param fd Connection from the new InputD, see HandoverServer::take(),
+ *           it is closed afterwards.
+ * @param state What to hand over.
+ * @param timeout Milliseconds to wait for the acknowledgement.
+ * @throws SocketError If the new InputD did not take over the devices.
+ */
+void sendHandover(int fd, const HandoverState &state, int timeout);
+
+/**
+ * Take over the devices of the InputD listening on `path`.
+ *
+ * @param path Handover socket of the running InputD.
+ * @param pointers Whether the udevice has to support pointers, the
+ *                 handover is declined if it does not match.
+ * @param state Where to put the devices, the caller owns the received
+ *              file descriptors.
+ * @param timeout Milliseconds to wait for the running InputD.
+ * @throws SocketError If the handover failed, the running InputD then
+ *         keeps its devices.
+ * @return False if no InputD is listening on `path`.
+ */
+bool receiveHandover(const std::string &path, bool pointers, HandoverState *state, int timeout);
+
+/**
+ * Waits for a new InputD to connect, so that the main loop can hand the
+ * devices over once it has nothing in flight. Only connections from the
+ * same user, or root, are accepted.
+ */
+class HandoverServer {
+    UNIXServer srv;
+    /** eventfd used to stop the server thread */
+    int wake_fd = -1;
+    std::atomic<bool> running {true};
+    /** Connection of the InputD waiting for a handover, or -1. */
+    std::atomic<int> waiting {-1};
+    std::thread thread;
+
+    void run();
+
+public:
+    /** Listen on `addr`, which is only accessible to the user. */
+    explicit HandoverServer(const std::string &addr);
+
+    ~HandoverServer();
+
+    /** Start accepting connections in a new thread. */
+    void start();
+
+    /** Whether a new InputD is waiting, cheap enough to check on every
+     *  iteration of the main loop. */
+    inline bool requested() const noexcept {
+        return waiting.load(std::memory_order_relaxed) != -1;
+    }
+
+    /** Take the connection of the waiting InputD, the caller owns it. */
+    inline int take() noexcept {
+        return waiting.exchange(-1);
+    }
+};
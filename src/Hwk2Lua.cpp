@@ -0,0 +1,191 @@
+#include <vector>
+
+#include "Hwk2Lua.hpp"
+
+using namespace std;
+
+/** Whitespace as in Python's str.isspace() and str.strip(), for ASCII. */
+static bool isSpace(char c) noexcept {
+    return c == ' ' || (c >= '\t' && c <= '\r') || (c >= '\x1c' && c <= '\x1f');
+}
+
+static bool allSpace(const string &s) noexcept {
+    if (s.empty())
+        return false;
+    for (char c : s)
+        if (!isSpace(c))
+            return false;
+    return true;
+}
+
+static string strip(const string &s) {
+    size_t begin = 0, end = s.size();
+    while (begin < end && isSpace(s[begin]))
+        begin++;
+    while (end > begin && isSpace(s[end - 1]))
+        end--;
+    return s.substr(begin, end - begin);
+}
+
+/** Length of a long bracket like [==[ or --]] at `pos`, 0 if there is none. */
+static size_t matchBracket(const string &s, size_t pos, char bracket) noexcept {
+    size_t i = pos;
+    if (s.compare(i, 2, "--") == 0 && i + 2 < s.size() && s[i + 2] == bracket)
+        i += 2;
+    if (i >= s.size() || s[i] != bracket)
+        return 0;
+    i++;
+    while (i < s.size() && s[i] == '=')
+        i++;
+    if (i >= s.size() || s[i] != bracket)
+        return 0;
+    return i + 1 - pos;
+}
+
+/** Length of a quoted string at `pos`, 0 if it is not terminated. */
+static size_t matchString(const string &s, size_t pos) noexcept {
+    char quote = s[pos];
+    for (size_t i = pos + 1; i < s.size(); i++) {
+        if (s[i] == quote)
+            return i + 1 - pos;
+        if (s[i] == '\\') {
+            // An escape never covers a line break.
+            if (i + 1 >= s.size() || s[i + 1] == '\n')
+                return 0;
+            i++;
+        }
+    }
+    return 0;
+}
+
+/** Length of the token at `pos`, 0 if there is none. */
+static size_t matchToken(const string &s, size_t pos) noexcept {
+    size_t len;
+    if ((len = matchBracket(s, pos, '[')) || (len = matchBracket(s, pos, ']')))
+        return len;
+    if (s.compare(pos, 2, "--") == 0 || s.compare(pos, 2, "=>") == 0)
+        return 2;
+    if (s[pos] == '"' || s[pos] == '\'')
+        return matchString(s, pos);
+    if (s[pos] == '{' || s[pos] == '}')
+        return 1;
+    return 0;
+}
+
+/**
+ * Split code into tokens and the text between them, the tokens being
+ * long brackets, "--", strings, "=>", "{" and "}". Every line starts with
+ * an empty token.
+ */
+static vector<string> tokenize(const string &code) {
+    vector<string> segments;
+    size_t last = 0;
+    for (size_t pos = 0; pos <= code.size(); pos++) {
+        if (pos == 0 || code[pos - 1] == '\n') {
+            if (pos != last)
+                segments.push_back(code.substr(last, pos - last));
+            segments.emplace_back();
+            last = pos;
+        }
+        if (pos == code.size())
+            break;
+        size_t len = matchToken(code, pos);
+        if (!len)
+            continue;
+        if (pos != last)
+            segments.push_back(code.substr(last, pos - last));
+        segments.push_back(code.substr(pos, len));
+        last = pos + len;
+        pos = last - 1;
+    }
+    segments.push_back(code.substr(last));
+    return segments;
+}
+
+/** A long bracket that opened a comment or string, see hwk2lua.py */
+struct LongBracket {
+    bool dashes;
+    size_t level;
+
+    bool operator==(const LongBracket &other) const noexcept {
+        return dashes == other.dashes && level == other.level;
+    }
+};
+
+static LongBracket bracketOf(const string &seg) noexcept {
+    size_t level = 0;
+    for (char c : seg)
+        level += c == '=';
+    return {seg.compare(0, 2, "--") == 0, level};
+}
+
+string hwk2lua(const string &hwk) {
+    string code;
+    code.reserve(hwk.size());
+    for (size_t i = 0; i < hwk.size(); i++) {
+        if (hwk[i] != '\r') {
+            code += hwk[i];
+        } else {
+            code += '\n';
+            if (i + 1 < hwk.size() && hwk[i + 1] == '\n')
+                i++;
+        }
+    }
+
+    vector<string> out;
+    string last;
+    vector<bool> scopes;
+    bool in_lcomment = false;
+    LongBracket lcomment = {false, 0};
+    bool in_comment = false;
+    for (const string &seg : tokenize(code)) {
+        bool active = !(in_comment || in_lcomment);
+        if (seg == "{" && active) {
+            scopes.push_back(last == "=>");
+            out.push_back(scopes.back() ? "MatchScope.new(function (__match)" : "{");
+        } else if (seg == "}" && active) {
+            if (scopes.empty())
+                throw Hwk2LuaError("Unbalanced curly braces (too many: '}')");
+            out.push_back(scopes.back() ? "end)" : "}");
+            scopes.pop_back();
+        } else if (seg == "=>" && active) {
+            // Everything since the start of the line is the pattern.
+            string match;
+            while (!out.empty()) {
+                string part = std::move(out.back());
+                out.pop_back();
+                if (part.empty())
+                    break;
+                match = part + match;
+            }
+            size_t ws_end = match.find_first_not_of("\t ");
+            if (ws_end == string::npos)
+                ws_end = match.size();
+            out.push_back(match.substr(0, ws_end) + "__match[" + strip(match) + "] =");
+        } else {
+            out.push_back(seg);
+        }
+
+        if (seg.empty()) {
+            in_comment = false;
+        } else if (seg == "--") {
+            in_comment = true;
+        } else if (matchBracket(seg, 0, '[') && !in_lcomment) {
+            in_lcomment = true;
+            lcomment = bracketOf(seg);
+        } else if (in_lcomment && matchBracket(seg, 0, ']') && bracketOf(seg) == lcomment) {
+            in_lcomment = false;
+        }
+
+        if (!allSpace(seg))
+            last = seg;
+    }
+
+    if (!scopes.empty())
+        throw Hwk2LuaError("Unbalanced curly braces (too many: '{')");
+    string lua;
+    lua.reserve(code.size() + code.size() / 4);
+    for (const string &part : out)
+        lua += part;
+    return lua;
+}
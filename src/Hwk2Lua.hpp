@@ -0,0 +1,36 @@
+/** @file Hwk2Lua.hpp
+ *
+ * @brief Translation of .hwk scripts into Lua.
+ */
+
+#pragma once
+
+#include <string>
+#include <stdexcept>
+
+/** Version of the output of hwk2lua(), part of the cache key of
+ *  translated scripts. */
+static constexpr const char *HWK2LUA_VERSION = "hwk2lua-native-1";
+
+class Hwk2LuaError : public std::runtime_error {
+public:
+    explicit Hwk2LuaError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * Translate a .hwk script into Lua, producing the same code as the
+ * hwk2lua.py script:
+ *
+ *     <pattern> => <action>
+ *       -> __match[<pattern>] = <action>
+ *     <pattern> => { <code> }
+ *       -> __match[<pattern>] = MatchScope.new(function (__match)
+ *              <code>
+ *          end)
+ *
+ * Line endings are normalized to \n, like Python does when reading the
+ * file.
+ *
+ * @throws Hwk2LuaError If the curly braces are unbalanced.
+ */
+std::string hwk2lua(const std::string &hwk);
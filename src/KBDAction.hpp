@@ -12,14 +12,93 @@ extern "C" {
     #include <stdint.h>
 }
 
+/** Timestamps taken as an event travels between the daemons, in
+ *  CLOCK_MONOTONIC nanoseconds. A timestamp is 0 if it was not taken. */
+struct KBDTimestamps {
+    /** InputD read the event from the keyboard. */
+    uint64_t read;
+    /** InputD sent the event to MacroD. */
+    uint64_t sent;
+    /** MacroD received the event. */
+    uint64_t recv;
+    /** MacroD sent its reply. */
+    uint64_t reply;
+};
+
 /** Actions as sent via UNIX socket from InputD to MacroD */
 struct KBDAction {
-    /** Whether this action signifies the end of a series of
-     *  events. */
-    uint8_t done : 1;
+    /** Sequence number of the event, replies from MacroD carry the
+     *  sequence number of the event they are replying to. */
+    uint32_t seq;
     /** The source keyboard for this event. */
     struct input_id dev_id;
     /** The event that was emitted, or should be emitted
      *  from the InputD UDevice. */
     struct input_event ev;
+    /** Latency instrumentation, MacroD echoes these back in the
+     *  final frame of its reply together with its own timestamps. */
+    struct KBDTimestamps ts;
+};
+
+/** Types of frames sent from MacroD to InputD. */
+enum KBDFrameType : uint16_t {
+    /** The payload is an array of input_event to be emitted. */
+    KBD_FRAME_EVENTS = 1,
+    /** Reply to a KBDHello, the flags are the accepted KBDHelloFlags. */
+    KBD_FRAME_HELLO = 2,
+    /** Sent by MacroD whenever its scripts or its event filters change,
+     *  the payload is a bitmap of KEY_CNT bits with the key codes that
+     *  scripts may react to. Bit i of byte j is set for key code j*8 + i.
+     *  The flags are KBDInterestFlags. */
+    KBD_FRAME_INTEREST = 3,
+    /** Events emitted by MacroD on its own, from timers in scripts. They
+     *  are not a reply to any event, so the seq is 0. */
+    KBD_FRAME_OUTPUT = 4,
+};
+
+/** Flags set in KBDFrame::flags. */
+enum KBDFrameFlags : uint16_t {
+    /** This is the final frame of the reply to an event. */
+    KBD_FRAME_DONE = 1 << 0,
+};
+
+/** Flags of a KBD_FRAME_INTEREST, key events that MacroD passes through
+ *  without running scripts, so InputD may skip the round trip. */
+enum KBDInterestFlags : uint16_t {
+    KBD_INTEREST_NO_KEYUP = 1 << 0,
+    KBD_INTEREST_NO_KEYDOWN = 1 << 1,
+    KBD_INTEREST_NO_REPEAT = 1 << 2,
+};
+
+/** Header of a frame sent from MacroD to InputD, followed by
+ *  `count` packed payload elements. */
+struct KBDFrame {
+    /** One of KBDFrameType */
+    uint16_t type;
+    /** Bitwise or of KBDFrameFlags */
+    uint16_t flags;
+    /** Sequence number of the event this frame is a reply to. */
+    uint32_t seq;
+    /** Number of elements in the payload. */
+    uint32_t count;
+    /** Timestamps of the event this frame is a reply to. */
+    struct KBDTimestamps ts;
+};
+
+/** "HWCK" */
+static constexpr uint32_t KBD_HELLO_MAGIC = 0x4b435748;
+static constexpr uint32_t KBD_PROTOCOL_VERSION = 1;
+
+enum KBDHelloFlags : uint32_t {
+    /** A memfd and two eventfds for a ShmTransport are attached. */
+    KBD_HELLO_SHM = 1 << 0,
+};
+
+/** First message sent by InputD after connecting, MacroD answers
+ *  with a KBD_FRAME_HELLO frame. */
+struct KBDHello {
+    uint32_t magic;
+    uint32_t version;
+    /** Bitwise or of KBDHelloFlags */
+    uint32_t flags;
 };
@@ -1,10 +1,15 @@
 #include "KBDB.hpp"
+#include "UEventMonitor.hpp"
 #include "utils.hpp"
 
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 
+extern "C" {
+    #include <syslog.h>
+}
+
 using namespace std;
 namespace fs = std::filesystem;
 
@@ -17,37 +22,33 @@ static_assert(is_same<decltype(((struct input_id *)nullptr)->vendor),
 static_assert(is_same<decltype(((struct input_id *)nullptr)->product),
                       decltype(((struct input_id *)nullptr)->version)>::value);
 
+KBDInfo::KBDInfo(const struct input_id *id) noexcept : id(*id) {}
+
+KBDInfo::KBDInfo(const struct input_id *id, const std::string &path) : id(*id) {
+    initFrom(pathJoin(path, "device"));
+}
+
 /**
- * For unprivileged access we can't use ioctl()s, but sysfs is world-readable so
- * we can pull all the data from there.
+ * Read the input_id of an event device, for unprivileged access we can't use
+ * ioctl()s, but sysfs is world-readable so we can pull all the data from there.
  */
-KBDInfo::KBDInfo(const struct input_id *id) : id(*id) {
-    for (auto d : fs::directory_iterator("/sys/class/input")) {
-        string path = d.path();
-        string name = pathBasename(path);
-        if (d.is_directory() && stringStartsWith(name, "event")) {
-            auto id_path = pathJoin(path, "device", "id");
-            struct input_id cid;
-            typedef decltype(cid.vendor) id_t;
-            vector<pair<string, id_t *>> parts = {{"bustype", &cid.bustype},
-                                                  {"vendor", &cid.vendor},
-                                                  {"product", &cid.product},
-                                                  {"version", &cid.version}};
-
-            // Read parts of the id
-            for (auto [part, ptr] : parts) {
-                ifstream idp(pathJoin(id_path, part));
-                if (!idp.is_open())
-                    throw SystemError("Unable to read: " + pathJoin(id_path, part));
-                idp >> hex >> *ptr;
-            }
+static struct input_id readInputID(const std::string &path) {
+    auto id_path = pathJoin(path, "device", "id");
+    struct input_id cid;
+    typedef decltype(cid.vendor) id_t;
+    vector<pair<string, id_t *>> parts = {{"bustype", &cid.bustype},
+                                          {"vendor", &cid.vendor},
+                                          {"product", &cid.product},
+                                          {"version", &cid.version}};
 
-            if (!::memcmp(&cid, id, sizeof(cid))) {
-                // Found match
-                initFrom(pathJoin(path, "device"));
-            }
-        }
+    // Read parts of the id
+    for (auto [part, ptr] : parts) {
+        ifstream idp(pathJoin(id_path, part));
+        if (!idp.is_open())
+            throw SystemError("Unable to read: " + pathJoin(id_path, part));
+        idp >> hex >> *ptr;
     }
+    return cid;
 }
 
 std::string KBDInfo::getID() noexcept {
@@ -77,4 +78,95 @@ void KBDInfo::initFrom(const std::string &path) noexcept(false) {
 }
 
 KBDB::KBDB() {}
-KBDB::~KBDB() {}
+
+KBDB::~KBDB() {
+    watching = false;
+    if (watcher.joinable())
+        watcher.join();
+}
+
+KBDB::Entry &KBDB::add(const struct input_id &id, const KBDInfo &kinfo) {
+    Entry &ent = info[id];
+    ent.info = kinfo;
+    ent.id = ent.info.getID();
+    ent.num = info.size();
+    return ent;
+}
+
+void KBDB::refresh() noexcept {
+    try {
+        for (auto d : fs::directory_iterator("/sys/class/input")) {
+            string path = d.path();
+            if (!d.is_directory() || !stringStartsWith(pathBasename(path), "event"))
+                continue;
+            try {
+                struct input_id id = readInputID(path);
+                // Several event devices may belong to the same keyboard.
+                if (info.count(id) == 0)
+                    add(id, KBDInfo(&id, path));
+            } catch (const SystemError &e) {
+                // The device may have disappeared while we were reading it.
+                syslog(LOG_WARNING, "Unable to read input device: %s", e.what());
+            }
+        }
+    } catch (const fs::filesystem_error &e) {
+        syslog(LOG_ERR, "Unable to scan input devices: %s", e.what());
+    }
+}
+
+void KBDB::startWatcher() noexcept {
+    try {
+        auto mon = make_shared<UEventMonitor>();
+        watching = true;
+        watcher = thread([this, mon]() { watch(mon); });
+    } catch (const SystemError &e) {
+        syslog(LOG_WARNING, "Unable to listen for udev events, new keyboards are looked up on their first key: %s",
+               e.what());
+    }
+}
+
+void KBDB::watch(shared_ptr<UEventMonitor> mon) noexcept {
+    UEvent ev;
+    while (watching) {
+        try {
+            // Wake up now and then to check watching.
+            if (!mon->recv(&ev, 128))
+                continue;
+        } catch (const SystemError &e) {
+            syslog(LOG_ERR, "Unable to receive udev events: %s", e.what());
+            return;
+        }
+        if (ev.action != "add" || ev.get("SUBSYSTEM") != "input" ||
+            !stringStartsWith(pathBasename(ev.devpath), "event"))
+            continue;
+        string path = "/sys" + ev.devpath;
+        try {
+            struct input_id id = readInputID(path);
+            KBDInfo kinfo(&id, path);
+            lock_guard<mutex> lock(found_mtx);
+            found[id] = kinfo;
+        } catch (const SystemError &e) {
+            syslog(LOG_WARNING, "Unable to read input device: %s", e.what());
+        }
+    }
+}
+
+KBDHandle KBDB::getID(const struct input_id *id) noexcept {
+    auto it = info.find(*id);
+    if (it == info.end()) {
+        lock_guard<mutex> lock(found_mtx);
+        auto f = found.find(*id);
+        if (f != found.end()) {
+            Entry &ent = add(*id, f->second);
+            found.erase(f);
+            return {ent.num, &ent.id};
+        }
+    }
+    if (it == info.end()) {
+        refresh();
+        it = info.find(*id);
+    }
+    // Don't scan again on every key if the device cannot be found.
+    Entry &ent = (it == info.end()) ? add(*id, KBDInfo(id)) : it->second;
+    return {ent.num, &ent.id};
+}
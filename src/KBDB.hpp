@@ -2,6 +2,10 @@
 
 #include <unordered_map>
 #include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
 
 extern "C" {
     #include <linux/uinput.h>
@@ -39,12 +43,25 @@ private:
     void initFrom(const std::string& path) noexcept(false);
 
 public:
-    KBDInfo(const struct input_id *id) noexcept(false);
+    /** Information about a device that could not be found in sysfs. */
+    KBDInfo(const struct input_id *id) noexcept;
+
+    /** Read information about a device from its /sys/class/input/event*
+     *  directory. */
+    KBDInfo(const struct input_id *id, const std::string &path) noexcept(false);
+
     inline KBDInfo() noexcept {}
 
     std::string getID() noexcept;
 };
 
+/** Keyboard ID interned by KBDB. */
+struct KBDHandle {
+    /** Small integer that identifies the keyboard, starting from 1. */
+    int num;
+    /** Human-readable ID, see KBDInfo::getID() */
+    const std::string *id;
+};
 
 /**
  * Keyboard database, accepts `struct input_id` and retrieves the rest of the
@@ -54,18 +71,49 @@ public:
  */
 class KBDB {
 private:
-    std::unordered_map<struct input_id, KBDInfo, InputIDHash> info;
+    struct Entry {
+        KBDInfo info;
+        std::string id;
+        int num;
+    };
+
+    /** Elements of unordered_map are never moved, so handles stay
+     *  valid for the lifetime of the KBDB. */
+    std::unordered_map<struct input_id, Entry, InputIDHash> info;
+
+    /** Devices read by the watcher thread, getID() moves them into
+     *  `info`. Requires found_mtx. */
+    std::unordered_map<struct input_id, KBDInfo, InputIDHash> found;
+    std::mutex found_mtx;
+    std::thread watcher;
+    std::atomic<bool> watching {false};
+
+    Entry &add(const struct input_id &id, const KBDInfo &kinfo);
+
+    /** Read the devices that udev announces until `watching` is cleared. */
+    void watch(std::shared_ptr<class UEventMonitor> mon) noexcept;
 
 public:
     KBDB();
     ~KBDB();
 
-    std::string getID(const struct input_id *id) noexcept(false) {
-        if (info.count(*id) == 0) {
-            KBDInfo kinfo(id);
-            info[*id] = kinfo;
-            return kinfo.getID();
-        }
-        return info[*id].getID();
-    }
+    /**
+     * Scan sysfs once, and remember all the input devices that are
+     * currently connected. Call it ahead of time, e.g when InputD connects,
+     * so that getID() does not have to touch sysfs.
+     */
+    void refresh() noexcept;
+
+    /**
+     * Read keyboards that are plugged in later on a background thread, as
+     * udev announces them, so that getID() finds them without scanning.
+     */
+    void startWatcher() noexcept;
+
+    /**
+     * Get the ID of a keyboard. sysfs is only scanned when an unknown
+     * keyboard shows up before the watcher has read it, e.g because the
+     * watcher is not running.
+     */
+    KBDHandle getID(const struct input_id *id) noexcept;
 };
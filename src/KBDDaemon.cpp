@@ -31,10 +31,17 @@
 #include <string>
 #include <chrono>
 #include <regex>
+#include <algorithm>
 
 extern "C" {
     #include <syslog.h>
     #include <grp.h>
+    #include <string.h>
+    #include <sys/inotify.h>
+    #include <signal.h>
+    #include <fnmatch.h>
+    #include <sys/epoll.h>
+    #include <unistd.h>
 }
 
 #include "KBDDaemon.hpp"
@@ -43,6 +50,7 @@ extern "C" {
 #include "Daemon.hpp"
 #include "Permissions.hpp"
 #include "LuaUtils.hpp"
+#include "Log.hpp"
 
 #if DANGER_DANGER_LOG_KEYS
     #warning "Currently logging keypresses"
@@ -53,31 +61,210 @@ using namespace std;
 using namespace Permissions;
 using namespace Lua;
 
-KBDDaemon::KBDDaemon() :
-    kbd_com("/var/lib/hawck-input/kbd.sock")
+static std::atomic<bool> dump_latency_requested(false);
+
+static void handleSigUsr1(int) {
+    dump_latency_requested = true;
+}
+
+KBDDaemon::MacroDClient::MacroDClient(const string &path, Metrics &metrics) :
+    path(path),
+    com(path, false)
 {
+    interest.set();
+    MetricLabels labels = {{"macrod", path}};
+    round_trip = &metrics.histogram("hawck_inputd_macrod_round_trip_seconds",
+                                    "Time from sending an event to MacroD until the final reply",
+                                    labels);
+    resets = &metrics.counter("hawck_inputd_macrod_resets_total",
+                              "Connections to MacroD that were reset", labels);
+    timeouts = &metrics.counter("hawck_inputd_macrod_timeouts_total",
+                                "Connections to MacroD that were reset after timing out", labels);
+    reconnects = &metrics.counter("hawck_inputd_macrod_connects_total",
+                                  "Completed handshakes with MacroD", labels);
+}
+
+KBDDaemon::MacroDClient::~MacroDClient() {
+    if (dir_fd != -1)
+        ::close(dir_fd);
+}
+
+KBDDaemon::KBDDaemon(bool pointers, const HandoverState *from) :
+    udev(pointers, from ? from->ufd : -1, from ? from->dfd : -1)
+{
+    kbman.setPointers(pointers);
+    if (from) {
+        for (const auto &kbd : from->kbds)
+            kbman.adoptDevice(kbd);
+        inherited_clients = from->clients;
+    }
+    clients.push_back(make_unique<MacroDClient>(home_path + "/kbd.sock", metrics));
+    kernel_lat = &latency.stage("kernel.to_inputd");
+    socket_in_lat = &latency.stage("socket.to_macrod");
+    lua_lat = &latency.stage("macrod.lua");
+    socket_out_lat = &latency.stage("socket.from_macrod");
+    flush_lat = &latency.stage("uinput.flush");
+    total_lat = &latency.stage("total.macrod");
+    passthrough_lat = &latency.stage("total.passthrough");
+    for (auto name : {"kernel.to_inputd", "socket.to_macrod", "macrod.lua", "socket.from_macrod",
+                      "uinput.flush", "total.macrod", "total.passthrough"})
+        metrics.addHistogram("hawck_inputd_stage_seconds", "Time spent in each stage of handling an event",
+                             latency.stage(name), {{"stage", name}});
+
+    const char *routed_help = "Events read from the keyboards, by where they were sent";
+    routed_macrod = &metrics.counter("hawck_inputd_routed_events_total", routed_help,
+                                     {{"route", "macrod"}});
+    routed_local = &metrics.counter("hawck_inputd_routed_events_total", routed_help,
+                                    {{"route", "passthrough"}});
+    routed_remapped = &metrics.counter("hawck_inputd_routed_events_total", routed_help,
+                                       {{"route", "remap"}});
+    config_reloads = &metrics.counter("hawck_inputd_config_reloads_total",
+                                      "Changes to passthrough and remap files that were handled");
+    metrics.addCounter("hawck_inputd_uinput_write_errors_total", "Failed writes to the udevice",
+                       [this]() { return double(udev.numWriteErrors()); });
+    metrics.addCounter("hawck_inputd_dropped_total",
+                       "Times the kernel dropped events that were not read in time",
+                       [this]() { return double(kbman.numDrops()); });
+    ks_combo = combos.addChord({KEY_ESC, KEY_SPACE});
     initPassthrough();
 }
 
-KBDDaemon::~KBDDaemon() {}
+KBDDaemon::~KBDDaemon() {
+    // The metrics read kbman, which goes away before the server does.
+    stats.reset();
+    handover.reset();
+    if (wake_epfd != -1)
+        ::close(wake_epfd);
+}
 
-void KBDDaemon::unloadPassthrough(std::string path) {
-    if (key_sources.find(path) != key_sources.end()) {
-        auto vec = key_sources[path];
-        for (int code : *vec)
-            key_visibility[code] = KEY_HIDE;
-        delete vec;
-        key_sources.erase(path);
+void KBDDaemon::addRoute(const string &pattern, const string &sock_path) {
+    string path = (sock_path.size() && sock_path[0] == '/') ? sock_path
+                                                           : home_path + "/" + sock_path;
+    auto it = find_if(clients.begin(), clients.end(), [&](const auto &c) {
+        return c->path == path;
+    });
+    if (it == clients.end()) {
+        clients.push_back(make_unique<MacroDClient>(path, metrics));
+        it = clients.end() - 1;
+    }
+    routes.push_back({pattern, it->get()});
+}
 
-        syslog(LOG_INFO, "Removing passthrough keys from: %s", path.c_str());
+KBDDaemon::MacroDClient &KBDDaemon::clientFor(const struct input_id &id) {
+    if (routes.empty())
+        return *clients[0];
+    auto it = route_cache.find(id);
+    if (it != route_cache.end())
+        return *it->second;
 
-        // Re-add keys
-        for (const auto &[_, vec] : key_sources) {
-            (void) _;
-            for (int code : *vec)
-                key_visibility[code] = KEY_SHOW;
+    const string &name = *kbdb.getID(&id).id;
+    MacroDClient *client = clients[0].get();
+    for (const auto &route : routes) {
+        if (fnmatch(route.pattern.c_str(), name.c_str(), 0) == 0) {
+            client = route.client;
+            break;
         }
     }
+    syslog(LOG_INFO, "Routing keyboard %s to %s", name.c_str(), client->path.c_str());
+    route_cache[id] = client;
+    return *client;
+}
+
+MetricCounter &KBDDaemon::deviceEvents(const struct input_id &id) {
+    auto it = device_events.find(id);
+    if (it != device_events.end())
+        return *it->second;
+    char name[32];
+    snprintf(name, sizeof(name), "%04x:%04x", id.vendor, id.product);
+    MetricCounter &counter = metrics.counter("hawck_inputd_device_events_total",
+                                             "Events read from each keyboard, by vendor:product",
+                                             {{"device", name}});
+    device_events[id] = &counter;
+    return counter;
+}
+
+int KBDDaemon::getWakeFd() {
+    auto fdOf = [](MacroDClient &c) {
+        if (!c.degraded)
+            return c.com.getWakeFd();
+        return c.hello_sent ? c.com.getfd() : c.dir_fd;
+    };
+
+    // Numbers alone are not enough, an fd that was closed has left the
+    // epoll sets, and its number may have been reused right away.
+    bool changed = false;
+    for (size_t i = 0; i < clients.size(); i++) {
+        int fd = fdOf(*clients[i]);
+        changed |= wake_fds[i] != fd || wake_gens[i] != clients[i]->wake_gen;
+        wake_fds[i] = fd;
+        wake_gens[i] = clients[i]->wake_gen;
+    }
+    if (clients.size() == 1) {
+        if (changed)
+            kbman.forgetWakeFd();
+        return wake_fds[0];
+    }
+    if (!changed && wake_epfd != -1)
+        return wake_epfd;
+
+    // The set is rebuilt rather than updated. The new set is created
+    // before the old one is closed, so that it gets a number that
+    // KBDManager has not seen.
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        throw SystemError("Unable to create epoll set: ", errno);
+    for (int fd : wake_fds) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        if (fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST) {
+            ::close(epfd);
+            throw SystemError("Unable to add fd to epoll set: ", errno);
+        }
+    }
+    if (wake_epfd != -1)
+        ::close(wake_epfd);
+    return wake_epfd = epfd;
+}
+
+void KBDDaemon::unloadPassthrough(std::string path) {
+    if (remap_sources.find(path) != remap_sources.end()) {
+        unloadRemap(path);
+        return;
+    }
+    setPassthrough(path, nullptr);
+}
+
+void KBDDaemon::setPassthrough(const string &path, vector<int> *keys) {
+    lock_guard<mutex> lock(passthrough_mtx);
+    auto it = key_sources.find(path);
+    if (it == key_sources.end() && !keys)
+        return;
+
+    // Keys whose reference count went from, or to, zero.
+    vector<int> changed;
+    if (it != key_sources.end()) {
+        for (int code : it->second)
+            if (--key_refs[code] == 0)
+                changed.push_back(code);
+        key_sources.erase(it);
+        if (!keys)
+            syslog(LOG_INFO, "Removing passthrough keys from: %s", path.c_str());
+    }
+    if (keys) {
+        sort(keys->begin(), keys->end());
+        keys->erase(unique(keys->begin(), keys->end()), keys->end());
+        for (int code : *keys)
+            if (key_refs[code]++ == 0)
+                changed.push_back(code);
+        key_sources[path] = std::move(*keys);
+    }
+    if (changed.empty())
+        return;
+
+    auto next = make_unique<bitset<KEY_MAX>>(*passthrough_keys.read());
+    for (int code : changed)
+        next->set(code, key_refs[code] != 0);
+    passthrough_keys.replace(std::move(next));
 }
 
 void KBDDaemon::loadPassthrough(std::string rel_path) {
@@ -85,27 +272,26 @@ void KBDDaemon::loadPassthrough(std::string rel_path) {
         // The CSV file is being reloaded after a change, remove the old keys.
         string path = realpath_safe(rel_path);
 
-        unloadPassthrough(path);
-
-        CSV csv(path);
-        auto cells = mkuniq(csv.getColCells("key_code"));
-        auto cells_i = mkuniq(new vector<int>());
-        for (auto *code_s : *cells) {
-            int i;
-            try {
-                i = stoi(*code_s);
-            } catch (const std::exception &e) {
-                continue;
-            }
-            if (i >= 0 && i < KEY_MAX) {
-                key_visibility[i] = KEY_SHOW;
-                cells_i->push_back(i);
-            } else {
-                syslog(LOG_WARNING, "Key code was out of range: %d", i);
-                continue;
-            }
+        if (RemapTable::isRemapFile(path)) {
+            loadRemap(path);
+            return;
         }
-        key_sources[path] = cells_i.release();
+
+        // Generated key lists can be long, so the file is scanned in place
+        // rather than loaded into a CSV matrix.
+        CSVView csv(path);
+        int col = csv.getColIndex("key_code");
+        if (col < 0)
+            throw CSV::CSVError("No such name");
+        vector<int> codes;
+        csv.forEachNumber<int>(col, [&](int i) {
+            if (i >= 0 && i < KEY_MAX)
+                codes.push_back(i);
+            else
+                HAWCK_LOG(LOG_WARNING, "Key code was out of range: %d", i);
+        });
+        // A reloaded file only changes the keys that differ between versions.
+        setPassthrough(path, &codes);
         keys_fsw.add(path);
         syslog(LOG_INFO, "Loaded passthrough keys from: %s", path.c_str());
     } catch (const CSV::CSVError &e) {
@@ -117,6 +303,44 @@ void KBDDaemon::loadPassthrough(std::string rel_path) {
     }
 }
 
+void KBDDaemon::rebuildRemaps() {
+    // Files are applied in order of their paths, so that the outcome of
+    // overlapping rules does not depend on the order they were loaded in.
+    vector<const string *> paths;
+    for (const auto &[path, _] : remap_sources) {
+        (void) _;
+        paths.push_back(&path);
+    }
+    sort(paths.begin(), paths.end(), [](const string *a, const string *b) {
+        return *a < *b;
+    });
+    auto tbl = mkuniq(new RemapTable());
+    for (const string *path : paths)
+        for (const auto &rule : remap_sources[*path])
+            tbl->add(rule);
+    remaps.replace(std::move(tbl));
+}
+
+void KBDDaemon::loadRemap(const std::string &path) {
+    try {
+        CSV csv(path);
+        remap_sources[path] = RemapTable::load(csv);
+        rebuildRemaps();
+        keys_fsw.add(path);
+        syslog(LOG_INFO, "Loaded %zu remaps from: %s",
+               remap_sources[path].size(), path.c_str());
+    } catch (const CSV::CSVError &e) {
+        syslog(LOG_ERR, "CSV parse error in '%s': %s", path.c_str(), e.what());
+    }
+}
+
+void KBDDaemon::unloadRemap(const std::string &path) {
+    if (remap_sources.erase(path)) {
+        rebuildRemaps();
+        syslog(LOG_INFO, "Removing remaps from: %s", path.c_str());
+    }
+}
+
 void KBDDaemon::loadPassthrough(FSEvent *ev) {
     unsigned perm = ev->stbuf.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
 
@@ -133,8 +357,6 @@ void KBDDaemon::loadPassthrough(FSEvent *ev) {
 }
 
 void KBDDaemon::initPassthrough() {
-    for (auto i = 0; i < KEY_MAX; i++)
-        key_visibility[i] = KEY_HIDE;
     auto files = mkuniq(keys_fsw.addFrom(data_dirs["keys"]));
     for (auto &file : *files)
         loadPassthrough(&file);
@@ -143,8 +365,10 @@ void KBDDaemon::initPassthrough() {
 void KBDDaemon::setup() {}
 
 void KBDDaemon::startPassthroughWatcher() {
+    keys_fsw.setCoalesce(100);
     keys_fsw.asyncWatch([this](FSEvent &ev) {
         syslog(LOG_INFO, "kbd file change on: %s", ev.path.c_str());
+        config_reloads->add();
         if (ev.mask & IN_DELETE_SELF)
             unloadPassthrough(ev.path);
         else if (ev.mask & (IN_CREATE | IN_MODIFY))
@@ -153,74 +377,588 @@ void KBDDaemon::startPassthroughWatcher() {
     });
 }
 
+void KBDDaemon::dumpLatency() noexcept {
+    try {
+        latency.dump(latency_path);
+        syslog(LOG_INFO, "Wrote latency statistics to: %s", latency_path.c_str());
+    } catch (const SystemError &e) {
+        syslog(LOG_ERR, "Unable to write latency statistics: %s", e.what());
+    }
+}
+
+bool KBDDaemon::queueLocal(MacroDClient &c, const KBDAction &action, bool direct) {
+    if (direct && c.pending.empty()) {
+        emitFor(c, action.ev);
+        passthrough_lat->since(action.ts.read);
+        return true;
+    }
+    c.pending.pushLocal(action, {action.ev});
+    return false;
+}
+
+bool KBDDaemon::queueRemapped(MacroDClient &c, const KBDAction &action,
+                              const KeyRemap &remap, bool direct)
+{
+    remap_buf.clear();
+    RemapTable::apply(remap, action.ev, &remap_buf);
+    if (direct && c.pending.empty()) {
+        for (const auto &ev : remap_buf)
+            emitFor(c, ev);
+        passthrough_lat->since(action.ts.read);
+        return true;
+    }
+    c.pending.pushLocal(action, remap_buf);
+    return false;
+}
+
+KeyRemap KBDDaemon::remapFor(const RemapTable &tbl, const KBDAction &action) {
+    const struct input_event &ev = action.ev;
+    if (ev.type != EV_KEY || ev.code >= KEY_CNT)
+        return KeyRemap();
+    // Repeats and releases go to whatever the key was pressed as.
+    if (ev.value != 1) {
+        KeyRemap remap = held_remaps[ev.code];
+        if (ev.value == 0)
+            held_remaps[ev.code] = KeyRemap();
+        return remap;
+    }
+    // The kill switch turns off remaps along with the scripts.
+    KeyRemap remap = ks_active ? KeyRemap() : tbl.lookup(action.dev_id, ev.code);
+    held_remaps[ev.code] = remap;
+    return remap;
+}
+
+void KBDDaemon::sendToMacroD(MacroDClient &c, const KBDAction &action) {
+    // Queued either way, so that resetting the connection emits it.
+    if (!c.pending.pushMacroD(action))
+        throw SocketTimeout("MacroD is too far behind");
+    sendQueued(c);
+}
+
+void KBDDaemon::sendQueued(MacroDClient &c) {
+    c.pending.sendQueued(max_in_flight, [&c](KBDAction &action) {
+        action.ts.sent = monotonicNanos();
+        c.com.send(&action);
+    });
+}
+
+void KBDDaemon::recvInterest(MacroDClient &c) {
+    KBDFrame frame;
+    c.com.recvFrame(&frame, &interest_buf, timeout);
+    c.filters = frame.flags;
+    c.interest.reset();
+    int num = 0;
+    for (size_t i = 0; i < KEY_CNT; i++) {
+        // Keys beyond the end of the bitmap are sent, MacroD might know
+        // of fewer keys than us.
+        if (i / 8 >= interest_buf.size() || (interest_buf[i / 8] & (1 << (i % 8)))) {
+            c.interest.set(i);
+            num++;
+        }
+    }
+    syslog(LOG_INFO, "MacroD scripts at %s react to %d keys, filters: 0x%x",
+           c.path.c_str(), num, c.filters);
+}
+
+void KBDDaemon::recvReply(MacroDClient &c) {
+    KBDFrame frame;
+    c.com.peekHeader(&frame, timeout);
+    if (frame.type == KBD_FRAME_INTEREST) {
+        recvInterest(c);
+        return;
+    }
+
+    c.com.recvFrame(&frame, &reply_buf, timeout);
+
+    if (frame.type == KBD_FRAME_OUTPUT) {
+        // Output of a timer in MacroD, it goes out after the replies to
+        // the events that were read before it.
+        c.pending.pushLocal(KBDAction(), reply_buf);
+        return;
+    }
+
+    if (frame.type != KBD_FRAME_EVENTS) {
+        syslog(LOG_WARNING, "Ignoring unknown frame type from MacroD: %d", frame.type);
+        return;
+    }
+
+    PendingEvent *it = c.pending.findInFlight(frame.seq);
+    if (!it)
+        throw SocketError("Received reply for unknown event: " + to_string(frame.seq));
+
+    it->out.insert(it->out.end(), reply_buf.begin(), reply_buf.end());
+
+    if (!(frame.flags & KBD_FRAME_DONE))
+        return;
+
+    // The final frame carries the timestamps of the round trip.
+    c.pending.complete(it);
+    c.round_trip->since(it->action.ts.sent);
+    socket_in_lat->between(frame.ts.sent, frame.ts.recv);
+    lua_lat->between(frame.ts.recv, frame.ts.reply);
+    socket_out_lat->since(frame.ts.reply);
+    sendQueued(c);
+}
+
+bool KBDDaemon::emitReady(MacroDClient &c) {
+    return c.pending.popDone([&](const PendingEvent &p) {
+        for (const auto &ev : p.out)
+            emitFor(c, ev);
+        if (p.action.ts.read)
+            (p.seq ? total_lat : passthrough_lat)->since(p.action.ts.read);
+    });
+}
+
+int KBDDaemon::timeUntilTimeout(const MacroDClient &c) const {
+    const PendingEvent *p = c.pending.oldestInFlight();
+    if (!p)
+        return -1;
+    int64_t waited_ms = (monotonicNanos() - p->action.ts.sent) / 1000000;
+    return std::max<int64_t>(0, timeout.count() - waited_ms);
+}
+
+void KBDDaemon::handleKillswitch(const KBDAction &action) noexcept {
+    if (combos.check(action.ev) != ks_combo)
+        return;
+    ks_active = !ks_active;
+    syslog(LOG_NOTICE, "Kill switch %s", ks_active ? "enabled, keys stay in InputD" : "disabled");
+}
+
+bool KBDDaemon::wantsMacroD(MacroDClient &c, const KBDAction &action) {
+    if (action.ev.type != EV_KEY)
+        return false;
+
+    // Keys that went down without MacroD are released without it.
+    uint16_t code = action.ev.code;
+    if (code < KEY_CNT && (c.degraded || c.direct_held[code])) {
+        if (action.ev.value == 1)
+            c.direct_held.set(code);
+        else if (action.ev.value == 0)
+            c.direct_held.reset(code);
+        handleKillswitch(action);
+        return false;
+    }
+
+    // Check if the key is listed in the passthrough set.
+    if (action.ev.code >= KEY_MAX) {
+        HAWCK_LOG(LOG_ERR, "Received key was out of range: %d", action.ev.code);
+        return false;
+    }
+    bool shown = passthrough_keys.read()->test(action.ev.code);
+    handleKillswitch(action);
+
+    uint16_t skip = 0;
+    switch (action.ev.value) {
+        case 0: skip = KBD_INTEREST_NO_KEYUP; break;
+        case 1: skip = KBD_INTEREST_NO_KEYDOWN; break;
+        case 2: skip = KBD_INTEREST_NO_REPEAT; break;
+    }
+    return !ks_active && shown && c.interest[action.ev.code] && !(c.filters & skip);
+}
+
+void KBDDaemon::setTrace(const std::string &path, bool redact) {
+    trace = make_unique<EventTraceWriter>(path, redact);
+    syslog(LOG_INFO, "Recording %s event trace to: %s",
+           redact ? "redacted" : "UNREDACTED", path.c_str());
+}
+
+void KBDDaemon::flushTrace() noexcept {
+    try {
+        trace->flush();
+    } catch (const SystemError &e) {
+        syslog(LOG_ERR, "Stopped recording event trace: %s", e.what());
+        trace.reset();
+    }
+}
+
+void KBDDaemon::recordFrame(const std::vector<KBDAction> &frame) noexcept {
+    try {
+        for (const auto &action : frame)
+            trace->record(action);
+    } catch (const SystemError &e) {
+        syslog(LOG_ERR, "Stopped recording event trace: %s", e.what());
+        trace.reset();
+    }
+}
+
+void KBDDaemon::handleFrame(const std::vector<KBDAction> &frame) {
+    if (frame.empty())
+        return;
+    kernel_lat->between(eventNanos(frame[0].ev), frame[0].ts.read);
+    if (trace)
+        recordFrame(frame);
+    // Frames are read from a single keyboard at a time.
+    MacroDClient &c = clientFor(frame[0].dev_id);
+    deviceEvents(frame[0].dev_id).add(frame.size());
+
+    // Routing is decided for the whole frame up front, if any of it goes
+    // to MacroD then the rest of it waits for the reply, so that e.g a
+    // MSC_SCAN is never emitted without its key.
+    frame_to_macrod.resize(frame.size());
+    frame_remaps.resize(frame.size());
+    bool any_to_macrod = false;
+    {
+        auto tbl = remaps.read();
+        for (size_t i = 0; i < frame.size(); i++) {
+            // Remapped keys never leave InputD.
+            bool to_macrod = wantsMacroD(c, frame[i]);
+            frame_remaps[i] = remapFor(*tbl, frame[i]);
+            if (frame_remaps[i].num)
+                to_macrod = false;
+            any_to_macrod |= (frame_to_macrod[i] = to_macrod);
+        }
+    }
+
+    bool had_direct = false;
+    uint64_t num_macrod = 0, num_remapped = 0;
+    size_t i = 0;
+    try {
+        for (; i < frame.size(); i++) {
+            if (frame_to_macrod[i]) {
+                sendToMacroD(c, frame[i]);
+                num_macrod++;
+            } else if (frame_remaps[i].num) {
+                had_direct |= queueRemapped(c, frame[i], frame_remaps[i], !any_to_macrod);
+                num_remapped++;
+            } else {
+                had_direct |= queueLocal(c, frame[i], !any_to_macrod);
+            }
+        }
+    } catch (const SocketError &e) {
+        // The event that failed was queued, so the reset emits it along
+        // with the rest of the queue. The client is degraded now, and the
+        // rest of the frame goes straight to the udevice.
+        connectionFailed(c, e);
+        for (i++; i < frame.size(); i++) {
+            const struct input_event &ev = frame[i].ev;
+            if (ev.type == EV_KEY && ev.code < KEY_CNT && ev.value != 2)
+                c.direct_held.set(ev.code, ev.value == 1);
+            if (frame_remaps[i].num) {
+                queueRemapped(c, frame[i], frame_remaps[i], true);
+                num_remapped++;
+            } else
+                queueLocal(c, frame[i], true);
+        }
+        had_direct = true;
+    }
+    if (num_macrod)
+        routed_macrod->add(num_macrod);
+    if (num_remapped)
+        routed_remapped->add(num_remapped);
+    if (frame.size() > num_macrod + num_remapped)
+        routed_local->add(frame.size() - num_macrod - num_remapped);
+
+    // The whole frame goes out in a single write.
+    if (had_direct) {
+        uint64_t flush_t = monotonicNanos();
+        udev.flush();
+        flush_lat->since(flush_t);
+    }
+}
+
+void KBDDaemon::connectionFailed(MacroDClient &c, const SocketError &e) {
+    HAWCK_LOG(LOG_ERR, "Socket error: %s", e.what());
+    if (dynamic_cast<const SocketTimeout *>(&e))
+        c.timeouts->add();
+    resetConnection(c);
+}
+
+void KBDDaemon::resetConnection(MacroDClient &c) {
+    syslog(LOG_INFO, "Resetting connection to MacroD at %s", c.path.c_str());
+    c.resets->add();
+
+    // Events that did not get a complete reply are emitted unchanged.
+    c.pending.drain([&](const struct input_event &ev) { emitFor(c, ev); });
+    // The new MacroD will tell us what it wants.
+    c.interest.set();
+    c.filters = 0;
+
+    // Only the keys of this client are released, other clients may be
+    // holding keys down on the same udevice.
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (c.keys_down[code]) {
+            udev.emit(EV_KEY, code, 0);
+            udev.emit(EV_SYN, SYN_REPORT, 0);
+        }
+    }
+    c.keys_down.reset();
+    udev.flush();
+
+    c.com.close();
+    c.wake_gen++;
+    enterDegraded(c);
+}
+
+void KBDDaemon::sendHello(MacroDClient &c) {
+    c.offered_shm.reset();
+    if (use_shm) {
+        try {
+            c.offered_shm = ShmTransport::create();
+        } catch (const SystemError &e) {
+            syslog(LOG_ERR, "Unable to set up shared memory, using socket: %s", e.what());
+        }
+    }
+
+    KBDHello hello;
+    hello.magic = KBD_HELLO_MAGIC;
+    hello.version = KBD_PROTOCOL_VERSION;
+    hello.flags = 0;
+    if (c.offered_shm)
+        hello.flags |= KBD_HELLO_SHM;
+    c.com.sendFds(&hello, sizeof(hello), c.offered_shm ? c.offered_shm->fds() : vector<int>());
+}
+
+void KBDDaemon::recvHello(MacroDClient &c) {
+    KBDFrame frame;
+    c.com.recvFrame(&frame, &reply_buf, timeout);
+    if (frame.type != KBD_FRAME_HELLO)
+        throw SocketError("Expected hello from MacroD, got frame type: " + to_string(frame.type));
+
+    if (c.offered_shm && (frame.flags & KBD_HELLO_SHM)) {
+        c.com.useShm(std::move(c.offered_shm));
+        c.wake_gen++;
+        syslog(LOG_INFO, "Using shared memory transport");
+    } else if (c.offered_shm) {
+        syslog(LOG_WARNING, "MacroD declined shared memory, using socket");
+    }
+    c.offered_shm.reset();
+}
+
+void KBDDaemon::enterDegraded(MacroDClient &c, bool lost) {
+    if (lost)
+        syslog(LOG_CRIT, "Unable to communicate with MacroD at %s, passing keys through until it is back",
+               c.path.c_str());
+    else
+        syslog(LOG_INFO, "Waiting for MacroD at %s, passing keys through until it answers",
+               c.path.c_str());
+    c.degraded = true;
+    c.hello_sent = false;
+    c.next_reconnect = chrono::steady_clock::now();
+
+    if (c.dir_fd == -1) {
+        // MacroD creates the socket, then changes its owner and mode.
+        size_t slash = c.path.rfind('/');
+        string dir = (slash == string::npos) ? "." : c.path.substr(0, slash);
+        c.dir_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (c.dir_fd != -1 &&
+            inotify_add_watch(c.dir_fd, dir.c_str(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) == -1)
+        {
+            syslog(LOG_WARNING, "Unable to watch %s for MacroD: %s", dir.c_str(), strerror(errno));
+            ::close(c.dir_fd);
+            c.dir_fd = -1;
+        }
+        c.wake_gen++;
+    }
+}
+
+void KBDDaemon::pollReconnect(MacroDClient &c) {
+    auto now = chrono::steady_clock::now();
+
+    if (c.hello_sent) {
+        try {
+            if (c.com.waitReadable(0)) {
+                recvHello(c);
+                c.degraded = c.hello_sent = false;
+                c.reconnects->add();
+                syslog(LOG_NOTICE, "Connected to MacroD at %s, keys are routed through it again",
+                       c.path.c_str());
+            } else if (now >= c.hello_deadline) {
+                throw SocketTimeout("Timed out waiting for hello from MacroD");
+            }
+        } catch (const SocketError &e) {
+            syslog(LOG_ERR, "Handshake with MacroD failed: %s", e.what());
+            c.com.close();
+            c.wake_gen++;
+            c.hello_sent = false;
+            c.next_reconnect = now + reconnect_interval;
+        }
+        return;
+    }
+
+    bool dir_changed = false;
+    if (c.dir_fd != -1) {
+        char buf[4096];
+        while (::read(c.dir_fd, buf, sizeof(buf)) > 0)
+            dir_changed = true;
+    }
+    if (!dir_changed && now < c.next_reconnect)
+        return;
+    c.next_reconnect = now + reconnect_interval;
+
+    try {
+        // tryRecon() closes the old socket, even if it fails.
+        c.wake_gen++;
+        if (!c.com.tryRecon())
+            return;
+        sendHello(c);
+        c.hello_sent = true;
+        c.hello_deadline = now + timeout;
+    } catch (const SocketError &e) {
+        syslog(LOG_ERR, "Unable to send hello to MacroD: %s", e.what());
+        c.com.close();
+        c.wake_gen++;
+    }
+}
+
 void KBDDaemon::run() {
-    KBDAction action;
-    memset(&action, '\0', sizeof(action));
+    vector<KBDAction> frame;
     setup();
     startPassthroughWatcher();
     kbman.setup();
     kbman.startHotplugWatcher();
+    if (!routes.empty()) {
+        kbdb.refresh();
+        kbdb.startWatcher();
+    }
+    wake_fds.assign(clients.size(), -1);
+    wake_gens.assign(clients.size(), 0);
+    // The connections of the old InputD to MacroD are gone, so the keys
+    // that MacroD held down are released. Keys that were passed straight
+    // through follow the physical keys, and are released with them.
+    bool released = false;
+    for (const auto &hc : inherited_clients) {
+        for (auto &c : clients) {
+            if (c->path != hc.path)
+                continue;
+            c->direct_held |= hc.direct_held;
+            c->keys_down |= hc.keys_down & hc.direct_held;
+        }
+        for (int code = 0; code < KEY_CNT; code++) {
+            if (hc.keys_down[code] && !hc.direct_held[code]) {
+                udev.emit(EV_KEY, code, 0);
+                udev.emit(EV_SYN, SYN_REPORT, 0);
+                released = true;
+            }
+        }
+    }
+    if (released)
+        udev.flush();
+    inherited_clients.clear();
+    // Keys are passed through until MacroD has answered the hello.
+    for (auto &c : clients) {
+        enterDegraded(*c, false);
+        pollReconnect(*c);
+    }
 
-    for (;;) {
-        action.done = 0;
-        if (!kbman.getEvent(&action))
-            continue;
+    signal(SIGUSR1, handleSigUsr1);
 
-        if (action.ev.type != EV_KEY) {
-            udev.emit(&action.ev);
-            udev.flush();
-            continue;
-        }
+    try {
+        stats = make_unique<StatsServer>(stats_path, metrics);
+        stats->start();
+    } catch (const SocketError &e) {
+        syslog(LOG_ERR, "Unable to start stats socket: %s", e.what());
+    } catch (const SystemError &e) {
+        syslog(LOG_ERR, "Unable to start stats socket: %s", e.what());
+    }
+    try {
+        handover = make_unique<HandoverServer>(handover_path);
+        handover->start();
+    } catch (const SocketError &e) {
+        syslog(LOG_ERR, "Unable to start handover socket: %s", e.what());
+    } catch (const SystemError &e) {
+        syslog(LOG_ERR, "Unable to start handover socket: %s", e.what());
+    }
 
-        // Check if the key is listed in the passthrough set.
-        KeyVisibility key_vis;
-        if (action.ev.code >= KEY_MAX) {
-            syslog(LOG_ERR, "Received key was out of range: %d", action.ev.code);
-            key_vis = KEY_HIDE;
-        } else {
-            key_vis = key_visibility[action.ev.code];
-            ks_combo.check(action);
+    // Let output be written while we keep reading from the keyboards.
+    if (use_emitter_thread)
+        udev.startEmitter();
+
+    // All the watcher threads have been started by now, so they keep the
+    // normal scheduler.
+    rt.applyToThisThread("event");
+    if (use_emitter_thread)
+        rt.applyTo(udev.getEmitterThread(), "emitter");
+
+    // Events are sent to MacroD as soon as they are read, replies are matched
+    // up with their events by sequence number, and output is emitted in the
+    // order the events were read. Each client has a pipeline of its own, and
+    // a client that is full only queues up the events of its own keyboards.
+    for (;;) {
+        if (dump_latency_requested.exchange(false))
+            dumpLatency();
+
+        int wait_ms = 64;
+        for (const auto &c : clients) {
+            int t = timeUntilTimeout(*c);
+            if (t >= 0 && t < wait_ms)
+                wait_ms = t;
         }
 
-        if (!ks_combo.active && key_vis == KEY_SHOW) {
-            input_event orig_ev = action.ev;
+        bool had_frame = kbman.getFrame(&frame, wait_ms, getWakeFd());
 
-            // Pass key to Lua executor
+        // Handle replies that have arrived
+        for (auto &c : clients) {
             try {
-                kbd_com.send(&action);
-
-                // Receive keys to emit from the macro daemon.
-                for (;;) {
-                    kbd_com.recv(&action, timeout);
-                    if (action.done)
-                        break;
-                    udev.emit(&action.ev);
-                }
-                // Flush received keys and continue on.
-                udev.flush();
-                continue;
+                while (!c->degraded && c->com.waitReadable(0))
+                    recvReply(*c);
             } catch (const SocketError &e) {
-                syslog(LOG_INFO, "Resetting connection to MacroD");
+                connectionFailed(*c, e);
+            }
+        }
 
-                udev.emit(&orig_ev);
-                udev.upAll();
-                udev.flush();
+        if (had_frame)
+            handleFrame(frame);
+        else if (trace)
+            flushTrace();
 
-                auto unlock = kbman.unlockAll();
-                syslog(LOG_CRIT, "Unable to communicate with MacroD, reconnecting ...");
-                // Reconnect.
-                kbd_com.recon();
+        bool had_output = false;
+        for (auto &c : clients)
+            had_output |= emitReady(*c);
+        if (had_output) {
+            uint64_t flush_t = monotonicNanos();
+            udev.flush();
+            flush_lat->since(flush_t);
+        }
 
-                // Skip the received event
-                continue;
+        for (auto &c : clients) {
+            if (c->degraded) {
+                pollReconnect(*c);
+            } else if (timeUntilTimeout(*c) == 0) {
+                connectionFailed(*c, SocketTimeout("Timed out waiting for MacroD"));
             }
         }
 
-        udev.emit(&action.ev);
-        udev.flush();
+        if (handover && handover->requested())
+            handOver();
     }
 }
 
+void KBDDaemon::handOver() {
+    // Output has to be complete, an event that is waiting on MacroD would
+    // be lost.
+    for (const auto &c : clients)
+        if (!c->pending.empty())
+            return;
+
+    HandoverState state;
+    state.pointers = udev.hasPointer();
+    state.ufd = udev.getfd();
+    state.dfd = udev.getEventFd();
+    for (const auto &c : clients)
+        state.clients.push_back({c->path, c->keys_down, c->direct_held});
+
+    bool sent = false;
+    bool idle = kbman.handOver([&](const vector<HandoverKeyboard> &kbds) {
+        state.kbds = kbds;
+        udev.sync();
+        try {
+            sendHandover(handover->take(), state, timeout.count());
+            sent = true;
+        } catch (const SocketError &e) {
+            syslog(LOG_ERR, "Unable to hand over the devices, keeping them: %s", e.what());
+        }
+    });
+    if (!idle || !sent)
+        return;
+
+    syslog(LOG_NOTICE, "Handed over %zu keyboards to the new InputD, exiting", state.kbds.size());
+    if (trace)
+        flushTrace();
+    // Running the destructors would ungrab the keyboards and destroy the
+    // udevice, which belong to the new InputD now.
+    _exit(0);
+}
+
 void KBDDaemon::setEventDelay(int delay) {
     udev.setEventDelay(delay);
 }
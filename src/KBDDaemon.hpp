@@ -29,7 +29,9 @@
 #pragma once
 
 #include <unordered_map>
+#include <deque>
 #include <set>
+#include <bitset>
 #include <mutex>
 #include <thread>
 #include <regex>
@@ -44,6 +46,16 @@
 #include "SystemError.hpp"
 #include "FSWatcher.hpp"
 #include "KeyCombo.hpp"
+#include "Latency.hpp"
+#include "Metrics.hpp"
+#include "StatsServer.hpp"
+#include "Handover.hpp"
+#include "EventTrace.hpp"
+#include "Remap.hpp"
+#include "RCU.hpp"
+#include "Realtime.hpp"
+#include "KBDB.hpp"
+#include "PendingQueue.hpp"
 
 extern "C" {
     #include <fcntl.h>
@@ -55,29 +67,36 @@ extern "C" {
 #define DANGER_DANGER_LOG_KEYS 0
 
 class KBDDaemon {
-    enum KeyVisibility {
-        /* Show a key to the MacroDaemon */
-        KEY_SHOW,
-        /* Keep a key inside the InputDaemon */
-        KEY_KEEP,
-        /* Hide a key, this means no Lua scripts will see them, and they will be echoed
-           onto the virtual keyboard. */
-        KEY_HIDE
-    };
-
     using Milliseconds = std::chrono::milliseconds;
 
   private:
     Milliseconds timeout = Milliseconds(2048);
-    std::atomic<KeyVisibility> key_visibility[KEY_MAX];
+    /** Keys that are shown to MacroD, all other keys are echoed onto the
+     *  virtual keyboard without any Lua script seeing them. Built from
+     *  key_refs and read by the main loop. */
+    RCUPtr<std::bitset<KEY_MAX>> passthrough_keys;
+    /** Guards key_sources and key_refs, which the watcher thread updates. */
+    std::mutex passthrough_mtx;
+    /** Number of files in key_sources listing each key. */
+    std::vector<uint16_t> key_refs = std::vector<uint16_t>(KEY_MAX);
     std::string home_path = "/var/lib/hawck-input";
     std::unordered_map<std::string, std::string> data_dirs = {
         {"keys", home_path + "/keys"}
     };
-    std::unordered_map<std::string, std::vector<int>*> key_sources;
+    /** Key codes of each passthrough file, without duplicates. */
+    std::unordered_map<std::string, std::vector<int>> key_sources;
+    /** Rules of the loaded remap files, see loadRemap() */
+    std::unordered_map<std::string, std::vector<RemapRule>> remap_sources;
+    /** Remaps applied by the main loop, built from remap_sources. */
+    RCUPtr<RemapTable> remaps;
+    /** Remap that each key was pressed with, so that it is released the
+     *  same way even if the remaps change while it is held down. */
+    std::vector<KeyRemap> held_remaps = std::vector<KeyRemap>(KEY_CNT);
+    /** Remap of each event of the frame being handled. */
+    std::vector<KeyRemap> frame_remaps;
+    std::vector<struct input_event> remap_buf;
     std::unordered_map<std::string, Lua::Script *> scripts;
     const std::string scripts_dir = "/var/lib/hawck-input/scripts";
-    UNIXSocket<KBDAction> kbd_com;
     UDevice udev;
     /** Watcher for /var/lib/hawck/keys */
     FSWatcher keys_fsw;
@@ -85,17 +104,261 @@ class KBDDaemon {
      * plugged in. Keyboards that were added on startup with --kbd-device
      * arguments will always be reconnected on hotplug. */
     bool allow_hotplug = true;
-    KeyComboToggle ks_combo = KeyComboToggle({KEY_ESC, KEY_SPACE});
+    /** Write output from a separate thread, see UDevice::startEmitter() */
+    bool use_emitter_thread = true;
+    /** Offer MacroD a shared memory transport on connect. */
+    bool use_shm = false;
+    static constexpr Milliseconds reconnect_interval = Milliseconds(1000);
+    /** Scheduling of the main loop and the emitter thread. */
+    RealtimeOptions rt;
+    /** Combos recognised by InputD, see handleKillswitch() */
+    ComboAutomaton combos;
+    /** Id of the kill switch in combos, Esc+Space toggles whether keys
+     *  are sent to MacroD and remapped. */
+    int ks_combo;
+    bool ks_active = false;
+    /** Time spent in each stage of handling an event, written to
+     *  latency_path on SIGUSR1. */
+    LatencyStats latency;
+    std::string latency_path = home_path + "/latency.txt";
+    LatencyHistogram *kernel_lat,
+                     *socket_in_lat,
+                     *lua_lat,
+                     *socket_out_lat,
+                     *flush_lat,
+                     *total_lat,
+                     *passthrough_lat;
+    /** Counters served on stats_path, see docs/hawck-inputd.md */
+    Metrics metrics;
+    std::string stats_path = home_path + "/stats.sock";
+    std::unique_ptr<StatsServer> stats;
+    /** Where a new InputD asks to take over the devices, see Handover.hpp */
+    std::string handover_path = home_path + "/handover.sock";
+    std::unique_ptr<HandoverServer> handover;
+    /** Keys that the InputD the devices were taken over from held down for
+     *  each MacroD, run() releases those that MacroD pressed */
+    std::vector<HandoverClient> inherited_clients;
+    /** Events read from each keyboard, see deviceEvents() */
+    std::unordered_map<struct input_id, MetricCounter *, InputIDHash> device_events;
+    MetricCounter *routed_macrod,
+                  *routed_local,
+                  *routed_remapped,
+                  *config_reloads;
+
+    /** A client with more pending events than this is considered stuck,
+     *  and its connection is reset. */
+    static constexpr size_t max_pending = 1024;
+
+    /**
+     * Connection to a MacroD instance, with a pipeline of its own. Every
+     * keyboard is routed to exactly one client, so slow scripts in one
+     * MacroD only hold back the keyboards that are routed to it.
+     */
+    struct MacroDClient {
+        /** Path of the socket that MacroD listens on. */
+        std::string path;
+        UNIXSocket<KBDAction> com;
+        /** Set while MacroD is unavailable, keys are then written straight
+         *  to the udevice while the keyboards stay grabbed. */
+        bool degraded = false;
+        /** Whether a hello is waiting for a reply, see pollReconnect() */
+        bool hello_sent = false;
+        std::chrono::steady_clock::time_point hello_deadline;
+        std::chrono::steady_clock::time_point next_reconnect;
+        /** Transport offered in the hello that is in flight. */
+        std::unique_ptr<ShmTransport> offered_shm;
+        /** inotify instance watching the directory of the socket. */
+        int dir_fd = -1;
+        /** Bumped whenever an fd of the client is closed or replaced, as
+         *  the new one may get the same number, see getWakeFd() */
+        uint32_t wake_gen = 0;
+        /** Keys pressed while degraded, their repeats and releases skip
+         *  MacroD even once it is back. */
+        std::bitset<KEY_CNT> direct_held;
+        /** Keys that were pressed on the udevice on behalf of this client,
+         *  they are released if the connection is reset. */
+        std::bitset<KEY_CNT> keys_down;
+        PendingQueue pending {max_pending};
+        /** Key codes that MacroD scripts may react to, all other keys are
+         *  emitted without a round trip. Everything is sent until MacroD
+         *  tells us otherwise. */
+        std::bitset<KEY_CNT> interest;
+        /** KBDInterestFlags of the last interest frame, key events that
+         *  they filter out are emitted without a round trip as well. */
+        uint16_t filters = 0;
+        /** Time from sending an event until its final reply. */
+        LatencyHistogram *round_trip;
+        MetricCounter *resets,
+                      *timeouts,
+                      *reconnects;
+
+        MacroDClient(const std::string &path, Metrics &metrics);
+        ~MacroDClient();
+    };
+
+    /** Sends keyboards whose KBDB id matches `pattern` to `client`. */
+    struct Route {
+        std::string pattern;
+        MacroDClient *client;
+    };
+
+    /** All MacroD instances, the first one gets every keyboard that no
+     *  route matches. */
+    std::vector<std::unique_ptr<MacroDClient>> clients;
+    std::vector<Route> routes;
+    /** Client of each keyboard that has been seen, see clientFor() */
+    std::unordered_map<struct input_id, MacroDClient *, InputIDHash> route_cache;
+    KBDB kbdb;
+    /** epoll set of the fds that wake up the main loop when there is more
+     *  than one client, and the fds and wake_gen of each client that it
+     *  was built from. */
+    int wake_epfd = -1;
+    std::vector<int> wake_fds;
+    std::vector<uint32_t> wake_gens;
+    /** Maximum number of events in flight to each MacroD, 1 means
+     *  stop-and-wait. */
+    size_t max_in_flight = 16;
+    /** Payload of the last frame received from MacroD. */
+    std::vector<struct input_event> reply_buf;
+    std::vector<uint8_t> interest_buf;
+    /** Routing of the frame being handled, see handleFrame() */
+    std::vector<bool> frame_to_macrod;
+    /** Records the events read from the keyboards, see setTrace() */
+    std::unique_ptr<EventTraceWriter> trace;
 
   private:
     void setup();
+
+    /** Add a frame to the trace, recording stops if that fails. */
+    void recordFrame(const std::vector<KBDAction> &frame) noexcept;
+
+    /** Write out the buffered part of the trace, done when idle. */
+    void flushTrace() noexcept;
+
+    /** Decide whether an event read from a keyboard should be sent
+     *  to the MacroD it is routed to. */
+    bool wantsMacroD(MacroDClient &c, const KBDAction &action);
+
+    /** Find the client that a keyboard is routed to. */
+    MacroDClient &clientFor(const struct input_id &id);
+
+    /** Get an fd that becomes readable when any client needs attention,
+     *  rebuilding wake_epfd if the fds of the clients changed. */
+    int getWakeFd();
+
+    /** Emit an event on behalf of a client, keeping track of the keys
+     *  it holds down. */
+    inline void emitFor(MacroDClient &c, const struct input_event &ev) {
+        if (ev.type == EV_KEY && ev.code < KEY_CNT)
+            c.keys_down.set(ev.code, ev.value != 0);
+        udev.emit(&ev);
+    }
+
+    /** Route a frame of events read from a keyboard, each event goes
+     *  either to MacroD or onto the output queue. */
+    void handleFrame(const std::vector<KBDAction> &frame);
+
+    /** Emit an event without involving MacroD, while keeping it ordered
+     *  after any events of the same client that are still in flight.
+     *
+     * @param direct Whether the event may be emitted right away if
+     *               nothing is pending.
+     * @return True if the event was emitted and needs a flush.
+     */
+    bool queueLocal(MacroDClient &c, const KBDAction &action, bool direct);
+
+    /** Like queueLocal(), but emits the remapped keys instead. */
+    bool queueRemapped(MacroDClient &c, const KBDAction &action,
+                       const KeyRemap &remap, bool direct);
+
+    /** Find the remap of a key event, taking keys that are held down
+     *  into account. */
+    KeyRemap remapFor(const RemapTable &tbl, const KBDAction &action);
+
+    /** Publish a new remap table built from remap_sources. */
+    void rebuildRemaps();
+
+    /** Send an event to MacroD, or queue it if max_in_flight events are
+     *  already in flight.
+     *
+     * @throws SocketTimeout If MacroD is max_pending events behind, the
+     *         event is queued anyway.
+     */
+    void sendToMacroD(MacroDClient &c, const KBDAction &action);
+
+    /** Send queued events while there is room in the pipeline. */
+    void sendQueued(MacroDClient &c);
+
+    /** Receive a single reply frame and match it with its event. */
+    void recvReply(MacroDClient &c);
+
+    /** Receive a KBD_FRAME_INTEREST frame. */
+    void recvInterest(MacroDClient &c);
+
+    /** Emit output for all done events at the front of the queue.
+     *
+     * @return True if anything was emitted and needs a flush.
+     */
+    bool emitReady(MacroDClient &c);
+
+    /** Milliseconds until the oldest event in flight times out. */
+    int timeUntilTimeout(const MacroDClient &c) const;
+
+    /** Emit everything that is pending and go into degraded mode until
+     *  MacroD is back. */
+    void resetConnection(MacroDClient &c);
+
+    /** Log a socket error and reset the connection. */
+    void connectionFailed(MacroDClient &c, const SocketError &e);
+
+    /** Counter of the events read from a keyboard. */
+    MetricCounter &deviceEvents(const struct input_id &id);
+
+    /** Send a hello on a new connection, offering shared memory if
+     *  use_shm is set. */
+    void sendHello(MacroDClient &c);
+
+    /** Receive the hello from MacroD and set up the transport it chose. */
+    void recvHello(MacroDClient &c);
+
+    /**
+     * Pass keys straight through to the udevice, and watch for the socket
+     * of MacroD to come back.
+     *
+     * @param lost False when MacroD has not been connected to yet, e.g at
+     *             startup, which is not worth more than an info message.
+     */
+    void enterDegraded(MacroDClient &c, bool lost = true);
+
+    /**
+     * Make progress on reconnecting to MacroD while degraded, without
+     * blocking. Attempts are made when the directory of the socket changes,
+     * and at most every reconnect_interval otherwise.
+     */
+    void pollReconnect(MacroDClient &c);
+
+    /** Write latency statistics to latency_path. */
+    void dumpLatency() noexcept;
+
+    /**
+     * Hand the devices over to the new InputD that asked for them, and
+     * exit. Returns if events are still in flight, or if the handover
+     * failed, in which case the devices are kept.
+     */
+    void handOver();
     void startPassthroughWatcher();
 
   public:
     KBDManager kbman;
 
     explicit KBDDaemon(const char *device);
-    KBDDaemon();
+    /**
+     * @param pointers Pass mice through as well, see UDevice(bool)
+     * @param from Devices taken over from another InputD, or null to
+     *             create the udevice. Keyboards that are not taken over
+     *             can still be added with kbman.addDevice()
+     */
+    explicit KBDDaemon(bool pointers = false, const HandoverState *from = nullptr);
     ~KBDDaemon();
 
     /**
@@ -106,6 +369,8 @@ class KBDDaemon {
 
     void initPassthrough();
 
+    /** Feed a key to the combos, and toggle the kill switch if the key
+     *  completes it. */
     void handleKillswitch(const KBDAction& action) noexcept;
 
     /**
@@ -128,15 +393,83 @@ class KBDDaemon {
      */
     void unloadPassthrough(std::string path);
 
+    /**
+     * Replace the keys of a passthrough file, and publish the keys that
+     * changed visibility as a new passthrough_keys snapshot.
+     *
+     * @param path File the keys come from.
+     * @param keys New keys of the file, or null to remove it.
+     */
+    void setPassthrough(const std::string &path, std::vector<int> *keys);
+
+    /**
+     * Load remaps from a file at `path`, see RemapTable. Remapped keys are
+     * rewritten by InputD and never sent to MacroD.
+     *
+     * @param path Path to a .remap.csv file.
+     */
+    void loadRemap(const std::string &path);
+
+    /** Unload the remaps from the file at `path`. */
+    void unloadRemap(const std::string &path);
+
+    /**
+     * Route keyboards to another MacroD instance, must be called before
+     * run(). Rules are tried in the order they were added, and keyboards
+     * that match none of them go to the MacroD at kbd.sock.
+     *
+     * @param pattern Glob matched against the KBDB id of the keyboard,
+     *                i.e vendor:product:Name_With_Underscores
+     * @param sock_path Socket of the MacroD, relative to home_path unless
+     *                  it is absolute.
+     */
+    void addRoute(const std::string &pattern, const std::string &sock_path);
+
     /**
      * Start running the daemon.
      */
     void run();
 
+    /** Set the number of events that may be sent to MacroD before
+     *  waiting for replies. */
+    inline void setPipelineDepth(int depth) noexcept {
+        max_in_flight = depth < 1 ? 1 : depth;
+    }
+
     /** Set timeout for read() on sockets. */
     inline void setSocketTimeout(int time) {
         timeout = Milliseconds(time);
     }
 
     void setEventDelay(int delay);
+
+    inline void setFlushMode(UDeviceFlushMode mode) {
+        udev.setFlushMode(mode);
+    }
+
+    /** Decide whether output should be written from a separate thread,
+     *  must be called before run(). */
+    inline void setEmitterThread(bool val) noexcept {
+        use_emitter_thread = val;
+    }
+
+    /** Offer a shared memory transport to MacroD, the socket is used
+     *  if MacroD declines it. */
+    inline void setShmTransport(bool val) noexcept {
+        use_shm = val;
+    }
+
+    /** Set how the threads that keys pass through are scheduled, must be
+     *  called before run(). */
+    inline void setRealtime(const RealtimeOptions &opts) {
+        rt = opts;
+    }
+
+    /**
+     * Record all events read from the keyboards, see EventTraceWriter.
+     *
+     * @param path Trace file to write.
+     * @param redact Whether to leave out what was typed.
+     */
+    void setTrace(const std::string &path, bool redact);
 };
@@ -1,19 +1,49 @@
 #include "KBDManager.hpp"
 #include "utils.hpp"
 #include "Permissions.hpp"
+#include "SystemError.hpp"
+#include "Latency.hpp"
+#include "UEventMonitor.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <memory>
+
+extern "C" {
+    #include <sys/epoll.h>
+    #include <string.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sys/ioctl.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #include <linux/input.h>
+}
 
 using namespace std;
 using namespace Permissions;
 
 constexpr int FSW_MAX_WAIT_PERMISSIONS_US = 5 * 1000000;
 
+KBDManager::KBDManager() {
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        throw SystemError("Unable to create epoll instance: ", errno);
+}
+
 KBDManager::~KBDManager() {
+    hotplug_running = false;
+    if (uevent_thread.joinable())
+        uevent_thread.join();
     for (Keyboard *kbd : kbds)
         delete kbd;
+    close(epfd);
 }
 
 void KBDManager::setup() {
     for (auto& kbd : kbds) {
+        // Keyboards taken over from another InputD are already grabbed.
+        if (kbd->getState() != KBDState::OPEN)
+            continue;
         syslog(LOG_INFO, "Attempting to get lock on device: %s @ %s",
                kbd->getName().c_str(), kbd->getPhys().c_str());
         kbd->lock();
@@ -22,41 +52,215 @@ void KBDManager::setup() {
     updateAvailableKBDs();
 }
 
-bool KBDManager::getEvent(KBDAction *action) {
-    Keyboard *kbd = nullptr;
-    bool had_key = false;
+void KBDManager::watch(Keyboard *kbd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = kbd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, kbd->getfd(), &ev) == -1 && errno != EEXIST)
+        throw SystemError("Unable to add keyboard to epoll set: ", errno);
+}
 
+void KBDManager::unwatch(Keyboard *kbd) noexcept {
+    // Closed file descriptors have already left the set.
+    if (!kbd->isDisabled())
+        epoll_ctl(epfd, EPOLL_CTL_DEL, kbd->getfd(), nullptr);
+}
+
+void KBDManager::watchWakeFd(int wake_fd) {
+    if (wake_fd == epoll_wake_fd)
+        return;
+    // The old descriptor may already be closed, in which case epoll has
+    // forgotten about it.
+    if (epoll_wake_fd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, epoll_wake_fd, nullptr);
+    epoll_wake_fd = -1;
+    if (wake_fd < 0)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) == -1 && errno != EEXIST)
+        throw SystemError("Unable to add wake fd to epoll set: ", errno);
+    epoll_wake_fd = wake_fd;
+}
+
+void KBDManager::forgetWakeFd() noexcept {
+    if (epoll_wake_fd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, epoll_wake_fd, nullptr);
+    epoll_wake_fd = -1;
+}
+
+void KBDManager::readFrom(Keyboard *kbd) {
     try {
-        available_kbds_mtx.lock();
-        vector<Keyboard *> kbds(available_kbds);
-        available_kbds_mtx.unlock();
-        int idx = kbdMultiplex(kbds, 64);
-        if (idx != -1) {
-            kbd = kbds[idx];
-            kbd->get(action);
-
-            // Throw away the key if the keyboard isn't locked yet.
-            if (kbd->getState() == KBDState::LOCKED)
-                had_key = true;
-            // Always lock unlocked keyboards.
-            else if (kbd->getState() == KBDState::OPEN)
-                kbd->lock();
-        }
+        uint64_t drops = kbd->numDrops();
+        // After a drop the device may have nothing more to read while
+        // the keyboard still has events for us.
+        do {
+            kbd->fill();
+
+            const struct input_event *evs;
+            size_t num;
+            while (kbd->nextFrame(&evs, &num)) {
+                // Throw away the keys if the keyboard isn't locked yet.
+                if (kbd->getState() != KBDState::LOCKED)
+                    continue;
+                KBDAction action;
+                memset(&action, 0, sizeof(action));
+                action.dev_id = kbd->getDevID();
+                action.ts.read = kbd->readTime();
+                size_t begin = pending.size();
+                for (size_t i = 0; i < num; i++) {
+                    action.ev = evs[i];
+                    pending.push_back(action);
+                }
+                pending_frames.push_back({eventNanos(evs[0]), begin, pending.size()});
+            }
+        } while (kbd->hasUnread());
+        if (kbd->numDrops() != drops)
+            num_drops.fetch_add(kbd->numDrops() - drops, memory_order_relaxed);
+        // Always lock unlocked keyboards.
+        if (kbd->getState() == KBDState::OPEN)
+            kbd->lock();
     } catch (const KeyboardError &e) {
         // Disable the keyboard,
-        syslog(LOG_ERR, "Read error on keyboard, assumed to be removed: %s",
-               kbd->getName().c_str());
-        kbd->disable();
+        HAWCK_LOG(LOG_ERR, "Read error on keyboard, assumed to be removed: %s",
+                  kbd->getName().c_str());
         {
             lock_guard<mutex> lock(available_kbds_mtx);
+            unwatch(kbd);
             auto pos_it = find(available_kbds.begin(), available_kbds.end(), kbd);
-            available_kbds.erase(pos_it);
+            if (pos_it != available_kbds.end())
+                available_kbds.erase(pos_it);
         }
+        kbd->disable();
         lock_guard<mutex> lock(pulled_kbds_mtx);
         pulled_kbds.push_back(kbd);
     }
+}
+
+void KBDManager::setReplay(unique_ptr<EventTraceReader> trace, bool realtime) {
+    // replayDelay() and queueReplay() expect a frame to be left.
+    if (trace->size() == 0)
+        throw SystemError("Event trace has no events to replay");
+    syslog(LOG_INFO, "Replaying %zu events%s", trace->size(),
+           trace->isRedacted() ? ", the trace is redacted" : "");
+    replay = std::move(trace);
+    replay_pos = 0;
+    replay_realtime = realtime;
+    replay_start = 0;
+}
+
+int KBDManager::replayDelay() const noexcept {
+    if (!replay_realtime || replay_start == 0)
+        return 0;
+    uint64_t due = replay_start + (*replay)[replay_pos].time;
+    uint64_t now = monotonicNanos();
+    if (due <= now)
+        return 0;
+    // Rounded up, so that it is due once epoll_wait() returns.
+    return int((due - now + 999999) / 1000000);
+}
+
+void KBDManager::queueReplay() {
+    uint64_t now = monotonicNanos();
+    if (replay_start == 0)
+        replay_start = now - (*replay)[replay_pos].time;
+
+    while (replay_pos < replay->size()) {
+        if (replay_realtime && replay_start + (*replay)[replay_pos].time > now)
+            break;
+        size_t end = replay->frameEnd(replay_pos);
+        KBDAction action;
+        memset(&action, 0, sizeof(action));
+        action.ts.read = now;
+        action.ev.time.tv_sec = now / 1000000000ULL;
+        action.ev.time.tv_usec = (now % 1000000000ULL) / 1000;
+        size_t begin = pending.size();
+        for (size_t i = replay_pos; i < end; i++) {
+            const EventTraceRecord &rec = (*replay)[i];
+            action.dev_id = rec.dev_id;
+            action.ev.type = rec.type;
+            action.ev.code = rec.code;
+            action.ev.value = rec.value;
+            pending.push_back(action);
+        }
+        pending_frames.push_back({now, begin, pending.size()});
+        replay_pos = end;
+        // At full speed a frame is handed out every time.
+        if (!replay_realtime)
+            break;
+    }
+
+    if (replay_pos == replay->size()) {
+        syslog(LOG_INFO, "Replay finished");
+        replay.reset();
+    }
+}
+
+void KBDManager::waitForFrames(int timeout, int wake_fd) {
+    pending.clear();
+    pending_frames.clear();
+    frame_pos = 0;
+
+    watchWakeFd(wake_fd);
+    if (replay) {
+        int delay = replayDelay();
+        if (timeout < 0 || delay < timeout)
+            timeout = delay;
+    }
+    struct epoll_event evs[32];
+    int num_ready = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout);
+    if (num_ready == -1) {
+        // Interrupted by a signal handler, treat it like a timeout.
+        if (errno == EINTR)
+            return;
+        throw SystemError("Error in epoll_wait(): ", errno);
+    }
+
+    for (int i = 0; i < num_ready; i++)
+        if (evs[i].data.ptr)
+            readFrom((Keyboard *) evs[i].data.ptr);
+    if (replay)
+        queueReplay();
+
+    // Keys pressed at the same time on different keyboards are
+    // handled in the order they were pressed in.
+    if (pending_frames.size() > 1)
+        stable_sort(pending_frames.begin(), pending_frames.end(),
+                    [](const PendingFrame &a, const PendingFrame &b) {
+                        return a.time < b.time;
+                    });
+    if (pending_frames.size() > 0)
+        pending_pos = pending_frames[0].begin;
+}
 
-    return had_key;
+bool KBDManager::getEvent(KBDAction *action, int timeout, int wake_fd) {
+    if (frame_pos == pending_frames.size())
+        waitForFrames(timeout, wake_fd);
+
+    if (frame_pos == pending_frames.size())
+        return false;
+    *action = pending[pending_pos++];
+    if (pending_pos == pending_frames[frame_pos].end && ++frame_pos < pending_frames.size())
+        pending_pos = pending_frames[frame_pos].begin;
+    return true;
+}
+
+bool KBDManager::getFrame(std::vector<KBDAction> *frame, int timeout, int wake_fd) {
+    frame->clear();
+    if (frame_pos == pending_frames.size())
+        waitForFrames(timeout, wake_fd);
+
+    if (frame_pos == pending_frames.size())
+        return false;
+    // Whatever getEvent() left of the current frame.
+    const PendingFrame &pf = pending_frames[frame_pos];
+    frame->insert(frame->end(), pending.begin() + pending_pos, pending.begin() + pf.end);
+    if (++frame_pos < pending_frames.size())
+        pending_pos = pending_frames[frame_pos].begin;
+    return true;
 }
 
 /**
@@ -107,7 +311,62 @@ static bool waitForDevice(const string& path) {
     return true;
 }
 
+void KBDManager::hotplug(const std::string &path, const std::string &event_path,
+                         bool is_keyboard, const struct input_id *id) {
+    {
+        lock_guard<mutex> lock(pulled_kbds_mtx);
+        for (auto it = pulled_kbds.begin(); it != pulled_kbds.end(); it++) {
+            auto kbd = *it;
+            // Don't open the device to find out if it's this keyboard
+            // when we already know that it isn't.
+            if (id && (id->vendor != kbd->getDevID().vendor ||
+                       id->product != kbd->getDevID().product))
+                continue;
+            if (kbd->isMe(path.c_str())) {
+                syslog(LOG_INFO, "Keyboard was plugged back in: %s", kbd->getName().c_str());
+                kbd->reset(path.c_str());
+                kbd->lock();
+                {
+                    lock_guard<mutex> lock(available_kbds_mtx);
+                    watch(kbd);
+                    available_kbds.push_back(kbd);
+                }
+                pulled_kbds.erase(it);
+                break;
+            }
+        }
+    }
+
+    if (!allow_hotplug)
+        return;
+
+    // If the keyboard is not in pulled_kbds, we want to
+    // make sure that it actually is a keyboard.
+    if (!is_keyboard)
+        return;
+
+    {
+        lock_guard<mutex> lock(kbds_mtx);
+        Keyboard *kbd = new Keyboard(event_path.c_str());
+        kbds.push_back(kbd);
+        syslog(LOG_INFO, "New keyboard plugged in: %s", kbd->getID().c_str());
+        kbd->lock();
+    }
+    updateAvailableKBDs();
+}
+
 void KBDManager::startHotplugWatcher() {
+    try {
+        auto mon = make_shared<UEventMonitor>();
+        hotplug_running = true;
+        uevent_thread = thread([this, mon]() { ueventLoop(*mon); });
+        syslog(LOG_INFO, "Watching for hotplug events from udev");
+        return;
+    } catch (const SystemError &e) {
+        syslog(LOG_WARNING, "Unable to listen for udev events, watching /dev/input/by-id: %s",
+               e.what());
+    }
+
     input_fsw.add("/dev/input/by-id");
     input_fsw.setWatchDirs(true);
     input_fsw.setAutoAdd(false);
@@ -123,43 +382,67 @@ void KBDManager::startHotplugWatcher() {
         if (!waitForDevice(event_path))
             return true;
 
-        {
-            lock_guard<mutex> lock(pulled_kbds_mtx);
-            for (auto it = pulled_kbds.begin(); it != pulled_kbds.end(); it++) {
-                auto kbd = *it;
-                if (kbd->isMe(ev.path.c_str())) {
-                    syslog(LOG_INFO, "Keyboard was plugged back in: %s", kbd->getName().c_str());
-                    kbd->reset(ev.path.c_str());
-                    kbd->lock();
-                    {
-                        lock_guard<mutex> lock(available_kbds_mtx);
-                        available_kbds.push_back(kbd);
-                    }
-                    pulled_kbds.erase(it);
-                    break;
+        bool is_input = KBDManager::byIDIsKeyboard(ev.path) ||
+                        (allow_pointers && KBDManager::byIDIsPointer(ev.path) &&
+                         KBDManager::isRelativePointer(event_path));
+        hotplug(ev.path, event_path, is_input, nullptr);
+
+        return true;
+    });
+}
+
+void KBDManager::ueventLoop(UEventMonitor &mon) {
+    UEvent ev;
+    while (hotplug_running) {
+        try {
+            // Wake up now and then to check hotplug_running.
+            if (!mon.recv(&ev, 128))
+                continue;
+            const string &devname = ev.get("DEVNAME");
+            if (ev.action != "add" || ev.get("SUBSYSTEM") != "input" ||
+                !stringStartsWith(devname, "/dev/input/event"))
+                continue;
+
+            // udev creates the by-id links of keyboards, and only sends the
+            // event once the device is ready to be opened.
+            bool is_keyboard = false;
+            if (ev.get("ID_INPUT_KEYBOARD") == "1") {
+                const string &links = ev.get("DEVLINKS");
+                for (size_t pos = 0; pos < links.size();) {
+                    size_t end = links.find(' ', pos);
+                    if (end == string::npos)
+                        end = links.size();
+                    string link = links.substr(pos, end - pos);
+                    if (stringStartsWith(link, "/dev/input/by-id/") && byIDIsKeyboard(link))
+                        is_keyboard = true;
+                    pos = end + 1;
                 }
             }
-        }
+            // Touchpads report absolute positions, only relative pointers
+            // are passed through.
+            if (allow_pointers && (ev.get("ID_INPUT_MOUSE") == "1" ||
+                                   ev.get("ID_INPUT_POINTINGSTICK") == "1") &&
+                ev.get("ID_INPUT_TOUCHPAD") != "1" && isRelativePointer(devname))
+                is_keyboard = true;
 
-        if (!allow_hotplug)
-            return true;
-
-        // If the keyboard is not in pulled_kbds, we want to
-        // make sure that it actually is a keyboard.
-        if (!KBDManager::byIDIsKeyboard(ev.path))
-            return true;
+            struct input_id id;
+            memset(&id, 0, sizeof(id));
+            bool has_id = false;
+            // Only USB devices are known to have the same IDs in udev.
+            if (ev.get("ID_BUS") == "usb") {
+                try {
+                    id.vendor = stoi(ev.get("ID_VENDOR_ID"), nullptr, 16);
+                    id.product = stoi(ev.get("ID_MODEL_ID"), nullptr, 16);
+                    has_id = true;
+                } catch (const exception &) {}
+            }
 
-        {
-            lock_guard<mutex> lock(kbds_mtx);
-            Keyboard *kbd = new Keyboard(event_path.c_str());
-            kbds.push_back(kbd);
-            syslog(LOG_INFO, "New keyboard plugged in: %s", kbd->getID().c_str());
-            kbd->lock();
+            syslog(LOG_INFO, "Hotplug event on %s", devname.c_str());
+            hotplug(devname, devname, is_keyboard, has_id ? &id : nullptr);
+        } catch (const exception &e) {
+            syslog(LOG_ERR, "Error while handling hotplug event: %s", e.what());
         }
-        updateAvailableKBDs();
-
-        return true;
-    });
+    }
 }
 
 
@@ -195,13 +478,77 @@ void KBDManager::updateAvailableKBDs() {
     lock_guard<mutex> lock1(available_kbds_mtx);
     lock_guard<mutex> lock2(kbds_mtx);
 
+    for (auto &kbd : available_kbds)
+        unwatch(kbd);
     available_kbds.clear();
-    for (auto &kbd : kbds)
-        if (!kbd->isDisabled())
+    for (auto &kbd : kbds) {
+        if (!kbd->isDisabled()) {
+            watch(kbd);
             available_kbds.push_back(kbd);
+        }
+    }
+}
+
+bool KBDManager::isRelativePointer(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_WARNING, "Unable to open %s to check its event types: %s",
+               path.c_str(), strerror(errno));
+        return false;
+    }
+    uint8_t types[EV_MAX / 8 + 1] = {};
+    int ret = ioctl(fd, EVIOCGBIT(0, sizeof(types)), types);
+    ::close(fd);
+    if (ret == -1)
+        return false;
+    auto has = [&](int type) { return (types[type / 8] >> (type % 8)) & 1; };
+    if (has(EV_REL) && !has(EV_ABS))
+        return true;
+    syslog(LOG_INFO, "Not grabbing %s, it is not a relative pointer", path.c_str());
+    return false;
 }
 
 void KBDManager::addDevice(const std::string& device) {
     lock_guard<mutex> lock(kbds_mtx);
     kbds.push_back(new Keyboard(device.c_str()));
 }
+
+void KBDManager::adoptDevice(const HandoverKeyboard &kbd) {
+    lock_guard<mutex> lock(kbds_mtx);
+    kbds.push_back(new Keyboard(kbd.fd, kbd.state, kbd.keys));
+}
+
+bool KBDManager::hasDevice(const std::string& device) {
+    // Identical keyboards, and the interfaces of a receiver, can only be
+    // told apart by their device numbers.
+    struct stat st;
+    if (stat(device.c_str(), &st) == -1)
+        return false;
+    lock_guard<mutex> lock(kbds_mtx);
+    for (Keyboard *kbd : kbds) {
+        struct stat kst;
+        if (!kbd->isDisabled() && fstat(kbd->getfd(), &kst) == 0 && kst.st_rdev == st.st_rdev)
+            return true;
+    }
+    return false;
+}
+
+bool KBDManager::handOver(const function<void(const vector<HandoverKeyboard> &)> &send) {
+    if (frame_pos != pending_frames.size() || replay)
+        return false;
+
+    lock_guard<mutex> lock1(available_kbds_mtx);
+    lock_guard<mutex> lock2(kbds_mtx);
+    vector<HandoverKeyboard> out;
+    for (Keyboard *kbd : available_kbds) {
+        if (!kbd->isIdle())
+            return false;
+        HandoverKeyboard hk;
+        hk.fd = kbd->getfd();
+        hk.state = kbd->getState();
+        hk.keys = kbd->keyState();
+        out.push_back(hk);
+    }
+    send(out);
+    return true;
+}
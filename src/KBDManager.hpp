@@ -3,13 +3,20 @@
 #include <mutex>
 #include <vector>
 #include <regex>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 #include "Keyboard.hpp"
+#include "EventTrace.hpp"
+#include "Handover.hpp"
 
 extern "C" {
     #include <syslog.h>
 }
 
+class UEventMonitor;
+
 class KBDUnlock {
     std::vector<Keyboard *> kbds;
 
@@ -20,14 +27,38 @@ class KBDUnlock {
 
 class KBDManager {
   private:
-    /** Watcher for /dev/input/ hotplug */
+    /** Watcher for /dev/input/ hotplug, only used if udev events are
+     *  unavailable. */
     FSWatcher input_fsw;
+    /** Receives udev hotplug events, see ueventLoop() */
+    std::thread uevent_thread;
+    std::atomic<bool> hotplug_running {false};
     /** All keyboards. */
     std::vector<Keyboard *> kbds;
     std::mutex kbds_mtx;
     /** Keyboards available for listening. */
     std::vector<Keyboard *> available_kbds;
     std::mutex available_kbds_mtx;
+    /** epoll set of the available keyboards, and of the wake_fd given to
+     *  getEvent(). Keyboards are added to it and removed from it together
+     *  with available_kbds. */
+    int epfd = -1;
+    int epoll_wake_fd = -1;
+    /** A complete frame of events in `pending`. */
+    struct PendingFrame {
+        uint64_t time;
+        size_t begin;
+        size_t end;
+    };
+    /** Events that were read but not yet returned by getEvent(), they are
+     *  handed out frame by frame in timestamp order. Only used by the thread
+     *  calling getEvent(). */
+    std::vector<KBDAction> pending;
+    std::vector<PendingFrame> pending_frames;
+    size_t frame_pos = 0;
+    size_t pending_pos = 0;
+    /** SYN_DROPPED events read from all keyboards. */
+    std::atomic<uint64_t> num_drops {0};
     /** Keyboards that were removed. */
     std::vector<Keyboard *> pulled_kbds;
     std::mutex pulled_kbds_mtx;
@@ -35,9 +66,57 @@ class KBDManager {
      * plugged in. Keyboards that were added on startup with --kbd-device
      * arguments will always be reconnected on hotplug. */
     bool allow_hotplug = true;
+    /** Whether mice and other relative pointers are grabbed on hotplug,
+     *  besides keyboards. */
+    bool allow_pointers = false;
+    /** Trace that is handed out as if it was read from a keyboard, see
+     *  setReplay(). Only used by the thread calling getEvent(). */
+    std::unique_ptr<EventTraceReader> replay;
+    size_t replay_pos = 0;
+    bool replay_realtime = true;
+    /** Time that the first record of the trace corresponds to. */
+    uint64_t replay_start = 0;
+
+    /** Milliseconds until the next frame of the replay is due. */
+    int replayDelay() const noexcept;
+
+    /** Add the frames of the replay that are due to the pending events. */
+    void queueReplay();
+
+    /** Add a keyboard to the epoll set, requires available_kbds_mtx. */
+    void watch(Keyboard *kbd);
+
+    /** Remove a keyboard from the epoll set, requires available_kbds_mtx. */
+    void unwatch(Keyboard *kbd) noexcept;
+
+    /** Make sure that wake_fd is the one in the epoll set. */
+    void watchWakeFd(int wake_fd);
+
+    /** Read from a keyboard that epoll reported as ready, and add the
+     *  complete frames to the pending events. */
+    void readFrom(Keyboard *kbd);
+
+    /**
+     * Handle a new input device, by reconnecting a keyboard that was
+     * removed, or by adding it if it is a keyboard.
+     *
+     * @param path Path to open the device by, to check if it is a removed keyboard.
+     * @param event_path Path to the device in /dev/input/
+     * @param is_keyboard Whether the device is a keyboard.
+     * @param id ID of the device if known, nullptr otherwise.
+     */
+    void hotplug(const std::string &path, const std::string &event_path,
+                 bool is_keyboard, const struct input_id *id);
+
+    /** Handle udev events until hotplug_running is cleared. */
+    void ueventLoop(UEventMonitor &mon);
+
+    /** Wait for keyboards to become readable and fill up the pending
+     *  events, which must all have been handed out. */
+    void waitForFrames(int timeout, int wake_fd);
 
   public:
-    inline KBDManager() {}
+    KBDManager();
 
     ~KBDManager();
 
@@ -47,6 +126,18 @@ class KBDManager {
         allow_hotplug = val;
     }
 
+    /** Number of times events were dropped by the kernel, because they
+     *  were not read fast enough. Safe to call from any thread. */
+    inline uint64_t numDrops() const noexcept {
+        return num_drops.load(std::memory_order_relaxed);
+    }
+
+    /** Grab pointers that are plugged in as well, the UDevice that events
+     *  are written to must have been created with pointer support. */
+    inline void setPointers(bool val) {
+        allow_pointers = val;
+    }
+
     /**
      * @param path A file path or file name from /dev/input/by-id
      * @return True iff the ID represents a keyboard.
@@ -60,12 +151,51 @@ class KBDManager {
         return std::regex_match(path, event_kbd) && !std::regex_match(path, input_if_rx);
     }
 
+    /**
+     * @param path A file path or file name from /dev/input/by-id
+     * @return True iff the ID represents a mouse or another relative pointer.
+     */
+    static inline bool byIDIsPointer(const std::string& path) {
+        // Unlike keyboards, the mouse of a combined receiver is usually on
+        // one of its extra interfaces.
+        const static std::regex event_mouse("^.*-event-mouse$");
+        return std::regex_match(path, event_mouse);
+    }
+
+    /**
+     * Check the event types of a device, by opening it. Touchpads and
+     * tablets also have mouse links in by-id, but they report absolute
+     * positions, which the udevice cannot pass on.
+     *
+     * @param path Path of the device in /dev/input/
+     * @return True iff the device has relative axes and no absolute ones.
+     */
+    static bool isRelativePointer(const std::string& path);
+
     /** Listen on a new device.
      *
      * @param device Full path to the device in /dev/input/
      */
     void addDevice(const std::string& device);
 
+    /** Listen on a keyboard that was taken over from another InputD, it
+     *  keeps its grab and key state. */
+    void adoptDevice(const HandoverKeyboard &kbd);
+
+    /** Check whether a device is one of the keyboards, by its device number. */
+    bool hasDevice(const std::string& device);
+
+    /**
+     * Hand the keyboards that are listened to over to another InputD, see
+     * Handover.hpp. Keyboards can't be plugged in or removed while `send`
+     * runs. Nothing is handed over while events that were already read
+     * have not been handed out by getEvent() or getFrame().
+     *
+     * @param send Sends the keyboards.
+     * @return False if there were events left, `send` was not called.
+     */
+    bool handOver(const std::function<void(const std::vector<HandoverKeyboard> &)> &send);
+
     /**
      * Check which keyboards have become unavailable/available again.
      */
@@ -79,7 +209,47 @@ class KBDManager {
 
     void startHotplugWatcher();
 
+    /**
+     * Replay a trace, its frames are handed out together with the ones read
+     * from the keyboards, as if they had been read just now.
+     *
+     * @param trace The trace to replay.
+     * @param realtime Keep the timing of the trace, rather than handing out
+     *                 a frame whenever one is asked for.
+     * @throws SystemError If the trace is empty.
+     */
+    void setReplay(std::unique_ptr<EventTraceReader> trace, bool realtime);
+
     void setup();
 
-    bool getEvent(KBDAction *action);
+    /** Register the wake fd passed to getEvent() or getFrame() anew, even
+     *  if it has the same number, e.g because the old one was closed and
+     *  the number reused. */
+    void forgetWakeFd() noexcept;
+
+    /**
+     * Get an event from one of the keyboards.
+     *
+     * Every keyboard that is ready when waking up is read from, and the
+     * complete frames that were read are then handed out in the order of
+     * their timestamps before waiting again. The events of a frame are
+     * always returned one after the other.
+     *
+     * @param action Where to put the event.
+     * @param timeout Time to wait for an event in milliseconds.
+     * @param wake_fd Stop waiting when this file descriptor becomes
+     *                readable, -1 to only wait for keyboards.
+     * @return True if an event was read.
+     */
+    bool getEvent(KBDAction *action, int timeout = 64, int wake_fd = -1);
+
+    /**
+     * Get a complete frame of events from one of the keyboards, the last
+     * event is the SYN_REPORT that ends it. Works like getEvent(), mixing
+     * the two returns the rest of a frame that getEvent() started on.
+     *
+     * @param frame Where to put the events, it is cleared first.
+     * @return True if a frame was read.
+     */
+    bool getFrame(std::vector<KBDAction> *frame, int timeout = 64, int wake_fd = -1);
 };
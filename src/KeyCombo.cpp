@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+
+#include "KeyCombo.hpp"
+
+using namespace std;
+
+ComboAutomaton::ComboAutomaton() : chords(KEY_CNT), slots(KEY_CNT, -1) {}
+
+int ComboAutomaton::addChord(const vector<int> &keys) {
+    if (keys.empty())
+        throw invalid_argument("Chords need at least one key");
+    for (int key : keys)
+        if (key < 0 || key >= KEY_CNT)
+            throw invalid_argument("Key code out of range: " + to_string(key));
+
+    Chord chord = {0, int(keys.size()), next_id};
+    for (size_t i = 0; i + 1 < keys.size(); i++) {
+        int key = keys[i];
+        if (slots[key] < 0) {
+            if (num_slots == 64)
+                throw invalid_argument("Too many different keys held in chords");
+            slots[key] = num_slots++;
+        }
+        chord.mask |= uint64_t(1) << slots[key];
+    }
+
+    auto &candidates = chords[keys.back()];
+    candidates.push_back(chord);
+    stable_sort(candidates.begin(), candidates.end(), [](const Chord &a, const Chord &b) {
+        return a.num_keys > b.num_keys;
+    });
+    return next_id++;
+}
+
+int ComboAutomaton::addSequence(const vector<int> &keys) {
+    if (keys.empty())
+        throw invalid_argument("Sequences need at least one key");
+    int node = 0;
+    for (int key : keys) {
+        if (key < 0 || key >= KEY_CNT)
+            throw invalid_argument("Key code out of range: " + to_string(key));
+        auto it = nodes[node].next.find(key);
+        if (it == nodes[node].next.end()) {
+            nodes.emplace_back();
+            it = nodes[node].next.emplace(key, int(nodes.size() - 1)).first;
+        }
+        node = it->second;
+    }
+    nodes[node].match = next_id;
+    link();
+    state = 0;
+    return next_id++;
+}
+
+void ComboAutomaton::link() {
+    // Nodes are visited breadth first, so the fail link of the parent is
+    // done before its children need it.
+    deque<int> todo;
+    for (auto &[_, child] : nodes[0].next) {
+        (void) _;
+        nodes[child].fail = 0;
+        nodes[child].out = nodes[child].match;
+        todo.push_back(child);
+    }
+    while (!todo.empty()) {
+        int node = todo.front();
+        todo.pop_front();
+        for (auto &[key, child] : nodes[node].next) {
+            int fail = nodes[node].fail;
+            while (fail != 0 && !nodes[fail].next.count(key))
+                fail = nodes[fail].fail;
+            auto it = nodes[fail].next.find(key);
+            nodes[child].fail = (it != nodes[fail].next.end()) ? it->second : 0;
+            // A shorter sequence may end here, as a suffix of this one.
+            Node &ch = nodes[child];
+            ch.out = ch.match != NO_MATCH ? ch.match : nodes[ch.fail].out;
+            todo.push_back(child);
+        }
+    }
+}
+
+int ComboAutomaton::step(uint16_t code) noexcept {
+    while (state != 0 && !nodes[state].next.count(code))
+        state = nodes[state].fail;
+    auto it = nodes[state].next.find(code);
+    state = (it == nodes[state].next.end()) ? 0 : it->second;
+
+    int id = nodes[state].out;
+    if (id != NO_MATCH)
+        state = 0;
+    return id;
+}
+
+int ComboAutomaton::check(const struct input_event &ev) noexcept {
+    if (ev.type != EV_KEY || ev.code >= KEY_CNT || ev.value == KEY_VAL_REPEAT)
+        return NO_MATCH;
+
+    int slot = slots[ev.code];
+    if (ev.value == KEY_VAL_UP) {
+        if (slot >= 0)
+            held &= ~(uint64_t(1) << slot);
+        return NO_MATCH;
+    }
+
+    int id = NO_MATCH;
+    for (const Chord &chord : chords[ev.code]) {
+        if ((held & chord.mask) == chord.mask) {
+            id = chord.id;
+            break;
+        }
+    }
+    if (slot >= 0)
+        held |= uint64_t(1) << slot;
+
+    if (nodes.size() > 1) {
+        uint64_t now = uint64_t(ev.time.tv_sec) * 1000000000ULL +
+                       uint64_t(ev.time.tv_usec) * 1000ULL;
+        if (sequence_timeout_ns && now - last_press > sequence_timeout_ns)
+            state = 0;
+        last_press = now;
+        int seq_id = step(ev.code);
+        if (id == NO_MATCH)
+            id = seq_id;
+    }
+    return id;
+}
+
+void ComboAutomaton::reset() noexcept {
+    held = 0;
+    state = 0;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <vector>
+#include <unordered_map>
+#include <stdint.h>
 #include <limits.h>
 #include <assert.h>
 #include "KBDAction.hpp"
@@ -55,3 +57,92 @@ struct KeyComboToggle : public KeyCombo {
         return active;
     }
 };
+
+/**
+ * Recognises many combos at once, with constant work per event.
+ *
+ * Chords are keys held down while a final key is pressed, like KeyCombo.
+ * Every key that is held in some chord gets a bit in a 64 bit mask of the
+ * keys that are down, so checking a chord is a single comparison, and only
+ * the chords ending in the pressed key are checked.
+ *
+ * Sequences are keys pressed one after another, matched by an Aho-Corasick
+ * automaton over key presses, so one sequence may start in the middle of
+ * another. Sequences are abandoned if no key is pressed for a while, see
+ * setSequenceTimeout().
+ */
+class ComboAutomaton {
+    struct Chord {
+        uint64_t mask;
+        int num_keys;
+        int id;
+    };
+
+    struct Node {
+        std::unordered_map<uint16_t, int> next;
+        int fail = 0;
+        /** Sequence that ends here. */
+        int match = -1;
+        /** Sequence that ends here, or at a suffix of this node. */
+        int out = -1;
+    };
+
+    /** Chords by their final key, the most specific ones first. */
+    std::vector<std::vector<Chord>> chords;
+    /** Bit of each key that is held in a chord, -1 for other keys. */
+    std::vector<int8_t> slots;
+    int num_slots = 0;
+    uint64_t held = 0;
+
+    /** Trie of the sequences, node 0 is the root. */
+    std::vector<Node> nodes = std::vector<Node>(1);
+    int state = 0;
+    uint64_t last_press = 0;
+    uint64_t sequence_timeout_ns = 1000000000ULL;
+    int next_id = 0;
+
+    /** Compute the fail links of the trie. */
+    void link();
+
+    /** Advance the sequence automaton by a key press. */
+    int step(uint16_t code) noexcept;
+
+public:
+    static constexpr int NO_MATCH = -1;
+
+    ComboAutomaton();
+
+    /**
+     * Add a chord, where the last key is pressed while all the others are
+     * held down.
+     *
+     * @return Id of the combo, returned by check() when it is completed.
+     * @throws std::invalid_argument If the chord is empty, or if more than
+     *                               64 different keys are held in chords.
+     */
+    int addChord(const std::vector<int> &keys);
+
+    /**
+     * Add a sequence of key presses.
+     *
+     * @return Id of the combo, returned by check() when it is completed.
+     * @throws std::invalid_argument If the sequence is empty.
+     */
+    int addSequence(const std::vector<int> &keys);
+
+    /**
+     * Feed a key event to the automaton.
+     *
+     * @return Id of the combo that the event completed, or NO_MATCH. A
+     *         chord wins over a sequence that completes with the same key.
+     */
+    int check(const struct input_event &ev) noexcept;
+
+    /** Forget the held keys and any sequence in progress. */
+    void reset() noexcept;
+
+    /** Time between the keys of a sequence, 0 to wait forever. */
+    inline void setSequenceTimeout(uint64_t ms) noexcept {
+        sequence_timeout_ns = ms * 1000000ULL;
+    }
+};
@@ -0,0 +1,94 @@
+/** @file KeyState.hpp
+ *
+ * @brief Set of keys that are held down.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <string.h>
+    #include <linux/input.h>
+}
+
+/**
+ * Bitset of the keys that are held down, kept up to date from a stream of
+ * events so that the kernel does not have to be asked with EVIOCGKEY.
+ */
+class KeyState {
+    static constexpr size_t word_bits = 64;
+    static constexpr size_t num_words = (KEY_CNT + word_bits - 1) / word_bits;
+    uint64_t words[num_words];
+
+public:
+    inline KeyState() noexcept {
+        clear();
+    }
+
+    inline void clear() noexcept {
+        memset(words, 0, sizeof(words));
+    }
+
+    inline bool isDown(int code) const noexcept {
+        if (code < 0 || code >= KEY_CNT)
+            return false;
+        return (words[code / word_bits] >> (code % word_bits)) & 1;
+    }
+
+    inline void set(int code, bool down) noexcept {
+        if (code < 0 || code >= KEY_CNT)
+            return;
+        uint64_t bit = uint64_t(1) << (code % word_bits);
+        if (down)
+            words[code / word_bits] |= bit;
+        else
+            words[code / word_bits] &= ~bit;
+    }
+
+    /** Track an event, anything but EV_KEY down/up is ignored. */
+    inline void update(const struct input_event &ev) noexcept {
+        if (ev.type == EV_KEY && (ev.value == 0 || ev.value == 1))
+            set(ev.code, ev.value);
+    }
+
+    /**
+     * Replace the state with a bitmap in the format returned by EVIOCGKEY,
+     * bit i of byte j is set for key code j*8 + i.
+     */
+    inline void setFromBitmap(const uint8_t *buf, size_t len) noexcept {
+        clear();
+        if (len > sizeof(words))
+            len = sizeof(words);
+        // Assemble the words byte by byte, to not depend on endianness.
+        for (size_t i = 0; i < len; i++)
+            words[i / 8] |= uint64_t(buf[i]) << (8 * (i % 8));
+    }
+
+    /** Write the state as a bitmap in the format of setFromBitmap(), keys
+     *  that do not fit in `len` bytes are left out. */
+    inline void toBitmap(uint8_t *buf, size_t len) const noexcept {
+        memset(buf, 0, len);
+        if (len > sizeof(words))
+            len = sizeof(words);
+        for (size_t i = 0; i < len; i++)
+            buf[i] = uint8_t(words[i / 8] >> (8 * (i % 8)));
+    }
+
+    /** Number of keys held down. */
+    inline int numDown() const noexcept {
+        int num = 0;
+        for (uint64_t w : words)
+            num += __builtin_popcountll(w);
+        return num;
+    }
+
+    /** Call `fn(code)` for every key held down, in ascending order. */
+    template <class F>
+    inline void forEachDown(F fn) const {
+        for (size_t i = 0; i < num_words; i++) {
+            for (uint64_t w = words[i]; w; w &= w - 1)
+                fn(int(i * word_bits + __builtin_ctzll(w)));
+        }
+    }
+};
@@ -38,9 +38,18 @@ extern "C" {
 #include "Keyboard.hpp"
 #include "SystemError.hpp"
 #include "utils.hpp"
+#include "Latency.hpp"
 
 using namespace std;
 
+/** Have the kernel timestamp events with CLOCK_MONOTONIC, so that they can be
+ *  compared with the timestamps in KBDAction::ts. */
+static void useMonotonicClock(int fd, const std::string& name) {
+    int clk = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clk) == -1)
+        syslog(LOG_WARNING, "Unable to set monotonic clock on: %s", name.c_str());
+}
+
 Keyboard::Keyboard(const char *path) {
     syslog(LOG_INFO, "Opening device: '%s' ...", path);
     fd = open(path, O_RDONLY);
@@ -53,6 +62,21 @@ Keyboard::Keyboard(const char *path) {
     }
 
     syslog(LOG_INFO, "ioctl get on device: '%s' ...", path);
+    identify();
+    useMonotonicClock(fd, name);
+    syslog(LOG_INFO, "Initialized keyboard: %s", getID().c_str());
+}
+
+Keyboard::Keyboard(int fd, KBDState state, const KeyState &keys)
+    : fd(fd),
+      state(state),
+      keys(keys)
+{
+    identify();
+    syslog(LOG_INFO, "Took over keyboard: %s", getID().c_str());
+}
+
+void Keyboard::identify() {
     name = ioctlGetString(fd, EVIOCGNAME);
     uniq_id = ioctlGetString(fd, EVIOCGUNIQ);
     phys = ioctlGetString(fd, EVIOCGPHYS);
@@ -60,7 +84,6 @@ Keyboard::Keyboard(const char *path) {
         syslog(LOG_ERR, "Unable to get ID for keyboard: %s", name.c_str());
         memset(&dev_id, 0, sizeof(dev_id));
     }
-    syslog(LOG_INFO, "Initialized keyboard: %s", getID().c_str());
 }
 
 Keyboard::~Keyboard() {
@@ -89,28 +112,26 @@ bool Keyboard::isMe(const char *path) const {
     if (ioctl(new_fd, EVIOCGID, &dev_id) == -1)
         memset(&dev_id, 0, sizeof(dev_id));
 
-    return (name == ioctlGetString(new_fd, EVIOCGNAME) &&
-            uniq_id == ioctlGetString(new_fd, EVIOCGUNIQ) &&
-            !memcmp(&this->dev_id, &dev_id, sizeof(dev_id)));
+    bool is_me = (name == ioctlGetString(new_fd, EVIOCGNAME) &&
+                  uniq_id == ioctlGetString(new_fd, EVIOCGUNIQ) &&
+                  !memcmp(&this->dev_id, &dev_id, sizeof(dev_id)));
+    close(new_fd);
+    return is_me;
 }
 
-int Keyboard::numDown() const {
-    unsigned char key_states[KEY_MAX/8 + 1];
+void Keyboard::syncKeyState() {
+    uint8_t key_states[KEY_MAX/8 + 1];
     memset(key_states, 0, sizeof(key_states));
     if (ioctl(fd, EVIOCGKEY(sizeof(key_states)), key_states) == -1)
         throw SystemError("Unable to get key states: ", errno);
-    int was_down = 0;
-    for (size_t i = 0; i < sizeof(key_states); i++)
-        // Shift bits to count downed keys.
-        for (unsigned int bs = 1; bs <= 128; bs <<= 1)
-            was_down += !!(bs & key_states[i]);
-    return was_down;
+    keys.setFromBitmap(key_states, sizeof(key_states));
 }
 
 void Keyboard::lockSync() {
     KBDAction action;
 
     syslog(LOG_INFO, "Locking keyboard synchronously ...");
+    syncKeyState();
 
     while (numDown() > 0)
         get(&action);
@@ -126,6 +147,9 @@ void Keyboard::lockSync() {
 
 void Keyboard::lock() {
     syslog(LOG_INFO, "Locking keyboard: %s ...", name.c_str());
+    // Keys may have been pressed while nobody was reading from the device,
+    // from here on the events keep the state up to date.
+    syncKeyState();
     if (numDown() == 0) {
         int grab = 1;
         if (ioctl(fd, EVIOCGRAB, &grab) == -1)
@@ -146,7 +170,7 @@ void Keyboard::unlock() {
     state = KBDState::OPEN;
 }
 
-void Keyboard::get(KBDAction *action) {
+void Keyboard::finishLock() {
     // Wait until key down events have been eliminated.
     if (state == KBDState::LOCKING && !numDown()) {
         int grab = 1;
@@ -155,14 +179,90 @@ void Keyboard::get(KBDAction *action) {
         state = KBDState::LOCKED;
         syslog(LOG_INFO, "Acquired lock on keyboard: %s", name.c_str());
     }
+}
 
-    ssize_t n;
-    if ((n = read(fd, &action->ev, sizeof(action->ev))) != sizeof(action->ev)) {
-        stringstream err("read() failed, returned: ");
-        err << n << ": " << strerror(errno);
-        throw KeyboardError(err.str());
+size_t Keyboard::fill() {
+    finishLock();
+
+    constexpr size_t cap = sizeof(rbuf) / sizeof(rbuf[0]);
+    // Move the incomplete frame left over from last time to the front.
+    if (rbuf_begin > 0) {
+        memmove(rbuf, rbuf + rbuf_begin, (rbuf_end - rbuf_begin) * sizeof(rbuf[0]));
+        rbuf_end -= rbuf_begin;
+        rbuf_begin = 0;
     }
+    // A frame that doesn't fit is handed out in pieces by nextFrame().
+    if (rbuf_end == cap)
+        return 0;
+
+    size_t space = cap - rbuf_end;
+    rbuf_read_time = monotonicNanos();
+
+    auto real_keys = [this](KeyState *real) { return readKeyState(real); };
+    uint64_t resyncs = drops.numResyncs();
+    size_t num;
+    if (drops.hasHeld()) {
+        num = drops.takeHeld(rbuf + rbuf_end, space, keys, real_keys);
+    } else {
+        ssize_t n = read(fd, rbuf + rbuf_end, space * sizeof(rbuf[0]));
+        if (n <= 0 || n % sizeof(rbuf[0]) != 0) {
+            stringstream err("read() failed, returned: ");
+            err << n << ": " << strerror(errno);
+            throw KeyboardError(err.str());
+        }
+        num = drops.filter(rbuf + rbuf_end, n / sizeof(rbuf[0]), keys, real_keys);
+    }
+    if (drops.numResyncs() != resyncs)
+        syslog(LOG_WARNING, "Events from %s were dropped, corrected %zu keys",
+               name.c_str(), drops.lastCorrected());
+    rbuf_end += num;
+    return num;
+}
+
+bool Keyboard::readKeyState(KeyState *out) noexcept {
+    uint8_t key_states[KEY_MAX/8 + 1];
+    if (ioctl(fd, EVIOCGKEY(sizeof(key_states)), key_states) == -1) {
+        syslog(LOG_ERR, "Unable to get key states of %s after dropped events: %s",
+               name.c_str(), strerror(errno));
+        return false;
+    }
+    out->setFromBitmap(key_states, sizeof(key_states));
+    return true;
+}
+
+bool Keyboard::nextFrame(const struct input_event **evs, size_t *num) noexcept {
+    constexpr size_t cap = sizeof(rbuf) / sizeof(rbuf[0]);
+    for (size_t i = rbuf_begin; i < rbuf_end; i++) {
+        if (rbuf[i].type == EV_SYN && rbuf[i].code == SYN_REPORT) {
+            *evs = rbuf + rbuf_begin;
+            *num = i + 1 - rbuf_begin;
+            rbuf_begin = i + 1;
+            return true;
+        }
+    }
+    // Never let a full buffer stall the keyboard.
+    if (rbuf_begin == 0 && rbuf_end == cap) {
+        *evs = rbuf;
+        *num = cap;
+        rbuf_begin = cap;
+        return true;
+    }
+    return false;
+}
+
+void Keyboard::get(KBDAction *action) {
+    if (rbuf_begin == rbuf_end) {
+        // Everything that was read may have been lost to a drop.
+        while (rbuf_begin == rbuf_end)
+            fill();
+    } else {
+        finishLock();
+    }
+
+    action->ev = rbuf[rbuf_begin++];
     action->dev_id = this->dev_id;
+    memset(&action->ts, 0, sizeof(action->ts));
+    action->ts.read = rbuf_read_time;
 }
 
 void Keyboard::disable() noexcept {
@@ -178,6 +278,8 @@ void Keyboard::disable() noexcept {
         syslog(LOG_ERR, "%s", exc.what());
     }
     fd = -1;
+    rbuf_begin = rbuf_end = 0;
+    drops.clear();
 }
 
 void Keyboard::reset(const char *path) {
@@ -185,22 +287,32 @@ void Keyboard::reset(const char *path) {
     if (fd < 0)
         throw SystemError("Error in open(): ", errno);
     this->fd = fd;
+    rbuf_begin = rbuf_end = 0;
+    drops.clear();
+    keys.clear();
+    useMonotonicClock(fd, name);
 }
 
-int kbdMultiplex(const std::vector<Keyboard*>& kbds, int timeout) {
+int kbdMultiplex(const std::vector<Keyboard*>& kbds, int timeout, int wake_fd) {
     size_t idx = 0,
            len = kbds.size();
 
-    struct pollfd pfds[len];
+    struct pollfd pfds[len + 1];
     for (const auto& kbd : kbds) {
         pfds[idx].events = POLLIN;
         pfds[idx++].fd = kbd->getfd();
     }
+    // Negative file descriptors are ignored by poll()
+    pfds[len].events = POLLIN;
+    pfds[len].fd = wake_fd;
 
     int num_fds;
     errno = 0;
-    switch (num_fds = poll(pfds, len, timeout)) {
+    switch (num_fds = poll(pfds, len + 1, timeout)) {
         case -1:
+            // Interrupted by a signal handler, treat it like a timeout.
+            if (errno == EINTR)
+                return -1;
             throw SystemError("Error in poll(): ", errno);
 
         case 0:
@@ -209,15 +321,11 @@ int kbdMultiplex(const std::vector<Keyboard*>& kbds, int timeout) {
             return -1;
 
         default:
-            int fd = -1;
-            for (auto pfd : pfds)
-                if (pfd.revents & (POLLNVAL | POLLERR | POLLHUP | POLLNVAL | POLLIN)) {
-                    fd = pfd.fd;
-                    break;
-                }
-            for (idx = 0; idx < kbds.size(); idx++)
-                if (pfds[idx].fd == fd)
+            for (idx = 0; idx < len; idx++)
+                if (pfds[idx].revents & (POLLNVAL | POLLERR | POLLHUP | POLLIN))
                     return idx;
+            if (pfds[len].revents)
+                return -2;
 
             throw SystemError("Unable to find file descriptor returned by poll()");
     }
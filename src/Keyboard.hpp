@@ -48,7 +48,9 @@ extern "C" {
 }
 
 #include "FSWatcher.hpp"
+#include "DropFilter.hpp"
 #include "KBDAction.hpp"
+#include "KeyState.hpp"
 
 class KeyboardError : public std::runtime_error {
 public:
@@ -112,6 +114,30 @@ private:
     int fd = -1;
     /** State of the keyboard, used in locking. */
     KBDState state = KBDState::OPEN;
+    /** Events that were read from the device but not yet handed out, the
+     *  valid ones are rbuf[rbuf_begin] to rbuf[rbuf_end - 1]. */
+    struct input_event rbuf[64];
+    size_t rbuf_begin = 0;
+    size_t rbuf_end = 0;
+    /** When the last batch of events was read. */
+    uint64_t rbuf_read_time = 0;
+    /** Keys held down, updated from the events that are read. */
+    KeyState keys;
+    /** Recovers from SYN_DROPPED, see fill() */
+    DropFilter drops;
+
+    /** Ask the kernel which keys are held down. */
+    void syncKeyState();
+
+    /** Ask the kernel which keys are held down, for drops. Failures are
+     *  logged. */
+    bool readKeyState(KeyState *out) noexcept;
+
+    /** Grab the keyboard if it is waiting for keys to be released. */
+    void finishLock();
+
+    /** Ask the device for its name and ids. */
+    void identify();
 
 public:
     /** Keyboard constructor.
@@ -123,6 +149,16 @@ public:
      */
     explicit Keyboard(const char *path);
 
+    /**
+     * Take over a keyboard that was opened by another InputD, see
+     * Handover.hpp
+     *
+     * @param fd File descriptor of the device, owned by the Keyboard.
+     * @param state Whether the other InputD had grabbed the keyboard.
+     * @param keys Keys held down as of the last event it read.
+     */
+    Keyboard(int fd, KBDState state, const KeyState &keys);
+
     /** Keyboard destructor.
      * 
      * Will also unlock the keyboard if it is locked.
@@ -173,6 +209,58 @@ public:
      */
     void get(KBDAction *action);
 
+    /**
+     * Read all the events that the device has available, up to the size of
+     * the buffer, with a single read(). Blocks if there are none.
+     *
+     * After a SYN_DROPPED the events that make up for it, and then the
+     * rest of what was read, are added by the calls that follow instead,
+     * see hasUnread().
+     *
+     * @throws KeyboardError if the read fails.
+     * @return Number of events added to the buffer.
+     */
+    size_t fill();
+
+    /** Whether events are waiting to be added by fill() without reading
+     *  from the device, so it may not become readable. */
+    inline bool hasUnread() const noexcept {
+        return drops.hasHeld();
+    }
+
+    /** Whether everything that was read from the device has been handed
+     *  out, so that the next event is the next one the kernel has. */
+    inline bool isIdle() const noexcept {
+        return rbuf_begin == rbuf_end && !drops.isDropping() && !hasUnread();
+    }
+
+    /** Number of times the kernel dropped events because they were not
+     *  read fast enough. */
+    inline uint64_t numDrops() const noexcept {
+        return drops.numDrops();
+    }
+
+    /**
+     * Take the next complete frame out of the buffer, that is all events up
+     * to and including the next SYN_REPORT. The events stay valid until
+     * the next call to fill() or get().
+     *
+     * @param evs Where to put a pointer to the first event.
+     * @param num Where to put the number of events.
+     * @return False if there is no complete frame in the buffer.
+     */
+    bool nextFrame(const struct input_event **evs, size_t *num) noexcept;
+
+    /** When the events handed out by nextFrame() were read, in
+     *  CLOCK_MONOTONIC nanoseconds. */
+    inline uint64_t readTime() const noexcept {
+        return rbuf_read_time;
+    }
+
+    inline const struct input_id &getDevID() const noexcept {
+        return dev_id;
+    }
+
     /** Get human-readable name of the keyboard device.
      *
      * @return Human-readable name of device.
@@ -199,11 +287,18 @@ public:
     }
 
     /**
-     * Get the number of keys current held down on the keyboard.
+     * Get the number of keys current held down on the keyboard, as of the
+     * last event that was read.
      *
      * @return Number of keys held down.
      */
-    int numDown() const;
+    inline int numDown() const noexcept {
+        return keys.numDown();
+    }
+
+    inline const KeyState &keyState() const noexcept {
+        return keys;
+    }
 
     inline const std::string& getPhys() const noexcept {
         return phys;
@@ -215,13 +310,15 @@ public:
  *
  * @param kbds Keyboards to check.
  * @param timeout Time to wait in milliseconds.
+ * @param wake_fd Additional file descriptor to wait for, ignored if it is -1.
  * 
  * @throws SystemError if the underlying polling function fails.
  *
  * @return Index of keyboard with available input in kbds, returns
- *         -1 if the function timed out.
+ *         -1 if the function timed out, and -2 if wake_fd became readable
+ *         while no keyboard had any input.
  */
-int kbdMultiplex(const std::vector<Keyboard*>& kbds, int timeout);
+int kbdMultiplex(const std::vector<Keyboard*>& kbds, int timeout, int wake_fd = -1);
 
 /**
  * Same as kbdMultiplex, but will not time out.
@@ -0,0 +1,426 @@
+extern "C" {
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+}
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <regex>
+#include <sstream>
+#include <vector>
+
+#include "Keymap.hpp"
+#include "Popen.hpp"
+#include "ScriptCache.hpp"
+#include "SystemError.hpp"
+#include "utils.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static constexpr uint32_t keymap_magic = 0x504d4b48; // "HKMP"
+
+struct KeymapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_names;
+    uint32_t num_codes;
+    uint32_t num_combos;
+    uint32_t num_mods;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+
+/** Entries refer to names by offset and length into the string pool. */
+struct KeymapName {
+    uint32_t str;
+    uint16_t len;
+    uint16_t code;
+};
+
+struct KeymapCode {
+    uint16_t code;
+    uint16_t len;
+    uint32_t str;
+};
+
+struct KeymapCombo {
+    uint32_t str;
+    uint16_t len;
+    uint16_t mod_code;
+    uint16_t root_code;
+    uint16_t reserved;
+};
+
+/** Columns after the plain key symbol, in the order they appear in. */
+static const char *keymap_mods[] = {
+    "Shift",
+    "AltGr",
+    "Control",
+    "Alt",
+    "Shift_L",
+    "Shift_R",
+    "Control_L",
+    "Control_R",
+    "CapsShift",
+};
+static constexpr size_t num_keymap_mods = sizeof(keymap_mods) / sizeof(*keymap_mods);
+
+static const map<string, string> synonyms = {
+    {"zero", "0"}, {"one", "1"}, {"two", "2"}, {"three", "3"}, {"four", "4"},
+    {"five", "5"}, {"six", "6"}, {"seven", "7"}, {"eight", "8"}, {"nine", "9"},
+};
+
+/** Includes nested deeper than this are assumed to be cyclic. */
+static constexpr int max_include_depth = 16;
+
+namespace {
+    struct ParsedKeymap {
+        map<string, int> names;
+        map<int, string> codes;
+        map<string, pair<int, int>> combos;
+        vector<int> mods;
+    };
+}
+
+static ParsedKeymap parseKeymap(const string &path, int depth);
+
+/** Resolve an include relative to the two directories above the keymap. */
+static ParsedKeymap parseInclude(const string &path, string name, int depth) {
+    if (stringEndsWith(name, ".map") || stringEndsWith(name, ".kmap"))
+        name += ".gz";
+    else if (name.find('.') == string::npos)
+        name += ".inc";
+
+    fs::path dir = fs::path(path).parent_path();
+    for (int i = 0; i < 2; i++) {
+        dir = dir.parent_path();
+        string inc_path = (dir / "include" / name).string();
+        if (access(inc_path.c_str(), F_OK) != 0)
+            inc_path += ".gz";
+        if (access(inc_path.c_str(), F_OK) != 0)
+            continue;
+        try {
+            return parseKeymap(inc_path, depth + 1);
+        } catch (const exception &) {
+            // Try the next directory, like Keymap.lua does.
+        }
+    }
+    throw SystemError("No such include: " + name);
+}
+
+static ParsedKeymap parseKeymap(const string &path, int depth) {
+    static const regex include_rx("^[\t ]*include \"(.*)\"");
+    static const regex keycode_rx("^[\t ]*keycode *([0-9]+) *= *([0-9a-zA-Z+]+) *(.*)$");
+    static const regex alt_keycode_rx("^.*keycode *([0-9]+) *= *([a-zA-Z0-9+]+)");
+
+    if (depth > max_include_depth)
+        throw SystemError("Keymap includes are nested too deeply: " + path);
+
+    string text = stringEndsWith(path, ".gz") ? Popen("gzip", "-dc", path).readOnce()
+                                              : readFile(path);
+
+    ParsedKeymap km;
+    // Key codes followed by the symbols in each column, the combos can
+    // only be assembled once the codes of the modifiers are known.
+    vector<pair<int, vector<string>>> combo_pre;
+
+    stringstream lines(text);
+    string line;
+    while (getline(lines, line)) {
+        line = line.substr(0, line.find('#'));
+        line = line.substr(0, line.find('!'));
+
+        smatch m;
+        string code_s, name, rest;
+        if (regex_search(line, m, keycode_rx)) {
+            code_s = m[1];
+            name = m[2];
+            rest = m[3];
+        } else if (regex_search(line, m, include_rx)) {
+            auto sub = parseInclude(path, m[1], depth);
+            for (auto &[k, v] : sub.names)
+                km.names[k] = v;
+            for (auto &[k, v] : sub.codes)
+                km.codes[k] = v;
+            for (auto &[k, v] : sub.combos)
+                km.combos[k] = v;
+            km.mods.insert(km.mods.end(), sub.mods.begin(), sub.mods.end());
+            continue;
+        } else {
+            // Lines where the modifiers are written out, only the plain
+            // ones are of interest.
+            auto beg = find_if(line.begin(), line.end(), [](char c) { return c >= 'a' && c <= 'z'; });
+            auto end = find_if(beg, line.end(), [](char c) { return !(c >= 'a' && c <= 'z'); });
+            if (string(beg, end) != "plain" || !regex_search(line, m, alt_keycode_rx))
+                continue;
+            code_s = m[1];
+            name = m[2];
+        }
+
+        if (name == "nul")
+            continue;
+
+        // Some keys are formatted as '+A' where A is a literal character.
+        bool is_letter = name[0] == '+';
+        if (is_letter)
+            name = name.substr(1);
+        if (name.empty() || code_s.size() > 5)
+            continue;
+        int code = stoi(code_s);
+        if (code > UINT16_MAX)
+            continue;
+
+        vector<string> cols;
+        stringstream rest_ss(rest);
+        for (string col; rest_ss >> col;)
+            cols.push_back(col);
+        // Hack for broken .map files that don't include a shift+letter
+        // upper case variant.
+        if (is_letter && cols.empty())
+            cols.push_back(string(1, (char) toupper((unsigned char) name[0])) + name.substr(1));
+        combo_pre.emplace_back(code, std::move(cols));
+
+        auto syn = synonyms.find(name);
+        if (syn != synonyms.end())
+            name = syn->second;
+        // A second instance of a key is the right version of that key,
+        // i.e Control and Control_R.
+        if (km.names.find(name) != km.names.end()) {
+            km.names[name + "_R"] = code;
+        } else {
+            km.codes[code] = name;
+            km.names[name] = code;
+        }
+    }
+
+    int mod_codes[num_keymap_mods];
+    for (size_t i = 0; i < num_keymap_mods; i++) {
+        auto it = km.names.find(keymap_mods[i]);
+        mod_codes[i] = (it == km.names.end()) ? 0 : it->second;
+        if (mod_codes[i])
+            km.mods.push_back(mod_codes[i]);
+    }
+
+    for (auto &[root_code, cols] : combo_pre) {
+        for (size_t i = 0; i < cols.size() && i < num_keymap_mods; i++) {
+            string sym = cols[i];
+            if (sym[0] == '+')
+                sym = sym.substr(1);
+            if (mod_codes[i] != 0 && !sym.empty() && km.combos.find(sym) == km.combos.end())
+                km.combos[sym] = {mod_codes[i], root_code};
+        }
+    }
+
+    return km;
+}
+
+template <class T>
+static void append(string &out, const T &val) {
+    out.append((const char *) &val, sizeof(val));
+}
+
+/** Lay out a parsed keymap in the binary format. */
+static string serialize(const ParsedKeymap &km) {
+    string pool;
+    auto intern = [&](const string &s) -> pair<uint32_t, uint16_t> {
+        uint32_t off = pool.size();
+        pool += s;
+        return {off, (uint16_t) min<size_t>(s.size(), UINT16_MAX)};
+    };
+
+    vector<int> mods(km.mods);
+    sort(mods.begin(), mods.end());
+    mods.erase(unique(mods.begin(), mods.end()), mods.end());
+
+    KeymapHeader hdr = {};
+    hdr.magic = keymap_magic;
+    hdr.version = Keymap::format_version;
+    hdr.num_names = km.names.size();
+    hdr.num_codes = km.codes.size();
+    hdr.num_combos = km.combos.size();
+    hdr.num_mods = mods.size();
+
+    string out;
+    string entries;
+    // std::map iterates in order, so the entries come out sorted.
+    for (const auto &[name, code] : km.names) {
+        auto [str, len] = intern(name);
+        append(entries, KeymapName {str, len, (uint16_t) code});
+    }
+    for (const auto &[code, name] : km.codes) {
+        auto [str, len] = intern(name);
+        append(entries, KeymapCode {(uint16_t) code, len, str});
+    }
+    for (const auto &[name, combo] : km.combos) {
+        auto [str, len] = intern(name);
+        append(entries, KeymapCombo {str, len, (uint16_t) combo.first, (uint16_t) combo.second, 0});
+    }
+    for (int code : mods)
+        append(entries, (uint16_t) code);
+    // Keep the string pool aligned.
+    if (mods.size() % 2)
+        append(entries, (uint16_t) 0);
+
+    hdr.strings_size = pool.size();
+    append(out, hdr);
+    out += entries;
+    out += pool;
+    return out;
+}
+
+Keymap::~Keymap() {
+    if (mapped)
+        munmap(mapped, mapped_size);
+}
+
+void Keymap::setData(const char *data, size_t size) {
+    if (size < sizeof(KeymapHeader))
+        throw SystemError("Keymap table is truncated");
+    hdr = (const KeymapHeader *) data;
+    if (hdr->magic != keymap_magic || hdr->version != format_version)
+        throw SystemError("Keymap table has the wrong format");
+
+    size_t off = sizeof(KeymapHeader);
+    names = (const KeymapName *) (data + off);
+    off += (size_t) hdr->num_names * sizeof(KeymapName);
+    codes = (const KeymapCode *) (data + off);
+    off += (size_t) hdr->num_codes * sizeof(KeymapCode);
+    combos = (const KeymapCombo *) (data + off);
+    off += (size_t) hdr->num_combos * sizeof(KeymapCombo);
+    mods = (const uint16_t *) (data + off);
+    off += (size_t) (hdr->num_mods + hdr->num_mods % 2) * sizeof(uint16_t);
+    strings = data + off;
+    if (off + hdr->strings_size != size)
+        throw SystemError("Keymap table is truncated");
+
+    auto check = [&](uint32_t str, uint16_t len) {
+        if ((size_t) str + len > hdr->strings_size)
+            throw SystemError("Keymap table is corrupt");
+    };
+    for (uint32_t i = 0; i < hdr->num_names; i++)
+        check(names[i].str, names[i].len);
+    for (uint32_t i = 0; i < hdr->num_codes; i++)
+        check(codes[i].str, codes[i].len);
+    for (uint32_t i = 0; i < hdr->num_combos; i++)
+        check(combos[i].str, combos[i].len);
+}
+
+shared_ptr<Keymap> Keymap::parse(const string &path) {
+    return fromData(serialize(parseKeymap(path, 0)));
+}
+
+shared_ptr<Keymap> Keymap::fromData(string data) {
+    shared_ptr<Keymap> km(new Keymap());
+    km->owned = std::move(data);
+    km->setData(km->owned.data(), km->owned.size());
+    return km;
+}
+
+shared_ptr<Keymap> Keymap::open(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw SystemError("Unable to open " + path + ": ", errno);
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) == -1) {
+        int err = errno;
+        close(fd);
+        throw SystemError("Unable to stat " + path + ": ", err);
+    }
+    if (stbuf.st_size == 0) {
+        close(fd);
+        throw SystemError("Keymap table is truncated");
+    }
+
+    void *mem = mmap(nullptr, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw SystemError("Unable to mmap() " + path + ": ", err);
+
+    shared_ptr<Keymap> km(new Keymap());
+    km->mapped = mem;
+    km->mapped_size = stbuf.st_size;
+    km->setData((const char *) mem, stbuf.st_size);
+    return km;
+}
+
+string_view Keymap::data() const noexcept {
+    if (mapped)
+        return string_view((const char *) mapped, mapped_size);
+    return owned;
+}
+
+/** Binary search for a name in one of the sorted tables. */
+template <class T>
+static const T *findName(const T *beg, uint32_t num, const char *strings, string_view name) {
+    const T *end = beg + num;
+    auto str = [&](const T &e) { return string_view(strings + e.str, e.len); };
+    const T *it = lower_bound(beg, end, name, [&](const T &e, string_view n) { return str(e) < n; });
+    return (it != end && str(*it) == name) ? it : nullptr;
+}
+
+bool Keymap::getKeysym(string_view name, int *code) const noexcept {
+    const KeymapName *e = findName(names, hdr->num_names, strings, name);
+    if (!e)
+        return false;
+    *code = e->code;
+    return true;
+}
+
+string_view Keymap::getName(int code) const noexcept {
+    const KeymapCode *end = codes + hdr->num_codes;
+    const KeymapCode *it = lower_bound(codes, end, code,
+                                       [](const KeymapCode &e, int c) { return e.code < c; });
+    if (it == end || it->code != code)
+        return string_view();
+    return string_view(strings + it->str, it->len);
+}
+
+bool Keymap::getCombo(string_view name, int *mod_code, int *root_code) const noexcept {
+    const KeymapCombo *e = findName(combos, hdr->num_combos, strings, name);
+    if (!e)
+        return false;
+    *mod_code = e->mod_code;
+    *root_code = e->root_code;
+    return true;
+}
+
+bool Keymap::isModifier(int code) const noexcept {
+    return binary_search(mods, mods + hdr->num_mods, code);
+}
+
+map<string, string> findKeymaps() {
+    static const char *kbmap_dirs[] = {
+        "/usr/share/kbd/keymaps",
+        "/usr/share/keymaps",
+        "/lib/kbd/keymaps/legacy/",
+        "/lib/kbd/keymaps/xkb/",
+    };
+    static const regex keymap_rx("/([a-z0-9]+)/([a-z0-9]+)/([a-z0-9-]+)\\.k?map\\.gz$");
+
+    map<string, string> keymaps;
+    for (const char *dir : kbmap_dirs) {
+        error_code ec;
+        if (!fs::is_directory(dir, ec))
+            continue;
+
+        vector<string> paths;
+        for (auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+             !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+            paths.push_back(it->path().string());
+        // Later entries win, sort them so that the outcome is the same every time.
+        sort(paths.begin(), paths.end());
+        for (const auto &path : paths) {
+            smatch m;
+            if (regex_search(path, m, keymap_rx))
+                keymaps[m[3]] = path;
+        }
+        break;
+    }
+    return keymaps;
+}
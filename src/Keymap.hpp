@@ -0,0 +1,111 @@
+/** @file Keymap.hpp
+ *
+ * @brief Native loader for Linux kbd keymaps.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+}
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct KeymapHeader;
+struct KeymapName;
+struct KeymapCode;
+struct KeymapCombo;
+
+/**
+ * Immutable key name table parsed from a Linux kbd keymap.
+ *
+ * The table is stored in a compact binary format that can be written to
+ * disk and mapped back into memory as-is, so a keymap only ever has to be
+ * parsed once. Lookups are binary searches over the mapped data, which
+ * makes it safe to share a single Keymap between any number of threads.
+ *
+ * Keymaps are parsed exactly like Keymap.lua does it, every method has a
+ * counterpart there.
+ */
+class Keymap {
+    std::string owned;
+    void *mapped = nullptr;
+    size_t mapped_size = 0;
+
+    const KeymapHeader *hdr = nullptr;
+    const KeymapName *names = nullptr;
+    const KeymapCode *codes = nullptr;
+    const KeymapCombo *combos = nullptr;
+    const uint16_t *mods = nullptr;
+    const char *strings = nullptr;
+
+    Keymap() = default;
+
+    /** Point the table into `data`, checking that every offset is in bounds. */
+    void setData(const char *data, size_t size);
+
+public:
+    /** Bump this when the binary format changes. */
+    static constexpr uint32_t format_version = 1;
+
+    Keymap(const Keymap &) = delete;
+    Keymap &operator=(const Keymap &) = delete;
+    ~Keymap();
+
+    /**
+     * Parse a kbd keymap, pulling in its includes.
+     *
+     * @param path Path to a .map, .map.gz or .inc file, gzipped files are
+     *             decompressed with gzip(1).
+     * @throws SystemError If the keymap or one of its includes could not be read.
+     */
+    static std::shared_ptr<Keymap> parse(const std::string &path);
+
+    /**
+     * Load a table that was written with data().
+     *
+     * @throws SystemError If the table is not valid.
+     */
+    static std::shared_ptr<Keymap> fromData(std::string data);
+
+    /**
+     * Map a table that was written with data() into memory.
+     *
+     * @throws SystemError If the file could not be mapped or is not valid.
+     */
+    static std::shared_ptr<Keymap> open(const std::string &path);
+
+    /** The binary table, ready to be written to disk. */
+    std::string_view data() const noexcept;
+
+    /**
+     * Get the key code of a key name.
+     *
+     * @return False if there is no such key.
+     */
+    bool getKeysym(std::string_view name, int *code) const noexcept;
+
+    /** Get the name of a key code, empty if there is no such key. */
+    std::string_view getName(int code) const noexcept;
+
+    /**
+     * Get the modifier and key that together produce a symbol.
+     *
+     * @return False if there is no such combo.
+     */
+    bool getCombo(std::string_view name, int *mod_code, int *root_code) const noexcept;
+
+    /** Check whether a key code is one of the modifiers. */
+    bool isModifier(int code) const noexcept;
+};
+
+/**
+ * Find all installed kbd keymaps, like kbmap.getall() in Keymap.lua.
+ *
+ * @return Map of language name to keymap path, empty if no keymap
+ *         directory exists.
+ */
+std::map<std::string, std::string> findKeymaps();
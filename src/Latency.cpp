@@ -0,0 +1,130 @@
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+
+extern "C" {
+    #include <stdio.h>
+    #include <errno.h>
+}
+
+#include "Latency.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram() noexcept {
+    reset();
+}
+
+int LatencyHistogram::bucketIndex(uint64_t ns) noexcept {
+    if (ns < sub_buckets)
+        return (int) ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - sub_bits;
+    return (shift + 1) * sub_buckets + (int) ((ns >> shift) & (sub_buckets - 1));
+}
+
+uint64_t LatencyHistogram::bucketUpper(int idx) noexcept {
+    if (idx < sub_buckets)
+        return (uint64_t) idx;
+    int shift = idx / sub_buckets - 1;
+    uint64_t lower = uint64_t(sub_buckets + idx % sub_buckets) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t ns) noexcept {
+    buckets[bucketIndex(ns)].fetch_add(1, memory_order_relaxed);
+    num_samples.fetch_add(1, memory_order_relaxed);
+    sum_ns.fetch_add(ns, memory_order_relaxed);
+    uint64_t prev = max_ns.load(memory_order_relaxed);
+    while (ns > prev && !max_ns.compare_exchange_weak(prev, ns, memory_order_relaxed))
+        ;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const noexcept {
+    uint64_t n = count();
+    if (n == 0)
+        return 0;
+    // Rank of the sample we're looking for, 1-indexed.
+    uint64_t rank = (uint64_t) ((p / 100.0) * (double) n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < num_buckets; i++) {
+        seen += buckets[i].load(memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(bucketUpper(i), max());
+    }
+    return max();
+}
+
+void LatencyHistogram::reset() noexcept {
+    for (auto &b : buckets)
+        b.store(0, memory_order_relaxed);
+    num_samples.store(0, memory_order_relaxed);
+    max_ns.store(0, memory_order_relaxed);
+    sum_ns.store(0, memory_order_relaxed);
+}
+
+LatencyHistogram& LatencyStats::stage(const std::string& name) {
+    auto it = stages.find(name);
+    if (it != stages.end())
+        return it->second;
+    order.push_back(name);
+    return stages.emplace(piecewise_construct,
+                          forward_as_tuple(name),
+                          forward_as_tuple()).first->second;
+}
+
+std::string LatencyStats::format() const {
+    stringstream ss;
+    auto us = [](uint64_t ns) { return double(ns) / 1000.0; };
+    ss << left << setw(24) << "stage"
+       << right << setw(10) << "count"
+       << setw(12) << "p50(us)"
+       << setw(12) << "p99(us)"
+       << setw(12) << "max(us)" << endl;
+    ss << fixed << setprecision(1);
+    for (const auto &name : order) {
+        const auto &h = stages.at(name);
+        ss << left << setw(24) << name
+           << right << setw(10) << h.count()
+           << setw(12) << us(h.percentile(50))
+           << setw(12) << us(h.percentile(99))
+           << setw(12) << us(h.max()) << endl;
+    }
+    return ss.str();
+}
+
+StatsTable LatencyStats::table() const {
+    StatsTable tbl;
+    for (const auto &[name, h] : stages) {
+        tbl[name] = {
+            {"count", double(h.count())},
+            {"p50_us", double(h.percentile(50)) / 1000.0},
+            {"p99_us", double(h.percentile(99)) / 1000.0},
+            {"max_us", double(h.max()) / 1000.0},
+            {"mean_us", double(h.mean()) / 1000.0},
+        };
+    }
+    return tbl;
+}
+
+void LatencyStats::dump(const std::string& path) const {
+    string tmp_path = path + ".tmp";
+    {
+        ofstream out(tmp_path, ios::trunc);
+        if (!out)
+            throw SystemError("Unable to open " + tmp_path + ": ", errno);
+        out << format();
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) == -1)
+        throw SystemError("Unable to rename " + tmp_path + ": ", errno);
+}
+
+void LatencyStats::reset() noexcept {
+    for (auto &[_, h] : stages) {
+        (void) _;
+        h.reset();
+    }
+}
@@ -0,0 +1,139 @@
+/** @file Latency.hpp
+ *
+ * @brief Latency histograms for the keystroke path.
+ *
+ * Every stage a key passes through (keyboard read, socket, Lua, uinput) gets
+ * its own LatencyHistogram inside a LatencyStats table. Recording is lock-free
+ * so it can be done from the event loop, while dumping/querying happens from
+ * other threads.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <time.h>
+    #include <stdint.h>
+    #include <linux/input.h>
+}
+
+#include <atomic>
+#include <string>
+#include <map>
+#include <vector>
+
+/** CLOCK_MONOTONIC time in nanoseconds. */
+static inline uint64_t monotonicNanos() noexcept {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + uint64_t(ts.tv_nsec);
+}
+
+/** Convert an input_event timestamp into nanoseconds. */
+static inline uint64_t eventNanos(const struct input_event &ev) noexcept {
+    return uint64_t(ev.time.tv_sec) * 1000000000ULL +
+           uint64_t(ev.time.tv_usec) * 1000ULL;
+}
+
+/**
+ * Log-linear histogram of durations in nanoseconds.
+ *
+ * Each power of two is split into 8 linear sub-buckets, so reported
+ * percentiles are within 12.5% of the real value.
+ */
+class LatencyHistogram {
+    static constexpr int sub_bits = 3;
+    static constexpr int sub_buckets = 1 << sub_bits;
+    static constexpr int num_buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    std::atomic<uint64_t> buckets[num_buckets];
+    std::atomic<uint64_t> num_samples;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> sum_ns;
+
+    static int bucketIndex(uint64_t ns) noexcept;
+
+    /** Largest value that falls into bucket `idx`. */
+    static uint64_t bucketUpper(int idx) noexcept;
+
+public:
+    LatencyHistogram() noexcept;
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    /** Record a single duration. */
+    void record(uint64_t ns) noexcept;
+
+    /** Record the time passed since `start_ns`. */
+    inline void since(uint64_t start_ns) noexcept {
+        uint64_t now = monotonicNanos();
+        if (start_ns && now >= start_ns)
+            record(now - start_ns);
+    }
+
+    /** Record the time between two timestamps, does nothing if
+     *  either of them was not taken. */
+    inline void between(uint64_t start_ns, uint64_t end_ns) noexcept {
+        if (start_ns && end_ns && end_ns >= start_ns)
+            record(end_ns - start_ns);
+    }
+
+    /**
+     * @param p Percentile in the range [0, 100].
+     * @return Upper bound of the bucket holding the p-th percentile.
+     */
+    uint64_t percentile(double p) const noexcept;
+
+    inline uint64_t count() const noexcept {
+        return num_samples.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t max() const noexcept {
+        return max_ns.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t sum() const noexcept {
+        return sum_ns.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t mean() const noexcept {
+        uint64_t n = count();
+        return n ? sum_ns.load(std::memory_order_relaxed) / n : 0;
+    }
+
+    void reset() noexcept;
+};
+
+/** Table of statistics, (name -> (field -> value)) */
+using StatsTable = std::map<std::string, std::map<std::string, double>>;
+
+/**
+ * Named collection of latency histograms, one for each stage.
+ *
+ * Stages should all be added before the event loop starts, the
+ * references returned by stage() stay valid for the lifetime of the
+ * LatencyStats object.
+ */
+class LatencyStats {
+    std::map<std::string, LatencyHistogram> stages;
+    std::vector<std::string> order;
+
+public:
+    /** Get, or create, the histogram for a stage. */
+    LatencyHistogram& stage(const std::string& name);
+
+    /** Human readable table with p50/p99/max for each stage. */
+    std::string format() const;
+
+    /** Stats for each stage in microseconds. */
+    StatsTable table() const;
+
+    /**
+     * Write format() to `path`, the file is replaced atomically.
+     *
+     * @throws SystemError If the file could not be written.
+     */
+    void dump(const std::string& path) const;
+
+    void reset() noexcept;
+};
@@ -0,0 +1,234 @@
+extern "C" {
+    #include <errno.h>
+    #include <stdarg.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <unistd.h>
+    #include <poll.h>
+    #include <sys/eventfd.h>
+}
+
+#include <thread>
+
+#include "Log.hpp"
+#include "Latency.hpp"
+
+using namespace std;
+
+namespace Log {
+
+namespace {
+    constexpr size_t ring_size = 256;
+    constexpr size_t max_message = 1024;
+
+    struct Slot {
+        /** Position that the slot is ready for, see push() and pop() */
+        std::atomic<size_t> seq;
+        int prio;
+        char msg[max_message];
+    };
+
+    /**
+     * Bounded multi-producer single-consumer ring, each slot carries a
+     * sequence number telling whether it is free for the position that a
+     * producer claimed, or holds a message for the consumer.
+     */
+    struct Ring {
+        Slot slots[ring_size];
+        alignas(64) std::atomic<size_t> tail {0};
+        alignas(64) size_t head = 0;
+
+        Ring() {
+            for (size_t i = 0; i < ring_size; i++)
+                slots[i].seq.store(i, memory_order_relaxed);
+        }
+
+        /** Claim a slot, which is published with commit(). */
+        Slot *claim() noexcept {
+            size_t pos = tail.load(memory_order_relaxed);
+            for (;;) {
+                Slot *slot = &slots[pos % ring_size];
+                intptr_t diff = intptr_t(slot->seq.load(memory_order_acquire)) - intptr_t(pos);
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        return slot;
+                } else if (diff < 0) {
+                    return nullptr;
+                } else {
+                    pos = tail.load(memory_order_relaxed);
+                }
+            }
+        }
+
+        void commit(Slot *slot) noexcept {
+            size_t pos = slot->seq.load(memory_order_relaxed);
+            slot->seq.store(pos + 1, memory_order_release);
+        }
+
+        /** Whether a message is ready, called by the drain thread only. */
+        bool peek() noexcept {
+            return slots[head % ring_size].seq.load(memory_order_acquire) == head + 1;
+        }
+
+        /** Called by the drain thread only. */
+        bool pop(int *prio, char *msg) noexcept {
+            Slot *slot = &slots[head % ring_size];
+            if (slot->seq.load(memory_order_acquire) != head + 1)
+                return false;
+            *prio = slot->prio;
+            memcpy(msg, slot->msg, max_message);
+            slot->seq.store(head + ring_size, memory_order_release);
+            head++;
+            return true;
+        }
+    };
+
+    Ring ring;
+    std::atomic<int> level {LOG_DEBUG};
+    std::atomic<bool> running {false};
+    std::atomic<uint32_t> dropped {0};
+    /** Sites that have suppressed messages at some point. */
+    std::atomic<Site *> sites {nullptr};
+    std::thread drainer;
+    /** Signalled when a message is queued while the drain thread sleeps,
+     *  or when it should stop. */
+    int wake_fd = -1;
+    std::atomic<bool> sleeping {false};
+
+    void wake() noexcept {
+        uint64_t one = 1;
+        while (::write(wake_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+            ;
+    }
+
+    void listSite(Site &site) noexcept {
+        bool listed = false;
+        if (!site.listed.compare_exchange_strong(listed, true))
+            return;
+        Site *head = sites.load(memory_order_relaxed);
+        do {
+            site.next = head;
+        } while (!sites.compare_exchange_weak(head, &site, memory_order_release));
+    }
+
+    void reportSuppressed() noexcept {
+        for (Site *site = sites.load(memory_order_acquire); site; site = site->next)
+            if (uint32_t n = site->suppressed.exchange(0))
+                syslog(site->prio, "Suppressed %u messages like: %s", n, site->fmt);
+        if (uint32_t n = dropped.exchange(0))
+            syslog(LOG_WARNING, "Log buffer was full, dropped %u messages", n);
+    }
+
+    void drain() noexcept {
+        int prio;
+        char msg[max_message];
+        uint64_t last_report = monotonicNanos();
+        for (;;) {
+            bool stopping = !running.load(memory_order_acquire);
+            bool got = false;
+            while (ring.pop(&prio, msg)) {
+                syslog(prio, "%s", msg);
+                got = true;
+            }
+            uint64_t now = monotonicNanos();
+            if (stopping || now - last_report >= rate_interval_ns) {
+                reportSuppressed();
+                last_report = now;
+            }
+            if (stopping)
+                return;
+            if (got)
+                continue;
+
+            // Announce that we are about to sleep before looking at the
+            // ring a last time, so that a message queued after the check
+            // is sure to wake us up.
+            sleeping.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (ring.peek() || !running.load(memory_order_acquire)) {
+                sleeping.store(false, memory_order_relaxed);
+                continue;
+            }
+            // Wake up at least once per interval for the summaries.
+            struct pollfd pfd = {wake_fd, POLLIN, 0};
+            if (poll(&pfd, 1, rate_interval_ns / 1000000) > 0) {
+                uint64_t n;
+                ssize_t r = ::read(wake_fd, &n, sizeof(n));
+                (void) r;
+            }
+            sleeping.store(false, memory_order_relaxed);
+        }
+    }
+}
+
+void start() {
+    if (running.load())
+        return;
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        syslog(LOG_WARNING, "Unable to create eventfd, logging synchronously: %s", strerror(errno));
+        return;
+    }
+    running = true;
+    drainer = std::thread(drain);
+    // Queued messages would be lost, and exit() would terminate() on the
+    // joinable thread.
+    static bool registered = false;
+    if (!registered && atexit(stop) == 0)
+        registered = true;
+}
+
+void stop() {
+    if (!running.exchange(false))
+        return;
+    wake();
+    drainer.join();
+    close(wake_fd);
+    wake_fd = -1;
+}
+
+void setLevel(int prio) noexcept {
+    level.store(prio, memory_order_relaxed);
+}
+
+int getLevel() noexcept {
+    return level.load(memory_order_relaxed);
+}
+
+void write(Site *site, ...) noexcept {
+    if (site->prio > level.load(memory_order_relaxed))
+        return;
+
+    uint64_t now = monotonicNanos();
+    uint64_t start = site->window_start.load(memory_order_relaxed);
+    if (now - start >= rate_interval_ns &&
+        site->window_start.compare_exchange_strong(start, now, memory_order_relaxed))
+        site->count.store(0, memory_order_relaxed);
+    if (site->count.fetch_add(1, memory_order_relaxed) >= rate_burst) {
+        site->suppressed.fetch_add(1, memory_order_relaxed);
+        listSite(*site);
+        return;
+    }
+
+    va_list args;
+    va_start(args, site);
+    if (!running.load(memory_order_acquire)) {
+        if (uint32_t n = site->suppressed.exchange(0))
+            syslog(site->prio, "Suppressed %u messages like: %s", n, site->fmt);
+        vsyslog(site->prio, site->fmt, args);
+    } else if (Slot *slot = ring.claim()) {
+        slot->prio = site->prio;
+        vsnprintf(slot->msg, max_message, site->fmt, args);
+        ring.commit(slot);
+        // Pairs with the fence in drain().
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load(memory_order_relaxed) && sleeping.exchange(false))
+            wake();
+    } else {
+        dropped.fetch_add(1, memory_order_relaxed);
+    }
+    va_end(args);
+}
+
+}
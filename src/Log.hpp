@@ -0,0 +1,70 @@
+/** @file Log.hpp
+ *
+ * @brief Non-blocking, rate-limited logging for the hot paths.
+ *
+ * Messages are formatted by the caller into a lock-free ring buffer, and a
+ * background thread passes them on to syslog, so a slow journald never
+ * holds up the event loop. Every call site is limited to a burst of
+ * messages per second, messages beyond that are counted and reported as
+ * a single summary.
+ *
+ *     HAWCK_LOG(LOG_ERR, "Read error on %s", name.c_str());
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <syslog.h>
+}
+
+#include <atomic>
+
+namespace Log {
+    /** Messages allowed from a single call site in one interval. */
+    constexpr uint32_t rate_burst = 10;
+    constexpr uint64_t rate_interval_ns = 1000000000ULL;
+
+    /** State of a single HAWCK_LOG() call site. */
+    struct Site {
+        const int prio;
+        const char *const fmt;
+        std::atomic<uint64_t> window_start {0};
+        std::atomic<uint32_t> count {0};
+        std::atomic<uint32_t> suppressed {0};
+        /** Whether the site is in the list of sites with summaries. */
+        std::atomic<bool> listed {false};
+        Site *next = nullptr;
+
+        constexpr Site(int prio, const char *fmt) noexcept : prio(prio), fmt(fmt) {}
+    };
+
+    /**
+     * Start the thread that writes messages to syslog, until then
+     * messages are written directly. Must be called after daemonizing,
+     * as threads do not survive fork(). The thread is stopped by stop(),
+     * or at exit().
+     */
+    void start();
+
+    /** Write out everything that is queued up and stop the thread. */
+    void stop();
+
+    /** Drop messages with a priority below this, e.g LOG_INFO drops
+     *  LOG_DEBUG messages. Can be changed at any time. */
+    void setLevel(int prio) noexcept;
+
+    int getLevel() noexcept;
+
+    /** Use HAWCK_LOG() rather than calling this directly. */
+    void write(Site *site, ...) noexcept;
+}
+
+#define HAWCK_LOG(_prio, _fmt, ...)                                   \
+    do {                                                              \
+        static ::Log::Site _hawck_log_site((_prio), (_fmt));          \
+        /* Never run, only lets the compiler check the format. */     \
+        if (false)                                                    \
+            syslog((_prio), (_fmt), ##__VA_ARGS__);                   \
+        ::Log::write(&_hawck_log_site, ##__VA_ARGS__);                \
+    } while (0)
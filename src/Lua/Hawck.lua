@@ -33,17 +33,29 @@ local kbmap = require "Keymap"
 require "match"
 require "app"
 kbd = require "kbd"
-local unpack = table.unpack
+local async = require "async"
+local compat = require "compat"
+local unpack = compat.unpack
 
 FALLTHROUGH = 0x3141592654
 
 -- Keeps track of keys that are requested by the script.
 __keys = {}
 
+-- Key codes whose state is checked with held(), every up/down event for
+-- these has to reach kbd:prepare().
+__tracked = {}
+
 -- Root match scope
 __match = MatchScope.new()
 match = __match
 _G["__match"] = __match
+-- Actions may wait for time to pass, keys or processes, see async.lua
+__match.run = async.run
+
+sleep = async.sleep
+nextKey = async.nextKey
+spawn = async.spawn
 
 cont = ConcatF.new(function ()
     return FALLTHROUGH
@@ -51,13 +63,13 @@ end)
 
 any = Cond.new(function ()
     return true
-end)
+end, Constraint.all())
 always = any
 all = any
 
 never = Cond.new(function ()
     return false
-end)
+end, Constraint.none())
 
 noop = function () end
 nothing = noop
@@ -67,9 +79,9 @@ off = noop
 key = function (key_name)
   __keys[key_name] = true
   local key_code = kbd:getKeysym(key_name)
-  return LazyCondF.new(function (key_code)
+  return Cond.new(function ()
       return kbd:hadKey(key_code)
-  end)(key_code)
+  end, Constraint.key(key_code))
 end
 
 press = LazyF.new(function (key)
@@ -78,13 +90,24 @@ end)
 
 write = LazyF.new(function (text)
   kbd:withCleanMods(function ()
-    for p, c in utf8.codes(text) do
+    -- Whatever udev:typeString can resolve is typed natively, the rest
+    -- one character at a time through the keymap.
+    local pos = 1
+    while pos <= #text do
+      if udev.typeString then
+        pos = udev:typeString(text, pos, kbd.map.lang)
+        if pos > #text then
+          break
+        end
+      end
+      local c = text:match("^" .. compat.charpattern, pos) or text:sub(pos, pos)
       local succ, _ = pcall(function ()
-        getEntryFunction(utf8.char(c))()
+        getEntryFunction(c)()
       end)
       if not succ then
-        print("No such key: " .. utf8.char(c))
+        print("No such key: " .. c)
       end
+      pos = pos + #c
     end
   end)
 end)
@@ -131,18 +154,26 @@ end)
 
 held = LazyCondF.new(function (key_name)
     return kbd:keyIsDown(key_name)
+end, function (key_name)
+    local succ, code = pcall(kbd.getKeysym, kbd, key_name)
+    if succ then
+      __tracked[code] = true
+    end
+    return Constraint.all()
 end)
 
 down = Cond.new(function ()
     return kbd:hadKeyDown()
-end)
+end, Constraint.values(KeyMask.DOWN))
 
 up = Cond.new(function ()
     return kbd:hadKeyUp()
-end)
+end, Constraint.values(KeyMask.UP))
 
 fromkbd = LazyCondF.new(function (kbd_hid)
     return kbd:from(kbd_hid)
+end, function ()
+    return Constraint.all()
 end)
 
 modkeys = {
@@ -173,16 +204,71 @@ for i, key in pairs(fn_keys) do
   fn_keycodes[kbd:getKeysym(key)] = true
 end
 
-function __match.prepare(...)
+-- Ctrl+Alt+F(n) switches between virtual terminals
+local function isVTSwitch()
+    return (ctrl + alt)() and fn_keycodes[kbd.event_code]
+end
+
+local function rootPrepare(...)
     kbd:prepare(...)
+    async.keyEvent(...)
 
     -- Don't act on Ctrl+Alt+F(n) keys
-    if (ctrl + alt)() and fn_keycodes[kbd.event_code] then
+    if isVTSwitch() then
       return false
     end
 
     return true
 end
+__match.prepare = rootPrepare
+
+--- Find out whether the script would react to an event, without running any
+--  of its actions, so that MacroD can test scripts in parallel and only run
+--  __match for those that react. Takes the same arguments as __match.
+--
+-- @return Whether the outcome is known, and whether an action would run.
+--         The outcome is unknown for scripts with conditions that might
+--         have side effects, and while an action waits for a key.
+function __test(...)
+  if getmetatable(__match) ~= PatternScopeMeta or rawget(__match, "prepare") ~= rootPrepare or
+     async.waitingForKey() then
+    return false, false
+  end
+  -- Only sets up the event, doing it again in __match changes nothing.
+  kbd:prepare(...)
+  if isVTSwitch() then
+    return true, false
+  end
+  return MatchScope.test(__match, rootPrepare)
+end
+
+--- Describe which key events the script can react to, used by MacroD to skip
+--  the script for all other events.
+--
+-- While an action waits for the next key, the script wants every event.
+--
+-- @return True if every event has to be passed to the script, and a list
+--         of `code << 3 | mask` entries otherwise, where bit `value` of
+--         mask is set for every event value the script wants.
+function __interest()
+  if getmetatable(__match) ~= PatternScopeMeta or async.waitingForKey() then
+    return true, {}
+  end
+  local c = MatchScope.constraint(__match, rootPrepare)
+  for code, _ in pairs(__tracked) do
+    c = Constraint.either(c, Constraint.key(code, compat.bor(KeyMask.UP, KeyMask.DOWN)))
+  end
+  if c.any ~= 0 then
+    return true, {}
+  end
+  local entries = {}
+  for code, mask in pairs(c.keys) do
+    if mask ~= 0 then
+      table.insert(entries, compat.bor(compat.lshift(code, 3), mask))
+    end
+  end
+  return false, entries
+end
 
 notify = LazyF.new(function (title, message)
     local p = io.popen(("notify-send -a '%s' -u normal -i hawck -t 3000 '%s'"):format(title, message))
@@ -209,12 +295,19 @@ function mode(name, cond)
 end
 
 -- __match[prepare] = echo
+-- When the script shares its Lua state with other scripts, _G is the
+-- environment of the script and the shared globals are in __base.
+local base = rawget(_G, "__base")
 ProtectedMeta = {
   __index = function (t, name)
-    if not rawget(t, name) then
+    local val = rawget(t, name)
+    if val == nil and base then
+      val = rawget(base, name)
+    end
+    if not val then
       error(("Undefined variable: %s"):format(name))
     end
-    return rawget(t, name)
+    return val
   end
 }
 
@@ -229,6 +322,11 @@ local OMNIPRESENT = {"Control_R",
 
 for idx, name in ipairs(OMNIPRESENT) do
   __keys[name] = true
+  -- kbd:withCleanMods() needs to know which modifiers are held.
+  local succ, code = pcall(kbd.getKeysym, kbd, name)
+  if succ then
+    __tracked[code] = true
+  end
 end
 
 function __setup() end
@@ -280,12 +280,21 @@ end
 -- @param lang The key map language.
 function kbmap.new(lang)
   assert(lang)
-  local maps = kbmap.getall()
-  if not maps[lang] then
-    error("No such keymap: " .. lang)
+  local keymap, combo_map, mod_codes
+  -- hawck-macrod parses each keymap once and shares the (read-only)
+  -- tables between all scripts.
+  local native_keymap = rawget(_G, "__keymap")
+  if native_keymap then
+    keymap, combo_map, mod_codes = native_keymap(lang)
+  else
+    local maps = kbmap.getall()
+    if not maps[lang] then
+      error("No such keymap: " .. lang)
+    end
+    keymap, combo_map, mod_codes = readLinuxKBMap(maps[lang])
   end
-  local keymap, combo_map, mod_codes = readLinuxKBMap(maps[lang])
   local map = {
+    lang = lang,
     keymap = keymap,
     combo_map = combo_map,
     mod_codes = mod_codes,
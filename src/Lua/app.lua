@@ -27,8 +27,15 @@
 
 local strict = require "strict"
 local u = require "utils"
+local async = require "async"
 require "match"
 
+-- hawck-macrod keeps an index of all desktop files that is shared by all
+-- scripts and current with the installed applications, they are only read
+-- here when running outside of it.
+local G = rawget(_G, "__base") or _G
+local native_desktop_entry = rawget(G, "__desktopEntry")
+
 local DESKTOP_FILE_CACHE = {}
 
 local function readDesktopFile(path)
@@ -74,6 +81,17 @@ local function readDesktopFile(path)
   return actions
 end
 
+local function findApp(name)
+  if native_desktop_entry then
+    local actions = native_desktop_entry(name)
+    if not actions then
+      error(("No such application: %s"):format(name))
+    end
+    return actions
+  end
+  return readDesktopFile(("/usr/share/applications/%s.desktop"):format(name))
+end
+
 local AppMethods = {}
 
 function AppMethods:new(arg)
@@ -102,19 +120,33 @@ function AppMetaMethods.__index(t, key)
 
   return LazyF.new(function (self, arg)
       print(arg)
+      -- The application may have been upgraded since the script was loaded.
+      if native_desktop_entry then
+        local current = native_desktop_entry(t._name)
+        local act = current and current[key]
+        if act and act["Exec"] then
+          exec = act["Exec"]
+        end
+      end
       local cmd
       if not exec:find("%%u") and arg then
         cmd = exec .. " " .. u.shescape(arg)
       else
         cmd = exec:gsub("%%u", u.shescape(arg or ""))
       end
+      -- Started without waiting for it, io.popen() handles would wait
+      -- for the application to exit once they are collected.
+      if async.can_spawn then
+        return async.spawn(cmd)
+      end
       io.popen(cmd)
   end)
 end
 
 local function app(name)
   local t = {
-    _actions = readDesktopFile(("/usr/share/applications/%s.desktop"):format(name))
+    _name = name,
+    _actions = findApp(name)
   }
   setmetatable(t, AppMetaMethods)
   return t
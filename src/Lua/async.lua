@@ -0,0 +1,166 @@
+--[====================================================================================[
+   Match actions that run as coroutines.
+
+   Every action is started as a coroutine, which runs until it finishes or
+   until it waits for something in sleep(), nextKey() or Process:wait().
+   MacroD resumes it from its main loop, on a timer or when the next key
+   comes in, and keys typed in the meantime are handled as usual.
+--]====================================================================================]
+
+local async = {}
+
+local G = rawget(_G, "__base") or _G
+local native_after = rawget(G, "after")
+local native_spawn = rawget(G, "__spawn")
+local native_reap = rawget(G, "__reap")
+local native_interest_changed = rawget(G, "__interestChanged")
+
+-- How often a process that is waited for is checked on.
+local PROCESS_POLL_MS = 20
+
+-- Yields of this module are told apart from those of coroutines that
+-- actions create themselves.
+local TAG = {}
+
+-- Coroutines waiting for the next key, see async.keyEvent()
+local key_waiters = {}
+-- Whether MacroD was last told that the script waits for keys.
+local reported_waiting = false
+
+-- Scripts that wait for a key are sent every key, MacroD learns about it
+-- through __interest().
+local function reportWaiting()
+  local waiting = #key_waiters > 0
+  if waiting ~= reported_waiting then
+    reported_waiting = waiting
+    if native_interest_changed then
+      native_interest_changed()
+    end
+  end
+end
+
+local resume
+
+local function schedule(co, what, arg)
+  if what == "sleep" then
+    native_after(arg, function ()
+      resume(co)
+    end)
+  elseif what == "key" then
+    key_waiters[#key_waiters + 1] = co
+    reportWaiting()
+  end
+end
+
+resume = function (co, ...)
+  local ok, tag, what, arg = coroutine.resume(co, ...)
+  if not ok then
+    error(tag, 0)
+  end
+  if coroutine.status(co) == "suspended" then
+    if tag ~= TAG then
+      error("Actions can only be paused by sleep(), nextKey() and Process:wait()")
+    end
+    schedule(co, what, arg)
+  end
+end
+
+local function yield(name, what, arg)
+  if not coroutine.isyieldable() then
+    error(("%s() can only be used in actions"):format(name), 3)
+  end
+  return coroutine.yield(TAG, what, arg)
+end
+
+--- Run an action as a coroutine, up to the point where it first waits.
+function async.run(fn)
+  resume(coroutine.create(fn))
+end
+
+--- Pause the action for `ms` milliseconds.
+function async.sleep(ms)
+  if not native_after then
+    error("sleep() is only available in hawck-macrod", 2)
+  end
+  yield("sleep", "sleep", ms)
+end
+
+--- Wait for the next key event, the script is sent every key while an
+--  action waits.
+--
+-- @return The key code and value of the event, which is then matched as
+--         usual.
+function async.nextKey()
+  return yield("nextKey", "key")
+end
+
+--- Whether any action is waiting for the next key, keyEvent() then has to
+--  run for every key.
+function async.waitingForKey()
+  return #key_waiters > 0
+end
+
+--- Resume the actions that wait for a key, called for every event before
+--  it is matched.
+function async.keyEvent(value, code, type)
+  if #key_waiters == 0 or type ~= 0x01 then
+    return
+  end
+  local waiters = key_waiters
+  key_waiters = {}
+  -- One failing action should not take the others with it.
+  local err
+  for _, co in ipairs(waiters) do
+    local ok, msg = pcall(resume, co, code, value)
+    if not ok and not err then
+      err = msg
+    end
+  end
+  reportWaiting()
+  if err then
+    error(err, 0)
+  end
+end
+
+local Process = {}
+Process.__index = Process
+
+-- Processes that nobody waits for are reaped by MacroD.
+function Process.__gc(p)
+  if not p.status then
+    native_reap(p.pid, true)
+  end
+end
+
+--- Whether processes can be started with async.spawn()
+async.can_spawn = native_spawn ~= nil
+
+--- Start a shell command without waiting for it.
+--
+-- @return A Process, which can be waited for in actions.
+function async.spawn(cmd)
+  if not native_spawn then
+    error("spawn() is only available in hawck-macrod", 2)
+  end
+  return setmetatable({pid = native_spawn(cmd)}, Process)
+end
+
+--- Exit status of the process, nil while it is running.
+function Process:poll()
+  if not self.status then
+    self.status = native_reap(self.pid)
+  end
+  return self.status
+end
+
+--- Wait for the process to exit, keys are handled in the meantime.
+--
+-- @return The exit status, 128 + the signal if it was killed.
+function Process:wait()
+  while not self:poll() do
+    async.sleep(PROCESS_POLL_MS)
+  end
+  return self.status
+end
+
+return async
@@ -0,0 +1,31 @@
+--[====================================================================================[
+   Differences between the Lua implementations that Hawck can be built
+   against, Lua 5.3 and LuaJIT.
+
+   LuaJIT does not parse the integer operators of Lua 5.3, so they are
+   only used through the functions in here, which are loaded from a
+   string on Lua 5.3 and taken from the bit library on LuaJIT.
+--]====================================================================================]
+
+local compat = {}
+
+local bit = rawget(_G, "bit")
+if bit then
+  compat.band = bit.band
+  compat.bor = bit.bor
+  compat.lshift = bit.lshift
+else
+  compat.band, compat.bor, compat.lshift = assert(load([[
+    return function (a, b) return a & b end,
+           function (a, b) return a | b end,
+           function (a, n) return a << n end
+  ]], "=compat", "t"))()
+end
+
+compat.unpack = table.unpack or unpack
+
+--- Pattern matching one UTF-8 encoded character, the same as
+-- utf8.charpattern, which LuaJIT does not have.
+compat.charpattern = "[%z\1-\127\194-\244][\128-\191]*"
+
+return compat
@@ -14,9 +14,14 @@ local ConfigMeta = {
 }
 
 function ConfigMeta.__newindex(t, idx, val)
-  print(("metamethod called %s, %s, %s"):format(t, idx, val))
+  if real_config[idx] == val then
+    return
+  end
   real_config[idx] = val
-  table.insert(modified, idx)
+  modified[idx] = true
+  if __optionChanged then
+    __optionChanged(idx)
+  end
 end
 
 config = {}
@@ -45,7 +50,7 @@ end
 -- Call relevant functions in MacroD to set the
 -- configuration options
 function setOptions()
-  for i, name in ipairs(modified) do
+  for name in pairs(modified) do
     local fn_name = "set_" .. name
     local fn = MacroD[fn_name]
     if fn then
@@ -55,7 +60,10 @@ function setOptions()
 end
 
 function getChanged()
-  local was_modified = modified
+  local was_modified = {}
+  for name in pairs(modified) do
+    table.insert(was_modified, name)
+  end
   reg["modified"] = {}
   modified = reg["modified"]
   return was_modified
@@ -67,13 +75,14 @@ function getConfigs(...)
     table.insert(configs, real_config[name])
   end
   u.puts(configs)
-  return table.unpack(configs)
+  return (table.unpack or unpack)(configs)
 end
 
 function exec(cmd)
   local env = {
     config = config,
     puts = puts,
+    query = __query,
   }
   local fn = load(cmd, nil, nil, env)
   local ss = json.sstream.new()
@@ -1,4 +1,7 @@
-package.path = "./LLib/?.lua;" .. package.path
+-- Scripts that share a Lua state all run this.
+if not package.path:find("./LLib/?.lua;", 1, true) then
+  package.path = "./LLib/?.lua;" .. package.path
+end
 require "Hawck"
 u = require "utils"
 app = require "app"
@@ -34,8 +34,16 @@ local cfg = require "cfg"
 local kbd = {
   keys_held = {},
   map = kbmap.new(cfg.keymap),
+  -- Set while withCleanMods() runs.
+  clean_mods = false,
 }
 
+-- hawck-macrod tracks held keys for all scripts, keys_held is only used
+-- when running outside of it.
+local G = rawget(_G, "__base") or _G
+local native_key_is_down = rawget(G, "__keyIsDown")
+local native_keys_down = rawget(G, "__keysDown")
+
 local meta = {}
 
 -- Values directly from <linux/input-event-codes.h>
@@ -115,6 +123,17 @@ function kbd:press(code)
   udev:flush()
 end
 
+--- Press each of the keys in turn, sent to InputD all at once.
+--
+-- @param ... The keys to press.
+function kbd:pressSequence(...)
+  local codes = {}
+  for i, key in ipairs({...}) do
+    codes[i] = self:getKeysym(key)
+  end
+  udev:emitSequence(codes)
+end
+
 function kbd:from(kbd_hid)
   return self.event_kbd == kbd_hid
 end
@@ -130,7 +149,9 @@ function kbd:prepare(ev_value, ev_code, ev_type, kbd_hid)
     return
   end
 
-  if self.event_value == KeyMode.DOWN then
+  if native_key_is_down then
+    -- Nothing to track.
+  elseif self.event_value == KeyMode.DOWN then
     self.keys_held[self.event_code] = true
   elseif self.event_value == KeyMode.UP then
     self.keys_held[self.event_code] = nil
@@ -162,6 +183,9 @@ end
 -- @param code The key to check for.
 function kbd:keyIsDown(code)
   code = self:getKeysym(code)
+  if native_key_is_down then
+    return (not self.clean_mods and native_key_is_down(code)) or nil
+  end
   return self.keys_held[code]
 end
 
@@ -178,8 +202,10 @@ end
 -- @return nil
 function kbd:withCleanMods(f)
   -- Clear all modifiers by sending key-up events for them
-  local keys_held = self.keys_held
+  local keys_held = native_keys_down and native_keys_down() or self.keys_held
+  local was_clean = self.clean_mods
   self.keys_held = {}
+  self.clean_mods = true
   for code, _ in pairs(keys_held) do
     if self.map:isModifier(code) then
       self:up(code)
@@ -197,7 +223,10 @@ function kbd:withCleanMods(f)
     end
   end
 
-  self.keys_held = keys_held
+  if not native_keys_down then
+    self.keys_held = keys_held
+  end
+  self.clean_mods = was_clean
 
   udev:flush()
 end
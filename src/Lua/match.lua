@@ -26,8 +26,66 @@
 --]====================================================================================]
 
 local u = require "utils"
+local compat = require "compat"
 
-local unpack = table.unpack
+local unpack = compat.unpack
+local band, bor = compat.band, compat.bor
+
+--[[
+  Key constraints.
+
+  Every condition may carry a constraint describing which events it can
+  possibly be true for, MacroD uses these to skip scripts that cannot react
+  to an event. A constraint is a table {any = mask, keys = {[code] = mask}},
+  the condition may be true for an event (code, value) if bit `value` is set
+  in `keys[code] | any`.
+
+  Conditions created without a constraint might have side effects, so any
+  pattern that uses one always has to be evaluated.
+--]]
+KeyMask = {
+  UP = 1,
+  DOWN = 2,
+  REPEAT = 4,
+  ALL = 7,
+}
+
+Constraint = {}
+
+function Constraint.all()
+  return {any = KeyMask.ALL, keys = {}}
+end
+
+function Constraint.none()
+  return {any = 0, keys = {}}
+end
+
+function Constraint.key(code, mask)
+  return {any = 0, keys = {[code] = mask or KeyMask.ALL}}
+end
+
+function Constraint.values(mask)
+  return {any = mask, keys = {}}
+end
+
+local function combine(a, b, op)
+  local keys = {}
+  for code, _ in pairs(a.keys) do
+    keys[code] = op(bor(a.keys[code], a.any), bor(b.keys[code] or 0, b.any))
+  end
+  for code, _ in pairs(b.keys) do
+    keys[code] = op(bor(a.keys[code] or 0, a.any), bor(b.keys[code], b.any))
+  end
+  return {any = op(a.any, b.any), keys = keys}
+end
+
+function Constraint.both(a, b)
+  return combine(a, b, band)
+end
+
+function Constraint.either(a, b)
+  return combine(a, b, bor)
+end
 
 PatternScopeMeta = {
   __call = function (t, ...)
@@ -49,10 +107,13 @@ PatternScopeMeta = {
   end,
 
   __newindex = function (t, pattern, action)
-    if pattern == "prepare" then
-      rawset(t, "prepare", action)
+    if pattern == "prepare" or pattern == "run" then
+      rawset(t, pattern, action)
     else
-      u.append(t.patterns, Pattern.new(pattern, action))
+      if getmetatable(action) == PatternScopeMeta then
+        rawset(action, "parent", t)
+      end
+      u.append(t.patterns, Pattern.new(pattern, action, t))
     end
   end,
 
@@ -71,6 +132,50 @@ MatchScope = {
       fn(scope)
     end
     return scope
+  end,
+
+  --- Compute the constraint of a scope, i.e every event that any of its
+  --  patterns might react to.
+  -- @param scope The scope.
+  -- @param prepare A prepare function that is known to be safe to skip.
+  constraint = function (scope, prepare)
+    local p = rawget(scope, "prepare")
+    if p and p ~= prepare then
+      return Constraint.all()
+    end
+    local c = Constraint.none()
+    for _, patt in ipairs(scope.patterns) do
+      c = Constraint.either(c, Pattern.constraint(patt))
+    end
+    return c
+  end,
+
+  --- Find out whether a scope would run an action for the current event,
+  --  without running it. Only conditions with a constraint are evaluated,
+  --  as any other condition might have side effects.
+  -- @param scope The scope.
+  -- @param prepare A prepare function that has already been run.
+  -- @return Whether the outcome is known, and whether an action would run.
+  test = function (scope, prepare)
+    local p = rawget(scope, "prepare")
+    if p and p ~= prepare then
+      return false, false
+    end
+    for _, patt in ipairs(scope.patterns) do
+      if not Cond.constraint(patt.pattern) then
+        return false, false
+      end
+      if patt.pattern() then
+        if getmetatable(patt.action) ~= PatternScopeMeta then
+          return true, true
+        end
+        local known, matches = MatchScope.test(patt.action)
+        if not known or matches then
+          return known, matches
+        end
+      end
+    end
+    return true, false
   end
 }
 
@@ -134,19 +239,19 @@ CondMeta = {
   __add = function (this, other)
     return Cond.new(function ()
         return this() and other()
-    end)
+    end, Cond.combine(this, other, Constraint.both))
   end,
 
   __div = function (this, other)
     return Cond.new(function ()
         return this() or other()
-    end)
+    end, Cond.combine(this, other, Constraint.either))
   end,
 
   __unm = function (this)
     return Cond.new(function ()
         return not this()
-    end)
+    end, Cond.constraint(this) and Constraint.all())
   end,
 
   __le = function (this, other)
@@ -160,30 +265,69 @@ CondMeta.__bnot = CondMeta.__unm
 CondMeta.__bor = CondMeta.__div
 
 Cond = {
-  new = function (cond)
-    local t = {cond = cond}
+  --- Create a new condition.
+  -- @param cond Function returning whether the condition holds.
+  -- @param constraint Key constraint of the condition, only give one if
+  --                   `cond` has no side effects.
+  new = function (cond, constraint)
+    local t = {cond = cond, constraint = constraint}
     setmetatable(t, CondMeta)
     return t
+  end,
+
+  --- Combine the constraints of two conditions, nil if either of them has
+  --  no constraint.
+  combine = function (a, b, op)
+    local ca, cb = Cond.constraint(a), Cond.constraint(b)
+    if ca and cb then
+      return op(ca, cb)
+    end
+  end,
+
+  constraint = function (c)
+    if getmetatable(c) == CondMeta then
+      return rawget(c, "constraint")
+    end
   end
 }
 
 LazyCondFMeta = {
   __call = function(t, ...)
     local pre = {...}
+    local constraint
+    if t.constrain then
+      constraint = t.constrain(...)
+    end
     return Cond.new(function ()
         return t.cond(unpack(pre))
-    end)
+    end, constraint)
   end
 }
 
 LazyCondF = {
-  new = function (cond)
-    local t = {cond = cond}
+  --- @param cond Function taking the arguments given to the LazyCondF.
+  -- @param constrain Function taking the same arguments, returning the
+  --                  key constraint of the resulting condition.
+  new = function (cond, constrain)
+    local t = {cond = cond, constrain = constrain}
     setmetatable(t, LazyCondFMeta)
     return t
   end
 }
 
+--- Find the function that runs the actions of a scope, scopes without
+--  one of their own use that of the scope they are in. See async.lua
+local function runnerOf(scope)
+  while scope do
+    local run = rawget(scope, "run")
+    if run then
+      return run
+    end
+    scope = rawget(scope, "parent")
+  end
+  return nil
+end
+
 PatternMeta = {
   __call = function (t)
     if t.pattern() then
@@ -191,7 +335,12 @@ PatternMeta = {
       if getmetatable(t.action) == PatternScopeMeta then
         return t.action()
       end
-      t.action()
+      local run = runnerOf(t.scope)
+      if run then
+        run(t.action)
+      else
+        t.action()
+      end
       return true
     end
     return false
@@ -199,13 +348,25 @@ PatternMeta = {
 }
 
 Pattern = {
-  new = function (pattern, action)
+  new = function (pattern, action, scope)
     local t = {
       pattern = pattern,
-      action = action
+      action = action,
+      scope = scope
     }
     setmetatable(t, PatternMeta)
     return t
+  end,
+
+  constraint = function (t)
+    local c = Cond.constraint(t.pattern)
+    if not c then
+      return Constraint.all()
+    end
+    if getmetatable(t.action) == PatternScopeMeta then
+      return Constraint.both(c, MatchScope.constraint(t.action))
+    end
+    return c
   end
 }
 
@@ -0,0 +1,50 @@
+--[====================================================================================[
+   Environments for running several scripts in a single Lua state.
+
+   Libraries without per-script state are loaded once into the real
+   globals, while the modules listed in PER_SCRIPT are loaded again
+   into every environment. Environments fall back on the real globals
+   for everything they do not define themselves.
+--]====================================================================================]
+
+local sandbox = {}
+
+--- Modules that keep state for the script that loaded them.
+local PER_SCRIPT = {
+  init = true,
+  Hawck = true,
+  kbd = true,
+  async = true,
+}
+
+--- Create a new script environment.
+-- @return Table to use as the _ENV of the script.
+function sandbox.new()
+  local env = setmetatable({}, {__index = _G})
+  local loaded = {}
+
+  env._G = env
+  -- Hawck.lua makes the globals of the script strict, it needs to know
+  -- where to look for the shared ones.
+  env.__base = _G
+
+  function env.require(name)
+    if not PER_SCRIPT[name] then
+      return require(name)
+    end
+    if loaded[name] == nil then
+      local path, err = package.searchpath(name, package.path)
+      if not path then
+        error(err)
+      end
+      local chunk = assert(loadfile(path, "t", env))
+      local mod = chunk(name, path)
+      loaded[name] = (mod == nil) and true or mod
+    end
+    return loaded[name]
+  end
+
+  return env
+end
+
+return sandbox
@@ -31,7 +31,7 @@ local indent_str = "  "
 local builtins = {} -- require "builtins"
 local string_byte, string_char, concat = string.byte, string.char, table.concat
 local serialize_recursive
-local unpack = table.unpack
+local unpack = table.unpack or unpack
 
 --- Append to an array
 -- @param t The array to append to.
@@ -114,7 +114,7 @@ function u.hex(i, pad)
   local digits = {}
   while i ~= 0 do
     table.insert(digits, i % 16)
-    i = i // 16
+    i = math.floor(i / 16)
   end
   local str = "x"
   for i = 1, pad - #digits do
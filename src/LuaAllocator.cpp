@@ -0,0 +1,127 @@
+extern "C" {
+    #include <stdlib.h>
+    #include <string.h>
+}
+
+#include <algorithm>
+
+#include "LuaAllocator.hpp"
+
+using namespace std;
+
+namespace Lua {
+    Allocator::~Allocator() {
+        for (void *slab : slabs)
+            free(slab);
+    }
+
+    void *Allocator::poolAlloc(size_t cls) noexcept {
+        FreeBlock *blk = free_lists[cls];
+        if (!blk) {
+            // Carve a new slab up into blocks of this class.
+            size_t bsize = (cls + 1) * class_size;
+            char *slab = (char *) malloc(slab_size);
+            if (!slab)
+                return nullptr;
+            try {
+                slabs.push_back(slab);
+            } catch (const bad_alloc &) {
+                free(slab);
+                return nullptr;
+            }
+            size_t n = slab_size / bsize;
+            for (size_t i = n; i-- > 0;) {
+                FreeBlock *b = (FreeBlock *) (slab + i * bsize);
+                b->next = blk;
+                blk = b;
+            }
+        }
+        free_lists[cls] = blk->next;
+        pool_allocs.fetch_add(1, memory_order_relaxed);
+        return blk;
+    }
+
+    void Allocator::poolFree(void *ptr, size_t cls) noexcept {
+        FreeBlock *blk = (FreeBlock *) ptr;
+        blk->next = free_lists[cls];
+        free_lists[cls] = blk;
+    }
+
+    void *Allocator::allocate(size_t sz) noexcept {
+        allocs.fetch_add(1, memory_order_relaxed);
+        if (sz <= max_pooled)
+            return poolAlloc(sizeClass(sz));
+        return malloc(sz);
+    }
+
+    void Allocator::release(void *ptr, size_t sz) noexcept {
+        frees.fetch_add(1, memory_order_relaxed);
+        if (sz <= max_pooled)
+            poolFree(ptr, sizeClass(sz));
+        else
+            free(ptr);
+    }
+
+    void *Allocator::reallocate(void *ptr, size_t osize, size_t nsize) noexcept {
+        bool o_pooled = osize <= max_pooled, n_pooled = nsize <= max_pooled;
+        if (o_pooled && n_pooled && sizeClass(osize) == sizeClass(nsize))
+            return ptr;
+        // Lua expects shrinking to succeed, if there is no memory for the
+        // smaller block the old one is kept. It is big enough, and once
+        // it is released in the smaller size it joins the pool of that
+        // size, even if it came from malloc().
+        if (!o_pooled && !n_pooled) {
+            void *nptr = realloc(ptr, nsize);
+            return (nptr || nsize > osize) ? nptr : ptr;
+        }
+        void *nptr = allocate(nsize);
+        if (!nptr)
+            return nsize < osize ? ptr : nullptr;
+        memcpy(nptr, ptr, min(osize, nsize));
+        release(ptr, osize);
+        return nptr;
+    }
+
+    void *Allocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize) noexcept {
+        Allocator *self = (Allocator *) ud;
+        // When ptr is NULL, osize is the type of the object.
+        if (!ptr)
+            osize = 0;
+
+        if (nsize == 0) {
+            if (ptr) {
+                self->release(ptr, osize);
+                self->in_use.fetch_sub(osize, memory_order_relaxed);
+            }
+            return nullptr;
+        }
+
+        size_t used = self->in_use.load(memory_order_relaxed) - osize + nsize;
+        size_t max = self->limit.load(memory_order_relaxed);
+        // Only growth counts against the limit, Lua expects shrinking to succeed.
+        if (max && nsize > osize && used > max) {
+            self->failed.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+
+        void *nptr = ptr ? self->reallocate(ptr, osize, nsize) : self->allocate(nsize);
+        if (!nptr)
+            return nullptr;
+        self->in_use.store(used, memory_order_relaxed);
+        if (used > self->peak.load(memory_order_relaxed))
+            self->peak.store(used, memory_order_relaxed);
+        return nptr;
+    }
+
+    AllocStats Allocator::stats() const noexcept {
+        AllocStats st;
+        st.in_use = in_use.load(memory_order_relaxed);
+        st.peak = peak.load(memory_order_relaxed);
+        st.limit = limit.load(memory_order_relaxed);
+        st.allocs = allocs.load(memory_order_relaxed);
+        st.pool_allocs = pool_allocs.load(memory_order_relaxed);
+        st.frees = frees.load(memory_order_relaxed);
+        st.failed = failed.load(memory_order_relaxed);
+        return st;
+    }
+}
@@ -0,0 +1,107 @@
+/** @file LuaAllocator.hpp
+ *
+ * @brief Pooling allocator for Lua states.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stddef.h>
+    #include <stdint.h>
+}
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+namespace Lua {
+    /** Counters kept by Allocator, in bytes where applicable. */
+    struct AllocStats {
+        size_t in_use;
+        size_t peak;
+        size_t limit;
+        uint64_t allocs;
+        uint64_t pool_allocs;
+        uint64_t frees;
+        uint64_t failed;
+    };
+
+    /**
+     * lua_Alloc implementation that serves small blocks out of size-class
+     * pools, and hands everything else to malloc().
+     *
+     * Most of what Lua allocates while handling a key, tables, closures
+     * and short strings, fit in the pools. These never give memory back
+     * to the system, but the blocks are reused by the same state, which
+     * keeps malloc() out of the way of the other states and threads.
+     *
+     * An allocator must only be used by one Lua state, Lua tells the
+     * allocator the size of every block that it frees, so there is no
+     * per-block overhead. The counters can be read from any thread.
+     */
+    class Allocator {
+    public:
+        /** Blocks up to this size come from the pools. */
+        static constexpr size_t max_pooled = 256;
+        static constexpr size_t class_size = 16;
+        static constexpr size_t num_classes = max_pooled / class_size;
+        /** Pools grow by this many bytes at a time. */
+        static constexpr size_t slab_size = 16 * 1024;
+
+    private:
+        struct FreeBlock {
+            FreeBlock *next;
+        };
+
+        std::array<FreeBlock *, num_classes> free_lists {};
+        std::vector<void *> slabs;
+
+        std::atomic<size_t> in_use {0};
+        std::atomic<size_t> peak {0};
+        std::atomic<size_t> limit {0};
+        std::atomic<uint64_t> allocs {0};
+        std::atomic<uint64_t> pool_allocs {0};
+        std::atomic<uint64_t> frees {0};
+        std::atomic<uint64_t> failed {0};
+
+        static inline size_t sizeClass(size_t sz) noexcept {
+            return (sz + class_size - 1) / class_size - 1;
+        }
+
+        void *poolAlloc(size_t cls) noexcept;
+        void poolFree(void *ptr, size_t cls) noexcept;
+        void *allocate(size_t sz) noexcept;
+        void release(void *ptr, size_t sz) noexcept;
+        void *reallocate(void *ptr, size_t osize, size_t nsize) noexcept;
+
+    public:
+        Allocator() = default;
+        Allocator(const Allocator &) = delete;
+        Allocator &operator=(const Allocator &) = delete;
+        ~Allocator();
+
+        /**
+         * The lua_Alloc function, pass it to lua_newstate() with the
+         * allocator as `ud`.
+         */
+        static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize) noexcept;
+
+        /**
+         * Make allocations fail once the state uses more than `bytes` of
+         * memory, Lua will collect garbage and then raise a memory error
+         * in the script. Freeing memory always succeeds.
+         *
+         * @param bytes The limit, 0 for no limit.
+         */
+        inline void setLimit(size_t bytes) noexcept {
+            limit.store(bytes, std::memory_order_relaxed);
+        }
+
+        AllocStats stats() const noexcept;
+
+        /** Number of allocations that failed because of the limit. */
+        inline uint64_t numFailed() const noexcept {
+            return failed.load(std::memory_order_relaxed);
+        }
+    };
+}
@@ -0,0 +1,73 @@
+/** @file LuaCompat.hpp
+ *
+ * @brief The parts of the Lua 5.3 C API that Hawck uses, for LuaJIT.
+ *
+ * LuaJIT implements the Lua 5.1 API plus a few functions from 5.2, this
+ * fills in the rest of what LuaUtils uses. Functions that exist in 5.1
+ * but whose results changed, like lua_rawgeti() returning the type of the
+ * value, are replaced with macros. Include this after the Lua headers, it
+ * does nothing when built against Lua 5.3.
+ */
+
+#pragma once
+
+#if LUA_VERSION_NUM < 502
+
+extern "C" {
+    #include <luajit.h>
+}
+
+/** Name of the Lua implementation, for compiled chunks in the script
+ *  cache and for benchmark results. */
+#define HAWCK_LUA_RELEASE LUAJIT_VERSION
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+inline int lua_absindex(lua_State *L, int idx) noexcept {
+    return (idx > 0 || idx <= LUA_REGISTRYINDEX) ? idx : lua_gettop(L) + idx + 1;
+}
+
+inline size_t lua_rawlen(lua_State *L, int idx) noexcept {
+    return lua_objlen(L, idx);
+}
+
+inline int lua_rawgetp(lua_State *L, int idx, const void *p) noexcept {
+    idx = lua_absindex(L, idx);
+    lua_pushlightuserdata(L, const_cast<void *>(p));
+    lua_rawget(L, idx);
+    return lua_type(L, -1);
+}
+
+inline void lua_rawsetp(lua_State *L, int idx, const void *p) noexcept {
+    idx = lua_absindex(L, idx);
+    lua_pushlightuserdata(L, const_cast<void *>(p));
+    lua_insert(L, -2);
+    lua_rawset(L, idx);
+}
+
+/** Userdata have environment tables instead of user values in 5.1. */
+inline int lua_getuservalue(lua_State *L, int idx) noexcept {
+    lua_getfenv(L, idx);
+    return lua_type(L, -1);
+}
+
+inline int hawck_compat_rawgeti(lua_State *L, int idx, int n) noexcept {
+    lua_rawgeti(L, idx, n);
+    return lua_type(L, -1);
+}
+#define lua_rawgeti hawck_compat_rawgeti
+
+/** LuaJIT cannot strip dumped chunks through the C API, they keep their
+ *  debug information. */
+inline int hawck_compat_dump(lua_State *L, lua_Writer writer, void *data, int) noexcept {
+    return lua_dump(L, writer, data);
+}
+#define lua_dump hawck_compat_dump
+
+#else
+
+#define HAWCK_LUA_RELEASE LUA_RELEASE
+
+#endif
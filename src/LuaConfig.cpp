@@ -1,5 +1,10 @@
 extern "C" {
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <stdio.h>
+    #include <string.h>
     #include <syslog.h>
+    #include <unistd.h>
 }
 
 #include "LuaConfig.hpp"
@@ -19,24 +24,111 @@ LuaConfig::LuaConfig(const std::string& fifo_path,
     ChDir cd(xdg.path(XDG_DATA_HOME, "scripts", "LLib"));
     lua.from("./config.lua");
     lua.call("loadConfig", luacfg_path);
+
+    lua_State *L = lua.getL();
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, LuaConfig::luaQuery, 1);
+    lua_setglobal(L, "__query");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, LuaConfig::luaOptionChanged, 1);
+    lua_setglobal(L, "__optionChanged");
+
+    flusher = thread([this]() { flushLoop(); });
+}
+
+LuaConfig::~LuaConfig() {
+    {
+        lock_guard<mutex> lock(lua_mtx);
+        stopping = true;
+    }
+    flush_cv.notify_all();
+    flusher.join();
+}
+
+int LuaConfig::luaOptionChanged(lua_State *L) {
+    auto *self = (LuaConfig *) lua_touserdata(L, lua_upvalueindex(1));
+    self->changed.insert(luaL_checkstring(L, 1));
+    return 0;
+}
+
+void LuaConfig::flushLoop() {
+    unique_lock<mutex> lock(lua_mtx);
+    for (;;) {
+        flush_cv.wait(lock, [this]() { return dirty || stopping; });
+        // Every change pushes the deadline further back.
+        while (dirty && !stopping && chrono::steady_clock::now() < last_change + flush_delay)
+            flush_cv.wait_until(lock, last_change + flush_delay);
+        if (dirty)
+            save();
+        if (stopping)
+            return;
+    }
+}
+
+void LuaConfig::save() {
+    dirty = false;
+    string tmp_path = luacfg_path + ".tmp";
+    try {
+        lua.call("dumpConfig", tmp_path);
+    } catch (const LuaError& e) {
+        syslog(LOG_ERR, "Unable to write config: %s", e.what());
+        return;
+    }
+
+    int fd = ::open(tmp_path.c_str(), O_RDONLY);
+    if (fd == -1 || ::fsync(fd) == -1) {
+        syslog(LOG_ERR, "Unable to sync config %s: %s", tmp_path.c_str(), strerror(errno));
+    } else if (::rename(tmp_path.c_str(), luacfg_path.c_str()) == -1) {
+        syslog(LOG_ERR, "Unable to replace config %s: %s", luacfg_path.c_str(), strerror(errno));
+    }
+    if (fd != -1)
+        ::close(fd);
+}
+
+int LuaConfig::luaQuery(lua_State *L) {
+    auto *self = (LuaConfig *) lua_touserdata(L, lua_upvalueindex(1));
+    const char *name = luaL_checkstring(L, 1);
+    auto it = self->queries.find(name);
+    if (it == self->queries.end()) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "No such query: %s", name);
+        return 2;
+    }
+
+    StatsTable tbl = it->second();
+    lua_createtable(L, 0, tbl.size());
+    for (const auto &[row_name, row] : tbl) {
+        lua_createtable(L, 0, row.size());
+        for (const auto &[field, val] : row) {
+            lua_pushnumber(L, val);
+            lua_setfield(L, -2, field.c_str());
+        }
+        lua_setfield(L, -2, row_name.c_str());
+    }
+    return 1;
 }
 
 std::string LuaConfig::handleMessage(const char *msg, size_t) {
+    string json;
+    lock_guard<mutex> lock(lua_mtx);
+    changed.clear();
     try {
-        auto [json] = lua.call<string>("exec", msg);
-        auto [changes] = lua.call<vector<string>>("getChanged");
-        lua.call("dumpConfig", luacfg_path);
-        for (const auto& name : changes)
-            try {
-                if (option_setters.find(name) != option_setters.end())
-                    option_setters[name]();
-            } catch (const LuaError& e) {
-                syslog(LOG_ERR, "Unable to get option %s: %s", name.c_str(), e.what());
-            }
-        return json;
+        tie(json) = lua.call<string>("exec", msg);
     } catch (const LuaError& e) {
+        // Options set before the error still need to be applied.
         syslog(LOG_ERR, "Lua error: %s", e.what());
     }
 
-    return "";
+    if (changed.empty())
+        return json;
+
+    for (const auto& name : changed) {
+        auto it = option_setters.find(name);
+        if (it != option_setters.end())
+            it->second();
+    }
+    dirty = true;
+    last_change = chrono::steady_clock::now();
+    flush_cv.notify_all();
+    return json;
 }
@@ -6,20 +6,62 @@ extern "C" {
 
 #include "LuaUtils.hpp"
 #include "FIFOWatcher.hpp"
+#include "Latency.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 class LuaConfig : public FIFOWatcher {
 private:
     Lua::Script lua;
     std::unordered_map<std::string, std::function<void()>> option_setters;
+    std::unordered_map<std::string, std::function<StatsTable()>> queries;
     std::string luacfg_path;
 
+    /** Guards lua and the state below, which is shared with the flusher. */
+    std::mutex lua_mtx;
+    /** Options that were assigned a new value by the current message. */
+    std::unordered_set<std::string> changed;
+    /** Whether there are changes that have not been written to luacfg_path */
+    bool dirty = false;
+    bool stopping = false;
+    std::chrono::steady_clock::time_point last_change;
+    std::condition_variable flush_cv;
+    std::thread flusher;
+
+    /** How long the configuration has to stay unchanged before it is
+     *  written, so that e.g dragging a slider results in a single write. */
+    static constexpr std::chrono::milliseconds flush_delay{750};
+
+    /** Implementation of query(name) inside config.lua's exec() environment. */
+    static int luaQuery(lua_State *L);
+
+    /** Called by config.lua each time an option is given a new value. */
+    static int luaOptionChanged(lua_State *L);
+
+    /** Write out pending changes once they have settled. */
+    void flushLoop();
+
+    /**
+     * Write the configuration to a temporary file, sync it and rename it
+     * over luacfg_path, so that a crash never leaves a truncated config.
+     *
+     * Must be called with lua_mtx held.
+     */
+    void save();
+
 public:
 
     explicit LuaConfig(const std::string& fifo_path,
                        const std::string& ofifo_path,
                        const std::string& luacfg_path);
 
+    /** Writes out changes that are still pending. */
+    virtual ~LuaConfig();
+
     template <class T>
     void addOption(const std::string& name, std::atomic<T> *val) {
         addOption<T>(name, [val](T got) {*val = got;});
@@ -38,6 +80,23 @@ public:
                                };
     }
 
-    /** Handle the raw Lua code */
+    /**
+     * Register a named query, the result can be requested over the FIFO
+     * with `return query("name")`.
+     *
+     * Must be called before start(), the callback is run from the FIFO
+     * thread.
+     */
+    inline void addQuery(const std::string& name,
+                         const std::function<StatsTable()> &callback) {
+        queries[name] = callback;
+    }
+
+    /**
+     * Handle the raw Lua code.
+     *
+     * Only the setters of options whose values changed are run, and the
+     * configuration is written out later by the flusher thread.
+     */
     virtual std::string handleMessage(const char *msg, size_t sz) override;
 };
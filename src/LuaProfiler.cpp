@@ -0,0 +1,127 @@
+extern "C" {
+    #include <string.h>
+}
+
+#include "LuaProfiler.hpp"
+
+using namespace std;
+
+namespace Lua {
+    static const char *baseName(const char *path) noexcept {
+        const char *slash = strrchr(path, '/');
+        return slash ? slash + 1 : path;
+    }
+
+    Profiler::Entry &Profiler::entry(unordered_map<string, Entry> &tbl,
+                                     const char *src, int line)
+    {
+        key.assign(baseName(src));
+        key += ':';
+        key += to_string(line);
+        auto it = tbl.find(key);
+        if (it == tbl.end())
+            it = tbl.emplace(key, Entry()).first;
+        return it->second;
+    }
+
+    void Profiler::begin(const string *path) noexcept {
+        script = path;
+        script_name = baseName(path->c_str());
+        call_start = last_sample = monotonicNanos();
+        call_samples = 0;
+    }
+
+    void Profiler::sample(lua_State *L) noexcept {
+        if (!script)
+            return;
+        uint64_t now = monotonicNanos();
+        uint64_t dt = now - last_sample;
+        last_sample = now;
+        call_samples++;
+
+        size_t name_len = strlen(script_name);
+        bool have_line = false;
+        lua_Debug ar;
+        try {
+            lock_guard<mutex> lock(mtx);
+            for (int lv = 0; lv < max_depth && lua_getstack(L, lv, &ar); lv++) {
+                lua_getinfo(L, "Sl", &ar);
+                // C functions
+                if (ar.currentline < 0)
+                    continue;
+                if (!have_line) {
+                    Entry &ent = entry(lines, ar.short_src, ar.currentline);
+                    ent.samples++;
+                    ent.nanos += dt;
+                    have_line = true;
+                }
+                size_t len = strlen(ar.source);
+                if (ar.source[0] == '@' && len > name_len &&
+                    !strcmp(ar.source + len - name_len, script_name) &&
+                    (ar.source[len - name_len - 1] == '/' || len - name_len == 1))
+                {
+                    Entry &ent = entry(patterns, ar.short_src, ar.currentline);
+                    ent.samples++;
+                    ent.nanos += dt;
+                    break;
+                }
+            }
+        } catch (const bad_alloc &) {
+            // Losing a sample is better than losing the key.
+        }
+    }
+
+    void Profiler::end() noexcept {
+        if (!script)
+            return;
+        try {
+            lock_guard<mutex> lock(mtx);
+            Entry &ent = scripts[*script];
+            ent.calls++;
+            ent.samples += call_samples;
+            ent.nanos += monotonicNanos() - call_start;
+        } catch (const bad_alloc &) {}
+        script = nullptr;
+    }
+
+    void Profiler::clear() noexcept {
+        lock_guard<mutex> lock(mtx);
+        scripts.clear();
+        patterns.clear();
+        lines.clear();
+    }
+
+    StatsTable Profiler::table(const unordered_map<string, Entry> &tbl) {
+        StatsTable out;
+        for (const auto &[name, ent] : tbl) {
+            auto &row = out[name];
+            row["samples"] = double(ent.samples);
+            row["total_ms"] = double(ent.nanos) / 1e6;
+            if (ent.calls) {
+                row["calls"] = double(ent.calls);
+                row["mean_us"] = double(ent.nanos) / double(ent.calls) / 1e3;
+            }
+        }
+        return out;
+    }
+
+    StatsTable Profiler::scriptTable() {
+        lock_guard<mutex> lock(mtx);
+        StatsTable out = table(scripts);
+        // The scripts are keyed by their full path, show just the name.
+        StatsTable named;
+        for (auto &[path, row] : out)
+            named[baseName(path.c_str())] = std::move(row);
+        return named;
+    }
+
+    StatsTable Profiler::patternTable() {
+        lock_guard<mutex> lock(mtx);
+        return table(patterns);
+    }
+
+    StatsTable Profiler::lineTable() {
+        lock_guard<mutex> lock(mtx);
+        return table(lines);
+    }
+}
@@ -0,0 +1,88 @@
+/** @file LuaProfiler.hpp
+ *
+ * @brief Sampling profiler for Lua scripts.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <lua.h>
+    #include <stdint.h>
+}
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "Latency.hpp"
+
+namespace Lua {
+    /**
+     * Attributes the time spent in Script::call() to scripts, patterns and
+     * source lines.
+     *
+     * The time of each call is measured exactly, and split up between
+     * the places where the count hook of the call found the script, every
+     * sample_instructions instructions. A pattern is the line of the
+     * script itself that was running, below any library code it called,
+     * and a line is where the innermost Lua function was.
+     *
+     * Calls are made from a single thread, the tables can be read from
+     * any thread.
+     */
+    class Profiler {
+    public:
+        /** Instructions between samples. */
+        static constexpr int sample_instructions = 1000;
+        /** Frames looked at to find the pattern of a sample. */
+        static constexpr int max_depth = 32;
+
+    private:
+        struct Entry {
+            uint64_t calls = 0;
+            uint64_t samples = 0;
+            uint64_t nanos = 0;
+        };
+
+        std::mutex mtx;
+        std::unordered_map<std::string, Entry> scripts;
+        std::unordered_map<std::string, Entry> patterns;
+        std::unordered_map<std::string, Entry> lines;
+
+        /** Path of the script being called and its basename. */
+        const std::string *script = nullptr;
+        const char *script_name = nullptr;
+        uint64_t call_start = 0;
+        uint64_t call_samples = 0;
+        uint64_t last_sample = 0;
+        /** Reused for looking up entries. */
+        std::string key;
+
+        Entry &entry(std::unordered_map<std::string, Entry> &tbl,
+                     const char *src, int line);
+
+        static StatsTable table(const std::unordered_map<std::string, Entry> &tbl);
+
+    public:
+        /** A call of a script started, `path` must outlive it. */
+        void begin(const std::string *path) noexcept;
+
+        /** Take a sample from inside the call, see lua_Hook. */
+        void sample(lua_State *L) noexcept;
+
+        /** The call that was started by begin() returned. */
+        void end() noexcept;
+
+        /** Throw away everything recorded so far. */
+        void clear() noexcept;
+
+        /** Calls, samples and time spent by each script. */
+        StatsTable scriptTable();
+
+        /** Samples and time spent by each line of the scripts. */
+        StatsTable patternTable();
+
+        /** Samples and time spent by each line of Lua code. */
+        StatsTable lineTable();
+    };
+}
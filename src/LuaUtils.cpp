@@ -30,6 +30,7 @@
 
 extern "C" {
     #include <unistd.h>
+    #include <syslog.h>
 }
 
 #include "LuaUtils.hpp"
@@ -114,42 +115,168 @@ namespace Lua {
         if (src.size() == 0)
             throw Lua::LuaError("No path given");
 
-        auto L = unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(),
-                                                             &lua_close);
-        this->L = L.get();
-        luaL_openlibs(L.get());
+        newState();
+        try {
+            from(path);
+        } catch (...) {
+            lua_close(L);
+            throw;
+        }
+    }
 
-        from(path);
+    Script::Script() {
+        newState();
+    }
 
-        L.release();
+    extern "C" int hwk_lua_panic(lua_State *L) noexcept {
+        const char *msg = lua_tostring(L, -1);
+        fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+                msg ? msg : "error object is not a string");
+        return 0;
     }
 
-    Script::Script() {
-        L = luaL_newstate();
+    void Script::newState() {
+        if (!allocator)
+            allocator = mkuniq(new Allocator());
+        L = lua_newstate(Allocator::alloc, allocator.get());
+#ifdef LUAJIT_VERSION
+        // LuaJIT on x86-64 without GC64 only runs with its own allocator,
+        // getAllocator() then returns nullptr.
+        if (!L) {
+            static bool had_allocator_warning = false;
+            if (!had_allocator_warning) {
+                syslog(LOG_WARNING, "LuaJIT does not support a custom allocator, "
+                                    "memory limits are not enforced");
+                had_allocator_warning = true;
+            }
+            L = luaL_newstate();
+        }
+#endif
+        if (!L)
+            throw Lua::LuaError("Unable to create Lua state");
+        // Same as luaL_newstate() does.
+        lua_atpanic(L, hwk_lua_panic);
         luaL_openlibs(L);
     }
 
+    Allocator *Script::getAllocator() noexcept {
+        void *ud;
+        if (lua_getallocf(L, &ud) != Allocator::alloc)
+            return nullptr;
+        return (Allocator *) ud;
+    }
+
+    Script::Script(Script *host) : L(host->getL()), owns_state(false) {
+        newEnv();
+    }
+
+    void Script::newEnv() {
+        lua_getglobal(L, "require");
+        lua_pushstring(L, "sandbox");
+        if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+            string err(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            throw Lua::LuaError(err);
+        }
+        lua_getfield(L, -1, "new");
+        lua_remove(L, -2);
+        if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+            string err(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            throw Lua::LuaError(err);
+        }
+        env_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    void Script::setEnv() noexcept {
+        if (env_ref == LUA_NOREF)
+            return;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, env_ref);
+#if LUA_VERSION_NUM < 502
+        // Lua 5.1 has function environments instead of _ENV.
+        lua_setfenv(L, -2);
+#else
+        // The first upvalue of a main chunk is always _ENV.
+        if (!lua_setupvalue(L, -2, 1))
+            lua_pop(L, 1);
+#endif
+    }
+
+    void Script::getGlobal(const char *name) {
+        if (env_ref == LUA_NOREF) {
+            lua_getglobal(L, name);
+            return;
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, env_ref);
+        lua_getfield(L, -1, name);
+        lua_remove(L, -2);
+    }
+
+    void Script::setGlobal(const char *name) {
+        if (env_ref == LUA_NOREF) {
+            lua_setglobal(L, name);
+            return;
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, env_ref);
+        lua_insert(L, -2);
+        lua_setfield(L, -2, name);
+        lua_pop(L, 1);
+    }
+
     void Script::from(const std::string& path) {
         if (luaL_loadfile(L, path.c_str()) != LUA_OK) {
             string err(lua_tostring(L, -1));
             throw Lua::LuaError(err);
         }
+        setEnv();
+        clearPrepared();
         if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
             string err(lua_tostring(L, -1));
             throw Lua::LuaError(err);
         }
     }
 
+    void Script::clearPrepared() noexcept {
+        for (auto &[_, ref] : prepared) {
+            (void) _;
+            luaL_unref(L, LUA_REGISTRYINDEX, ref);
+            ref = LUA_NOREF;
+        }
+    }
+
+    void Script::pushPrepared(size_t slot) {
+        auto &[name, ref] = prepared[slot];
+        if (ref == LUA_NOREF) {
+            getGlobal(name.c_str());
+            if (!isCallable(L, -1)) {
+                lua_pop(L, 1);
+                throw LuaError("Unable to retrieve " + name +
+                               " function from Lua state");
+            }
+            ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    }
+
     void Script::reset() {
+        clearPrepared();
+        if (!owns_state) {
+            luaL_unref(L, LUA_REGISTRYINDEX, env_ref);
+            env_ref = LUA_NOREF;
+            newEnv();
+            return;
+        }
         lua_close(L);
-        auto L = unique_ptr<lua_State, decltype(&lua_close)>(luaL_newstate(), &lua_close);
-        this->L = L.get();
-        luaL_openlibs(L.get());
-        L.release();
+        newState();
     }
 
     Script::~Script() noexcept {
-        lua_close(L);
+        if (owns_state)
+            lua_close(L);
+        else {
+            clearPrepared();
+            luaL_unref(L, LUA_REGISTRYINDEX, env_ref);
+        }
     }
 
     lua_State *Script::getL() noexcept {
@@ -170,28 +297,99 @@ namespace Lua {
             string err(lua_tostring(L, -1));
             throw Lua::LuaError(reformat(err));
         }
+        setEnv();
+        clearPrepared();
         if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
             string err(lua_tostring(L, -1));
             throw Lua::LuaError(reformat(err));
         }
     }
 
-    std::mutex TimeoutHook::script_end_times_mtx;
-    std::unordered_map<uintptr_t, milliseconds> TimeoutHook::script_end_times;
+    static int writeChunk(lua_State *, const void *p, size_t sz, void *ud) {
+        static_cast<string *>(ud)->append(static_cast<const char *>(p), sz);
+        return 0;
+    }
+
+    std::string Script::compile(const std::string &chunkname, const std::string &str) {
+        if (luaL_loadbufferx(L, str.data(), str.size(), chunkname.c_str(), "t") != LUA_OK) {
+            string err(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            throw Lua::LuaError(err);
+        }
+        string chunk;
+        lua_dump(L, writeChunk, &chunk, 0);
+        lua_pop(L, 1);
+        return chunk;
+    }
+
+    bool Script::execBinary(const std::string &chunkname, const std::string &chunk) {
+        if (luaL_loadbufferx(L, chunk.data(), chunk.size(), chunkname.c_str(), "b") != LUA_OK) {
+            lua_pop(L, 1);
+            return false;
+        }
+        setEnv();
+        clearPrepared();
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+            string err(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            throw Lua::LuaError(err);
+        }
+        return true;
+    }
+
+    void GCPolicy::update(const std::map<std::string, int> &tbl) noexcept {
+        for (const auto &[key, val] : tbl) {
+            if (key == "pause")
+                pause = val;
+            else if (key == "stepmul")
+                stepmul = val;
+            else if (key == "step_kb")
+                step_kb = val;
+            else if (key == "manual")
+                mode = val ? MANUAL : (mode == MANUAL ? INCREMENTAL : mode);
+            else if (key == "generational")
+                mode = val ? GENERATIONAL : (mode == GENERATIONAL ? INCREMENTAL : mode);
+        }
+    }
+
+    bool Script::setGCPolicy(const GCPolicy &policy) noexcept {
+        bool supported = true;
+        if (policy.mode == GCPolicy::MANUAL)
+            lua_gc(L, LUA_GCSTOP, 0);
+        else
+            lua_gc(L, LUA_GCRESTART, 0);
+#if defined(LUA_GCGEN)
+        if (policy.mode == GCPolicy::GENERATIONAL)
+            lua_gc(L, LUA_GCGEN, 0, 0);
+        else
+            lua_gc(L, LUA_GCINC, policy.pause, policy.stepmul, 0);
+#else
+        supported = policy.mode != GCPolicy::GENERATIONAL;
+        lua_gc(L, LUA_GCSETPAUSE, policy.pause);
+        lua_gc(L, LUA_GCSETSTEPMUL, policy.stepmul);
+#endif
+        return supported;
+    }
+
+    thread_local TimeoutHook *TimeoutHook::current = nullptr;
 
-    TimeoutHook::TimeoutHook(lua_State *L, milliseconds time)
-        : Hook(L, lua_timeout_hook, TimeoutHook::NUM_INST)
+    TimeoutHook::TimeoutHook(lua_State *L, milliseconds time,
+                             const string *script, Profiler *profiler)
+        : Hook(L, lua_timeout_hook,
+               profiler ? Profiler::sample_instructions : TimeoutHook::NUM_INST),
+          prev(current),
+          deadline(steady_clock::now() + time),
+          profiler(script ? profiler : nullptr)
     {
-        lock_guard<mutex> lock(script_end_times_mtx);
-        milliseconds ms = duration_cast<milliseconds>(
-            system_clock::now().time_since_epoch()
-        );
-        script_end_times[reinterpret_cast<uintptr_t>(L)] = ms + time;
+        current = this;
+        if (this->profiler)
+            this->profiler->begin(script);
     }
 
     TimeoutHook::~TimeoutHook() {
-        lock_guard<mutex> lock(script_end_times_mtx);
-        script_end_times.erase(reinterpret_cast<uintptr_t>(L));
+        if (profiler)
+            profiler->end();
+        current = prev;
     }
 
 #define MK_LUA_ERROR_HOOK(_name, _msg)                                  \
@@ -208,12 +406,11 @@ namespace Lua {
     extern "C" void lua_timeout_hook(lua_State *L, lua_Debug *ar) noexcept
     {
         (void) ar;
-        lock_guard<mutex> lock(TimeoutHook::script_end_times_mtx);
-        milliseconds end_time = TimeoutHook::script_end_times[reinterpret_cast<uintptr_t>(L)];
-        milliseconds now = duration_cast<milliseconds>(
-            system_clock::now().time_since_epoch()
-        );
-        if (now > end_time) {
+        TimeoutHook *hook = TimeoutHook::current;
+        if (hook && hook->profiler)
+            hook->profiler->sample(L);
+        if (hook && steady_clock::now() > hook->deadline) {
+            hook->expired = true;
             lua_sethook(L, NULL, 0, 0);
             lua_sethook(L, lua_timeout_error_hook, LUA_MASKCOUNT, 1);
         }
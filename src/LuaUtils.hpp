@@ -42,6 +42,7 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <unordered_map>
 #include <atomic>
 #include <iostream>
@@ -54,6 +55,8 @@
 #include <vector>
 
 #include "utils.hpp"
+#include "LuaAllocator.hpp"
+#include "LuaProfiler.hpp"
 
 extern "C" {
     #include <lua.h>
@@ -62,6 +65,8 @@ extern "C" {
     #include <libgen.h>
 }
 
+#include "LuaCompat.hpp"
+
 extern "C" {
     #undef _GNU_SOURCE
     #include <string.h>
@@ -460,21 +465,53 @@ namespace Lua {
          */
         std::vector<T> get(lua_State *L, int idx) {
             std::vector<T> vec;
-            lua_pushvalue(L, idx);
-            if (!lua_istable(L, -1))
+            // The stack is left as it was, as arguments and results are
+            // retrieved by their position relative to the top.
+            int tbl = lua_absindex(L, idx);
+            if (!lua_istable(L, tbl))
                 throw LuaError("Expected a table");
             for (int i = 1;; i++) {
                 lua_pushinteger(L, i);
-                lua_gettable(L, -2);
-                if (lua_isnil(L, -1))
+                lua_gettable(L, tbl);
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
                     break;
-                vec.push_back(LuaValue<T>().get(L, -1));
+                }
+                try {
+                    vec.push_back(LuaValue<T>().get(L, -1));
+                } catch (const LuaError &) {
+                    lua_pop(L, 1);
+                    throw;
+                }
                 lua_pop(L, 1);
             }
             return vec;
         }
     };
 
+    /** Lua tables with string keys, entries with other keys are skipped. */
+    template <class T> struct LuaValue<std::map<std::string, T>> {
+        /** Retrieve a table from the Lua state.
+         *
+         * @param L Lua state.
+         * @param idx The index of the table on the stack.
+         */
+        std::map<std::string, T> get(lua_State *L, int idx) {
+            std::map<std::string, T> map;
+            if (!lua_istable(L, idx))
+                throw LuaError("Expected a table");
+            lua_pushvalue(L, idx);
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                if (lua_type(L, -2) == LUA_TSTRING)
+                    map[lua_tostring(L, -2)] = LuaValue<T>().get(L, -1);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            return map;
+        }
+    };
+
     struct UncheckedLuaPtr;
 
     /**
@@ -649,6 +686,37 @@ namespace Lua {
         return 1;
     }
 
+    /**
+     * String that is pushed through a cache in the registry of each Lua
+     * state, so that passing it to Lua does not create a new string every
+     * time. The string behind a number must never change.
+     */
+    struct InternedString {
+        /** Key in the cache, must be a positive integer. */
+        int num;
+        const std::string *str;
+    };
+
+    /** Registry key of the InternedString cache. */
+    inline const char interned_strings_key = 0;
+
+    inline int luaPush(lua_State *L, InternedString s) noexcept {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &interned_strings_key) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &interned_strings_key);
+        }
+        if (lua_rawgeti(L, -1, s.num) != LUA_TSTRING) {
+            lua_pop(L, 1);
+            lua_pushlstring(L, s.str->c_str(), s.str->length());
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, s.num);
+        }
+        lua_remove(L, -2);
+        return 1;
+    }
+
     inline int luaPush(lua_State *L, const void *ptr) noexcept {
         if (ptr == nullptr)
             lua_pushnil(L);
@@ -729,6 +797,25 @@ namespace Lua {
             return lua_type(L, idx) == LUA_TBOOLEAN;
         }
 
+        /** Arrays, the elements are checked as well so that retrieving
+         *  them cannot fail. */
+        template <class E>
+        inline bool checkLuaType(int idx, const std::vector<E> &) noexcept {
+            if (lua_type(L, idx) != LUA_TTABLE)
+                return false;
+            int tbl = lua_absindex(L, idx);
+            size_t len = lua_rawlen(L, tbl);
+            for (size_t i = 1; i <= len; i++) {
+                int top = -1;
+                lua_rawgeti(L, tbl, i);
+                bool ok = checkLuaType(top, E());
+                lua_pop(L, 1);
+                if (!ok)
+                    return false;
+            }
+            return true;
+        }
+
         static inline constexpr int varargLength() noexcept {
             return 0;
         }
@@ -784,6 +871,8 @@ namespace Lua {
         const std::string typeString(int          ) noexcept { return "number";  }
         const std::string typeString(float        ) noexcept { return "number";  }
         const std::string typeString(bool         ) noexcept { return "boolean"; }
+        template <class E>
+        const std::string typeString(std::vector<E>) noexcept { return "table";   }
         template <class P>
         const std::string typeString(P *          ) noexcept {
             if constexpr (std::is_base_of<LuaIface<P>, P>::value)
@@ -1074,15 +1163,76 @@ namespace Lua {
 
     extern "C" void lua_timeout_hook(lua_State *L, lua_Debug *ar) noexcept;
 
+    /**
+     * Raise "Timeout Error" in the Lua state once the hook has been alive
+     * for longer than its time limit. The clock is only checked every
+     * NUM_INST instructions, so the limit is not exact.
+     *
+     * With a profiler the hook runs more often, and takes a sample of the
+     * script every time.
+     */
     class TimeoutHook : public Hook {
+    private:
+        /** Innermost hook on this thread, coroutines of the state run
+         *  on it as well, but with their own lua_State. */
+        static thread_local TimeoutHook *current;
+        TimeoutHook *prev;
+        steady_clock::time_point deadline;
+        Profiler *profiler;
+        bool expired = false;
+
+        friend void lua_timeout_hook(lua_State *L, lua_Debug *ar) noexcept;
+
     public:
-        static std::mutex script_end_times_mtx;
-        static std::unordered_map<uintptr_t, milliseconds> script_end_times;
         static const int NUM_INST = 16384;
 
-        TimeoutHook(lua_State *L, milliseconds time);
+        /**
+         * @param script Path of the script, for the profiler.
+         * @param profiler Profiler to record the call in, may be nullptr.
+         */
+        TimeoutHook(lua_State *L, milliseconds time,
+                    const std::string *script = nullptr,
+                    Profiler *profiler = nullptr);
 
         virtual ~TimeoutHook();
+
+        /** Whether the time limit was reached. */
+        inline bool hasExpired() const noexcept {
+            return expired;
+        }
+    };
+
+    /** Thrown by Script::call() when the call ran out of time. */
+    class LuaTimeoutError : public LuaError {
+    public:
+        explicit LuaTimeoutError(const LuaError &err) : LuaError(err) {}
+    };
+
+    /** How the garbage collector of a Lua state is run, see
+     *  Script::setGCPolicy() */
+    struct GCPolicy {
+        enum Mode {
+            INCREMENTAL,
+            /** Only available with Lua 5.4 and later. */
+            GENERATIONAL,
+            /** Automatic collection is stopped, the owner of the state
+             *  has to call Script::gcStep() */
+            MANUAL,
+        };
+
+        Mode mode = INCREMENTAL;
+        /** The pause and step multiplier of the incremental collector,
+         *  in percent. In manual mode the pause decides when another
+         *  cycle is due. */
+        int pause = 200;
+        int stepmul = 200;
+        /** Work done in each manual step, in KiB. */
+        int step_kb = 16;
+
+        /** Update the fields present in `tbl`, with the keys "pause",
+         *  "stepmul", "step_kb", and "manual" or "generational" set to 1
+         *  to pick a mode. */
+        void update(const std::map<std::string, int> &tbl) noexcept;
     };
 
     /** C++ bindings to make the Lua API easier to deal with.
@@ -1093,11 +1243,92 @@ namespace Lua {
         bool enabled = true;
         long max_run_time_ms = 2000;
         int max_instructions = 16384;
-        milliseconds SCRIPT_TIMEOUT = 2000ms;
+        milliseconds timeout = 2000ms;
+        Profiler *profiler = nullptr;
+        /** Registry reference to the environment of the script when it
+         *  shares its Lua state, see Script(Script *). */
+        int env_ref = LUA_NOREF;
+        bool owns_state = true;
+        /** Allocator of the Lua state, unless it is owned by a host. */
+        std::unique_ptr<Allocator> allocator;
+
+        /** Create a Lua state with its own allocator. */
+        void newState();
+
+        /** Create a fresh environment with sandbox.lua */
+        void newEnv();
+
+        /** Make the environment of the script the _ENV of the chunk on
+         *  top of the stack. */
+        void setEnv() noexcept;
+
+        /** Push a global variable of the script. */
+        void getGlobal(const char *name);
+
+        /** Pop a value into a global variable of the script. */
+        void setGlobal(const char *name);
+
+        /** Functions resolved for Prepared calls, by name, with their
+         *  registry references. The references are LUA_NOREF until the
+         *  first call, and again after loading code into the script. */
+        std::vector<std::pair<std::string, int>> prepared;
+
+        /** Forget the resolved functions of prepared calls. */
+        void clearPrepared() noexcept;
+
+        /** Push the function of a prepared call, resolving it if needed. */
+        void pushPrepared(size_t slot);
+
+        /** Call the function below `nargs` arguments on the stack, which
+         *  has hwk_lua_error_handler_callback below it. */
+        template <class... T>
+        std::tuple<T...> pcall(const TimeoutHook &hook, int nargs) {
+            constexpr int nres = countT<T...>();
+            // -2-nargs is the position of hwk_lua_error_handler_callback
+            // on the Lua stack.
+            if (lua_pcall(L, nargs, nres, -2-nargs) != LUA_OK) {
+                // Here be dragons
+                auto exc = std::unique_ptr<LuaError>(
+                    static_cast<LuaError*>(lua_touserdata(L, -1)));
+                if (!exc)
+                    throw LuaError("Unknown error");
+                LuaError err = *exc;
+                if (hook.hasExpired())
+                    throw LuaTimeoutError(err);
+                throw err;
+            }
+
+            auto tup = ret_r<-nres, T...>();
+            lua_pop(L, 1 + nres);
+            return tup;
+        }
+
+        template <class... T, class... Arg>
+        std::tuple<T...> callPrepared(size_t slot, Arg... args) {
+            TimeoutHook hook(L, timeout, &src, profiler);
+
+            constexpr int nargs = countT<Arg...>();
+            checkStack(L, nargs + 2);
+
+            lua_pushcfunction(L, hwk_lua_error_handler_callback);
+            try {
+                pushPrepared(slot);
+            } catch (const LuaError &) {
+                lua_pop(L, 1);
+                throw;
+            }
+            call_r(0, args...);
+            return pcall<T...>(hook, nargs);
+        }
 
     public:
         std::string src;
 
+        /** Recent calls that ran out of time, kept by the owner of the
+         *  script to decide when to give up on it. */
+        unsigned num_timeouts = 0;
+        steady_clock::time_point last_timeout;
+
         /** Initialize a Lua state and load a script.
          *
          * @param path Path to the Lua script.
@@ -1107,12 +1338,26 @@ namespace Lua {
         /** Initialize a Lua state. */
         Script();
 
+        /**
+         * Run in the Lua state of `host`, with globals kept in a separate
+         * environment, libraries that sandbox.lua considers shared are
+         * only loaded once per state.
+         *
+         * Scripts sharing a state must not be used from different
+         * threads at the same time, and `host` must outlive them.
+         */
+        explicit Script(Script *host);
+
         /** Destroy a Lua state. */
         virtual ~Script() noexcept;
 
         /** Get the raw Lua state. */
         lua_State *getL() noexcept;
 
+        /** Get the allocator of the Lua state, which is the one of the
+         *  host if the state is shared. */
+        Allocator *getAllocator() noexcept;
+
         /** Load a script into the Lua state.
          *
          * @param path Path to the Lua script.
@@ -1122,7 +1367,8 @@ namespace Lua {
         /** Open a Lua interface in the Script. */
         template <class T>
         void open(LuaIface<T> *iface, std::string name) {
-            iface->luaOpen(L, name.c_str());
+            iface->luaPush(L);
+            setGlobal(name.c_str());
         }
 
         int call_r(int n) noexcept {
@@ -1164,37 +1410,117 @@ namespace Lua {
          * @tparam Arg... The list of function argument types.
          * @param name Name of global Lua function.
          * @param args Any number of arguments that the Lua function requires.
+         * @throws LuaTimeoutError If the call took longer than the timeout,
+         *                         see setTimeout().
          */
         template <class... T, class... Arg>
         std::tuple<T...> call(std::string name, Arg... args) {
-            TimeoutHook hook(L, SCRIPT_TIMEOUT);
+            TimeoutHook hook(L, timeout, &src, profiler);
 
-            constexpr int nres = countT<T...>();
             constexpr int nargs = countT<Arg...>();
             checkStack(L, nargs + 1);
 
             lua_pushcfunction(L, hwk_lua_error_handler_callback);
-            lua_getglobal(L, name.c_str());
+            getGlobal(name.c_str());
             if (!isCallable(L, -1))
                 throw LuaError("Unable to retrieve " + name +
                                 " function from Lua state");
             call_r(0, args...);
+            return pcall<T...>(hook, nargs);
+        }
 
-            // -n-nargs is the position of hwk_lua_error_handler_callback
-            // on the Lua stack.
-            if (lua_pcall(L, nargs, nres, -2-nargs) != LUA_OK) {
-                // Here be dragons
-                auto exc = std::unique_ptr<LuaError>(
-                    static_cast<LuaError*>(lua_touserdata(L, -1)));
-                if (!exc)
-                    throw LuaError("Unknown error");
-                LuaError err = *exc;
-                throw err;
+        /** Call a function that was stored with luaL_ref() in the
+         *  registry, like call() does with globals.
+         *
+         * @param ref Registry reference to the function.
+         * @throws LuaTimeoutError If the call took longer than the timeout.
+         */
+        template <class... T, class... Arg>
+        std::tuple<T...> callRef(int ref, Arg... args) {
+            TimeoutHook hook(L, timeout, &src, profiler);
+
+            constexpr int nargs = countT<Arg...>();
+            checkStack(L, nargs + 2);
+
+            lua_pushcfunction(L, hwk_lua_error_handler_callback);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+            if (!isCallable(L, -1)) {
+                lua_pop(L, 2);
+                throw LuaError("Reference is not a function");
             }
+            call_r(0, args...);
+            return pcall<T...>(hook, nargs);
+        }
 
-            auto tup = ret_r<-nres, T...>();
-            lua_pop(L, 1 + nres);
-            return tup;
+        template <class Sig> class Prepared;
+
+        /**
+         * A global Lua function that is looked up once, and then called
+         * through a registry reference, without any string handling.
+         * Created with Script::prepare().
+         *
+         *     auto match = script.prepare<std::tuple<bool>(int, int)>("match");
+         *     auto [succ] = match(1, 2);
+         *
+         * The function is looked up again after code is loaded into the
+         * script with from(), exec() or reset(), but Lua code assigning
+         * to the global is not noticed. A Prepared is only valid for as
+         * long as its script is.
+         *
+         * @tparam T... The list of return types.
+         * @tparam Arg... The list of function argument types.
+         */
+        template <class... T, class... Arg>
+        class Prepared<std::tuple<T...>(Arg...)> {
+            Script *sc = nullptr;
+            size_t slot = 0;
+
+        public:
+            Prepared() = default;
+            Prepared(Script *sc, size_t slot) : sc(sc), slot(slot) {}
+
+            /** Call the function, see Script::call(). */
+            inline std::tuple<T...> operator()(Arg... args) const {
+                return sc->callPrepared<T...>(slot, args...);
+            }
+
+            inline bool isValid() const noexcept {
+                return sc != nullptr;
+            }
+        };
+
+        /**
+         * Prepare calls of a global Lua function, which is looked up
+         * right away.
+         *
+         * Preparing the same function again reuses the reference, the
+         * first prepare() of a name must not run at the same time as
+         * other calls into the script.
+         *
+         * @tparam Sig The signature, std::tuple<T...>(Arg...)
+         * @throws LuaError If there is no such function.
+         */
+        template <class Sig>
+        Prepared<Sig> prepare(const std::string &name) {
+            size_t slot = 0;
+            while (slot < prepared.size() && prepared[slot].first != name)
+                slot++;
+            if (slot == prepared.size())
+                prepared.emplace_back(name, LUA_NOREF);
+            if (prepared[slot].second == LUA_NOREF) {
+                pushPrepared(slot);
+                lua_pop(L, 1);
+            }
+            return Prepared<Sig>(this, slot);
+        }
+
+        /** Whether prepare() has resolved `name`, without looking it up
+         *  again, so it can be called while the script is running. */
+        inline bool isPrepared(const std::string &name) const noexcept {
+            for (const auto &[n, ref] : prepared)
+                if (n == name)
+                    return ref != LUA_NOREF;
+            return false;
         }
 
         /** Retrieve a global Lua value. */
@@ -1209,7 +1535,17 @@ namespace Lua {
         template <class T>
         void set(std::string name, T value) {
             luaPush(L, value);
-            lua_setglobal(L, name.c_str());
+            setGlobal(name.c_str());
+        }
+
+        /** Set how long call() may run for, 2 seconds by default. */
+        inline void setTimeout(milliseconds ms) noexcept {
+            timeout = ms;
+        }
+
+        /** Record the calls of the script in `prof`, nullptr to stop. */
+        inline void setProfiler(Profiler *prof) noexcept {
+            profiler = prof;
         }
 
         inline bool isEnabled() noexcept {
@@ -1226,8 +1562,53 @@ namespace Lua {
          */
         void exec(const std::string &src, const std::string& str);
 
+        /**
+         * Compile Lua code into a binary chunk, without running it.
+         *
+         * @param chunkname Name of the chunk used in error messages,
+         *                  see lua_load().
+         * @param str Lua code.
+         * @return The chunk as written by lua_dump().
+         * @throws LuaError If the code does not compile.
+         */
+        std::string compile(const std::string &chunkname, const std::string &str);
+
+        /**
+         * Run a binary chunk from compile().
+         *
+         * @return False if the chunk could not be loaded, e.g because it
+         *         was compiled by a different Lua version.
+         * @throws LuaError If the chunk raised an error.
+         */
+        bool execBinary(const std::string &chunkname, const std::string &chunk);
+
+        /**
+         * Configure the garbage collector, this affects every script
+         * in the state if it is shared.
+         *
+         * @return False if the mode is not supported, in which case the
+         *         incremental collector is used.
+         */
+        bool setGCPolicy(const GCPolicy &policy) noexcept;
+
+        /**
+         * Do a step of garbage collection.
+         *
+         * @param kb Amount of work to do, in KiB.
+         * @return True if the step finished a cycle.
+         */
+        inline bool gcStep(int kb) noexcept {
+            return lua_gc(L, LUA_GCSTEP, kb);
+        }
+
+        /** Memory in use by the Lua state, in bytes. */
+        inline size_t memoryUsed() noexcept {
+            return size_t(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+        }
+
         /** Reset the Lua state, will destroy all data currently
-         *  held within it */
+         *  held within it, or just the environment of the script if
+         *  it shares the state. */
         void reset();
     };
 }
@@ -27,12 +27,21 @@
  */
 
 #include <thread>
+#include <future>
+#include <algorithm>
 #include <iostream>
 #include <filesystem>
+#include <new>
+#include <climits>
+#include <unordered_set>
 
 extern "C" {
     #include <libnotify/notify.h>
     #include <syslog.h>
+    #include <spawn.h>
+    #include <sched.h>
+    #include <signal.h>
+    #include <sys/wait.h>
 }
 
 #include "Daemon.hpp"
@@ -43,7 +52,9 @@ extern "C" {
 #include "LuaConfig.hpp"
 #include "XDG.hpp"
 #include "KBDB.hpp"
-#include "Popen.hpp"
+#include "Hwk2Lua.hpp"
+#include "ThreadPool.hpp"
+#include "Log.hpp"
 
 using namespace Lua;
 using namespace Permissions;
@@ -52,9 +63,19 @@ namespace fs = std::filesystem;
 
 static bool macrod_main_loop_running = true;
 
-MacroDaemon::MacroDaemon()
-    : kbd_srv("/var/lib/hawck-input/kbd.sock"),
-      xdg("hawck")
+thread_local Script *MacroDaemon::running_script = nullptr;
+thread_local bool MacroDaemon::script_loading = false;
+
+static void showNotification(const Notification &notif);
+
+MacroDaemon::MacroDaemon(bool share_lua_state, const string &sock_path)
+    : kbd_srv(sock_path),
+      xdg("hawck"),
+      script_cache(xdg.path(XDG_CACHE_HOME, "scripts")),
+      keymap_cache(xdg.path(XDG_CACHE_HOME, "keymaps")),
+      desktop_index(DesktopIndex::defaultDirs()),
+      notifications(showNotification),
+      timer_wheel(monotonicNanos() / 1000000)
 {
     notify_on_err = true;
     stop_on_err = false;
@@ -62,41 +83,143 @@ MacroDaemon::MacroDaemon()
     eval_keyup = true;
     eval_repeat = true;
     disabled = false;
+    memory_limit_kb = 0;
+    script_timeout_ms = 100;
+    max_script_timeouts = 3;
+
+    events_handled = &metrics.counter("hawck_macrod_events_total", "Events received from InputD");
+    script_reloads = &metrics.counter("hawck_macrod_script_reloads_total",
+                                      "Changes to the script directory that were handled");
+    connections = &metrics.counter("hawck_macrod_connections_total",
+                                   "Connections from InputD that completed the handshake");
+    socket_errors = &metrics.counter("hawck_macrod_socket_errors_total",
+                                     "Connections to InputD that were lost");
+    scripts_skipped = &metrics.counter("hawck_macrod_scripts_skipped_total",
+                                       "Scripts that were not run after testing them in parallel");
+    metrics.addGauge("hawck_macrod_scripts", "Scripts that are loaded",
+                     [this]() { return double(script_table.read()->scripts.size()); });
+    // The latency query may walk the stages as soon as the FIFO is up, so
+    // they are all added here.
+    socket_in_lat = &latency.stage("socket.to_macrod");
+    lua_lat = &latency.stage("macrod.lua");
+    total_lat = &latency.stage("macrod.total");
+    for (auto name : {"socket.to_macrod", "macrod.lua", "macrod.total"})
+        metrics.addHistogram("hawck_macrod_stage_seconds", "Time spent in each stage of handling an event",
+                             latency.stage(name), {{"stage", name}});
 
     auto [grp, grpbuf] = getgroup("hawck-input-share");
     (void) grpbuf;
-    if (chown("/var/lib/hawck-input/kbd.sock", getuid(), grp->gr_gid) == -1)
-        throw SystemError("Unable to chown kbd.sock: ", errno);
-    if (chmod("/var/lib/hawck-input/kbd.sock", 0660) == -1)
-        throw SystemError("Unable to chmod kbd.sock: ", errno);
+    if (chown(sock_path.c_str(), getuid(), grp->gr_gid) == -1)
+        throw SystemError("Unable to chown " + sock_path + ": ", errno);
+    if (chmod(sock_path.c_str(), 0660) == -1)
+        throw SystemError("Unable to chmod " + sock_path + ": ", errno);
     notify_init("Hawck");
+    if (share_lua_state) {
+        shared_lua = mkuniq(new Script());
+        initLuaState(shared_lua->getL());
+        applyMemoryLimit("", shared_lua.get());
+        syslog(LOG_INFO, "Scripts share a single Lua state");
+    }
+    desktop_index.start();
     xdg.mkpath(0755, XDG_CONFIG_HOME, "scripts");
     initScriptDir(xdg.path(XDG_CONFIG_HOME, "scripts"));
 }
 
 void MacroDaemon::getConnection() {
-    if (kbd_com)
+    {
+        lock_guard<mutex> lock(scripts_mtx);
         delete kbd_com;
+        kbd_com = nullptr;
+        remote_udev.setConnection(nullptr);
+    }
     syslog(LOG_INFO, "Listening for a connection ...");
 
     // Keep looping around until we get a connection.
+    UNIXSocket<KBDAction> *com = nullptr;
     for (;;) {
         try {
             int fd = kbd_srv.accept();
-            kbd_com = new UNIXSocket<KBDAction>(fd);
+            com = new UNIXSocket<KBDAction>(fd);
             syslog(LOG_INFO, "Got a connection");
+            handshake(com);
+            connections->add();
             break;
         } catch (SocketError &e) {
             syslog(LOG_ERR, "Error in accept(): %s", e.what());
+            delete com;
+            com = nullptr;
         }
         // Wait for 0.1 seconds
         usleep(100000);
     }
 
+    lock_guard<mutex> lock(scripts_mtx);
+    kbd_com = com;
     remote_udev.setConnection(kbd_com);
+    sendInterest();
+}
+
+void MacroDaemon::sendInterest() noexcept {
+    if (!kbd_com)
+        return;
+    KBDFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.type = KBD_FRAME_INTEREST;
+    if (!eval_keyup)
+        frame.flags |= KBD_INTEREST_NO_KEYUP;
+    if (!eval_keydown)
+        frame.flags |= KBD_INTEREST_NO_KEYDOWN;
+    if (!eval_repeat)
+        frame.flags |= KBD_INTEREST_NO_REPEAT;
+    auto bits = script_table.read()->global_index.codeBitmap();
+    if (disabled)
+        fill(bits.begin(), bits.end(), 0);
+    try {
+        kbd_com->sendFrame(frame, bits.data(), bits.size());
+    } catch (const SocketError &e) {
+        // The main loop will notice the broken connection.
+        syslog(LOG_ERR, "Unable to send key interest to InputD: %s", e.what());
+    }
+}
+
+void MacroDaemon::handshake(UNIXSocket<KBDAction> *com) {
+    KBDHello hello;
+    vector<int> fds;
+    com->recvFds(&hello, sizeof(hello), &fds, 3, 1000);
+    if (hello.magic != KBD_HELLO_MAGIC || hello.version != KBD_PROTOCOL_VERSION) {
+        for (int fd : fds)
+            close(fd);
+        throw SocketError("Unsupported protocol version from InputD: " + to_string(hello.version));
+    }
+
+    unique_ptr<ShmTransport> shm;
+    if ((hello.flags & KBD_HELLO_SHM) && fds.size() == 3) {
+        try {
+            shm = ShmTransport::attach(fds[0], fds[1], fds[2]);
+        } catch (const SystemError &e) {
+            syslog(LOG_ERR, "Unable to attach to shared memory, using socket: %s", e.what());
+        }
+    } else {
+        for (int fd : fds)
+            close(fd);
+    }
+
+    KBDFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.type = KBD_FRAME_HELLO;
+    if (shm)
+        frame.flags |= KBD_HELLO_SHM;
+    com->sendFrame(frame, (const input_event *) nullptr, 0);
+
+    if (shm) {
+        com->useShm(std::move(shm));
+        syslog(LOG_INFO, "Using shared memory transport");
+    }
 }
 
 MacroDaemon::~MacroDaemon() {
+    if (script_loader.joinable())
+        script_loader.join();
     for (auto &[_, s] : scripts) {
         (void) _;
         delete s;
@@ -104,56 +227,858 @@ MacroDaemon::~MacroDaemon() {
 }
 
 void MacroDaemon::initScriptDir(const std::string &dir_path) {
-    for (auto entry : fs::directory_iterator(dir_path)) {
-        try {
-            loadScript(entry.path());
-        } catch (exception &e) {
-            notify("Hawck Script Error", e.what());
-            syslog(LOG_ERR, "Unable to load script '%s': %s", pathBasename(entry.path()).c_str(),
-                   e.what());
-        }
-    }
+    vector<string> paths;
+    for (auto entry : fs::directory_iterator(dir_path))
+        paths.push_back(entry.path());
+    sort(paths.begin(), paths.end());
     fsw.addFrom(dir_path);
+
+    // Keys are passed through while this is running, as the interest sent
+    // to InputD stays empty until the scripts are published.
+    script_loader = thread([this, paths]() {
+        vector<future<pair<unique_ptr<Script>, MatchIndex>>> loads;
+        {
+            ThreadPool pool(std::min<size_t>(paths.size(), thread::hardware_concurrency()));
+            for (const auto &path : paths) {
+                loads.push_back(pool.submit([this, path]() {
+                    // A shared Lua state can only be used by one thread at a time.
+                    unique_lock<mutex> lock(scripts_mtx, defer_lock);
+                    if (shared_lua)
+                        lock.lock();
+                    auto sc = prepareScript(path);
+                    MatchIndex index = sc ? buildIndex(sc.get()) : MatchIndex();
+                    return make_pair(std::move(sc), index);
+                }));
+            }
+        }
+
+        lock_guard<mutex> lock(scripts_mtx);
+        for (size_t i = 0; i < paths.size(); i++) {
+            try {
+                auto [sc, index] = loads[i].get();
+                if (!sc)
+                    continue;
+                // The watcher may have loaded a newer version in the meantime.
+                if (scripts.find(pathBasename(paths[i])) != scripts.end()) {
+                    retireScript(std::move(sc));
+                    continue;
+                }
+                publishScript(paths[i], std::move(sc), index);
+            } catch (exception &e) {
+                notify("Hawck Script Error", e.what());
+                syslog(LOG_ERR, "Unable to load script '%s': %s", pathBasename(paths[i]).c_str(),
+                       e.what());
+            }
+        }
+        rebuildIndex();
+        syslog(LOG_INFO, "Loaded %zu scripts", scripts.size());
+        script_cache.prune(chrono::hours(24 * 30));
+        keymap_cache.prune(chrono::hours(24 * 30));
+    });
 }
 
-void MacroDaemon::loadScript(const std::string &path) {
+unique_ptr<Script> MacroDaemon::prepareScript(const std::string &path) {
     if (stringStartsWith(path, ".") || !(stringEndsWith(path, ".lua") ||
                                          stringEndsWith(path, ".hwk"))) {
         syslog(LOG_NOTICE,
                "Not loading: %s, filename must end in .lua or .hwk and may not start with a leading '.'",
                path.c_str());
-        return;
+        return nullptr;
     }
 
     auto rpath = realpath_safe(path);
     if (!checkFile(rpath, "frwxr-xr-x ~:*"))
-        return;
+        return nullptr;
+
+    unique_ptr<Script> sc;
+    if (shared_lua) {
+        sc = mkuniq(new Script(shared_lua.get()));
+    } else {
+        sc = mkuniq(new Script());
+        initLuaState(sc->getL());
+    }
+    sc->src = path;
 
-    auto sc = mkuniq(new Script());
-    auto chdir = xdg.cd(XDG_DATA_HOME, "scripts");
     sc->call("require", "init");
     sc->open(&remote_udev, "udev");
-    if (stringEndsWith(path, ".hwk")) {
-        sc->exec(pathBasename(path), (Popen("hwk2lua", path)).readOnce());
-    } else if (stringEndsWith(path, ".lua")) {
-        sc->from(path);
+
+    // Compiled code is looked up by the contents of the script, together
+    // with everything else that went into compiling it.
+    bool is_hwk = stringEndsWith(path, ".hwk");
+    string src = readFile(path);
+    string chunkname = "@" + (is_hwk ? pathBasename(path) : path);
+    string kind = string(HAWCK_LUA_RELEASE) + (is_hwk ? string("/hwk/") + HWK2LUA_VERSION : "/lua");
+    string key = ScriptCache::key(kind, chunkname, src);
+    string chunk;
+    // Timers started by the chunk wait for the script to be published.
+    running_script = sc.get();
+    script_loading = true;
+    try {
+        if (!script_cache.get(key, "luac", &chunk) || !sc->execBinary(chunkname, chunk)) {
+            string lua_src = is_hwk ? hwk2lua(src) : src;
+            chunk = sc->compile(chunkname, lua_src);
+            if (is_hwk)
+                script_cache.put(key, "lua", lua_src);
+            script_cache.put(key, "luac", chunk);
+            if (!sc->execBinary(chunkname, chunk))
+                throw LuaError("Unable to load compiled chunk: " + chunkname);
+        }
+        // Resolved here, before the script is published, so that the main
+        // loop never has to look it up.
+        sc->prepare<MatchSig>("__match");
+    } catch (...) {
+        running_script = nullptr;
+        script_loading = false;
+        dropTimers(sc.get());
+        throw;
+    }
+    running_script = nullptr;
+    script_loading = false;
+    try {
+        sc->prepare<TestSig>("__test");
+    } catch (const LuaError &) {
+        // Scripts without the Hawck library are only ever run.
     }
+    return sc;
+}
+
+void MacroDaemon::initLuaState(lua_State *L) {
+    // Scripts are loaded from several threads at once, so the library is
+    // found through an absolute package.path instead of the working directory.
+    string lib_dir = xdg.path(XDG_DATA_HOME, "scripts");
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    string pkg_path = lib_dir + "/?.lua;" + lib_dir + "/LLib/?.lua;" + lua_tostring(L, -1);
+    lua_pop(L, 1);
+    lua_pushstring(L, pkg_path.c_str());
+    lua_setfield(L, -2, "path");
+    lua_pop(L, 1);
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, MacroDaemon::luaKeymap, 1);
+    lua_setglobal(L, "__keymap");
+    lua_pushlightuserdata(L, &desktop_index);
+    lua_pushcclosure(L, MacroDaemon::luaDesktopEntry, 1);
+    lua_setglobal(L, "__desktopEntry");
+    lua_pushlightuserdata(L, &key_state);
+    lua_pushcclosure(L, MacroDaemon::luaKeyIsDown, 1);
+    lua_setglobal(L, "__keyIsDown");
+    lua_pushlightuserdata(L, &key_state);
+    lua_pushcclosure(L, MacroDaemon::luaKeysDown, 1);
+    lua_setglobal(L, "__keysDown");
+    lua_pushlightuserdata(L, this);
+    lua_pushboolean(L, false);
+    lua_pushcclosure(L, MacroDaemon::luaStartTimer, 2);
+    lua_setglobal(L, "after");
+    lua_pushlightuserdata(L, this);
+    lua_pushboolean(L, true);
+    lua_pushcclosure(L, MacroDaemon::luaStartTimer, 2);
+    lua_setglobal(L, "every");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, MacroDaemon::luaCancelTimer, 1);
+    lua_setglobal(L, "cancel");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, MacroDaemon::luaSpawn, 1);
+    lua_setglobal(L, "__spawn");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, MacroDaemon::luaReap, 1);
+    lua_setglobal(L, "__reap");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, MacroDaemon::luaInterestChanged, 1);
+    lua_setglobal(L, "__interestChanged");
+}
+
+unique_ptr<Script> MacroDaemon::publishScript(const std::string &path, unique_ptr<Script> sc,
+                                              const MatchIndex &index) {
     auto name = pathBasename(path);
+    unique_ptr<Script> old;
     if (scripts.find(name) != scripts.end()) {
-        delete scripts[name];
+        old.reset(scripts[name]);
         scripts.erase(name);
     }
     syslog(LOG_INFO, "Loaded script: %s", path.c_str());
-    notify(pathBasename(path), "<i>Loaded</i> script");
+    notify(name, "<i>Loaded</i> script");
+    script_index[name] = index;
+    applyMemoryLimit(name, sc.get());
+    applyGCPolicy(name, sc.get());
     scripts[name] = sc.release();
+    return old;
+}
+
+void MacroDaemon::loadScript(const std::string &path) {
+    // The new script is built without holding scripts_mtx, so the main loop
+    // keeps on handling keys with the old one in the meantime. A shared Lua
+    // state can only be used by one thread at a time though.
+    unique_lock<mutex> lock(scripts_mtx, defer_lock);
+    if (shared_lua)
+        lock.lock();
+    auto sc = prepareScript(path);
+    if (!sc)
+        return;
+    MatchIndex index = buildIndex(sc.get());
+    if (!lock.owns_lock())
+        lock.lock();
+    auto old = publishScript(path, std::move(sc), index);
+    rebuildIndex();
+    retireScript(std::move(old));
+}
+
+void MacroDaemon::retireScript(unique_ptr<Script> sc) noexcept {
+    if (!sc)
+        return;
+    dropGCState(sc.get());
+    dropTimers(sc.get());
+    sc.reset();
+}
+
+int MacroDaemon::luaStartTimer(lua_State *L) {
+    auto *self = static_cast<MacroDaemon *>(lua_touserdata(L, lua_upvalueindex(1)));
+    bool repeat = lua_toboolean(L, lua_upvalueindex(2));
+    lua_Integer ms = luaL_checkinteger(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    // Scripts are loaded on other threads, and the Lua state of a script
+    // that is still loading may never be published, so its timers are only
+    // armed once it is.
+    Script *sc = running_script;
+    if (!sc)
+        return luaL_error(L, "timers can only be started by scripts");
+    if (ms < (repeat ? 1 : 0) || ms > INT32_MAX)
+        // %f, as LuaJIT has no format for 64-bit integers.
+        return luaL_error(L, "invalid timer interval: %f ms", (lua_Number) ms);
+
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    TimerWheel::Id id = 0;
+    {
+        // Nothing in here may raise a Lua error, it would skip the unlock.
+        lock_guard<mutex> lock(self->timers_mtx);
+        if (self->timers.size() < max_timers) {
+            id = self->next_timer_id++;
+            uint64_t when = monotonicNanos() / 1000000 + uint64_t(ms);
+            self->timers[id] = {sc, ref, repeat ? uint32_t(ms) : 0, when,
+                                !script_loading, uint32_t(ms)};
+            if (!script_loading)
+                self->timer_wheel.add(id, when);
+        }
+    }
+    if (!id) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        return luaL_error(L, "too many timers");
+    }
+    lua_pushinteger(L, lua_Integer(id));
+    return 1;
+}
+
+int MacroDaemon::luaCancelTimer(lua_State *L) {
+    auto *self = static_cast<MacroDaemon *>(lua_touserdata(L, lua_upvalueindex(1)));
+    lua_Integer id = luaL_checkinteger(L, 1);
+    int ref = LUA_NOREF;
+    {
+        lock_guard<mutex> lock(self->timers_mtx);
+        auto it = self->timers.find(TimerWheel::Id(id));
+        // Scripts can only cancel their own timers.
+        if (it != self->timers.end() && running_script && it->second.sc == running_script) {
+            ref = it->second.fn_ref;
+            self->timer_wheel.cancel(it->first, it->second.when);
+            self->timers.erase(it);
+        }
+    }
+    if (ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    lua_pushboolean(L, ref != LUA_NOREF);
+    return 1;
+}
+
+int MacroDaemon::luaSpawn(lua_State *L) {
+    auto *self = static_cast<MacroDaemon *>(lua_touserdata(L, lua_upvalueindex(1)));
+    const char *cmd = luaL_checkstring(L, 1);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    // Applications should not inherit the real-time priority of the main
+    // loop, nor the signals that it blocks.
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER);
+    posix_spawnattr_setschedparam(&attr, &param);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSCHEDULER | POSIX_SPAWN_SETSIGMASK);
+    const char *argv[] = {"/bin/sh", "-c", cmd, nullptr};
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", nullptr, &attr, (char *const *) argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (err)
+        return luaL_error(L, "unable to run %s: %s", cmd, strerror(err));
+
+    {
+        lock_guard<mutex> lock(self->children_mtx);
+        self->reapDetached();
+        self->children[pid] = false;
+    }
+    lua_pushinteger(L, lua_Integer(pid));
+    return 1;
+}
+
+int MacroDaemon::luaReap(lua_State *L) {
+    auto *self = static_cast<MacroDaemon *>(lua_touserdata(L, lua_upvalueindex(1)));
+    pid_t pid = pid_t(luaL_checkinteger(L, 1));
+    bool detach = lua_toboolean(L, 2);
+    int status = 0;
+    pid_t ret;
+    {
+        lock_guard<mutex> lock(self->children_mtx);
+        auto it = self->children.find(pid);
+        // Only our own children are waited for, the others may belong to a
+        // Popen on another thread.
+        if (it == self->children.end()) {
+            ret = -1;
+        } else {
+            ret = waitpid(pid, &status, WNOHANG);
+            if (ret == 0 && detach)
+                it->second = true;
+            else if (ret != 0)
+                self->children.erase(it);
+        }
+    }
+    if (ret == 0) {
+        lua_pushnil(L);
+    } else if (ret == -1) {
+        lua_pushinteger(L, -1);
+    } else {
+        lua_pushinteger(L, WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+    }
+    return 1;
+}
+
+int MacroDaemon::luaInterestChanged(lua_State *L) {
+    auto *self = static_cast<MacroDaemon *>(lua_touserdata(L, lua_upvalueindex(1)));
+    // A script that is loading is indexed once it has loaded.
+    Script *sc = running_script;
+    if (sc && !script_loading &&
+        find(self->stale_interest.begin(), self->stale_interest.end(), sc) == self->stale_interest.end())
+        self->stale_interest.push_back(sc);
+    return 0;
+}
+
+void MacroDaemon::refreshInterest() {
+    vector<Script *> stale;
+    stale.swap(stale_interest);
+    lock_guard<mutex> lock(scripts_mtx);
+    for (const auto &[name, sc] : scripts)
+        if (find(stale.begin(), stale.end(), sc) != stale.end())
+            script_index[name] = buildIndex(sc);
+    rebuildIndex();
+}
+
+void MacroDaemon::reapDetached() noexcept {
+    for (auto it = children.begin(); it != children.end();) {
+        if (it->second && waitpid(it->first, nullptr, WNOHANG) != 0)
+            it = children.erase(it);
+        else
+            ++it;
+    }
+}
+
+int MacroDaemon::timeUntilTimer() {
+    lock_guard<mutex> lock(timers_mtx);
+    if (timer_wheel.empty())
+        return -1;
+    uint64_t now = monotonicNanos() / 1000000;
+    uint64_t next = timer_wheel.nextExpiry();
+    return next <= now ? 0 : int(min<uint64_t>(next - now, INT_MAX));
+}
+
+void MacroDaemon::runTimers() {
+    uint64_t now = monotonicNanos() / 1000000;
+    vector<TimerWheel::Id> due;
+    {
+        lock_guard<mutex> lock(timers_mtx);
+        timer_wheel.advance(now, [&](TimerWheel::Id id) { due.push_back(id); });
+    }
+    if (due.empty())
+        return;
+
+    unique_lock<mutex> lock(scripts_mtx, defer_lock);
+    if (shared_lua)
+        lock.lock();
+    // A script that is gone from the table may be deleted at any moment,
+    // its timers go with it.
+    auto tbl = script_table.read();
+    auto published = [&](Script *sc) -> const ScriptEntry * {
+        for (const ScriptEntry &ent : tbl->scripts)
+            if (ent.sc == sc)
+                return &ent;
+        return nullptr;
+    };
+
+    for (TimerWheel::Id id : due) {
+        ScriptTimer t;
+        {
+            lock_guard<mutex> tlock(timers_mtx);
+            auto it = timers.find(id);
+            if (it == timers.end())
+                continue;
+            t = it->second;
+        }
+        const ScriptEntry *ent = published(t.sc);
+        if (!ent)
+            continue;
+
+        bool keep = t.interval_ms > 0 && t.sc->isEnabled() && !disabled;
+        if (t.sc->isEnabled() && !disabled) {
+            t.sc->setTimeout(milliseconds(script_timeout_ms));
+            t.sc->setProfiler(profile ? &profiler : nullptr);
+            running_script = t.sc;
+            remote_udev.beginAsync();
+            try {
+                t.sc->callRef<>(t.fn_ref);
+                lua_settop(t.sc->getL(), 0);
+            } catch (const LuaTimeoutError &e) {
+                HAWCK_LOG(LOG_WARNING, "Timer of script %s timed out, cancelling it",
+                          t.sc->src.c_str());
+                ent->timeouts->add();
+                keep = false;
+            } catch (const LuaError &e) {
+                ent->errors->add();
+                std::string report = e.fmtReport();
+                if (notify_on_err)
+                    notify("Lua error", report);
+                HAWCK_LOG(LOG_ERR, "LUA:%s", report.c_str());
+                keep = false;
+            }
+            running_script = nullptr;
+            remote_udev.done();
+        }
+
+        int ref = LUA_NOREF;
+        {
+            lock_guard<mutex> tlock(timers_mtx);
+            auto it = timers.find(id);
+            // The callback may have cancelled its own timer.
+            if (it == timers.end())
+                continue;
+            if (keep) {
+                // Repeating timers keep to their schedule, but calls that
+                // are already overdue are skipped instead of piling up.
+                uint64_t when = t.when + t.interval_ms;
+                if (when <= now)
+                    when = now + t.interval_ms;
+                it->second.when = when;
+                timer_wheel.add(id, when);
+            } else {
+                ref = it->second.fn_ref;
+                timers.erase(it);
+            }
+        }
+        if (ref != LUA_NOREF)
+            luaL_unref(t.sc->getL(), LUA_REGISTRYINDEX, ref);
+    }
+}
+
+void MacroDaemon::dropTimers(Script *sc) noexcept {
+    lock_guard<mutex> lock(timers_mtx);
+    for (auto it = timers.begin(); it != timers.end();) {
+        if (it->second.sc != sc) {
+            ++it;
+            continue;
+        }
+        // A Lua state of its own goes away together with the script.
+        if (shared_lua)
+            luaL_unref(sc->getL(), LUA_REGISTRYINDEX, it->second.fn_ref);
+        timer_wheel.cancel(it->first, it->second.when);
+        it = timers.erase(it);
+    }
+}
+
+void MacroDaemon::armTimers() noexcept {
+    unordered_set<Script *> published;
+    for (const auto &ent : scripts)
+        published.insert(ent.second);
+    uint64_t now = monotonicNanos() / 1000000;
+    lock_guard<mutex> lock(timers_mtx);
+    for (auto &[id, t] : timers) {
+        if (t.armed || !published.count(t.sc))
+            continue;
+        t.armed = true;
+        t.when = now + t.delay_ms;
+        timer_wheel.add(id, t.when);
+    }
+}
+
+shared_ptr<Keymap> MacroDaemon::getKeymap(const std::string &lang) {
+    // Scripts are loaded in parallel, the first one to ask for a keymap
+    // loads it while the others wait.
+    lock_guard<mutex> lock(keymaps_mtx);
+    auto it = keymaps.find(lang);
+    if (it != keymaps.end())
+        return it->second;
+
+    auto paths = findKeymaps();
+    auto path = paths.find(lang);
+    if (path == paths.end())
+        throw SystemError("No such keymap: " + lang);
+
+    // Includes are not part of the key, they are installed together with
+    // the keymap itself.
+    string key = ScriptCache::key("keymap/" + to_string(Keymap::format_version),
+                                  path->second, readFile(path->second));
+    shared_ptr<Keymap> km;
+    string cache_path;
+    if (keymap_cache.lookup(key, "kmap", &cache_path)) {
+        try {
+            km = Keymap::open(cache_path);
+        } catch (const SystemError &e) {
+            syslog(LOG_WARNING, "Ignoring cached keymap: %s", e.what());
+        }
+    }
+    if (!km) {
+        km = Keymap::parse(path->second);
+        keymap_cache.putMapped(key, "kmap", string(km->data()));
+    }
+    syslog(LOG_INFO, "Loaded keymap: %s", path->second.c_str());
+    keymaps[lang] = km;
+    return km;
+}
+
+/** Metatables of the three tables returned by __keymap() */
+static const char *keymap_types[] = {"hawck.Keymap.keys", "hawck.Keymap.combos", "hawck.Keymap.mods"};
+
+static const Keymap *checkKeymap(lua_State *L, int type) {
+    return ((shared_ptr<Keymap> *) luaL_checkudata(L, 1, keymap_types[type]))->get();
+}
+
+/** keymap[name] -> code and keymap[code] -> name */
+static int keymapKeysIndex(lua_State *L) {
+    const Keymap *km = checkKeymap(L, 0);
+    int isnum, code;
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        string_view name = km->getName(lua_tointegerx(L, 2, &isnum));
+        if (isnum && !name.empty())
+            lua_pushlstring(L, name.data(), name.size());
+        else
+            lua_pushnil(L);
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t len;
+        const char *name = lua_tolstring(L, 2, &len);
+        if (km->getKeysym(string_view(name, len), &code))
+            lua_pushinteger(L, code);
+        else
+            lua_pushnil(L);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/** combo_map[name] -> {mod_code, root_code} */
+static int keymapCombosIndex(lua_State *L) {
+    const Keymap *km = checkKeymap(L, 1);
+    size_t len;
+    const char *name = lua_type(L, 2) == LUA_TSTRING ? lua_tolstring(L, 2, &len) : nullptr;
+    int mod_code, root_code;
+    if (name && km->getCombo(string_view(name, len), &mod_code, &root_code)) {
+        lua_createtable(L, 2, 0);
+        lua_pushinteger(L, mod_code);
+        lua_rawseti(L, -2, 1);
+        lua_pushinteger(L, root_code);
+        lua_rawseti(L, -2, 2);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/** mod_codes[code] -> true */
+static int keymapModsIndex(lua_State *L) {
+    const Keymap *km = checkKeymap(L, 2);
+    int isnum;
+    lua_Integer code = lua_tointegerx(L, 2, &isnum);
+    if (isnum && km->isModifier(code))
+        lua_pushboolean(L, true);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+static int keymapReadOnly(lua_State *L) {
+    return luaL_error(L, "Keymaps are read-only");
+}
+
+static int keymapGC(lua_State *L) {
+    ((shared_ptr<Keymap> *) lua_touserdata(L, 1))->~shared_ptr();
+    return 0;
+}
+
+static void pushKeymapTable(lua_State *L, const shared_ptr<Keymap> &km, int type) {
+    static const lua_CFunction index_fns[] = {keymapKeysIndex, keymapCombosIndex, keymapModsIndex};
+    new (lua_newuserdata(L, sizeof(shared_ptr<Keymap>))) shared_ptr<Keymap>(km);
+    if (luaL_newmetatable(L, keymap_types[type])) {
+        lua_pushcfunction(L, index_fns[type]);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, keymapReadOnly);
+        lua_setfield(L, -2, "__newindex");
+        lua_pushcfunction(L, keymapGC);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+}
+
+int MacroDaemon::luaKeyIsDown(lua_State *L) {
+    auto *keys = (const KeyState *) lua_touserdata(L, lua_upvalueindex(1));
+    lua_pushboolean(L, keys->isDown(luaL_checkinteger(L, 1)));
+    return 1;
+}
+
+int MacroDaemon::luaKeysDown(lua_State *L) {
+    auto *keys = (const KeyState *) lua_touserdata(L, lua_upvalueindex(1));
+    lua_createtable(L, 0, keys->numDown());
+    keys->forEachDown([L](int code) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, -2, code);
+    });
+    return 1;
+}
+
+static void pushDesktopGroup(lua_State *L, const DesktopEntry::Group &group) {
+    lua_createtable(L, 0, int(group.size()));
+    for (const auto &[key, value] : group) {
+        lua_pushlstring(L, value.data(), value.size());
+        lua_setfield(L, -2, key.c_str());
+    }
+}
+
+int MacroDaemon::luaDesktopEntry(lua_State *L) {
+    auto *index = (DesktopIndex *) lua_touserdata(L, lua_upvalueindex(1));
+    const char *id = luaL_checkstring(L, 1);
+    DesktopEntry ent;
+    if (!index->find(id, &ent)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 1, int(ent.actions.size()));
+    pushDesktopGroup(L, ent.entry);
+    lua_rawseti(L, -2, 0);
+    for (const auto &[name, group] : ent.actions) {
+        pushDesktopGroup(L, group);
+        lua_setfield(L, -2, name.c_str());
+    }
+    return 1;
+}
+
+int MacroDaemon::luaKeymap(lua_State *L) {
+    auto *self = (MacroDaemon *) lua_touserdata(L, lua_upvalueindex(1));
+    const char *lang = luaL_checkstring(L, 1);
+    bool found;
+    // lua_error() does not unwind the C++ stack, so it is raised outside
+    // of the scope of the shared_ptr.
+    {
+        shared_ptr<Keymap> km;
+        try {
+            km = self->getKeymap(lang);
+            // Scripts type text with the keymap that they asked for.
+            self->remote_udev.addKeymap(lang, km);
+        } catch (const exception &e) {
+            lua_pushstring(L, e.what());
+        }
+        if ((found = (bool) km))
+            for (int type = 0; type < 3; type++)
+                pushKeymapTable(L, km, type);
+    }
+    if (!found)
+        return lua_error(L);
+    return 3;
+}
+
+void MacroDaemon::applyMemoryLimit(const std::string &name, Script *sc) noexcept {
+    Allocator *alloc = sc->getAllocator();
+    if (!alloc)
+        return;
+    // A shared Lua state can only have one limit.
+    int kb = memory_limit_kb;
+    auto it = script_memory_limits_kb.find(name);
+    if (!shared_lua && it != script_memory_limits_kb.end())
+        kb = it->second;
+    alloc->setLimit(size_t(max(kb, 0)) * 1024);
+}
+
+StatsTable MacroDaemon::memoryTable() {
+    auto row = [](const AllocStats &st) -> map<string, double> {
+        return {
+            {"in_use_kb", double(st.in_use) / 1024.0},
+            {"peak_kb", double(st.peak) / 1024.0},
+            {"limit_kb", double(st.limit) / 1024.0},
+            {"allocs", double(st.allocs)},
+            {"pool_allocs", double(st.pool_allocs)},
+            {"frees", double(st.frees)},
+            {"failed", double(st.failed)},
+        };
+    };
+
+    lock_guard<mutex> lock(scripts_mtx);
+    StatsTable tbl;
+    if (shared_lua) {
+        if (Allocator *alloc = shared_lua->getAllocator())
+            tbl["shared"] = row(alloc->stats());
+        return tbl;
+    }
+    for (const auto &[name, sc] : scripts)
+        if (Allocator *alloc = sc->getAllocator())
+            tbl[name] = row(alloc->stats());
+    return tbl;
+}
+
+void MacroDaemon::applyGCPolicy(const std::string &name, Script *sc) noexcept {
+    Script *owner = shared_lua ? shared_lua.get() : sc;
+    GCPolicy policy;
+    policy.update(gc_settings);
+    // A shared Lua state can only have one policy.
+    auto it = script_gc_settings.find(name);
+    if (!shared_lua && it != script_gc_settings.end())
+        policy.update(it->second);
+
+    auto &gc = script_gc[owner];
+    if (!gc)
+        gc = mkuniq(new ScriptGC());
+    gc->policy = policy;
+    if (!owner->setGCPolicy(policy))
+        syslog(LOG_WARNING, "Generational GC is not supported by this Lua version");
+}
+
+MacroDaemon::ScriptGC *MacroDaemon::gcState(Script *sc) noexcept {
+    auto it = script_gc.find(shared_lua ? shared_lua.get() : sc);
+    return it == script_gc.end() ? nullptr : it->second.get();
+}
+
+void MacroDaemon::dropGCState(Script *sc) noexcept {
+    if (!shared_lua)
+        script_gc.erase(sc);
+}
+
+void MacroDaemon::gcIdle() {
+    if (gc_settings_changed.exchange(false)) {
+        lock_guard<mutex> lock(scripts_mtx);
+        for (auto &[name, sc] : scripts)
+            applyGCPolicy(name, sc);
+    }
+
+    for (;;) {
+        lock_guard<mutex> lock(scripts_mtx);
+        bool stepped = false;
+        for (auto &[sc, gc] : script_gc) {
+            if (gc->policy.mode != GCPolicy::MANUAL)
+                continue;
+            // Like the incremental collector, start a new cycle once memory
+            // use has grown by `pause` percent since the last one.
+            size_t used = sc->memoryUsed();
+            size_t due = gc->mem_after_gc * size_t(max(gc->policy.pause, 100)) / 100;
+            bool first_cycle = gc->mem_after_gc == 0;
+            if (!first_cycle && used < due)
+                continue;
+            // Keys take priority, unless they have kept the collector from
+            // running for so long that memory use has doubled again. There
+            // is nothing to compare with before the first cycle has ended.
+            if ((first_cycle || used < 2 * due) && kbd_com->waitReadable(0))
+                return;
+            uint64_t start = monotonicNanos();
+            bool finished = sc->gcStep(gc->policy.step_kb);
+            gc->steps.since(start);
+            if (finished) {
+                gc->cycles++;
+                gc->mem_after_gc = max<size_t>(sc->memoryUsed(), 1);
+            }
+            stepped = true;
+        }
+        if (!stepped)
+            return;
+    }
+}
+
+StatsTable MacroDaemon::gcTable() {
+    lock_guard<mutex> lock(scripts_mtx);
+    auto row = [](const ScriptGC &gc) -> map<string, double> {
+        return {
+            {"manual", double(gc.policy.mode == GCPolicy::MANUAL)},
+            {"generational", double(gc.policy.mode == GCPolicy::GENERATIONAL)},
+            {"pause", double(gc.policy.pause)},
+            {"stepmul", double(gc.policy.stepmul)},
+            {"cycles", double(gc.cycles)},
+            {"steps", double(gc.steps.count())},
+            {"step_p99_us", double(gc.steps.percentile(99)) / 1000.0},
+            {"step_max_us", double(gc.steps.max()) / 1000.0},
+            {"gc_calls", double(gc.gc_calls.count())},
+            {"gc_call_p99_us", double(gc.gc_calls.percentile(99)) / 1000.0},
+            {"gc_call_max_us", double(gc.gc_calls.max()) / 1000.0},
+        };
+    };
+
+    StatsTable tbl;
+    if (shared_lua) {
+        if (ScriptGC *gc = gcState(shared_lua.get()))
+            tbl["shared"] = row(*gc);
+        return tbl;
+    }
+    for (const auto &[name, sc] : scripts)
+        if (ScriptGC *gc = gcState(sc))
+            tbl[name] = row(*gc);
+    return tbl;
+}
+
+MatchIndex MacroDaemon::buildIndex(Script *sc) {
+    try {
+        auto [match_all, entries] = sc->call<bool, vector<int>>("__interest");
+        if (match_all)
+            return MatchIndex();
+        MatchIndex index(entries);
+        syslog(LOG_INFO, "Script reacts to %d keys", index.size());
+        return index;
+    } catch (const LuaError &e) {
+        // Older scripts without __interest() see every event.
+        syslog(LOG_WARNING, "Unable to index script, it will see all keys: %s", e.what());
+        return MatchIndex();
+    }
+}
+
+void MacroDaemon::rebuildIndex() {
+    auto tbl = mkuniq(new ScriptTable());
+    tbl->global_index.clear();
+    // Run scripts in order of their names, so that the outcome of
+    // overlapping matches does not depend on the order they were loaded in.
+    vector<string> names;
+    for (auto &[name, _] : scripts) {
+        (void) _;
+        names.push_back(name);
+    }
+    sort(names.begin(), names.end());
+    tbl->scripts.reserve(names.size());
+    for (const auto &name : names) {
+        Script *sc = scripts[name];
+        const MatchIndex &index = script_index[name];
+        MetricLabels labels = {{"script", name}};
+        Script::Prepared<TestSig> test;
+        if (sc->isPrepared("__test"))
+            test = sc->prepare<TestSig>("__test");
+        tbl->scripts.push_back({sc, gcState(sc), index, sc->prepare<MatchSig>("__match"), test,
+                                &metrics.counter("hawck_macrod_script_errors_total",
+                                                 "Lua errors raised by each script", labels),
+                                &metrics.counter("hawck_macrod_script_timeouts_total",
+                                                 "Times that each script ran out of time", labels)});
+        tbl->global_index.merge(index);
+    }
+    script_table.replace(std::move(tbl));
+    armTimers();
+    sendInterest();
 }
 
 void MacroDaemon::unloadScript(const std::string &rel_path) noexcept {
     string name = pathBasename(rel_path);
     if (scripts.find(name) != scripts.end()) {
         syslog(LOG_INFO, "Deleting script: %s", name.c_str());
-        delete scripts[name];
+        unique_ptr<Script> old(scripts[name]);
         scripts.erase(name);
+        script_index.erase(name);
+        rebuildIndex();
+        retireScript(std::move(old));
         notify(name, "<i>Unloaded</i> script");
     } else {
         syslog(LOG_ERR, "Attempted to delete non-existent script: %s", name.c_str());
@@ -165,19 +1090,13 @@ struct script_error_info {
     char path[];
 };
 
-void MacroDaemon::notify(string title, string msg) {
-    notify(title, msg, "hawck");
-}
-
-void MacroDaemon::notify(string title, string msg, string icon) {
-    // AFAIK you don't have to free the memory manually, but I could be wrong.
-    lock_guard<mutex> lock(last_notification_mtx);
-    tuple<string, string> notif(title, msg);
-    if (notif == last_notification)
-        return;
-    last_notification = notif;
+/** Display a freedesktop DBus notification, this blocks on the session bus. */
+static void showNotification(const Notification &notif) {
+    string msg = notif.msg;
+    if (notif.suppressed)
+        msg += "\n<i>(" + to_string(notif.suppressed) + " similar notifications were suppressed)</i>";
 
-    NotifyNotification *n = notify_notification_new(title.c_str(), msg.c_str(), icon.c_str());
+    NotifyNotification *n = notify_notification_new(notif.title.c_str(), msg.c_str(), notif.icon.c_str());
     notify_notification_set_timeout(n, 12000);
     notify_notification_set_urgency(n, NOTIFY_URGENCY_CRITICAL);
     notify_notification_set_app_name(n, "Hawck");
@@ -185,6 +1104,22 @@ void MacroDaemon::notify(string title, string msg, string icon) {
     if (!notify_notification_show(n, nullptr)) {
         syslog(LOG_INFO, "Notifications cannot be shown.");
     }
+    g_object_unref(n);
+}
+
+void MacroDaemon::notify(string title, string msg) {
+    notify(title, msg, "hawck");
+}
+
+void MacroDaemon::notify(string title, string msg, string icon) {
+    if (!notifications.push(title, msg, icon))
+        return;
+
+    lock_guard<mutex> lock(control_mtx);
+    if (control)
+        control->broadcast("{\"event\":\"notification\",\"title\":" +
+                           ControlServer::jsonString(title) + ",\"message\":" +
+                           ControlServer::jsonString(msg) + "}");
 }
 
 static void handleSigPipe(int) {}
@@ -195,16 +1130,29 @@ static void handleSigTerm(int) {
 }
 #endif
 
-bool MacroDaemon::runScript(Lua::Script *sc, const struct input_event &ev, string kbd_hid) {
+bool MacroDaemon::runScript(const ScriptEntry &ent, const struct input_event &ev,
+                             Lua::InternedString kbd_hid) {
     static bool had_stack_leak_warning = false;
     bool repeat = true;
+    Script *sc = ent.sc;
+    Allocator *alloc = sc->getAllocator();
+    uint64_t num_failed = alloc ? alloc->numFailed() : 0;
+    ScriptGC *gc = ent.gc;
+    size_t mem_before = gc ? sc->memoryUsed() : 0;
+    uint64_t call_start = monotonicNanos();
+    sc->setTimeout(milliseconds(script_timeout_ms));
+    sc->setProfiler(profile ? &profiler : nullptr);
+    running_script = sc;
 
     try {
-        auto [succ] = sc->call<bool>("__match",
-                                     (int)ev.value,
-                                     (int)ev.code,
-                                     (int)ev.type,
-                                     kbd_hid);
+        auto [succ] = ent.match((int)ev.value,
+                                (int)ev.code,
+                                (int)ev.type,
+                                kbd_hid);
+        // Memory is only ever freed by the collector, so this tells apart
+        // the calls that were slowed down by it.
+        if (gc && sc->memoryUsed() < mem_before)
+            gc->gc_calls.since(call_start);
         if (lua_gettop(sc->getL()) != 0) {
             if (!had_stack_leak_warning) {
                 syslog(LOG_WARNING,
@@ -216,19 +1164,104 @@ bool MacroDaemon::runScript(Lua::Script *sc, const struct input_event &ev, strin
             lua_settop(sc->getL(), 0);
         }
         repeat = !succ;
+    } catch (const LuaTimeoutError &e) {
+        // Keep InputD waiting for no longer than this, the event is
+        // passed through and the script gets another chance, unless
+        // it keeps doing this.
+        ent.timeouts->add();
+        auto now = steady_clock::now();
+        if (now - sc->last_timeout > 60s)
+            sc->num_timeouts = 0;
+        sc->last_timeout = now;
+        int max_timeouts = max_script_timeouts;
+        if (stop_on_err || (max_timeouts > 0 && ++sc->num_timeouts >= unsigned(max_timeouts))) {
+            sc->setEnabled(false);
+            HAWCK_LOG(LOG_WARNING, "Disabled script %s after it timed out %u times",
+                      sc->src.c_str(), sc->num_timeouts);
+            notify("Script disabled", "A script took too long to handle keys");
+        } else {
+            HAWCK_LOG(LOG_WARNING, "Script %s timed out, passing the key through",
+                      sc->src.c_str());
+        }
+        repeat = true;
     } catch (const LuaError &e) {
+        ent.errors->add();
         if (stop_on_err)
             sc->setEnabled(false);
+        // Throttle scripts that run into their memory limit, instead of
+        // having them fail on every key.
+        if (!shared_lua && alloc && alloc->numFailed() != num_failed) {
+            sc->setEnabled(false);
+            HAWCK_LOG(LOG_WARNING, "Disabled script after it ran out of memory");
+            notify("Script disabled", "A script ran into its memory limit");
+        }
         std::string report = e.fmtReport();
         if (notify_on_err)
             notify("Lua error", report);
-        syslog(LOG_ERR, "LUA:%s", report.c_str());
+        HAWCK_LOG(LOG_ERR, "LUA:%s", report.c_str());
         repeat = true;
     }
+    running_script = nullptr;
 
     return repeat;
 }
 
+bool MacroDaemon::runScriptsParallel(const ScriptTable &tbl, const struct input_event &ev,
+                                     Lua::InternedString kbd_hid) {
+    vector<const ScriptEntry *> wanted;
+    for (const ScriptEntry &ent : tbl.scripts)
+        if (ent.index.wants(ev) && ent.sc->isEnabled())
+            wanted.push_back(&ent);
+    // Testing a single script only adds to the time it takes to run it.
+    if (wanted.size() < 2)
+        return wanted.empty() || runScript(*wanted.front(), ev, kbd_hid);
+
+    // Whether the script may react to the event, those that can't tell or
+    // fail the test are run to find out.
+    auto test = [&ev, kbd_hid](const ScriptEntry *ent) noexcept {
+        if (!ent->test.isValid())
+            return true;
+        try {
+            auto [known, matches] = ent->test((int)ev.value, (int)ev.code, (int)ev.type, kbd_hid);
+            return !known || matches;
+        } catch (const LuaError &) {
+            return true;
+        }
+    };
+
+    // The first script is tested on this thread, it would only be waiting
+    // for the workers otherwise.
+    vector<future<bool>> tests;
+    tests.reserve(wanted.size());
+    for (const ScriptEntry *ent : wanted) {
+        ent->sc->setTimeout(milliseconds(script_timeout_ms));
+        ent->sc->setProfiler(nullptr);
+        if (ent != wanted.front())
+            tests.push_back(test_pool->submit([ent, &test]() { return test(ent); }));
+    }
+    // Workers may still be testing later scripts when one of them matches,
+    // none of them may be touched again before that is done.
+    struct WaitAll {
+        vector<future<bool>> &tests;
+        ~WaitAll() {
+            for (auto &t : tests)
+                if (t.valid())
+                    t.wait();
+        }
+    } wait_all {tests};
+
+    for (size_t i = 0; i < wanted.size(); i++) {
+        bool may_match = i == 0 ? test(wanted[i]) : tests[i - 1].get();
+        if (!may_match) {
+            scripts_skipped->add();
+            continue;
+        }
+        if (!runScript(*wanted[i], ev, kbd_hid))
+            return false;
+    }
+    return true;
+}
+
 void MacroDaemon::reloadAll() {
     // Disabled due to restructuring of the script load process
     #if 0
@@ -253,19 +1286,20 @@ void MacroDaemon::reloadAll() {
 void MacroDaemon::startScriptWatcher() {
     fsw.setWatchDirs(true);
     fsw.setAutoAdd(true);
-    // TODO: Display desktop notifications for these syslogs.
-    //       You'll have to evaluate the thread-safety of doing that, and you
-    //       might have to push onto a shared notification queue rather than
-    //       just sending the messages directly from here.
+    // Editors tend to write, rename and chmod a file when saving it, wait
+    // for things to calm down so that the script is only reloaded once.
+    fsw.setCoalesce(100);
+    // notify() only queues up notifications, so it is safe to call here.
     fsw.asyncWatch([this](FSEvent &ev) {
-        lock_guard<mutex> lock(scripts_mtx);
         try {
             // Don't react to the directory itself.
             if (ev.path == xdg.path(XDG_CONFIG_HOME, "scripts"))
                 return true;
+            script_reloads->add();
 
             if (ev.mask & IN_DELETE) {
                 syslog(LOG_INFO, "Deleting script: %s", ev.path.c_str());
+                lock_guard<mutex> lock(scripts_mtx);
                 unloadScript(ev.name);
             } else if (ev.mask & IN_MODIFY) {
                 syslog(LOG_INFO, "Reloading script: %s", ev.path.c_str());
@@ -278,6 +1312,7 @@ void MacroDaemon::startScriptWatcher() {
                 if (ev.stbuf.st_mode & S_IXUSR) {
                     loadScript(ev.path);
                 } else {
+                    lock_guard<mutex> lock(scripts_mtx);
                     unloadScript(ev.path);
                 }
             }
@@ -307,20 +1342,118 @@ void MacroDaemon::run() {
                    xdg.path(XDG_DATA_HOME, "cfg.lua"));
     conf.addOption("notify_on_err", &notify_on_err);
     conf.addOption("stop_on_err", &stop_on_err);
-    conf.addOption("eval_keydown", &eval_keydown);
-    conf.addOption("eval_keyup", &eval_keyup);
-    conf.addOption("eval_repeat", &eval_repeat);
-    conf.addOption("disabled", &disabled);
+    // InputD is told about the filters, so that it can skip the round trip
+    // for the events that they filter out.
+    for (auto [name, flag] : {make_pair("eval_keydown", &eval_keydown),
+                              make_pair("eval_keyup", &eval_keyup),
+                              make_pair("eval_repeat", &eval_repeat),
+                              make_pair("disabled", &disabled)}) {
+        conf.addOption<bool>(name, [this, flag = flag](bool on) {
+            if (flag->exchange(on) == on)
+                return;
+            lock_guard<mutex> lock(scripts_mtx);
+            sendInterest();
+        });
+    }
+    conf.addOption("script_timeout_ms", &script_timeout_ms);
+    conf.addOption("max_script_timeouts", &max_script_timeouts);
+    conf.addOption<bool>("profile", [this](bool on) {
+        // Every run of the profiler starts from scratch.
+        if (on && !profile)
+            profiler.clear();
+        profile = on;
+    });
     conf.addOption<string>("keymap", [this](string) {reloadAll();});
+    conf.addOption<int>("log_level", [](int prio) { Log::setLevel(prio); });
+    conf.addOption<int>("memory_limit_kb", [this](int kb) {
+        lock_guard<mutex> lock(scripts_mtx);
+        memory_limit_kb = kb;
+        for (auto &[name, sc] : scripts)
+            applyMemoryLimit(name, sc);
+        if (shared_lua)
+            applyMemoryLimit("", shared_lua.get());
+    });
+    conf.addOption<map<string, int>>("script_memory_limits_kb", [this](map<string, int> limits) {
+        lock_guard<mutex> lock(scripts_mtx);
+        script_memory_limits_kb = limits;
+        for (auto &[name, sc] : scripts)
+            applyMemoryLimit(name, sc);
+    });
+    conf.addOption<map<string, int>>("gc", [this](map<string, int> settings) {
+        lock_guard<mutex> lock(scripts_mtx);
+        gc_settings = settings;
+        gc_settings_changed = true;
+    });
+    conf.addOption<map<string, map<string, int>>>("script_gc", [this](map<string, map<string, int>> settings) {
+        lock_guard<mutex> lock(scripts_mtx);
+        script_gc_settings = settings;
+        gc_settings_changed = true;
+    });
+    conf.addQuery("latency", [this]() { return latency.table(); });
+    conf.addQuery("gc", [this]() { return gcTable(); });
+    conf.addQuery("memory", [this]() { return memoryTable(); });
+    conf.addQuery("profile_scripts", [this]() { return profiler.scriptTable(); });
+    conf.addQuery("profile_patterns", [this]() { return profiler.patternTable(); });
+    conf.addQuery("profile_lines", [this]() { return profiler.lineTable(); });
     conf.start();
 
+    // Serves the same requests as the FIFOs, to any number of clients.
+    try {
+        auto srv = mkuniq(new ControlServer(xdg.path(XDG_RUNTIME_DIR, "control.sock"),
+                                            [&conf](const char *msg, size_t sz) {
+                                                return conf.handleMessage(msg, sz);
+                                            }));
+        srv->start();
+        lock_guard<mutex> lock(control_mtx);
+        control = std::move(srv);
+    } catch (const SocketError& e) {
+        syslog(LOG_ERR, "Unable to start control socket: %s", e.what());
+    } catch (const SystemError& e) {
+        syslog(LOG_ERR, "Unable to start control socket: %s", e.what());
+    }
+
+    try {
+        stats = mkuniq(new StatsServer(xdg.path(XDG_RUNTIME_DIR, "stats.sock"), metrics));
+        stats->start();
+    } catch (const SocketError& e) {
+        syslog(LOG_ERR, "Unable to start stats socket: %s", e.what());
+    } catch (const SystemError& e) {
+        syslog(LOG_ERR, "Unable to start stats socket: %s", e.what());
+    }
+
     startScriptWatcher();
+    // The watcher threads have been started, so only the thread that
+    // handles keys runs with a real-time priority.
+    rt.applyToThisThread("event");
+    if (parallel_scripts > 0 && shared_lua) {
+        syslog(LOG_WARNING, "Scripts that share a Lua state cannot be tested in parallel");
+    } else if (parallel_scripts > 0) {
+        // The workers are on the path of every key, so they get the same
+        // priority. They are not pinned to the CPUs of the event thread
+        // they were created by, where they would only wait for each other.
+        RealtimeOptions worker_rt = rt;
+        worker_rt.cpus.clear();
+        test_pool = mkuniq(new ThreadPool(parallel_scripts, [worker_rt]() {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, &set);
+            if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+                syslog(LOG_WARNING, "Unable to reset CPU affinity of test thread: %s", strerror(err));
+            worker_rt.applyToThisThread("test");
+        }));
+        syslog(LOG_INFO, "Testing scripts on %zu threads", test_pool->size());
+    }
 
     KBDAction action;
     struct input_event &ev = action.ev;
     KBDB kbdb;
 
     getConnection();
+    // Learn about the connected keyboards before the first key arrives,
+    // and about new ones as they are plugged in.
+    kbdb.refresh();
+    kbdb.startWatcher();
 
     syslog(LOG_INFO, "Starting main loop");
 
@@ -328,18 +1461,51 @@ void MacroDaemon::run() {
         try {
             bool repeat = true;
 
+            // Actions that wait for a key see every key, not only the
+            // ones that their script matches on.
+            if (!stale_interest.empty())
+                refreshInterest();
+
+            // Timers fire between keys, while waiting for the next one.
+            int timer_ms = timeUntilTimer();
+            if (timer_ms >= 0 && !kbd_com->waitReadable(timer_ms)) {
+                runTimers();
+                continue;
+            }
+
             kbd_com->recv(&action);
-            string kbd_hid = kbdb.getID(&action.dev_id);
+            action.ts.recv = monotonicNanos();
+            events_handled->add();
+            socket_in_lat->between(action.ts.sent, action.ts.recv);
+            remote_udev.begin(action);
+            key_state.update(ev);
 
             if (!( (!eval_keydown && ev.value == 1) ||
-                   (!eval_keyup && ev.value == 0) ) && !disabled)
+                   (!eval_keyup && ev.value == 0) ||
+                   (!eval_repeat && ev.value == 2) ) && !disabled)
             {
-                lock_guard<mutex> lock(scripts_mtx);
-                // Look for a script match.
-                for (auto &[_, sc] : scripts) {
-                    (void) _;
-                    if (sc->isEnabled() && !(repeat = runScript(sc, ev, kbd_hid)))
-                        break;
+                // Only a shared Lua state needs the lock, as scripts are
+                // loaded into it from other threads.
+                unique_lock<mutex> lock(scripts_mtx, defer_lock);
+                if (shared_lua)
+                    lock.lock();
+                auto tbl = script_table.read();
+                // Events that no script can react to skip Lua entirely.
+                if (tbl->global_index.wants(ev)) {
+                    uint64_t lua_start = monotonicNanos();
+                    KBDHandle kbd = kbdb.getID(&action.dev_id);
+                    Lua::InternedString kbd_hid {kbd.num, kbd.id};
+                    // Look for a script match.
+                    if (test_pool && !profile) {
+                        repeat = runScriptsParallel(*tbl, ev, kbd_hid);
+                    } else {
+                        for (const ScriptEntry &ent : tbl->scripts) {
+                            if (ent.index.wants(ev) && ent.sc->isEnabled() &&
+                                !(repeat = runScript(ent, ev, kbd_hid)))
+                                break;
+                        }
+                    }
+                    lua_lat->since(lua_start);
                 }
             }
 
@@ -347,13 +1513,29 @@ void MacroDaemon::run() {
                 remote_udev.emit(&ev);
 
             remote_udev.done();
+            total_lat->since(action.ts.recv);
+
+            // Timers started by the key may already be due.
+            runTimers();
+
+            // Collect garbage between keys, rather than while handling them.
+            gcIdle();
         } catch (const SocketError& e) {
             // Reset connection
-            syslog(LOG_ERR, "Socket error: %s", e.what());
+            HAWCK_LOG(LOG_ERR, "Socket error: %s", e.what());
+            socket_errors->add();
             notify("Socket error", "Connection to InputD timed out, reconnecting ...");
             getConnection();
         }
     }
 
+    {
+        // The control server uses conf, which is about to go away.
+        lock_guard<mutex> lock(control_mtx);
+        control.reset();
+    }
+    stats.reset();
+    test_pool.reset();
+
     syslog(LOG_INFO, "macrod exiting ...");
 }
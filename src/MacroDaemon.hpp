@@ -36,6 +36,9 @@
 #include <vector>
 #include <string>
 #include <chrono>
+#include <memory>
+#include <thread>
+#include <map>
 
 #include "UNIXSocket.hpp"
 #include "KBDAction.hpp"
@@ -44,6 +47,20 @@
 #include "FSWatcher.hpp"
 #include "FIFOWatcher.hpp"
 #include "XDG.hpp"
+#include "Latency.hpp"
+#include "Metrics.hpp"
+#include "StatsServer.hpp"
+#include "MatchIndex.hpp"
+#include "KeyState.hpp"
+#include "RCU.hpp"
+#include "ScriptCache.hpp"
+#include "Keymap.hpp"
+#include "ControlServer.hpp"
+#include "NotificationQueue.hpp"
+#include "Realtime.hpp"
+#include "TimerWheel.hpp"
+#include "DesktopIndex.hpp"
+#include "ThreadPool.hpp"
 
 /** Macro daemon.
  *
@@ -53,12 +70,34 @@
 class MacroDaemon {
 private:
     UNIXServer kbd_srv;
+    /** Connection to InputD, only replaced while holding scripts_mtx. */
     UNIXSocket<KBDAction> *kbd_com = nullptr;
     std::mutex scripts_mtx;
     std::unordered_map<std::string, Lua::Script *> scripts;
+    /** Lua state that all scripts run in when they share one, only used
+     *  while holding scripts_mtx. */
+    std::unique_ptr<Lua::Script> shared_lua;
+    /** Key events that each script can react to, by script name. */
+    std::unordered_map<std::string, MatchIndex> script_index;
+    /** Keys held down, as seen in the events from InputD. Shared by all
+     *  scripts through __keyIsDown() and __keysDown(), see kbd.lua */
+    KeyState key_state;
+    /** Loads the initial set of scripts, see initScriptDir() */
+    std::thread script_loader;
     RemoteUDevice remote_udev;
     FSWatcher fsw;
     XDG xdg;
+    /** Compiled scripts, so that unchanged .hwk files don't have to go
+     *  through hwk2lua again. */
+    ScriptCache script_cache;
+    /** Keymaps shared by all scripts, by language. */
+    std::mutex keymaps_mtx;
+    std::unordered_map<std::string, std::shared_ptr<Keymap>> keymaps;
+    /** Binary keymap tables, so that keymaps are only parsed once. */
+    ScriptCache keymap_cache;
+    /** Installed applications, shared by all scripts through
+     *  __desktopEntry(), see app.lua */
+    DesktopIndex desktop_index;
 
     std::atomic<bool> notify_on_err;
     std::atomic<bool> stop_on_err;
@@ -66,9 +105,153 @@ private:
     std::atomic<bool> eval_keyup;
     std::atomic<bool> eval_repeat;
     std::atomic<bool> disabled;
+    /** Time that a script may spend on a single event, in milliseconds. */
+    std::atomic<int> script_timeout_ms;
+    /** Scripts are disabled after this many timeouts, unless a minute
+     *  has passed since the last one. 0 to never disable them. */
+    std::atomic<int> max_script_timeouts;
+    /** Memory limit of each Lua state in KiB, 0 for none. */
+    std::atomic<int> memory_limit_kb;
+    /** Memory limits of individual scripts in KiB, by script name,
+     *  these override memory_limit_kb. Requires scripts_mtx. */
+    std::map<std::string, int> script_memory_limits_kb;
 
-    std::mutex last_notification_mtx;
-    std::tuple<std::string, std::string> last_notification;
+    /** Garbage collection of a Lua state, see gcIdle() */
+    struct ScriptGC {
+        Lua::GCPolicy policy;
+        /** Memory in use when the last manual cycle finished. */
+        size_t mem_after_gc = 0;
+        std::atomic<uint64_t> cycles {0};
+        /** Manual steps taken between keys. */
+        LatencyHistogram steps;
+        /** Script calls during which the collector freed memory. */
+        LatencyHistogram gc_calls;
+    };
+    /** GC state by the script that owns the Lua state, which is
+     *  shared_lua if the state is shared. Requires scripts_mtx. */
+    std::unordered_map<Lua::Script *, std::unique_ptr<ScriptGC>> script_gc;
+    /** Set when the GC settings change, the main loop then applies
+     *  them, as it is the only one that may touch the Lua states. */
+    std::atomic<bool> gc_settings_changed {false};
+
+    /** Signature of __match(value, code, type, keyboard) */
+    using MatchSig = std::tuple<bool>(int, int, int, Lua::InternedString);
+    /** Signature of __test(value, code, type, keyboard), returning whether
+     *  the outcome is known and whether the script would match. */
+    using TestSig = std::tuple<bool, bool>(int, int, int, Lua::InternedString);
+
+    /** A script as seen by the main loop. */
+    struct ScriptEntry {
+        Lua::Script *sc;
+        /** GC state of the Lua state of the script, may be nullptr. */
+        ScriptGC *gc;
+        MatchIndex index;
+        Lua::Script::Prepared<MatchSig> match;
+        /** Invalid for scripts without __test(), they are always run. */
+        Lua::Script::Prepared<TestSig> test;
+        /** Lua errors and timeouts of the script, by its name. */
+        MetricCounter *errors;
+        MetricCounter *timeouts;
+    };
+    /** Snapshot of the scripts, the main loop reads it without locks. */
+    struct ScriptTable {
+        /** Scripts in the order they are run. */
+        std::vector<ScriptEntry> scripts;
+        /** Union of all script indices, events outside of it skip Lua.
+         *  Empty until the first scripts are published. */
+        MatchIndex global_index;
+
+        inline ScriptTable() noexcept {
+            global_index.clear();
+        }
+    };
+    /** Published by rebuildIndex(), scripts and their GC state may only
+     *  be deleted once they have been removed from it. */
+    RCUPtr<ScriptTable> script_table;
+    /** GC settings for all scripts, and for individual scripts by name,
+     *  see GCPolicy::update(). Requires scripts_mtx. */
+    std::map<std::string, int> gc_settings;
+    std::map<std::string, std::map<std::string, int>> script_gc_settings;
+
+    /** Time spent in each stage of handling an event, available
+     *  through the LuaConfig FIFO with query("latency") */
+    LatencyStats latency;
+    LatencyHistogram *socket_in_lat,
+                     *lua_lat,
+                     *total_lat;
+
+    /** Counters served on the stats socket, see docs/hawck-macrod.md */
+    Metrics metrics;
+    MetricCounter *events_handled,
+                  *script_reloads,
+                  *connections,
+                  *socket_errors,
+                  *scripts_skipped;
+    /** Only exists while run() is. */
+    std::unique_ptr<StatsServer> stats;
+
+    /** Where scripts spend their time, while config.profile is set,
+     *  see query("profile_scripts") */
+    Lua::Profiler profiler;
+    std::atomic<bool> profile {false};
+
+    /** Desktop notifications, shown from a background thread so that
+     *  Lua errors on the hot path never wait for DBus. */
+    NotificationQueue notifications;
+
+    std::mutex control_mtx;
+    /** Control socket, notifications are also pushed to its clients.
+     *  Only exists while run() is, requires control_mtx. */
+    std::unique_ptr<ControlServer> control;
+
+    /** Scheduling of the main loop, see setRealtime() */
+    RealtimeOptions rt;
+
+    /** Threads that test scripts in parallel, see setParallelScripts() */
+    unsigned parallel_scripts = 0;
+    /** Only exists while run() is, and only with parallel_scripts. */
+    std::unique_ptr<ThreadPool> test_pool;
+
+    /** A timer that a script started with after() or every(). */
+    struct ScriptTimer {
+        Lua::Script *sc;
+        /** Registry reference to the callback, in the Lua state of sc. */
+        int fn_ref;
+        /** Time between calls in milliseconds, 0 if it only runs once. */
+        uint32_t interval_ms;
+        /** When the timer is due, in milliseconds of monotonic time. */
+        uint64_t when;
+        /** Timers started while their script is loading are not in the
+         *  wheel until it is published, see armTimers(). The first call
+         *  is then `delay_ms` later. */
+        bool armed;
+        uint32_t delay_ms;
+    };
+    /** Timers are started by the main loop, and by the threads that load
+     *  scripts. Scripts that are deleted on other threads take their
+     *  timers with them. */
+    std::mutex timers_mtx;
+    /** Requires timers_mtx. */
+    TimerWheel timer_wheel;
+    /** Timers by id, those that are gone are ignored by the wheel.
+     *  Requires timers_mtx. */
+    std::unordered_map<TimerWheel::Id, ScriptTimer> timers;
+    TimerWheel::Id next_timer_id = 1;
+    /** Timers that may exist at once, for all scripts together. */
+    static constexpr size_t max_timers = 4096;
+    /** Script that is run by the main loop, or that is being loaded,
+     *  which timers started from Lua belong to. */
+    static thread_local Lua::Script *running_script;
+    /** Set while running_script is being loaded. */
+    static thread_local bool script_loading;
+    /** Scripts whose interest changed while handling a key or a timer,
+     *  only used by the main loop. */
+    std::vector<Lua::Script *> stale_interest;
+
+    /** Processes started by scripts with __spawn(), by pid, with whether
+     *  nobody waits for them anymore. Requires children_mtx. */
+    std::mutex children_mtx;
+    std::unordered_map<pid_t, bool> children;
 
     /** Display freedesktop DBus notification. */
     void notify(std::string title,
@@ -79,29 +262,170 @@ private:
                 std::string msg,
                 std::string icon);
 
-    /** Run a script match on an input event.
+    /** Run a script match on an input event, events that the script
+     *  takes too long to handle are passed through.
      *
-     * @param sc Script to be executed.
+     * @param ent Script to be executed.
      * @param ev Event to pass on to the script.
-     * @param kbd_hid Human readable keyboard ID.
+     * @param kbd_hid Human readable keyboard ID, see KBDB::getID()
      * @return True if the key event should be repeated.
      */
-    bool runScript(Lua::Script *sc, const struct input_event &ev, std::string kbd_hid);
+    bool runScript(const ScriptEntry &ent, const struct input_event &ev,
+                   Lua::InternedString kbd_hid);
 
-    /** Load a Lua script. */
+    /**
+     * Test the scripts that want an event with __test() on test_pool, and
+     * run __match only for those that may react to it, in order. Scripts
+     * that don't get to see the event in order are still tested, so they
+     * must not be able to tell.
+     *
+     * @return True if the key event should be repeated.
+     */
+    bool runScriptsParallel(const ScriptTable &tbl, const struct input_event &ev,
+                            Lua::InternedString kbd_hid);
+
+    /** Load a Lua script and publish it, scripts_mtx is only held while
+     *  publishing it unless the Lua state is shared. */
     void loadScript(const std::string &path);
 
+    /**
+     * Create a Lua state and run a script in it, without touching the set
+     * of published scripts. May be called from several threads at once.
+     *
+     * @return The script, or nullptr if the file should not be loaded.
+     */
+    std::unique_ptr<Lua::Script> prepareScript(const std::string &path);
+
+    /** Set up a fresh Lua state for running scripts in. */
+    void initLuaState(lua_State *L);
+
+    /** Make a prepared script visible to the main loop, replacing any
+     *  script with the same name. Requires scripts_mtx, and a call to
+     *  rebuildIndex() afterwards.
+     *
+     * @return The replaced script, to be passed to retireScript() after
+     *         rebuildIndex().
+     */
+    std::unique_ptr<Lua::Script> publishScript(const std::string &path,
+                       std::unique_ptr<Lua::Script> sc,
+                       const MatchIndex &index);
+
     void loadHawckScript(const std::string &path);
 
-    /** Unload a Lua script */
+    /** Unload a Lua script, requires scripts_mtx. */
     void unloadScript(const std::string &path) noexcept;
 
-    /** Initialize a script directory. */
+    /** Delete a script that was removed from the script table by
+     *  rebuildIndex(), requires scripts_mtx. */
+    void retireScript(std::unique_ptr<Lua::Script> sc) noexcept;
+
+    /** Get the keymap for a language, it is only parsed if it is
+     *  not already loaded or cached. */
+    std::shared_ptr<Keymap> getKeymap(const std::string &lang);
+
+    /** Implementation of __keymap(lang) in script states, see Keymap.lua */
+    static int luaKeymap(lua_State *L);
+
+    /** Implementation of __desktopEntry(id) in script states, returns
+     *  nil or a table with the keys of [Desktop Entry] at index 0, and
+     *  those of each [Desktop Action <name>] by name. */
+    static int luaDesktopEntry(lua_State *L);
+
+    /** Implementation of __keyIsDown(code) in script states. */
+    static int luaKeyIsDown(lua_State *L);
+
+    /** Implementation of __keysDown() in script states, returns a table
+     *  with the held down key codes as keys. */
+    static int luaKeysDown(lua_State *L);
+
+    /** Implementation of after(ms, fn) and every(ms, fn) in script states,
+     *  the second upvalue tells them apart. Returns an id for cancel(). */
+    static int luaStartTimer(lua_State *L);
+
+    /** Implementation of cancel(id) in script states, returns whether
+     *  there was such a timer. */
+    static int luaCancelTimer(lua_State *L);
+
+    /** Implementation of __spawn(cmd) in script states, which starts a
+     *  shell command and returns its pid, see async.lua */
+    static int luaSpawn(lua_State *L);
+
+    /** Implementation of __reap(pid, detach) in script states, returns
+     *  the exit status of a process from __spawn(), or nil while it is
+     *  running. With detach, the process is reaped once it exits. */
+    static int luaReap(lua_State *L);
+
+    /** Implementation of __interestChanged() in script states, called
+     *  when __interest() of the running script would return something
+     *  else, e.g because an action waits for any key, see async.lua */
+    static int luaInterestChanged(lua_State *L);
+
+    /** Index the scripts in stale_interest anew, and tell InputD. */
+    void refreshInterest();
+
+    /** Reap the processes that nobody waits for, requires children_mtx. */
+    void reapDetached() noexcept;
+
+    /** Milliseconds until the next timer is due, -1 if there are none. */
+    int timeUntilTimer();
+
+    /** Run the callbacks of the timers that are due. Their output is not
+     *  a reply to any key, it is sent to InputD on its own. */
+    void runTimers();
+
+    /** Forget the timers of a script that is being deleted, requires
+     *  scripts_mtx. */
+    void dropTimers(Lua::Script *sc) noexcept;
+
+    /** Start the timers that published scripts started while they were
+     *  loading, requires scripts_mtx. */
+    void armTimers() noexcept;
+
+    /** Apply the configured memory limit to a script, requires scripts_mtx. */
+    void applyMemoryLimit(const std::string &name, Lua::Script *sc) noexcept;
+
+    /** Memory usage of the Lua states, for the "memory" query. */
+    StatsTable memoryTable();
+
+    /** Apply the configured GC policy to a script, requires scripts_mtx. */
+    void applyGCPolicy(const std::string &name, Lua::Script *sc) noexcept;
+
+    /** Get the GC state of the Lua state that a script runs in. */
+    ScriptGC *gcState(Lua::Script *sc) noexcept;
+
+    /** Forget about the GC state of a script that is being deleted. */
+    void dropGCState(Lua::Script *sc) noexcept;
+
+    /** Run manual garbage collection steps until either InputD sends
+     *  another key or no collection is due. */
+    void gcIdle();
+
+    /** GC statistics of the Lua states, for the "gc" query. */
+    StatsTable gcTable();
+
+    /** Ask a script which key events it can react to. */
+    MatchIndex buildIndex(Lua::Script *sc);
+
+    /** Publish a new script_table after scripts were loaded or unloaded,
+     *  and send the new interest to InputD. Requires scripts_mtx, returns
+     *  once the main loop has stopped using the old table. */
+    void rebuildIndex();
+
+    /** Initialize a script directory, the scripts are loaded in the
+     *  background on a thread pool and published all at once. */
     void initScriptDir(const std::string &dir_path);
 
     /** Get a connection to listen for keys on. */
     void getConnection();
 
+    /** Answer the KBDHello from InputD on a new connection, and attach
+     *  to shared memory if it was offered. */
+    void handshake(UNIXSocket<KBDAction> *com);
+
+    /** Tell InputD which keys the scripts may react to, so that it can
+     *  keep all other keys to itself. Requires scripts_mtx. */
+    void sendInterest() noexcept;
+
     /** Reload all scripts from their sources, this may be necessary
      *  if an important configuration variable like the keymap is set. */
     void reloadAll();
@@ -109,9 +433,29 @@ private:
     void startScriptWatcher();
 
 public:
-    MacroDaemon();
+    /**
+     * @param share_lua_state Run all scripts in a single Lua state, each
+     *                        in its own environment, instead of giving
+     *                        each script a Lua state of its own.
+     * @param sock_path Socket to listen on for InputD, several MacroD
+     *                  instances can be attached through InputD routes.
+     */
+    explicit MacroDaemon(bool share_lua_state = false,
+                         const std::string &sock_path = "/var/lib/hawck-input/kbd.sock");
     ~MacroDaemon();
 
+    /** Set how the main loop is scheduled, must be called before run(). */
+    inline void setRealtime(const RealtimeOptions &opts) {
+        rt = opts;
+    }
+
+    /** Test scripts on `num_threads` threads before running the ones
+     *  that match, 0 to run them one by one. Ignored with a shared Lua
+     *  state, must be called before run(). */
+    inline void setParallelScripts(unsigned num_threads) {
+        parallel_scripts = num_threads;
+    }
+
     /** Run the mainloop. */
     void run();
 };
@@ -0,0 +1,108 @@
+/** @file MatchIndex.hpp
+ *
+ * @brief Index of the key events that a script can react to.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <linux/input.h>
+}
+
+#include <array>
+#include <vector>
+
+/**
+ * Set of (code, value) pairs of EV_KEY events, built from the constraints
+ * that a script reports through its __interest() function.
+ */
+class MatchIndex {
+    /** masks[code] has bit `value` set for every value that is wanted. */
+    std::array<uint8_t, KEY_CNT> masks;
+    bool match_all;
+
+public:
+    static constexpr int num_values = 3;
+    static constexpr uint8_t all_values = (1 << num_values) - 1;
+
+    /** Create an index matching every event. */
+    inline MatchIndex() noexcept {
+        setAll();
+    }
+
+    /**
+     * Create an index from a list of `code << 3 | mask` entries, the
+     * format returned by __interest().
+     */
+    explicit inline MatchIndex(const std::vector<int> &entries) noexcept {
+        clear();
+        for (int e : entries)
+            add(e >> 3, e & all_values);
+    }
+
+    inline void clear() noexcept {
+        masks.fill(0);
+        match_all = false;
+    }
+
+    inline void setAll() noexcept {
+        masks.fill(all_values);
+        match_all = true;
+    }
+
+    inline bool matchesAll() const noexcept {
+        return match_all;
+    }
+
+    /** Want events with key `code` for every value in `mask`, codes
+     *  that are out of range make the index match everything. */
+    inline void add(int code, uint8_t mask) noexcept {
+        if (code < 0 || code >= KEY_CNT) {
+            setAll();
+            return;
+        }
+        masks[code] |= mask & all_values;
+    }
+
+    inline void merge(const MatchIndex &other) noexcept {
+        if (other.match_all) {
+            setAll();
+            return;
+        }
+        for (int i = 0; i < KEY_CNT; i++)
+            masks[i] |= other.masks[i];
+    }
+
+    /** Whether any value of key `code` is wanted. */
+    inline bool wantsCode(int code) const noexcept {
+        return code < 0 || code >= KEY_CNT || masks[code];
+    }
+
+    /** Whether the event might be matched, always true for events
+     *  that are not EV_KEY. */
+    inline bool wants(const struct input_event &ev) const noexcept {
+        if (ev.type != EV_KEY || ev.code >= KEY_CNT ||
+            ev.value < 0 || ev.value >= num_values)
+            return true;
+        return masks[ev.code] & (1 << ev.value);
+    }
+
+    /** Bitmap of key codes with at least one wanted value, in the
+     *  format of KBD_FRAME_INTEREST. */
+    inline std::vector<uint8_t> codeBitmap() const {
+        std::vector<uint8_t> bits((KEY_CNT + 7) / 8, 0);
+        for (int i = 0; i < KEY_CNT; i++)
+            if (masks[i])
+                bits[i / 8] |= 1 << (i % 8);
+        return bits;
+    }
+
+    /** Number of key codes with at least one wanted value. */
+    inline int size() const noexcept {
+        int n = 0;
+        for (auto m : masks)
+            n += m != 0;
+        return n;
+    }
+};
@@ -0,0 +1,147 @@
+#include <sstream>
+#include <stdexcept>
+
+#include "Metrics.hpp"
+
+using namespace std;
+
+int MetricCounter::shardIndex() noexcept {
+    static atomic<unsigned> next_shard {0};
+    thread_local int idx = int(next_shard.fetch_add(1, memory_order_relaxed) % num_shards);
+    return idx;
+}
+
+uint64_t MetricCounter::value() const noexcept {
+    uint64_t sum = 0;
+    for (const auto &shard : shards)
+        sum += shard.n.load(memory_order_relaxed);
+    return sum;
+}
+
+string Metrics::formatLabels(const MetricLabels &labels) {
+    if (labels.empty())
+        return "";
+    string out = "{";
+    for (const auto &[name, value] : labels) {
+        if (out.size() > 1)
+            out += ",";
+        out += name + "=\"";
+        for (char c : value) {
+            switch (c) {
+                case '\\': out += "\\\\"; break;
+                case '"': out += "\\\""; break;
+                case '\n': out += "\\n"; break;
+                default: out += c;
+            }
+        }
+        out += "\"";
+    }
+    return out + "}";
+}
+
+Metrics::Series &Metrics::series(const string &name, const string &help, Kind kind,
+                                 const MetricLabels &labels, bool *created)
+{
+    auto it = families.find(name);
+    if (it == families.end())
+        it = families.emplace(name, Family{help, kind, {}}).first;
+    else if (it->second.kind != kind)
+        throw invalid_argument("Metric registered twice with different types: " + name);
+    auto [sit, inserted] = it->second.series.try_emplace(formatLabels(labels));
+    if (created)
+        *created = inserted;
+    return sit->second;
+}
+
+MetricCounter &Metrics::counter(const string &name, const string &help,
+                                const MetricLabels &labels)
+{
+    lock_guard<mutex> lock(mtx);
+    bool created;
+    Series &s = series(name, help, METRIC_COUNTER, labels, &created);
+    if (created)
+        s.counter = make_unique<MetricCounter>();
+    if (!s.counter)
+        throw invalid_argument("Metric is not a native counter: " + name);
+    return *s.counter;
+}
+
+LatencyHistogram &Metrics::histogram(const string &name, const string &help,
+                                     const MetricLabels &labels)
+{
+    lock_guard<mutex> lock(mtx);
+    bool created;
+    Series &s = series(name, help, METRIC_SUMMARY, labels, &created);
+    if (created) {
+        s.owned_hist = make_unique<LatencyHistogram>();
+        s.hist = s.owned_hist.get();
+    }
+    if (!s.owned_hist)
+        throw invalid_argument("Histogram is owned by someone else: " + name);
+    return *s.owned_hist;
+}
+
+void Metrics::addHistogram(const string &name, const string &help,
+                           const LatencyHistogram &hist, const MetricLabels &labels)
+{
+    lock_guard<mutex> lock(mtx);
+    Series &s = series(name, help, METRIC_SUMMARY, labels);
+    if (s.owned_hist)
+        throw invalid_argument("Histogram is owned by the registry: " + name);
+    s.hist = &hist;
+}
+
+void Metrics::addCounter(const string &name, const string &help,
+                         function<double()> read, const MetricLabels &labels)
+{
+    lock_guard<mutex> lock(mtx);
+    Series &s = series(name, help, METRIC_COUNTER, labels);
+    if (s.counter)
+        throw invalid_argument("Counter is owned by the registry: " + name);
+    s.read = read;
+}
+
+void Metrics::addGauge(const string &name, const string &help,
+                       function<double()> read, const MetricLabels &labels)
+{
+    lock_guard<mutex> lock(mtx);
+    Series &s = series(name, help, METRIC_GAUGE, labels);
+    s.read = read;
+}
+
+/** Add a label to an already formatted label set. */
+static string withLabel(const string &labels, const string &label) {
+    if (labels.empty())
+        return "{" + label + "}";
+    return labels.substr(0, labels.size() - 1) + "," + label + "}";
+}
+
+string Metrics::format() const {
+    static const char *kind_names[] = {"counter", "gauge", "summary"};
+    static const pair<double, const char *> quantiles[] = {
+        {50, "0.5"}, {90, "0.9"}, {99, "0.99"},
+    };
+
+    stringstream ss;
+    // Enough digits for counters to be printed as integers.
+    ss.precision(15);
+    lock_guard<mutex> lock(mtx);
+    for (const auto &[name, fam] : families) {
+        ss << "# HELP " << name << " " << fam.help << "\n";
+        ss << "# TYPE " << name << " " << kind_names[fam.kind] << "\n";
+        for (const auto &[labels, s] : fam.series) {
+            if (s.hist) {
+                for (const auto &[p, q] : quantiles)
+                    ss << name << withLabel(labels, string("quantile=\"") + q + "\"") << " "
+                       << double(s.hist->percentile(p)) / 1e9 << "\n";
+                ss << name << "_sum" << labels << " " << double(s.hist->sum()) / 1e9 << "\n";
+                ss << name << "_count" << labels << " " << s.hist->count() << "\n";
+            } else if (s.counter) {
+                ss << name << labels << " " << s.counter->value() << "\n";
+            } else {
+                ss << name << labels << " " << s.read() << "\n";
+            }
+        }
+    }
+    return ss.str();
+}
@@ -0,0 +1,131 @@
+/** @file Metrics.hpp
+ *
+ * @brief Always-on counters for the daemons, in the Prometheus text format.
+ *
+ * Counters are updated from the event loops, so updating one is a relaxed
+ * increment of a cache line that the thread has to itself. The shards are
+ * only summed up when the metrics are read, which is done by StatsServer
+ * from a thread of its own.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Latency.hpp"
+
+/**
+ * Counter that many threads can increment without contending on it.
+ *
+ * Every thread gets a shard of its own, unless there are more than
+ * num_shards of them, in which case some threads share shards.
+ */
+class MetricCounter {
+    static constexpr int num_shards = 16;
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> n {0};
+    };
+    Shard shards[num_shards];
+
+    /** Shard of the calling thread, threads are handed out shards in the
+     *  order that they first touch a counter. */
+    static int shardIndex() noexcept;
+
+public:
+    MetricCounter() noexcept = default;
+
+    MetricCounter(const MetricCounter&) = delete;
+    MetricCounter& operator=(const MetricCounter&) = delete;
+
+    inline void add(uint64_t n = 1) noexcept {
+        shards[shardIndex()].n.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /** Sum of all shards, increments that race with this may or may not
+     *  be included. */
+    uint64_t value() const noexcept;
+};
+
+/** Label names and values of a metric, in the order they are printed. */
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+/**
+ * Registry of named metrics.
+ *
+ * Metrics are usually registered before the event loop starts, references
+ * returned by the registry stay valid for its lifetime. Registering a
+ * metric that already exists with the same labels returns the existing one,
+ * so a script that is loaded again keeps its counters.
+ */
+class Metrics {
+    enum Kind {
+        METRIC_COUNTER,
+        METRIC_GAUGE,
+        METRIC_SUMMARY,
+    };
+
+    struct Series {
+        std::unique_ptr<MetricCounter> counter;
+        std::unique_ptr<LatencyHistogram> owned_hist;
+        const LatencyHistogram *hist = nullptr;
+        std::function<double()> read;
+    };
+
+    struct Family {
+        std::string help;
+        Kind kind;
+        /** Series by their formatted labels, i.e {device="1:2"} */
+        std::map<std::string, Series> series;
+    };
+
+    mutable std::mutex mtx;
+    std::map<std::string, Family> families;
+
+    /**
+     * Get, or create, a series.
+     *
+     * @throws std::invalid_argument If the name is already used for a
+     *         metric of another kind.
+     */
+    Series &series(const std::string &name, const std::string &help, Kind kind,
+                   const MetricLabels &labels, bool *created = nullptr);
+
+    /** Format labels as {name="value",...}, or "" if there are none. */
+    static std::string formatLabels(const MetricLabels &labels);
+
+public:
+    /** Get, or create, a counter. */
+    MetricCounter &counter(const std::string &name, const std::string &help,
+                           const MetricLabels &labels = {});
+
+    /** Get, or create, a histogram of durations, exported as a summary
+     *  in seconds. */
+    LatencyHistogram &histogram(const std::string &name, const std::string &help,
+                                const MetricLabels &labels = {});
+
+    /** Export a histogram that is owned by someone else, it must outlive
+     *  the registry. */
+    void addHistogram(const std::string &name, const std::string &help,
+                      const LatencyHistogram &hist, const MetricLabels &labels = {});
+
+    /** Export a counter that is kept elsewhere, `read` is called from the
+     *  thread reading the metrics. */
+    void addCounter(const std::string &name, const std::string &help,
+                    std::function<double()> read, const MetricLabels &labels = {});
+
+    /** Export a value that can go up and down, `read` is called from the
+     *  thread reading the metrics. */
+    void addGauge(const std::string &name, const std::string &help,
+                  std::function<double()> read, const MetricLabels &labels = {});
+
+    /** All metrics in the Prometheus text exposition format. */
+    std::string format() const;
+};
@@ -0,0 +1,88 @@
+#include <algorithm>
+
+#include "NotificationQueue.hpp"
+
+using namespace std;
+
+NotificationQueue::NotificationQueue(ShowFn show, Milliseconds min_interval, size_t max_pending)
+    : show(show),
+      min_interval(min_interval),
+      max_pending(max_pending),
+      worker([this]() { run(); })
+{}
+
+NotificationQueue::~NotificationQueue() {
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+bool NotificationQueue::push(const string &title, const string &msg, const string &icon) {
+    lock_guard<mutex> lock(mtx);
+    if (title == last_title && msg == last_msg)
+        return false;
+    last_title = title;
+    last_msg = msg;
+
+    auto it = find_if(pending.begin(), pending.end(), [&](const Notification &n) {
+        return n.title == title;
+    });
+    if (it != pending.end()) {
+        it->msg = msg;
+        it->icon = icon;
+        it->suppressed++;
+        return true;
+    }
+    if (pending.size() >= max_pending)
+        return false;
+    pending.push_back({title, msg, icon, 0});
+    cv.notify_one();
+    return true;
+}
+
+void NotificationQueue::run() {
+    unique_lock<mutex> lock(mtx);
+    while (!stopping) {
+        if (pending.empty()) {
+            cv.wait(lock);
+            continue;
+        }
+
+        // Pick the oldest notification whose title is not rate limited.
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        auto ready = pending.end();
+        for (auto it = pending.begin(); it != pending.end(); it++) {
+            auto shown = last_shown.find(it->title);
+            if (shown == last_shown.end() || shown->second + min_interval <= now) {
+                ready = it;
+                break;
+            }
+            next = min(next, shown->second + min_interval);
+        }
+        if (ready == pending.end()) {
+            cv.wait_until(lock, next);
+            continue;
+        }
+
+        Notification n = std::move(*ready);
+        pending.erase(ready);
+        if (last_shown.size() > 256) {
+            // Titles that are no longer rate limited can be forgotten.
+            for (auto it = last_shown.begin(); it != last_shown.end();) {
+                if (it->second + min_interval <= now)
+                    it = last_shown.erase(it);
+                else
+                    it++;
+            }
+        }
+        last_shown[n.title] = now;
+
+        lock.unlock();
+        show(n);
+        lock.lock();
+    }
+}
@@ -0,0 +1,77 @@
+/** @file NotificationQueue.hpp
+ *
+ * @brief Desktop notifications shown from a background thread.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+struct Notification {
+    std::string title;
+    std::string msg;
+    std::string icon;
+    /** Number of notifications with the same title that were merged into
+     *  this one because of the rate limit. */
+    int suppressed = 0;
+};
+
+/**
+ * Queue of notifications that are shown by a background thread, so that
+ * callers never wait on the session bus.
+ *
+ * A notification identical to the previous one is dropped, and at most
+ * one notification per title is shown every `min_interval`. While a title
+ * is rate limited, newer notifications replace the pending one.
+ */
+class NotificationQueue {
+public:
+    using Milliseconds = std::chrono::milliseconds;
+    using ShowFn = std::function<void(const Notification &)>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    ShowFn show;
+    Milliseconds min_interval;
+    size_t max_pending;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Notification> pending;
+    std::unordered_map<std::string, Clock::time_point> last_shown;
+    std::string last_title, last_msg;
+    bool stopping = false;
+    std::thread worker;
+
+    void run();
+
+public:
+    /**
+     * @param show Displays a notification, run from the background thread.
+     * @param min_interval Shortest time between two notifications with
+     *                     the same title.
+     * @param max_pending Notifications beyond this many are dropped.
+     */
+    explicit NotificationQueue(ShowFn show,
+                               Milliseconds min_interval = Milliseconds(2000),
+                               size_t max_pending = 32);
+
+    /** Stops the thread, pending notifications are dropped. */
+    ~NotificationQueue();
+
+    /**
+     * Queue up a notification.
+     *
+     * @return False if it was dropped as a duplicate or because the queue
+     *         was full.
+     */
+    bool push(const std::string &title, const std::string &msg, const std::string &icon);
+};
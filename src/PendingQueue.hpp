@@ -0,0 +1,173 @@
+/** @file PendingQueue.hpp
+ *
+ * @brief Events of a MacroD client that are waiting to be emitted.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <linux/input.h>
+}
+
+#include <deque>
+#include <vector>
+
+#include "KBDAction.hpp"
+
+/** An event waiting to be emitted, either because it is waiting on a
+ *  reply from MacroD, or because an earlier event is. */
+struct PendingEvent {
+    /** Sequence number of the event, 0 if it was not sent to MacroD. */
+    uint32_t seq;
+    /** Whether the output for this event is complete. */
+    bool done;
+    /** Whether the event has been written to the socket, events wait
+     *  in the queue while max_in_flight events are in flight. */
+    bool sent;
+    /** The event as it was read from the keyboard. */
+    KBDAction action;
+    /** Events to emit in place of the original event. */
+    std::vector<struct input_event> out;
+};
+
+/**
+ * Events in the order they were read, output is emitted from the front
+ * once it is done. Events that stay in InputD are queued behind the events
+ * that went to MacroD before them, so that the order is kept.
+ */
+class PendingQueue {
+    std::deque<PendingEvent> events;
+    size_t max_pending;
+    /** Number of events sent to MacroD that have not been replied to. */
+    size_t num_in_flight = 0;
+    /** Number of events waiting to be sent. */
+    size_t num_unsent = 0;
+    uint32_t next_seq = 1;
+
+public:
+    /** @param max_pending Events that may be queued before MacroD is
+     *                     considered stuck, see pushMacroD(). */
+    explicit PendingQueue(size_t max_pending) noexcept : max_pending(max_pending) {}
+
+    inline bool empty() const noexcept {
+        return events.empty();
+    }
+
+    inline size_t size() const noexcept {
+        return events.size();
+    }
+
+    inline size_t inFlight() const noexcept {
+        return num_in_flight;
+    }
+
+    /**
+     * Queue an event for MacroD, it is sent by sendQueued(). The event is
+     * queued even if MacroD is too far behind, so that it is emitted when
+     * the queue is drained.
+     *
+     * @return False if more than max_pending events are queued now, the
+     *         connection should then be reset.
+     */
+    bool pushMacroD(const KBDAction &action) {
+        // Sequence number 0 is reserved for events that stay in InputD.
+        if (next_seq == 0)
+            next_seq++;
+        events.push_back({next_seq++, false, false, action, {}});
+        events.back().action.seq = events.back().seq;
+        num_unsent++;
+        return events.size() <= max_pending;
+    }
+
+    /** Queue an event that stays in InputD, `out` is emitted in its place
+     *  once everything before it is done. */
+    void pushLocal(const KBDAction &action, std::vector<struct input_event> out) {
+        events.push_back({0, true, true, action, std::move(out)});
+    }
+
+    /**
+     * Send queued events in order, while fewer than `max_in_flight` are in
+     * flight.
+     *
+     * @param send Called with each event to send, it may throw.
+     */
+    template <class Fn>
+    void sendQueued(size_t max_in_flight, Fn send) {
+        // Events are sent in order, so nothing after the first queued
+        // event has been sent.
+        for (auto it = events.begin(); num_unsent && it != events.end(); ++it) {
+            if (num_in_flight >= max_in_flight)
+                return;
+            if (it->sent)
+                continue;
+            it->sent = true;
+            num_unsent--;
+            num_in_flight++;
+            send(it->action);
+        }
+    }
+
+    /** Find the event in flight that a reply is for, nullptr if there is
+     *  no such event. */
+    PendingEvent *findInFlight(uint32_t seq) noexcept {
+        if (seq == 0)
+            return nullptr;
+        for (auto &p : events)
+            if (p.seq == seq && p.sent && !p.done)
+                return &p;
+        return nullptr;
+    }
+
+    /** Mark an event from findInFlight() as done, it has all its output. */
+    inline void complete(PendingEvent *p) noexcept {
+        p->done = true;
+        num_in_flight--;
+    }
+
+    /** The oldest event that is waiting for a reply, or nullptr. */
+    const PendingEvent *oldestInFlight() const noexcept {
+        for (const auto &p : events) {
+            if (p.done)
+                continue;
+            return p.sent ? &p : nullptr;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Remove the events at the front of the queue that are done.
+     *
+     * @param emit Called with each of them, in order.
+     * @return True if anything was removed.
+     */
+    template <class Fn>
+    bool popDone(Fn emit) {
+        bool any = false;
+        while (!events.empty() && events.front().done) {
+            emit(events.front());
+            events.pop_front();
+            any = true;
+        }
+        return any;
+    }
+
+    /**
+     * Empty the queue, e.g when the connection to MacroD is lost.
+     *
+     * @param emit Called in order with the output of every event that is
+     *             done, and with every other event unchanged.
+     */
+    template <class Fn>
+    void drain(Fn emit) {
+        for (const auto &p : events) {
+            if (p.done)
+                for (const auto &ev : p.out)
+                    emit(ev);
+            else
+                emit(p.action.ev);
+        }
+        events.clear();
+        num_in_flight = num_unsent = 0;
+    }
+};
@@ -0,0 +1,104 @@
+/** @file Pointer.hpp
+ *
+ * @brief Coalescing of relative pointer motion.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <linux/input.h>
+}
+
+#include <vector>
+
+/** Whether an event ends a SYN_REPORT frame. */
+inline bool isFrameEnd(const struct input_event &ev) noexcept {
+    return ev.type == EV_SYN && ev.code == SYN_REPORT;
+}
+
+/** Whether a frame only moves the pointer, i.e holds nothing but EV_REL
+ *  events and a SYN_REPORT. */
+inline bool isMotionFrame(const struct input_event *evs, size_t num) noexcept {
+    bool any = false;
+    for (size_t i = 0; i < num; i++) {
+        if (evs[i].type == EV_REL)
+            any = true;
+        else if (!isFrameEnd(evs[i]))
+            return false;
+    }
+    return any;
+}
+
+/**
+ * Merge runs of consecutive motion frames into single frames, summing up
+ * the deltas of each axis. A 1000 Hz mouse then costs one write for all
+ * the motion that piled up while the output was busy, instead of one write
+ * per frame. Frames with anything but EV_REL in them, like button presses,
+ * are kept as they are so that clicks land where they did originally.
+ *
+ * @param evs Events to coalesce in place, split into frames by SYN_REPORT.
+ * @return True if anything was merged.
+ */
+inline bool coalesceMotion(std::vector<struct input_event> *evs) noexcept {
+    std::vector<struct input_event> &v = *evs;
+    int32_t sums[REL_CNT] = {0};
+    // Start of the motion frame that later frames are merged into, in the
+    // output, which is never ahead of the input.
+    size_t open = SIZE_MAX;
+    bool open_merged = false;
+    bool merged = false;
+    size_t out = 0;
+
+    auto add = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            if (v[i].type == EV_REL && v[i].code < REL_CNT)
+                sums[v[i].code] += v[i].value;
+    };
+    // Replace the open frame with the sums, it is the last thing written.
+    auto close = [&]() {
+        if (open_merged) {
+            struct input_event syn = v[out - 1];
+            out = open;
+            for (int code = 0; code < REL_CNT; code++) {
+                if (!sums[code])
+                    continue;
+                v[out] = syn;
+                v[out].type = EV_REL;
+                v[out].code = code;
+                v[out].value = sums[code];
+                out++;
+            }
+            v[out++] = syn;
+        }
+        for (int code = 0; code < REL_CNT; code++)
+            sums[code] = 0;
+        open = SIZE_MAX;
+        open_merged = false;
+    };
+
+    for (size_t begin = 0; begin < v.size();) {
+        size_t end = begin;
+        while (end < v.size() && !isFrameEnd(v[end++]))
+            ;
+        // A trailing partial frame is never merged.
+        bool motion = isFrameEnd(v[end - 1]) && isMotionFrame(&v[begin], end - begin);
+        if (motion && open != SIZE_MAX) {
+            add(begin, end);
+            open_merged = merged = true;
+        } else {
+            close();
+            if (motion) {
+                add(begin, end);
+                open = out;
+            }
+            for (size_t i = begin; i < end; i++)
+                v[out++] = v[i];
+        }
+        begin = end;
+    }
+    close();
+    v.resize(out);
+    return merged;
+}
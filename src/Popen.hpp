@@ -6,6 +6,7 @@
 extern "C" {
     #include <sys/wait.h>
     #include <unistd.h>
+    #include <fcntl.h>
     #include <string.h>
 }
 
@@ -17,7 +18,8 @@ class Pipe {
     int io[2];
 
     inline Pipe() {
-        if (pipe(io) == -1) {
+        // Keep the pipe from leaking into processes started by other threads.
+        if (pipe2(io, O_CLOEXEC) == -1) {
             throw SystemError("Unable to open pipe: ", errno);
         }
     }
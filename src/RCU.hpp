@@ -0,0 +1,95 @@
+/** @file RCU.hpp
+ *
+ * @brief Pointers to data that is read without locks.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <unistd.h>
+}
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+/**
+ * Pointer to an immutable object that readers use without taking any locks,
+ * writers replace the object as a whole and get the old one back once no
+ * reader can be using it anymore (read-copy-update.)
+ *
+ * Readers announce themselves in one of two counters, chosen by the parity
+ * of a grace period counter that writers flip after publishing a new object.
+ * A reader that picked the old parity may have seen the old object, so the
+ * writer waits for that counter to drain. A reader could have picked its
+ * counter before an earlier flip however, so the writer flips twice and
+ * waits for both counters, like SRCU in Linux.
+ *
+ * Read sections should be short, and must never wait for a writer.
+ */
+template <class T>
+class RCUPtr {
+    std::atomic<T *> ptr;
+    std::atomic<unsigned> grace_period {0};
+    std::atomic<unsigned> readers[2] = {{0}, {0}};
+    std::mutex writer_mtx;
+
+public:
+    /** Read-side section, the object stays valid until it is destroyed. */
+    class ReadLock {
+        RCUPtr *rcu;
+        unsigned idx;
+        const T *p;
+
+        friend class RCUPtr;
+
+        inline ReadLock(RCUPtr *rcu) noexcept : rcu(rcu) {
+            idx = rcu->grace_period.load() & 1;
+            rcu->readers[idx].fetch_add(1);
+            p = rcu->ptr.load();
+        }
+
+    public:
+        ReadLock(const ReadLock &) = delete;
+        ReadLock &operator=(const ReadLock &) = delete;
+
+        inline ~ReadLock() {
+            rcu->readers[idx].fetch_sub(1, std::memory_order_release);
+        }
+
+        inline const T *get() const noexcept { return p; }
+        inline const T *operator->() const noexcept { return p; }
+        inline const T &operator*() const noexcept { return *p; }
+    };
+
+    explicit inline RCUPtr(std::unique_ptr<T> init) : ptr(init.release()) {}
+
+    inline RCUPtr() : RCUPtr(std::unique_ptr<T>(new T())) {}
+
+    RCUPtr(const RCUPtr &) = delete;
+    RCUPtr &operator=(const RCUPtr &) = delete;
+
+    inline ~RCUPtr() {
+        delete ptr.load();
+    }
+
+    inline ReadLock read() noexcept {
+        return ReadLock(this);
+    }
+
+    /**
+     * Publish a new object, and wait until no reader is using the old one.
+     *
+     * @return The old object, which the caller may now destroy, or reuse.
+     */
+    inline std::unique_ptr<T> replace(std::unique_ptr<T> next) {
+        std::lock_guard<std::mutex> lock(writer_mtx);
+        std::unique_ptr<T> old(ptr.exchange(next.release()));
+        for (int i = 0; i < 2; i++) {
+            unsigned prev = grace_period.fetch_add(1);
+            while (readers[prev & 1].load(std::memory_order_acquire) != 0)
+                usleep(50);
+        }
+        return old;
+    }
+};
@@ -0,0 +1,94 @@
+extern "C" {
+    #include <alloca.h>
+    #include <errno.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <syslog.h>
+}
+
+#include <stdexcept>
+
+#include "Realtime.hpp"
+
+using namespace std;
+
+int RealtimeOptions::parsePolicy(const string &s) {
+    if (s == "fifo")
+        return SCHED_FIFO;
+    if (s == "rr")
+        return SCHED_RR;
+    throw invalid_argument("Unknown scheduling policy, expected fifo or rr: " + s);
+}
+
+vector<int> RealtimeOptions::parseCPUs(const string &s) {
+    vector<int> cpus;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == string::npos)
+            end = s.size();
+        string part = s.substr(pos, end - pos);
+        size_t dash = part.find('-');
+        try {
+            size_t used;
+            int first = stoi(part, &used), last = first;
+            if (dash != string::npos) {
+                if (used != dash)
+                    throw invalid_argument(part);
+                last = stoi(part.substr(dash + 1), &used);
+                used += dash + 1;
+            }
+            if (used != part.size() || first < 0 || last < first || last >= CPU_SETSIZE)
+                throw invalid_argument(part);
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        } catch (const logic_error &) {
+            throw invalid_argument("Invalid CPU list: " + s);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+void RealtimeOptions::setupProcess() const noexcept {
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        syslog(LOG_WARNING, "Unable to lock memory, RLIMIT_MEMLOCK may be too low: %s",
+               strerror(errno));
+}
+
+void RealtimeOptions::applyTo(pthread_t thread, const char *name) const noexcept {
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+            CPU_SET(cpu, &set);
+        if (int err = pthread_setaffinity_np(thread, sizeof(set), &set))
+            syslog(LOG_WARNING, "Unable to set CPU affinity of %s thread: %s", name, strerror(err));
+    }
+
+    if (priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        if (int err = pthread_setschedparam(thread, policy, &param))
+            syslog(LOG_WARNING, "Unable to use real-time priority %d for %s thread, "
+                                "RLIMIT_RTPRIO may be too low: %s", priority, name, strerror(err));
+        else
+            syslog(LOG_INFO, "Running %s thread with real-time priority %d", name, priority);
+    }
+}
+
+/** Touch the stack so that it does not have to grow while handling a key,
+ *  with memory locked the pages then stay put. */
+[[gnu::noinline]] static void prefaultStack(size_t kb) noexcept {
+    size_t sz = kb * 1024;
+    volatile char *stack = (volatile char *) alloca(sz);
+    for (size_t i = 0; i < sz; i += 4096)
+        stack[i] = 0;
+}
+
+void RealtimeOptions::applyToThisThread(const char *name) const noexcept {
+    if (lock_memory || priority > 0)
+        prefaultStack(prefault_stack_kb);
+    applyTo(pthread_self(), name);
+}
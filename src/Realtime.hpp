@@ -0,0 +1,67 @@
+/** @file Realtime.hpp
+ *
+ * @brief Real-time scheduling and memory locking for the event threads.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <pthread.h>
+    #include <sched.h>
+}
+
+#include <string>
+#include <vector>
+
+/**
+ * How the threads that handle keys are scheduled.
+ *
+ * Only the threads that keys pass through should be given a real-time
+ * priority, so it is applied with applyTo() once the watcher threads have
+ * been started, as threads inherit the policy of the thread that creates
+ * them.
+ */
+struct RealtimeOptions {
+    /** SCHED_FIFO or SCHED_RR, only used when priority > 0 */
+    int policy = SCHED_FIFO;
+    /** Real-time priority, 0 keeps the normal scheduler. */
+    int priority = 0;
+    /** CPUs to run the event threads on, empty for any. */
+    std::vector<int> cpus;
+    /** Lock all current and future pages of the process in memory. */
+    bool lock_memory = false;
+    /** Amount of stack to fault in ahead of time. */
+    size_t prefault_stack_kb = 256;
+
+    /**
+     * Parse a scheduling policy, "fifo" or "rr".
+     *
+     * @throws std::invalid_argument If the policy is unknown.
+     */
+    static int parsePolicy(const std::string &s);
+
+    /**
+     * Parse a list of CPUs, e.g "0,2-3".
+     *
+     * @throws std::invalid_argument If the list is malformed.
+     */
+    static std::vector<int> parseCPUs(const std::string &s);
+
+    /**
+     * Lock memory if requested, must be done after daemonizing as
+     * locks are not inherited by fork(). Failures are logged.
+     */
+    void setupProcess() const noexcept;
+
+    /**
+     * Set the priority and affinity of a thread. Failures are logged, the
+     * thread then keeps running with the normal scheduler.
+     *
+     * @param thread Thread to apply the options to.
+     * @param name Name of the thread, for the log.
+     */
+    void applyTo(pthread_t thread, const char *name) const noexcept;
+
+    /** Apply the options to the calling thread, and fault in its stack. */
+    void applyToThisThread(const char *name) const noexcept;
+};
@@ -0,0 +1,118 @@
+extern "C" {
+    #include <stdio.h>
+    #include <syslog.h>
+}
+
+#include "Remap.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+RemapTable::RemapTable() : keys(KEY_CNT) {}
+
+void RemapTable::add(const RemapRule &rule) {
+    if (rule.from >= KEY_CNT)
+        return;
+    if (rule.vendor == 0 && rule.product == 0) {
+        keys[rule.from] = rule.to;
+        return;
+    }
+    auto &tbl = devices[deviceKey(rule.vendor, rule.product)];
+    if (tbl.empty())
+        tbl.resize(KEY_CNT);
+    tbl[rule.from] = rule.to;
+}
+
+bool RemapTable::empty() const noexcept {
+    if (!devices.empty())
+        return false;
+    for (const auto &remap : keys)
+        if (remap.num)
+            return false;
+    return true;
+}
+
+/** @return The key code, or -1 if it is not valid. */
+static int parseCode(const string &s) {
+    int code;
+    try {
+        code = stoi(s);
+    } catch (const std::exception &) {
+        return -1;
+    }
+    return (code > 0 && code < KEY_MAX) ? code : -1;
+}
+
+static bool parseRemap(const string &s, KeyRemap *remap) {
+    size_t pos = 0;
+    remap->num = 0;
+    while (pos <= s.size()) {
+        size_t end = s.find('+', pos);
+        if (end == string::npos)
+            end = s.size();
+        int code = parseCode(s.substr(pos, end - pos));
+        if (code < 0 || remap->num == KeyRemap::max_keys)
+            return false;
+        remap->keys[remap->num++] = code;
+        pos = end + 1;
+    }
+    return remap->num > 0;
+}
+
+vector<RemapRule> RemapTable::load(CSV &csv) {
+    int from_col = csv.getColIndex("from"),
+        to_col = csv.getColIndex("to"),
+        dev_col = csv.getColIndex("device");
+    if (from_col < 0 || to_col < 0)
+        throw CSV::CSVError("Remap files require a from and a to column");
+
+    auto from = mkuniq(csv.getColCells(from_col));
+    auto to = mkuniq(csv.getColCells(to_col));
+    unique_ptr<vector<const string *>> dev;
+    if (dev_col >= 0)
+        dev = mkuniq(csv.getColCells(dev_col));
+
+    vector<RemapRule> rules;
+    for (size_t i = 0; i < from->size(); i++) {
+        RemapRule rule;
+        int code = parseCode(*(*from)[i]);
+        if (code < 0 || !parseRemap(*(*to)[i], &rule.to)) {
+            syslog(LOG_WARNING, "Invalid remap: %s -> %s",
+                   (*from)[i]->c_str(), (*to)[i]->c_str());
+            continue;
+        }
+        rule.from = code;
+        if (dev && !(*dev)[i]->empty() &&
+            sscanf((*dev)[i]->c_str(), "%hx:%hx", &rule.vendor, &rule.product) != 2)
+        {
+            syslog(LOG_WARNING, "Invalid device for remap, expected vendor:product: %s",
+                   (*dev)[i]->c_str());
+            continue;
+        }
+        rules.push_back(rule);
+    }
+    return rules;
+}
+
+void RemapTable::apply(const KeyRemap &remap, const struct input_event &ev,
+                       vector<struct input_event> *out)
+{
+    struct input_event rev = ev;
+    auto emit = [&](uint16_t code) {
+        rev.code = code;
+        out->push_back(rev);
+    };
+
+    if (ev.value == 1)
+        for (int i = 0; i < remap.num; i++)
+            emit(remap.keys[i]);
+    else if (ev.value == 0)
+        for (int i = remap.num - 1; i >= 0; i--)
+            emit(remap.keys[i]);
+    else if (remap.num)
+        emit(remap.keys[remap.num - 1]);
+}
+
+bool RemapTable::isRemapFile(const string &path) noexcept {
+    return stringEndsWith(path, ".remap.csv");
+}
@@ -0,0 +1,103 @@
+/** @file Remap.hpp
+ *
+ * @brief Key remaps that InputD applies without involving MacroD.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <linux/input.h>
+}
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CSV.hpp"
+
+/** What a key is rewritten to, a single key or a chord. */
+struct KeyRemap {
+    static constexpr int max_keys = 4;
+
+    /** Number of keys, 0 if the key is not remapped. */
+    uint8_t num = 0;
+    /** Keys in the order they are pressed, released in reverse. */
+    uint16_t keys[max_keys] = {0};
+};
+
+/** A row of a remap file. */
+struct RemapRule {
+    /** Device the rule applies to, 0:0 for all of them. */
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    uint16_t from = 0;
+    KeyRemap to;
+};
+
+/**
+ * Lookup table from key codes to their remaps, with overrides for
+ * individual devices.
+ *
+ * Remap files are CSV files with the columns `from` and `to`, holding key
+ * codes, and an optional `device` column with a vendor:product id in hex.
+ * A chord is written as codes joined by '+', e.g "29+42" for Ctrl+Shift.
+ *
+ *     from,to,device
+ *     58,29,
+ *     125,56,046d:c52b
+ *
+ * Mapping a key to itself for a device keeps the key as it is on that
+ * device, even if there is a remap for all devices.
+ */
+class RemapTable {
+    std::vector<KeyRemap> keys;
+    /** Tables of the devices with overrides, by vendor << 16 | product */
+    std::unordered_map<uint32_t, std::vector<KeyRemap>> devices;
+
+    static inline uint32_t deviceKey(uint16_t vendor, uint16_t product) noexcept {
+        return uint32_t(vendor) << 16 | product;
+    }
+
+public:
+    RemapTable();
+
+    /** Add a rule, replacing earlier rules for the same key and device. */
+    void add(const RemapRule &rule);
+
+    /** Get the remap of a key, which has num == 0 if there is none. */
+    inline const KeyRemap &lookup(const struct input_id &id, uint16_t code) const noexcept {
+        static const KeyRemap none;
+        if (code >= KEY_CNT)
+            return none;
+        if (!devices.empty()) {
+            auto it = devices.find(deviceKey(id.vendor, id.product));
+            if (it != devices.end() && it->second[code].num)
+                return it->second[code];
+        }
+        return keys[code];
+    }
+
+    /** Whether there are no rules at all. */
+    bool empty() const noexcept;
+
+    /**
+     * Read the rules of a remap file, invalid rows are logged and skipped.
+     *
+     * @throws CSV::CSVError If the `from` or `to` column is missing.
+     */
+    static std::vector<RemapRule> load(CSV &csv);
+
+    /**
+     * Write out the events that a key event is replaced by.
+     *
+     * Presses press all the keys of the remap in order, releases release
+     * them in reverse, and repeats repeat the last key.
+     */
+    static void apply(const KeyRemap &remap, const struct input_event &ev,
+                      std::vector<struct input_event> *out);
+
+    /** Whether a file in the keys directory holds remaps rather than
+     *  passthrough keys, i.e ends in .remap.csv */
+    static bool isRemapFile(const std::string &path) noexcept;
+};
@@ -27,51 +27,186 @@
  */
 
 #include "RemoteUDevice.hpp"
+#include "Latency.hpp"
+#include "UTF8.hpp"
+
+using namespace std;
 
 RemoteUDevice::RemoteUDevice(UNIXSocket<KBDAction> *conn)
     : LuaIface(this, RemoteUDevice_lua_methods) {
     this->conn = conn;
+    memset(&cur_ts, 0, sizeof(cur_ts));
 }
 
 RemoteUDevice::RemoteUDevice()
-    : LuaIface(this, RemoteUDevice_lua_methods) {}
+    : LuaIface(this, RemoteUDevice_lua_methods) {
+    memset(&cur_ts, 0, sizeof(cur_ts));
+}
 
 RemoteUDevice::~RemoteUDevice() {}
 
 void RemoteUDevice::emit(int type, int code, int val) {
-    KBDAction ac;
-    memset(&ac, 0, sizeof(ac));
-    ac.ev.type = type;
-    ac.ev.code = code;
-    ac.ev.value = val;
-    evbuf.push_back(ac);
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = val;
+    evbuf.push_back(ev);
 }
 
 void RemoteUDevice::emit(const input_event *send_event) {
-    KBDAction ac;
-    memset(&ac, 0, sizeof(ac));
-    memcpy(&ac.ev, send_event, sizeof(*send_event));
-    ac.done = 0;
-    evbuf.push_back(ac);
+    evbuf.push_back(*send_event);
+}
+
+void RemoteUDevice::sendFrame(uint16_t flags) {
+    KBDFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.type = async ? KBD_FRAME_OUTPUT : KBD_FRAME_EVENTS;
+    frame.flags = flags;
+    if (!async) {
+        frame.seq = cur_seq;
+        frame.ts = cur_ts;
+    }
+    if (flags & KBD_FRAME_DONE)
+        frame.ts.reply = monotonicNanos();
+    conn->sendFrame(frame, evbuf.data(), evbuf.size());
+    evbuf.clear();
 }
 
 void RemoteUDevice::flush() {
     if (!conn)
         return;
-    if (evbuf.size()) {
-        conn->send(evbuf);
-        evbuf.clear();
-    }
+    if (evbuf.size())
+        sendFrame(0);
+}
+
+void RemoteUDevice::begin(const KBDAction &request) noexcept {
+    cur_seq = request.seq;
+    cur_ts = request.ts;
+    async = false;
+}
+
+void RemoteUDevice::beginAsync() noexcept {
+    async = true;
 }
 
 void RemoteUDevice::done() {
+    if (async) {
+        // Nothing waits for the end of output that is not a reply.
+        flush();
+        async = false;
+        return;
+    }
     if (!conn)
         return;
+    sendFrame(KBD_FRAME_DONE);
+}
+
+/** Names in kbd keymaps of the printable ASCII characters that are not
+ *  named by themselves, indexed from '!' */
+static const char *ascii_names[] = {
+    "exclam", "quotedbl", "numbersign", "dollar", "percent", "ampersand",
+    "apostrophe", "parenleft", "parenright", "asterisk", "plus", "comma",
+    "minus", "period", "slash",
+    nullptr, nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, nullptr,
+    "colon", "semicolon", "less", "equal", "greater", "question", "at",
+};
+static const char *ascii_names2[] = {
+    "bracketleft", "backslash", "bracketright", "asciicircum", "underscore", "grave",
+};
+static const char *ascii_names3[] = {
+    "braceleft", "bar", "braceright", "asciitilde",
+};
+
+static const char *asciiName(uint32_t cp) noexcept {
+    switch (cp) {
+        case ' ': return "space";
+        case '\n': return "Return";
+        case '\t': return "Tab";
+    }
+    if (cp >= '!' && cp <= '@')
+        return ascii_names[cp - '!'];
+    if (cp >= '[' && cp <= '`')
+        return ascii_names2[cp - '['];
+    if (cp >= '{' && cp <= '~')
+        return ascii_names3[cp - '{'];
+    return nullptr;
+}
+
+RemoteUDevice::Stroke RemoteUDevice::resolve(TypingKeymap &tk, uint32_t cp, string_view chr) {
+    auto it = tk.strokes.find(cp);
+    if (it != tk.strokes.end())
+        return it->second;
+
+    Stroke st = {0, -1};
+    const char *alt = asciiName(cp);
+    for (string_view name : {chr, alt ? string_view(alt) : string_view()}) {
+        if (name.empty())
+            continue;
+        if (tk.keymap->getKeysym(name, &st.code))
+            break;
+        if (tk.keymap->getCombo(name, &st.mod, &st.code))
+            break;
+        st = {0, -1};
+    }
+    tk.strokes[cp] = st;
+    return st;
+}
+
+void RemoteUDevice::emitStroke(int mod, int code) {
+    if (mod) {
+        emit(EV_KEY, mod, 1);
+        emit(EV_SYN, SYN_REPORT, 0);
+    }
+    emit(EV_KEY, code, 1);
+    emit(EV_SYN, SYN_REPORT, 0);
+    emit(EV_KEY, code, 0);
+    emit(EV_SYN, SYN_REPORT, 0);
+    if (mod) {
+        emit(EV_KEY, mod, 0);
+        emit(EV_SYN, SYN_REPORT, 0);
+    }
+}
+
+int RemoteUDevice::typeString(string text, int start, string lang) {
+    size_t pos = start < 1 ? 0 : size_t(start - 1);
+    {
+        lock_guard<mutex> lock(keymaps_mtx);
+        auto it = keymaps.find(lang);
+        if (it == keymaps.end())
+            return start;
+        TypingKeymap &tk = it->second;
+        while (pos < text.size()) {
+            uint32_t cp;
+            size_t len = decodeUTF8(text, pos, &cp);
+            if (len == 0)
+                break;
+            Stroke st = resolve(tk, cp, string_view(text).substr(pos, len));
+            if (st.code < 0)
+                break;
+            emitStroke(st.mod, st.code);
+            pos += len;
+        }
+    }
+    flush();
+    return int(pos) + 1;
+}
+
+void RemoteUDevice::emitSequence(vector<int> codes) {
+    for (int code : codes)
+        if (code > 0 && code < KEY_MAX)
+            emitStroke(0, code);
     flush();
-    KBDAction ac;
-    memset(&ac, 0, sizeof(ac));
-    ac.done = 1;
-    conn->send(&ac);
+}
+
+void RemoteUDevice::addKeymap(const string &lang, shared_ptr<Keymap> km) {
+    lock_guard<mutex> lock(keymaps_mtx);
+    TypingKeymap &tk = keymaps[lang];
+    if (km == tk.keymap)
+        return;
+    tk.keymap = std::move(km);
+    tk.strokes.clear();
 }
 
 LUA_CREATE_BINDINGS(RemoteUDevice_lua_methods)
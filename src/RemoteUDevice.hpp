@@ -51,12 +51,19 @@ extern "C" {
 #include "UNIXSocket.hpp"
 #include "IUDevice.hpp"
 #include "KBDAction.hpp"
+#include "Keymap.hpp"
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 // Methods to export to Lua
 // (ClassName, methodName, type0(), type1()...)
 #define RemoteUDevice_lua_methods(M, _)                 \
     M(RemoteUDevice, emit, int(), int(), int()) _       \
-    M(RemoteUDevice, flush)
+    M(RemoteUDevice, flush) _                           \
+    M(RemoteUDevice, typeString, std::string(), int(), std::string()) _ \
+    M(RemoteUDevice, emitSequence, std::vector<int>())
 
 LUA_DECLARE(RemoteUDevice_lua_methods)
 
@@ -68,7 +75,38 @@ class RemoteUDevice : public IUDevice,
                       public Lua::LuaIface<RemoteUDevice> {
 private:
     UNIXSocket<KBDAction> *conn = nullptr;
-    std::vector<KBDAction> evbuf;
+    std::vector<struct input_event> evbuf;
+
+    /** Send buffered events in a single frame. */
+    void sendFrame(uint16_t flags);
+    /** Sequence number of the event being replied to. */
+    uint32_t cur_seq = 0;
+    /** Timestamps of the event being replied to. */
+    KBDTimestamps cur_ts;
+    /** Set between beginAsync() and done(), when output is not a reply. */
+    bool async = false;
+
+    /** How a character is typed, code is -1 if it cannot be. */
+    struct Stroke {
+        int mod;
+        int code;
+    };
+    /** A keymap that text is typed with. */
+    struct TypingKeymap {
+        std::shared_ptr<Keymap> keymap;
+        /** Strokes of the characters typed so far, by code point. */
+        std::unordered_map<uint32_t, Stroke> strokes;
+    };
+    /** Keymaps used by typeString() by language, added from the script
+     *  loading threads. */
+    std::mutex keymaps_mtx;
+    std::unordered_map<std::string, TypingKeymap> keymaps;
+
+    /** Find the stroke of a character, requires keymaps_mtx. */
+    Stroke resolve(TypingKeymap &tk, uint32_t cp, std::string_view chr);
+
+    /** Buffer a key press and release, with the modifier held. */
+    void emitStroke(int mod, int code);
 
 public:
     explicit RemoteUDevice(UNIXSocket<KBDAction> *conn);
@@ -81,10 +119,48 @@ public:
 
     virtual void emit(int type, int code, int val) override;
 
+    /**
+     * Start replying to an event from InputD, all emitted events up to
+     * the next done() will carry its sequence number.
+     *
+     * @param request The event that is being replied to.
+     */
+    void begin(const KBDAction &request) noexcept;
+
+    /** Start emitting events that are not a reply to any event, like the
+     *  output of timers. They are sent as KBD_FRAME_OUTPUT frames, up to
+     *  the next done(). */
+    void beginAsync() noexcept;
+
+    /** Send the remaining events in a frame marked as done. It carries
+     *  the latency timestamps of the request, with ts.reply filled in. */
     virtual void done() override;
 
     virtual void flush() override;
 
+    /**
+     * Type a string, with every character resolved in a keymap from
+     * addKeymap(), and send it all in a single frame.
+     *
+     * @param text UTF-8 text.
+     * @param start Position to start typing from, counting from 1 like
+     *              Lua strings.
+     * @param lang Keymap of the script that is typing, nothing is typed
+     *             if it has not been added.
+     * @return Position of the first character that could not be typed,
+     *         #text + 1 if all of it was. The caller types that one some
+     *         other way, and may then continue after it.
+     */
+    int typeString(std::string text, int start, std::string lang);
+
+    /** Press and release each of the key codes in turn, and send them
+     *  in a single frame. */
+    void emitSequence(std::vector<int> codes);
+
+    /** Add the keymap that typeString() uses for `lang`, replacing the
+     *  one that was there. */
+    void addKeymap(const std::string &lang, std::shared_ptr<Keymap> km);
+
     inline void setConnection(UNIXSocket<KBDAction> *conn) {
         this->conn = conn;
     }
@@ -0,0 +1,71 @@
+/** @file SPSCQueue.hpp
+ *
+ * @brief Bounded lock-free single-producer/single-consumer queue.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <utility>
+#include <cstddef>
+
+/**
+ * Bounded lock-free queue for exactly one producer thread and one consumer
+ * thread.
+ *
+ * @tparam T Element type, must be default constructible and movable.
+ * @tparam N Capacity, must be a power of two.
+ */
+template <class T, size_t N>
+class SPSCQueue {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SPSCQueue capacity must be a power of two");
+
+    std::array<T, N> items;
+    /** Next slot to be read, only written by the consumer. */
+    alignas(64) std::atomic<size_t> head = 0;
+    /** Next slot to be written, only written by the producer. */
+    alignas(64) std::atomic<size_t> tail = 0;
+
+public:
+    /**
+     * Push an element onto the queue, called from the producer.
+     *
+     * @return False if the queue was full, `item` is left untouched.
+     */
+    bool push(T &&item) noexcept {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        items[t & (N - 1)] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pop an element from the queue, called from the consumer.
+     *
+     * @return False if the queue was empty.
+     */
+    bool pop(T *item) noexcept {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        *item = std::move(items[h & (N - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Approximate number of queued elements. */
+    inline size_t size() const noexcept {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    inline bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    static constexpr size_t capacity() noexcept {
+        return N;
+    }
+};
@@ -0,0 +1,221 @@
+extern "C" {
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <syslog.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+}
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include "ScriptCache.hpp"
+#include "SystemError.hpp"
+#include "XDG.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+/** Bump this when the way entries are produced changes. */
+static constexpr int cache_format = 2;
+
+/** Size of the digest in front of entries written by put(). */
+static constexpr size_t digest_size = 32;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) noexcept {
+    return (x >> n) | (x << (32 - n));
+}
+
+string sha256(const string &data) {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    // Padding: a 1 bit, zeros up to 56 mod 64, then the length in bits.
+    string msg = data;
+    msg.push_back('\x80');
+    while (msg.size() % 64 != 56)
+        msg.push_back('\0');
+    uint64_t bits = (uint64_t) data.size() * 8;
+    for (int i = 7; i >= 0; i--)
+        msg.push_back((char) (bits >> (i * 8)));
+
+    for (size_t off = 0; off < msg.size(); off += 64) {
+        const unsigned char *p = (const unsigned char *) msg.data() + off;
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t) p[i*4] << 24 | (uint32_t) p[i*4 + 1] << 16 |
+                   (uint32_t) p[i*4 + 2] << 8 | (uint32_t) p[i*4 + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3],
+                 e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = hh + s1 + ch + sha256_k[i] + w[i];
+            uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    string out;
+    for (uint32_t v : h)
+        for (int i = 3; i >= 0; i--)
+            out.push_back((char) (v >> (i * 8)));
+    return out;
+}
+
+static string toHex(const string &data) {
+    stringstream ss;
+    ss << hex << setfill('0');
+    for (unsigned char c : data)
+        ss << setw(2) << (int) c;
+    return ss.str();
+}
+
+ScriptCache::ScriptCache(const string &dir) : dir(dir) {
+    try {
+        XDG::mkPathIfNotExists(dir, 0700);
+        // In case it already existed, but with the wrong permissions.
+        if (chmod(dir.c_str(), 0700) == -1)
+            throw SystemError("Unable to set permissions of " + dir + ": ", errno);
+    } catch (const SystemError &e) {
+        // Lookups will just miss.
+        syslog(LOG_WARNING, "Unable to create script cache: %s", e.what());
+    }
+}
+
+string ScriptCache::key(const string &kind, const string &name, const string &src) {
+    stringstream meta;
+    meta << cache_format << ':' << kind << ':' << name << ':' << src.size() << ':';
+    return toHex(sha256(meta.str() + src));
+}
+
+string ScriptCache::entryPath(const string &key, const string &ext) const {
+    return dir + "/" + key + "." + ext;
+}
+
+bool ScriptCache::get(const string &key, const string &ext, string *out) const {
+    string path = entryPath(key, ext);
+    string data;
+    try {
+        data = readFile(path);
+    } catch (const SystemError &) {
+        return false;
+    }
+    if (data.size() < digest_size ||
+        sha256(data.substr(digest_size)) != data.substr(0, digest_size))
+    {
+        syslog(LOG_WARNING, "Ignoring corrupt script cache entry: %s", path.c_str());
+        unlink(path.c_str());
+        return false;
+    }
+    *out = data.substr(digest_size);
+    // Mark the entry as used, for prune().
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return true;
+}
+
+bool ScriptCache::lookup(const string &key, const string &ext, string *path) const {
+    *path = entryPath(key, ext);
+    if (access(path->c_str(), R_OK) != 0)
+        return false;
+    utimensat(AT_FDCWD, path->c_str(), nullptr, 0);
+    return true;
+}
+
+void ScriptCache::put(const string &key, const string &ext, const string &data) const noexcept {
+    try {
+        putMapped(key, ext, sha256(data) + data);
+    } catch (const bad_alloc &) {
+        syslog(LOG_WARNING, "Unable to write script cache entry: %s", key.c_str());
+    }
+}
+
+void ScriptCache::putMapped(const string &key, const string &ext, const string &data) const noexcept {
+    string path = entryPath(key, ext);
+    string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd == -1) {
+        syslog(LOG_WARNING, "Unable to create script cache entry %s: %s", path.c_str(),
+               SystemError::getErrorString(errno).c_str());
+        return;
+    }
+    // Write to a temporary file first, so that other instances never see
+    // a partial entry.
+    const char *buf = data.data();
+    size_t left = data.size();
+    while (left) {
+        ssize_t n = ::write(fd, buf, left);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        buf += n;
+        left -= n;
+    }
+    close(fd);
+    if (left || rename(tmp_path.c_str(), path.c_str()) == -1) {
+        syslog(LOG_WARNING, "Unable to write script cache entry: %s", path.c_str());
+        unlink(tmp_path.c_str());
+    }
+}
+
+void ScriptCache::prune(chrono::hours max_age) const noexcept {
+    try {
+        auto now = fs::file_time_type::clock::now();
+        for (auto &entry : fs::directory_iterator(dir))
+            if (now - entry.last_write_time() > max_age)
+                fs::remove(entry.path());
+    } catch (const fs::filesystem_error &e) {
+        syslog(LOG_WARNING, "Unable to prune script cache: %s", e.what());
+    }
+}
+
+string executableId(const string &name) {
+    const char *env_path = getenv("PATH");
+    stringstream dirs(env_path ? env_path : "/usr/local/bin:/usr/bin:/bin");
+    string dir;
+    while (getline(dirs, dir, ':')) {
+        string path = dir + "/" + name;
+        struct stat stbuf;
+        if (stat(path.c_str(), &stbuf) == 0 && S_ISREG(stbuf.st_mode) && access(path.c_str(), X_OK) == 0)
+            return path + ":" + to_string(stbuf.st_size) + ":" + to_string(stbuf.st_mtime);
+    }
+    return name;
+}
+
+string readFile(const string &path) {
+    ifstream in(path, ios::binary);
+    if (!in)
+        throw SystemError("Unable to open " + path + ": ", errno);
+    stringstream ss;
+    ss << in.rdbuf();
+    if (in.bad())
+        throw SystemError("Unable to read " + path + ": ", errno);
+    return ss.str();
+}
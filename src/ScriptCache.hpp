@@ -0,0 +1,92 @@
+/** @file ScriptCache.hpp
+ *
+ * @brief On-disk cache of translated and compiled scripts.
+ */
+
+#pragma once
+
+#include <string>
+#include <chrono>
+
+/**
+ * Content addressed cache of compiled scripts.
+ *
+ * Entries are keyed by a hash of everything that went into producing them,
+ * so an entry never has to be invalidated, and stale ones are just left to
+ * expire with prune().
+ *
+ * The cache directory is private to the user, and entries written with
+ * put() carry a digest of their contents that get() checks, so that a
+ * corrupt entry is never loaded as bytecode.
+ */
+class ScriptCache {
+    std::string dir;
+
+    std::string entryPath(const std::string &key, const std::string &ext) const;
+
+public:
+    /**
+     * @param dir Directory to keep the cache in, created with mode 0700 if
+     *            it does not exist, and set to 0700 if it does.
+     */
+    explicit ScriptCache(const std::string &dir);
+
+    /**
+     * Compute a cache key, the hex SHA-256 of everything that went into
+     * producing the entry.
+     *
+     * @param kind What the source is, e.g "hwk" or "lua".
+     * @param name Chunk name, this ends up in the compiled code.
+     * @param src Contents of the source file.
+     */
+    static std::string key(const std::string &kind,
+                           const std::string &name,
+                           const std::string &src);
+
+    /**
+     * Look up an entry.
+     *
+     * @param key Key from key().
+     * @param ext Kind of entry, e.g "luac" for bytecode.
+     * @param out Where to put the cached data.
+     * @return False if there was no such entry, or if it was corrupt.
+     */
+    bool get(const std::string &key, const std::string &ext, std::string *out) const;
+
+    /**
+     * Look up an entry written by putMapped() without reading it, for
+     * entries that are mapped into memory. These are not checked, so the
+     * format has to be validated when it is loaded.
+     *
+     * @param path Where to put the path of the entry.
+     * @return False if there was no such entry.
+     */
+    bool lookup(const std::string &key, const std::string &ext, std::string *path) const;
+
+    /** Write an entry for get(), failure to do so is only logged. */
+    void put(const std::string &key, const std::string &ext, const std::string &data) const noexcept;
+
+    /** Write an entry for lookup(), as it is, failure to do so is only logged. */
+    void putMapped(const std::string &key, const std::string &ext, const std::string &data) const noexcept;
+
+    /** Remove entries that have not been used for `max_age`. */
+    void prune(std::chrono::hours max_age) const noexcept;
+};
+
+/** Binary SHA-256 digest of `data`. */
+std::string sha256(const std::string &data);
+
+/**
+ * Read an entire file.
+ *
+ * @throws SystemError If the file could not be read.
+ */
+std::string readFile(const std::string &path);
+
+/**
+ * Identify the version of an executable in PATH, for use in cache keys.
+ *
+ * @return The path, size and modification time of the executable, or just
+ *         `name` if it could not be found.
+ */
+std::string executableId(const std::string &name);
@@ -0,0 +1,222 @@
+extern "C" {
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <errno.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/eventfd.h>
+}
+
+#include <chrono>
+#include <cstring>
+
+#include "ShmTransport.hpp"
+#include "UNIXSocket.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+
+/** The control blocks take up the first page, the rings follow. */
+static constexpr size_t ctl_size = 4096;
+static constexpr size_t shm_size = ctl_size + 2 * ShmTransport::ring_size;
+
+static_assert(2 * sizeof(ShmRingCtl) <= ctl_size, "Ring control blocks do not fit");
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "Shared memory rings require lock-free atomics");
+
+ShmTransport::ShmTransport(int memfd, int efd0, int efd1, int tx)
+    : memfd(memfd), tx(tx)
+{
+    efds[0] = efd0;
+    efds[1] = efd1;
+    mem = mmap(nullptr, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED) {
+        mem = nullptr;
+        throw SystemError("Unable to mmap() shared memory: ", errno);
+    }
+    mem_size = shm_size;
+}
+
+ShmTransport::~ShmTransport() {
+    if (mem)
+        munmap(mem, mem_size);
+    for (int fd : {memfd, efds[0], efds[1]})
+        if (fd != -1)
+            close(fd);
+}
+
+unique_ptr<ShmTransport> ShmTransport::create() {
+    int memfd = memfd_create("hawck-kbd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1)
+        throw SystemError("Unable to create memfd: ", errno);
+    if (ftruncate(memfd, shm_size) == -1) {
+        close(memfd);
+        throw SystemError("Unable to resize memfd: ", errno);
+    }
+    // Keep the other side from shrinking the memory under our feet.
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        close(memfd);
+        throw SystemError("Unable to seal memfd: ", errno);
+    }
+
+    int efd0 = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int efd1 = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd0 == -1 || efd1 == -1) {
+        int err = errno;
+        for (int fd : {memfd, efd0, efd1})
+            if (fd != -1)
+                close(fd);
+        throw SystemError("Unable to create eventfd: ", err);
+    }
+
+    // Memory from ftruncate() is zeroed, so the rings start out empty.
+    try {
+        return unique_ptr<ShmTransport>(new ShmTransport(memfd, efd0, efd1, 0));
+    } catch (const SystemError &) {
+        for (int fd : {memfd, efd0, efd1})
+            close(fd);
+        throw;
+    }
+}
+
+unique_ptr<ShmTransport> ShmTransport::attach(int memfd, int efd0, int efd1) {
+    auto close_all = [&]() {
+        for (int fd : {memfd, efd0, efd1})
+            close(fd);
+    };
+
+    int seals = fcntl(memfd, F_GET_SEALS);
+    struct stat stbuf;
+    if (seals == -1 || fstat(memfd, &stbuf) == -1) {
+        int err = errno;
+        close_all();
+        throw SystemError("Unable to inspect memfd: ", err);
+    }
+    if (!(seals & F_SEAL_SHRINK) || (size_t) stbuf.st_size != shm_size) {
+        close_all();
+        throw SystemError("Shared memory was not sealed, or has the wrong size");
+    }
+
+    try {
+        return unique_ptr<ShmTransport>(new ShmTransport(memfd, efd0, efd1, 1));
+    } catch (const SystemError &) {
+        close_all();
+        throw;
+    }
+}
+
+vector<int> ShmTransport::fds() const {
+    return {memfd, efds[0], efds[1]};
+}
+
+ShmRingCtl *ShmTransport::ctl(int ring) const noexcept {
+    return ((ShmRingCtl *) mem) + ring;
+}
+
+char *ShmTransport::data(int ring) const noexcept {
+    return ((char *) mem) + ctl_size + ring * ring_size;
+}
+
+uint32_t ShmTransport::available() const {
+    ShmRingCtl *c = ctl(1 - tx);
+    uint32_t n = c->tail.load(memory_order_acquire) - c->head.load(memory_order_relaxed);
+    // The other side controls the tail, don't trust it.
+    if (n > ring_size)
+        throw SocketError("Shared memory ring is corrupt");
+    return n;
+}
+
+void ShmTransport::send(const struct iovec *iov, int iovcnt, int timeout) {
+    using namespace std::chrono;
+    ShmRingCtl *c = ctl(tx);
+    char *buf = data(tx);
+    auto deadline = steady_clock::now() + milliseconds(timeout);
+
+    for (int i = 0; i < iovcnt; i++) {
+        const char *src = (const char *) iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while (left) {
+            uint32_t tail = c->tail.load(memory_order_relaxed);
+            uint32_t used = tail - c->head.load(memory_order_acquire);
+            if (used > ring_size)
+                throw SocketError("Shared memory ring is corrupt");
+
+            if (used == ring_size) {
+                // The ring is full, wait for the other side to catch up.
+                if (steady_clock::now() > deadline)
+                    throw SocketTimeout("Timed out waiting for room in shared memory ring");
+                usleep(50);
+                continue;
+            }
+
+            size_t n = min<size_t>(left, ring_size - used);
+            uint32_t off = tail & (ring_size - 1);
+            size_t first = min<size_t>(n, ring_size - off);
+            memcpy(buf + off, src, first);
+            memcpy(buf, src + first, n - first);
+            c->tail.store(tail + n, memory_order_release);
+            src += n;
+            left -= n;
+
+            // Wake the consumer up if it went to sleep.
+            atomic_thread_fence(memory_order_seq_cst);
+            if (c->armed.exchange(0)) {
+                uint64_t one = 1;
+                if (write(efds[tx], &one, sizeof(one)) == -1 && errno != EAGAIN)
+                    throw SocketError("Unable to signal eventfd: " + SystemError::getErrorString(errno));
+            }
+        }
+    }
+}
+
+size_t ShmTransport::recvSome(char *dst, size_t max) {
+    ShmRingCtl *c = ctl(1 - tx);
+    char *buf = data(1 - tx);
+    size_t n = min<size_t>(available(), max);
+    if (n == 0)
+        return 0;
+    uint32_t head = c->head.load(memory_order_relaxed);
+    uint32_t off = head & (ring_size - 1);
+    size_t first = min<size_t>(n, ring_size - off);
+    memcpy(dst, buf + off, first);
+    memcpy(dst + first, buf, n - first);
+    c->head.store(head + n, memory_order_release);
+    return n;
+}
+
+bool ShmTransport::wait(int timeout, int sock_fd) {
+    if (available())
+        return true;
+
+    ShmRingCtl *c = ctl(1 - tx);
+    c->armed.store(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    // The producer might have written before it saw that we were armed.
+    if (available())
+        return true;
+
+    struct pollfd pfds[2];
+    pfds[0].fd = getfd();
+    pfds[0].events = POLLIN;
+    pfds[1].fd = sock_fd;
+    pfds[1].events = POLLIN;
+    int ret = poll(pfds, 2, timeout);
+    if (ret == -1 && errno != EINTR)
+        throw SystemError("Error in poll(): ", errno);
+
+    if (ret > 0 && pfds[1].revents) {
+        // Nothing is sent over the socket after the handshake, so anything
+        // happening on it means that the connection is gone.
+        throw SocketError("Connection closed");
+    }
+
+    if (ret > 0 && pfds[0].revents & POLLIN) {
+        uint64_t cnt;
+        if (read(getfd(), &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+            throw SocketError("Unable to read eventfd: " + SystemError::getErrorString(errno));
+    }
+
+    return available();
+}
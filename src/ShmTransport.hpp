@@ -0,0 +1,115 @@
+/** @file ShmTransport.hpp
+ *
+ * @brief Shared memory transport between InputD and MacroD.
+ *
+ * Two single-producer/single-consumer byte rings live in a sealed memfd, one
+ * for each direction. A consumer that is about to block "arms" its ring, and
+ * the producer only writes to the ring's eventfd when it finds it armed, so a
+ * busy connection does not need any syscalls at all.
+ *
+ * The memfd and eventfds are created by InputD and handed to MacroD over the
+ * kbd.sock UNIX socket, so only processes that are allowed to connect to that
+ * socket can get at the memory.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+    #include <sys/uio.h>
+}
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/** Control block of a ring, kept at the start of the shared memory. */
+struct ShmRingCtl {
+    /** Read position, only written by the consumer. */
+    alignas(64) std::atomic<uint32_t> head;
+    /** Write position, only written by the producer. */
+    alignas(64) std::atomic<uint32_t> tail;
+    /** Set by the consumer when it wants to be woken up on the next write. */
+    std::atomic<uint32_t> armed;
+};
+
+class ShmTransport {
+public:
+    /** Size of each of the two rings, must be a power of two. */
+    static constexpr uint32_t ring_size = 64 * 1024;
+
+private:
+    int memfd = -1;
+    /** efds[i] is signalled when data is written to ring i */
+    int efds[2] = {-1, -1};
+    void *mem = nullptr;
+    size_t mem_size = 0;
+    /** Index of the ring we send on, we receive on the other one. */
+    int tx;
+
+    ShmRingCtl *ctl(int ring) const noexcept;
+    char *data(int ring) const noexcept;
+
+    /** Number of bytes ready to be read from our incoming ring. */
+    uint32_t available() const;
+
+    ShmTransport(int memfd, int efd0, int efd1, int tx);
+
+public:
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+
+    ~ShmTransport();
+
+    /**
+     * Create a new transport, done by InputD.
+     *
+     * @throws SystemError If the memfd or eventfds could not be created.
+     */
+    static std::unique_ptr<ShmTransport> create();
+
+    /**
+     * Attach to a transport created by the other side, takes ownership of
+     * the file descriptors.
+     *
+     * @throws SystemError If the memfd is not sealed, or has the wrong size.
+     */
+    static std::unique_ptr<ShmTransport> attach(int memfd, int efd0, int efd1);
+
+    /** File descriptors to hand to the other side, in the order
+     *  expected by attach(). */
+    std::vector<int> fds() const;
+
+    /** File descriptor that becomes readable when data arrives, only
+     *  reliable after wait() has returned false. */
+    inline int getfd() const noexcept {
+        return efds[1 - tx];
+    }
+
+    /**
+     * Write to the outgoing ring, data larger than the ring is streamed
+     * through it as the other side reads.
+     *
+     * @param timeout Time to wait for space in the ring, in milliseconds.
+     * @throws SocketTimeout If the other side did not make room in time.
+     */
+    void send(const struct iovec *iov, int iovcnt, int timeout);
+
+    /**
+     * Read up to `max` bytes that are ready in the incoming ring.
+     *
+     * @return Number of bytes read, 0 if the ring was empty.
+     */
+    size_t recvSome(char *dst, size_t max);
+
+    /**
+     * Wait for data in the incoming ring.
+     *
+     * @param timeout Timeout in milliseconds, -1 for no timeout.
+     * @param sock_fd The UNIX socket the transport was negotiated on,
+     *                the connection is considered dead if it hangs up.
+     * @return True if there is data to be read.
+     * @throws SocketError If the socket was closed.
+     */
+    bool wait(int timeout, int sock_fd);
+};
@@ -0,0 +1,86 @@
+extern "C" {
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <string.h>
+    #include <sys/eventfd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/time.h>
+    #include <syslog.h>
+    #include <unistd.h>
+}
+
+#include "StatsServer.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+
+StatsServer::StatsServer(const string &addr, const Metrics &metrics, mode_t mode)
+    : srv(addr),
+      metrics(metrics)
+{
+    if (chmod(addr.c_str(), mode) == -1)
+        throw SystemError("Unable to chmod stats socket: ", errno);
+    if ((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        throw SystemError("Unable to create eventfd: ", errno);
+}
+
+StatsServer::~StatsServer() {
+    running = false;
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) == -1)
+        syslog(LOG_ERR, "Unable to wake up stats server: %s", strerror(errno));
+    if (thread.joinable())
+        thread.join();
+    ::close(wake_fd);
+}
+
+void StatsServer::start() {
+    thread = std::thread([this]() { run(); });
+}
+
+void StatsServer::serve(int fd) noexcept {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct timeval tv = {send_timeout_ms / 1000, (send_timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    try {
+        string text = metrics.format();
+        size_t pos = 0;
+        while (pos < text.size()) {
+            ssize_t n = ::send(fd, text.data() + pos, text.size() - pos, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            pos += n;
+        }
+    } catch (const exception &e) {
+        syslog(LOG_ERR, "Unable to format metrics: %s", e.what());
+    }
+    ::close(fd);
+}
+
+void StatsServer::run() {
+    while (running) {
+        struct pollfd pfds[] = {
+            {srv.getfd(), POLLIN, 0},
+            {wake_fd, POLLIN, 0},
+        };
+        if (::poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Stats server stopped, error in poll(): %s", strerror(errno));
+            return;
+        }
+        if (!running || (pfds[1].revents & POLLIN))
+            break;
+        if (pfds[0].revents & POLLIN) {
+            try {
+                serve(srv.accept());
+            } catch (const SocketError &e) {
+                syslog(LOG_ERR, "Stats server: %s", e.what());
+            }
+        }
+    }
+}
@@ -0,0 +1,56 @@
+/** @file StatsServer.hpp
+ *
+ * @brief Socket that serves Metrics in the Prometheus text format.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <sys/types.h>
+}
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "Metrics.hpp"
+#include "UNIXSocket.hpp"
+
+/**
+ * Writes out the metrics to every client that connects, and then hangs up,
+ * so that e.g `socat - UNIX-CONNECT:stats.sock` is a complete scrape. The
+ * metrics are formatted on the server thread, the threads that update them
+ * never wait for it.
+ */
+class StatsServer {
+    UNIXServer srv;
+    const Metrics &metrics;
+    /** eventfd used to stop the server thread */
+    int wake_fd = -1;
+    std::atomic<bool> running {true};
+    std::thread thread;
+
+    /** Clients that don't read their metrics within this many
+     *  milliseconds are dropped. */
+    static constexpr int send_timeout_ms = 1000;
+
+    void run();
+
+    /** Send the metrics to a client and close the connection. */
+    void serve(int fd) noexcept;
+
+public:
+    /**
+     * Listen on a socket.
+     *
+     * @param addr Path of the socket.
+     * @param metrics Metrics to serve, must outlive the server.
+     * @param mode Permissions of the socket.
+     */
+    StatsServer(const std::string &addr, const Metrics &metrics, mode_t mode = 0600);
+
+    ~StatsServer();
+
+    /** Start serving clients in a new thread. */
+    void start();
+};
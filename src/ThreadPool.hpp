@@ -0,0 +1,99 @@
+/** @file ThreadPool.hpp
+ *
+ * @brief Fixed-size pool of worker threads.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed number of worker threads taking jobs from a shared queue.
+ *
+ * The destructor finishes every job that was submitted before joining
+ * the workers.
+ */
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool stopping = false;
+
+    void work() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cond.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    /**
+     * @param num_threads Number of workers, 0 to use one for each
+     *                    hardware thread.
+     * @param init Run by each worker before it takes any jobs, e.g to set
+     *             its scheduling.
+     */
+    explicit ThreadPool(unsigned num_threads = 0, std::function<void()> init = nullptr) {
+        if (num_threads == 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        workers.reserve(num_threads);
+        for (unsigned i = 0; i < num_threads; i++)
+            workers.emplace_back([this, init]() {
+                if (init)
+                    init();
+                work();
+            });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    inline size_t size() const noexcept {
+        return workers.size();
+    }
+
+    /**
+     * Run `fn` on one of the workers.
+     *
+     * @return Future holding the result of `fn`, or the exception it threw.
+     */
+    template <class Fn>
+    auto submit(Fn fn) -> std::future<decltype(fn())> {
+        using R = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+        auto fut = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs.emplace_back([task]() { (*task)(); });
+        }
+        cond.notify_one();
+        return fut;
+    }
+};
@@ -0,0 +1,127 @@
+#include <algorithm>
+
+#include "TimerWheel.hpp"
+
+using namespace std;
+
+TimerWheel::TimerWheel(uint64_t now) noexcept : cur(now) {}
+
+vector<TimerWheel::Entry> &TimerWheel::slotFor(uint64_t when) noexcept {
+    // A timer sits on the lowest level whose slots still have the same
+    // parent slot as the current tick, so that it is cascaded down exactly
+    // when the wheel reaches that parent.
+    for (int level = 0; level < num_levels; level++)
+        if (((when ^ cur) >> (slot_bits * (level + 1))) == 0)
+            return slots[level][(when >> (slot_bits * level)) & slot_mask];
+    return far;
+}
+
+void TimerWheel::place(const Entry &ent) {
+    slotFor(ent.when).push_back(ent);
+}
+
+void TimerWheel::cascade(int level) {
+    vector<Entry> ents;
+    if (level == num_levels)
+        ents.swap(far);
+    else
+        ents.swap(slots[level][(cur >> (slot_bits * level)) & slot_mask]);
+    for (const Entry &ent : ents)
+        place(ent);
+}
+
+void TimerWheel::rebase(uint64_t tick) {
+    vector<Entry> ents;
+    ents.reserve(num_timers);
+    for (auto &level : slots) {
+        for (auto &slot : level) {
+            ents.insert(ents.end(), slot.begin(), slot.end());
+            slot.clear();
+        }
+    }
+    ents.insert(ents.end(), far.begin(), far.end());
+    far.clear();
+    cur = tick;
+    for (const Entry &ent : ents)
+        place(ent);
+}
+
+void TimerWheel::tick(const function<void(Id)> &fire) {
+    cur++;
+    // Higher levels go first, what they cascade may have to go further down
+    // on this very tick.
+    for (int level = num_levels; level >= 1; level--)
+        if ((cur & ((uint64_t(1) << (slot_bits * level)) - 1)) == 0)
+            cascade(level);
+
+    vector<Entry> due;
+    due.swap(slots[0][cur & slot_mask]);
+    for (const Entry &ent : due) {
+        num_timers--;
+        fire(ent.id);
+    }
+}
+
+void TimerWheel::add(Id id, uint64_t when) {
+    place({id, max(when, cur + 1)});
+    num_timers++;
+}
+
+bool TimerWheel::cancel(Id id, uint64_t when) noexcept {
+    auto remove = [&](vector<Entry> &slot) {
+        auto it = find_if(slot.begin(), slot.end(), [&](const Entry &e) { return e.id == id; });
+        if (it == slot.end())
+            return false;
+        *it = slot.back();
+        slot.pop_back();
+        num_timers--;
+        return true;
+    };
+    // Timers that were already due when they were added expire later than
+    // `when`, and are found by searching everywhere.
+    if (when > cur && remove(slotFor(when)))
+        return true;
+    for (auto &level : slots)
+        for (auto &slot : level)
+            if (remove(slot))
+                return true;
+    return remove(far);
+}
+
+void TimerWheel::advance(uint64_t now, const function<void(Id)> &fire) {
+    while (cur < now) {
+        if (num_timers == 0) {
+            cur = now;
+            break;
+        }
+        // Skip over long stretches without any timers instead of ticking
+        // through all of them.
+        uint64_t next = nextExpiry();
+        if (next > cur + num_slots) {
+            rebase(min(next - 1, now));
+            continue;
+        }
+        tick(fire);
+    }
+}
+
+uint64_t TimerWheel::nextExpiry() const noexcept {
+    // All timers on a level expire before those on the levels above it, and
+    // within a level the slots after the current one are in order.
+    for (int level = 0; level < num_levels; level++) {
+        uint64_t at = (cur >> (slot_bits * level)) & slot_mask;
+        for (uint64_t idx = at + (level > 0); idx < num_slots; idx++) {
+            const auto &slot = slots[level][idx];
+            if (slot.empty())
+                continue;
+            uint64_t next = UINT64_MAX;
+            for (const Entry &ent : slot)
+                next = min(next, ent.when);
+            return next;
+        }
+    }
+    uint64_t next = UINT64_MAX;
+    for (const Entry &ent : far)
+        next = min(next, ent.when);
+    return next;
+}
@@ -0,0 +1,102 @@
+/** @file TimerWheel.hpp
+ *
+ * @brief Hierarchical timer wheel for delayed and repeating actions.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+}
+
+#include <functional>
+#include <vector>
+
+/**
+ * Hashed hierarchical timer wheel with a resolution of one tick, in the
+ * style of Varghese & Lauck. Timers are placed by their absolute expiry,
+ * the lowest level holds the ones due within the current 64 ticks, and each
+ * level above covers 64 times as much. Adding a timer and firing it are
+ * O(1), timers are cascaded down a level at a time as their expiry comes
+ * closer.
+ *
+ * The wheel only hands out ids, whoever uses it keeps track of what they
+ * stand for. Timers that are no longer wanted have to be cancel()ed, so
+ * that they neither take up space nor keep nextExpiry() early.
+ *
+ * Not thread-safe.
+ */
+class TimerWheel {
+public:
+    using Id = uint64_t;
+
+private:
+    static constexpr int slot_bits = 6;
+    static constexpr int num_slots = 1 << slot_bits;
+    static constexpr int num_levels = 4;
+    static constexpr uint64_t slot_mask = num_slots - 1;
+
+    struct Entry {
+        Id id;
+        uint64_t when;
+    };
+
+    /** Every timer that expires at or before this tick has been fired. */
+    uint64_t cur;
+    std::vector<Entry> slots[num_levels][num_slots];
+    /** Timers that lie beyond the top level. */
+    std::vector<Entry> far;
+    size_t num_timers = 0;
+
+    /** The slot that a timer expiring at `when` belongs in. */
+    std::vector<Entry> &slotFor(uint64_t when) noexcept;
+
+    /** Put an entry into the slot that its expiry belongs in. */
+    void place(const Entry &ent);
+
+    /** Move the timers of a slot down to the levels below it. */
+    void cascade(int level);
+
+    /** Move the wheel forward to `tick`, which must be before the
+     *  earliest expiry, by placing every timer anew. */
+    void rebase(uint64_t tick);
+
+    /** Advance by one tick and fire the timers that are due. */
+    void tick(const std::function<void(Id)> &fire);
+
+public:
+    /** @param now Current tick, e.g monotonic time in milliseconds. */
+    explicit TimerWheel(uint64_t now) noexcept;
+
+    /** Schedule a timer, ones that are already due fire on the next
+     *  call to advance(). */
+    void add(Id id, uint64_t when);
+
+    /**
+     * Remove a timer before it fires.
+     *
+     * @param when The expiry it was added with, used to find its slot.
+     * @return False if there is no such timer, e.g because it has fired.
+     */
+    bool cancel(Id id, uint64_t when) noexcept;
+
+    /** Fire all timers that expire at or before `now`, in order of
+     *  their expiry. Timers may be added from `fire`. */
+    void advance(uint64_t now, const std::function<void(Id)> &fire);
+
+    /** Earliest expiry of any timer, only valid if !empty(). */
+    uint64_t nextExpiry() const noexcept;
+
+    /** Tick that the wheel has advanced to. */
+    inline uint64_t now() const noexcept {
+        return cur;
+    }
+
+    inline bool empty() const noexcept {
+        return num_timers == 0;
+    }
+
+    inline size_t size() const noexcept {
+        return num_timers;
+    }
+};
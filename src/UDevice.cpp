@@ -9,10 +9,13 @@ extern "C" {
     #include <time.h>
     #include <dirent.h>
     #include <poll.h>
+    #include <sys/eventfd.h>
+    #include <syslog.h>
 }
 
 #include "SystemError.hpp"
 #include "UDevice.hpp"
+#include "KeyState.hpp"
 #include "utils.hpp"
 #include <filesystem>
 #include <regex>
@@ -25,6 +28,31 @@ static_assert(sizeof(hawck_udev_name) < UINPUT_MAX_NAME_SIZE,
 using namespace std;
 namespace fs = std::filesystem;
 
+/**
+ * Find the event device of a uinput device through sysfs, the kernel knows
+ * it by a name like input23 and it has an eventN directory there.
+ *
+ * @return Path in /dev/input, or "" if the kernel does not support
+ *         UI_GET_SYSNAME.
+ */
+static string sysnameEventPath(int ufd) {
+#ifdef UI_GET_SYSNAME
+    char sysname[64];
+    if (ioctl(ufd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+        return "";
+    sysname[sizeof(sysname) - 1] = '\0';
+    error_code ec;
+    for (auto &entry : fs::directory_iterator(pathJoin("/sys/devices/virtual/input", sysname), ec))
+        if (stringStartsWith(entry.path().filename().string(), "event"))
+            return pathJoin("/dev/input", entry.path().filename().string());
+#else
+    (void) ufd;
+#endif
+    return "";
+}
+
+/** Scan /dev/input for a device by name, for kernels without
+ *  UI_GET_SYSNAME. */
 static int getDevice(const string &by_name) {
     char buf[NAME_MAX];
     string devdir = "/dev/input";
@@ -44,18 +72,8 @@ static int getDevice(const string &by_name) {
     return -1;
 }
 
-UDevice::UDevice()
-    : LuaIface(this, UDevice_lua_methods)
-{
-    // UDevice initialization taken from this guide:
-    //   https://www.kernel.org/doc/html/v4.12/input/uinput.html
-
-    if ((fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK)) < 0)
-        throw SystemError("Unable to open /dev/uinput: ", errno);
-
-    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
-        throw SystemError("Unable to set event bit", errno);
-
+/** The keys of ALL_KEYS that the running kernel knows of. */
+static vector<int> kernelKeys() {
     // Hawck might have been compiled with keys that are not supported on the
     // kernel on which it runs.
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
@@ -81,11 +99,53 @@ UDevice::UDevice()
     syslog(LOG_INFO, "Older kernel version, popping %d key(s).",
            newer_keys);
 
-    for (int i = 0; i < ((int) ALL_KEYS.size()) - newer_keys; i++)
-        if (ioctl(fd, UI_SET_KEYBIT, ALL_KEYS[i]) < 0)
-            throw SystemError("Unable to set key bit", errno);
+    return vector<int>(ALL_KEYS.begin(), ALL_KEYS.end() - newer_keys);
+}
 
+/** kernelKeys(), worked out once for every UDevice that the process
+ *  creates. */
+static const vector<int> &supportedKeys() {
+    static const vector<int> keys = kernelKeys();
+    return keys;
+}
+
+UDevice::UDevice(bool pointer, int adopt_fd, int adopt_dfd)
+    : LuaIface(this, UDevice_lua_methods),
+      pointer(pointer)
+{
     memset(&usetup, 0, sizeof(usetup));
+    if (adopt_fd >= 0) {
+        // Already set up by the InputD that created it.
+        fd = adopt_fd;
+        dfd = adopt_dfd;
+        syslog(LOG_INFO, "Took over the udevice");
+        return;
+    }
+
+    // UDevice initialization taken from this guide:
+    //   https://www.kernel.org/doc/html/v4.12/input/uinput.html
+
+    if ((fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+        throw SystemError("Unable to open /dev/uinput: ", errno);
+
+    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
+        throw SystemError("Unable to set event bit", errno);
+
+    for (int key : supportedKeys())
+        if (ioctl(fd, UI_SET_KEYBIT, key) < 0)
+            throw SystemError("Unable to set key bit", errno);
+
+    if (pointer) {
+        if (ioctl(fd, UI_SET_EVBIT, EV_REL) < 0)
+            throw SystemError("Unable to set event bit", errno);
+        for (int code : POINTER_AXES)
+            if (ioctl(fd, UI_SET_RELBIT, code) < 0)
+                throw SystemError("Unable to set relative axis bit", errno);
+        for (int btn = BTN_LEFT; btn <= BTN_TASK; btn++)
+            if (ioctl(fd, UI_SET_KEYBIT, btn) < 0)
+                throw SystemError("Unable to set key bit", errno);
+    }
+
     usetup.id.bustype = BUS_USB;
     usetup.id.vendor = 0x420b;
     usetup.id.product = 0x1a2e;
@@ -99,8 +159,17 @@ UDevice::UDevice()
     // FIXME: HACK: For some reason the `fd` from open() cannot be used in
     // `upAll()` or anything else that requires retrieving the key states. But
     // opening up a second file-handle to the device works.
+    // The event device is registered by UI_DEV_CREATE, so it can usually
+    // be opened right away.
+    string path = sysnameEventPath(fd);
     int errors = 0;
-    while ((dfd = getDevice(usetup.name)) < 0) {
+    for (;;) {
+        if (path.size())
+            dfd = open(path.c_str(), O_RDWR | O_CLOEXEC | O_NONBLOCK);
+        else
+            dfd = getDevice(usetup.name);
+        if (dfd >= 0)
+            break;
         if (errors++ > 100)
             throw SystemError("Unable to get file descriptor of udevice.");
         usleep(1000);
@@ -108,6 +177,15 @@ UDevice::UDevice()
 }    
 
 UDevice::~UDevice() {
+    if (emitter_running) {
+        sync();
+        emitter_running = false;
+        uint64_t one = 1;
+        if (write(emitter_efd, &one, sizeof(one)) != sizeof(one))
+            syslog(LOG_ERR, "Unable to wake emitter thread: %s", strerror(errno));
+        emitter.join();
+        close(emitter_efd);
+    }
     ioctl(fd, UI_DEV_DESTROY);
     close(fd);
     close(dfd);
@@ -126,13 +204,162 @@ void UDevice::emit(int type, int code, int val) {
     events.push_back(ev);
 }
 
-void UDevice::flush() {
-    for (struct input_event& ev : this->events) {
-        if (write(fd, &ev, sizeof(ev)) != sizeof(ev))
+void UDevice::writeEvents(const struct input_event *evs, size_t num) {
+    const char *buf = (const char *) evs;
+    ssize_t left = num * sizeof(*evs);
+    while (left > 0) {
+        ssize_t n = write(fd, buf, left);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            write_errors.fetch_add(1, memory_order_relaxed);
             throw SystemError("Error in write(): ", errno);
-        usleep(ev_delay);
+        }
+        buf += n;
+        left -= n;
     }
-    this->events.clear();
+    last_write_t = chrono::steady_clock::now();
+}
+
+void UDevice::pace() {
+    if (ev_delay <= 0)
+        return;
+    auto next_t = last_write_t + chrono::microseconds(ev_delay);
+    auto now = chrono::steady_clock::now();
+    if (now < next_t)
+        usleep(chrono::duration_cast<chrono::microseconds>(next_t - now).count());
+}
+
+void UDevice::writeBatch(const EventBatch &batch) {
+    switch (flush_mode) {
+        case FLUSH_EVENTS:
+            for (const struct input_event& ev : batch) {
+                writeEvents(&ev, 1);
+                usleep(ev_delay);
+            }
+            break;
+
+        case FLUSH_FRAMES: {
+            // Write each frame, up to and including its SYN_REPORT, in one go.
+            size_t start = 0;
+            for (size_t i = 0; i < batch.size(); i++) {
+                const auto &ev = batch[i];
+                if (isFrameEnd(ev) || i == batch.size() - 1) {
+                    // The delay is there for desktops that drop keys, pointer
+                    // motion is written as soon as possible.
+                    if (!pointer || !isMotionFrame(&batch[start], i - start + 1))
+                        pace();
+                    writeEvents(&batch[start], i - start + 1);
+                    start = i + 1;
+                }
+            }
+            break;
+        }
+
+        case FLUSH_BATCH:
+            if (batch.size())
+                writeEvents(&batch[0], batch.size());
+            break;
+    }
+}
+
+void UDevice::flush() {
+    if (!emitter_running) {
+        if (pointer)
+            coalesceMotion(&events);
+        writeBatch(events);
+        events.clear();
+        return;
+    }
+
+    if (events.empty())
+        return;
+
+    EventBatch batch;
+    if (!recycled.pop(&batch))
+        batch.reserve(evbuf_start_len);
+    batch.swap(events);
+
+    // The emitter is falling behind, wait for it to catch up rather than
+    // dropping output.
+    while (!pending.push(std::move(batch)))
+        usleep(100);
+    batches_queued++;
+
+    if (emitter_sleeping.exchange(false)) {
+        uint64_t one = 1;
+        if (write(emitter_efd, &one, sizeof(one)) != sizeof(one))
+            throw SystemError("Unable to wake emitter thread: ", errno);
+    }
+}
+
+void UDevice::startEmitter() {
+    if (emitter_running)
+        return;
+    if ((emitter_efd = eventfd(0, EFD_CLOEXEC)) == -1)
+        throw SystemError("Unable to create eventfd: ", errno);
+    emitter_running = true;
+    emitter = thread([this]() { emitterLoop(); });
+}
+
+void UDevice::emitterLoop() noexcept {
+    EventBatch batch;
+    while (emitter_running) {
+        if (!pending.pop(&batch)) {
+            emitter_sleeping = true;
+            atomic_thread_fence(memory_order_seq_cst);
+            // Check again, flush() might have pushed before seeing the flag.
+            if (pending.empty() && emitter_running) {
+                uint64_t cnt;
+                if (read(emitter_efd, &cnt, sizeof(cnt)) == -1 && errno != EINTR)
+                    syslog(LOG_ERR, "Emitter: error in read(): %s", strerror(errno));
+            }
+            emitter_sleeping = false;
+            continue;
+        }
+
+        // Whatever piled up while the previous batch was being written goes
+        // out together, with pointer motion merged, so that a fast mouse
+        // does not cost a write per frame.
+        uint64_t num_batches = 1;
+        if (pointer) {
+            EventBatch next;
+            while (batch.size() < max_drain_len && pending.pop(&next)) {
+                batch.insert(batch.end(), next.begin(), next.end());
+                next.clear();
+                recycled.push(std::move(next));
+                next = EventBatch();
+                num_batches++;
+            }
+            coalesceMotion(&batch);
+        }
+
+        try {
+            writeBatch(batch);
+        } catch (const SystemError &e) {
+            syslog(LOG_ERR, "Emitter: unable to write events: %s", e.what());
+        }
+        batch.clear();
+        batches_written += num_batches;
+        // If the recycle queue is full the batch is simply freed.
+        recycled.push(std::move(batch));
+        batch = EventBatch();
+    }
+}
+
+void UDevice::sync() noexcept {
+    while (emitter_running && batches_written < batches_queued)
+        usleep(100);
+}
+
+UDeviceFlushMode UDevice::parseFlushMode(const std::string& name) {
+    if (name == "events")
+        return FLUSH_EVENTS;
+    if (name == "frames")
+        return FLUSH_FRAMES;
+    if (name == "batch")
+        return FLUSH_BATCH;
+    throw invalid_argument("Invalid flush mode: " + name);
 }
 
 void UDevice::done() {
@@ -144,20 +371,18 @@ void UDevice::setEventDelay(int delay) {
 }
 
 void UDevice::upAll() {
-    unsigned char key_states[KEY_MAX/8 + 1];
+    // Make sure the key states reflect everything that has been flushed.
+    sync();
+    uint8_t key_states[KEY_MAX/8 + 1];
     memset(key_states, 0, sizeof(key_states));
     if (ioctl(dfd, EVIOCGKEY(sizeof(key_states)), key_states) == -1)
         throw SystemError("Unable to get key states: ", errno);
-    int key = 0;
-    for (size_t i = 0; i < sizeof(key_states); i++)
-        // Shift bits to count downed keys.
-        for (unsigned int bs = 1; bs <= 128; bs <<= 1) {
-            if (bs & key_states[i]) {
-                emit(EV_KEY, key, 0);
-                emit(EV_SYN, 0, 0);
-            }
-            key++;
-        }
+    KeyState keys;
+    keys.setFromBitmap(key_states, sizeof(key_states));
+    keys.forEachDown([this](int key) {
+        emit(EV_KEY, key, 0);
+        emit(EV_SYN, 0, 0);
+    });
     flush();
 }
 
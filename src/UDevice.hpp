@@ -21,7 +21,13 @@ extern "C" {
 #include <stdio.h>
 #include <stdexcept>
 #include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
 #include "IUDevice.hpp"
+#include "SPSCQueue.hpp"
+#include "Pointer.hpp"
 
 static const std::vector<int> ALL_KEYS = {
     KEY_ESC,
@@ -527,6 +533,18 @@ static const std::vector<int> ALL_KEYS = {
 #endif
 };
 
+/** Relative axes of the udevice when it passes pointers through. */
+static const std::vector<int> POINTER_AXES = {
+    REL_X,
+    REL_Y,
+    REL_HWHEEL,
+    REL_WHEEL,
+#ifdef REL_WHEEL_HI_RES
+    REL_WHEEL_HI_RES,
+    REL_HWHEEL_HI_RES,
+#endif
+};
+
 // Methods to export to Lua
 // (ClassName, methodName, type0(), type1()...)
 #define UDevice_lua_methods(M, _)               \
@@ -536,6 +554,18 @@ static const std::vector<int> ALL_KEYS = {
 // Declare extern "C" Lua bindings
 LUA_DECLARE(UDevice_lua_methods)
 
+/** How UDevice::flush() writes out buffered events. */
+enum UDeviceFlushMode {
+    /** One write() per event, with the event delay after each one. */
+    FLUSH_EVENTS,
+    /** One write() per SYN_REPORT frame, the event delay is only
+     *  applied between frames. */
+    FLUSH_FRAMES,
+    /** The entire buffer is written with a single write(), without
+     *  any delay. */
+    FLUSH_BATCH,
+};
+
 class UDevice : public IUDevice,
                 public Lua::LuaIface<UDevice> {
 private:
@@ -543,13 +573,62 @@ private:
     int fd;
     int dfd;
     int ev_delay = 3800;
+    UDeviceFlushMode flush_mode = FLUSH_FRAMES;
+    /** When the previous write() finished, used to pace frames
+     *  without sleeping after the final one. */
+    std::chrono::steady_clock::time_point last_write_t;
     uinput_setup usetup;
     std::vector<struct input_event> events;
+    /** Whether pointer axes and buttons are enabled, see UDevice(bool) */
+    bool pointer;
+
+    using EventBatch = std::vector<struct input_event>;
+    static constexpr size_t emitter_queue_len = 256;
+    /** Batches waiting to be written by the emitter thread. */
+    SPSCQueue<EventBatch, emitter_queue_len> pending;
+    /** Written batches handed back to flush(), so that their
+     *  memory can be reused. */
+    SPSCQueue<EventBatch, emitter_queue_len> recycled;
+    std::thread emitter;
+    std::atomic<bool> emitter_running = false;
+    /** Set by the emitter before it blocks on emitter_efd. */
+    std::atomic<bool> emitter_sleeping = false;
+    /** eventfd used to wake up the emitter thread. */
+    int emitter_efd = -1;
+    std::atomic<uint64_t> batches_queued = 0;
+    std::atomic<uint64_t> batches_written = 0;
+    /** Number of write()s to the udevice that failed. */
+    std::atomic<uint64_t> write_errors = 0;
+    /** Maximum number of events the emitter collects from the queue
+     *  before writing them out. */
+    static constexpr size_t max_drain_len = 4096;
+
+    /** Write `num` events with a single write(). */
+    void writeEvents(const struct input_event *evs, size_t num);
+
+    /** Sleep until ev_delay has passed since the previous write(). */
+    void pace();
+
+    /** Write out a batch of events according to the flush mode. */
+    void writeBatch(const EventBatch &batch);
+
+    /** Main loop of the emitter thread. */
+    void emitterLoop() noexcept;
 
     LUA_METHOD_COLLECT(UDevice_lua_methods);
 
 public:
-    UDevice();
+    /**
+     * @param pointer Also enable relative axes and mouse buttons, so that
+     *                mice can be passed through. This is opt-in, desktops
+     *                may treat the device as a mouse and e.g disable the
+     *                touchpad while it is present.
+     * @param adopt_fd Take over the uinput device with this file descriptor
+     *                 from another InputD instead of creating one, see
+     *                 Handover.hpp
+     * @param adopt_dfd Event device of the adopted uinput device.
+     */
+    explicit UDevice(bool pointer = false, int adopt_fd = -1, int adopt_dfd = -1);
 
     ~UDevice();
 
@@ -570,6 +649,56 @@ public:
      */
     void setEventDelay(int delay);
 
+    /**
+     * Start a dedicated thread for writing to the device.
+     *
+     * After this flush() only hands the buffered events over to the emitter
+     * thread and returns immediately, the order of the output is preserved.
+     * Should be called before the device is used.
+     */
+    void startEmitter();
+
+    /** Native handle of the emitter thread, only valid after startEmitter(). */
+    inline pthread_t getEmitterThread() noexcept {
+        return emitter.native_handle();
+    }
+
+    /** Wait until the emitter thread has written everything that has been
+     *  flushed so far, returns immediately without an emitter thread. */
+    void sync() noexcept;
+
+    /** Whether pointer axes and buttons are enabled. */
+    inline bool hasPointer() const noexcept {
+        return pointer;
+    }
+
+    /** File descriptor of the uinput device. */
+    inline int getfd() const noexcept {
+        return fd;
+    }
+
+    /** File descriptor of the event device of the uinput device. */
+    inline int getEventFd() const noexcept {
+        return dfd;
+    }
+
+    /** Number of failed writes, safe to call from any thread. */
+    inline uint64_t numWriteErrors() const noexcept {
+        return write_errors.load(std::memory_order_relaxed);
+    }
+
+    /** Set the way buffered events are written out on flush(). */
+    inline void setFlushMode(UDeviceFlushMode mode) noexcept {
+        flush_mode = mode;
+    }
+
+    /**
+     * Parse a flush mode name, one of "events", "frames" or "batch".
+     *
+     * @throws std::invalid_argument If the name is not recognized.
+     */
+    static UDeviceFlushMode parseFlushMode(const std::string& name);
+
     /** Generate key up events for all held keys.
      */
     void upAll();
@@ -0,0 +1,140 @@
+extern "C" {
+    #include <sys/socket.h>
+    #include <linux/netlink.h>
+    #include <arpa/inet.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <string.h>
+    #include <errno.h>
+}
+
+#include "UEventMonitor.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+
+/** Multicast group that udevd sends processed events to, group 1 has the
+ *  raw kernel events. */
+static constexpr unsigned UDEV_MONITOR_UDEV = 2;
+
+/** Header of udev netlink messages, see libudev-monitor.c in systemd. */
+struct udev_monitor_netlink_header {
+    /** "libudev" */
+    char prefix[8];
+    /** 0xfeedcafe in network byte order. */
+    unsigned magic;
+    unsigned header_size;
+    unsigned properties_off;
+    unsigned properties_len;
+    unsigned filter_subsystem_hash;
+    unsigned filter_devtype_hash;
+    unsigned filter_tag_bloom_hi;
+    unsigned filter_tag_bloom_lo;
+};
+
+static constexpr unsigned UDEV_MONITOR_MAGIC = 0xfeedcafe;
+
+UEventMonitor::UEventMonitor() {
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd == -1)
+        throw SystemError("Unable to create netlink socket: ", errno);
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UDEV_MONITOR_UDEV;
+    if (::bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(fd);
+        throw SystemError("Unable to bind netlink socket: ", err);
+    }
+
+    // Needed to check where messages come from.
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) == -1) {
+        int err = errno;
+        close(fd);
+        throw SystemError("Unable to set SO_PASSCRED on netlink socket: ", err);
+    }
+}
+
+UEventMonitor::~UEventMonitor() {
+    close(fd);
+}
+
+bool UEventMonitor::parse(const char *buf, size_t len, UEvent *ev) {
+    udev_monitor_netlink_header hdr;
+    if (len < sizeof(hdr))
+        return false;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (memcmp(hdr.prefix, "libudev", 8) != 0 ||
+        ntohl(hdr.magic) != UDEV_MONITOR_MAGIC ||
+        hdr.properties_off < sizeof(hdr) || hdr.properties_off > len ||
+        hdr.properties_len > len - hdr.properties_off)
+        return false;
+
+    ev->props.clear();
+    const char *p = buf + hdr.properties_off;
+    const char *end = p + hdr.properties_len;
+    while (p < end) {
+        size_t n = strnlen(p, end - p);
+        const char *eq = (const char *) memchr(p, '=', n);
+        if (eq)
+            ev->props.emplace(string(p, eq - p), string(eq + 1, p + n - (eq + 1)));
+        p += n + 1;
+    }
+    ev->action = ev->get("ACTION");
+    ev->devpath = ev->get("DEVPATH");
+    return !ev->action.empty();
+}
+
+bool UEventMonitor::recv(UEvent *ev, int timeout) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    switch (poll(&pfd, 1, timeout)) {
+        case -1:
+            if (errno == EINTR)
+                return false;
+            throw SystemError("Error in poll(): ", errno);
+        case 0:
+            return false;
+    }
+
+    char buf[8192];
+    char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+    struct iovec iov = {buf, sizeof(buf)};
+    struct sockaddr_nl addr;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return false;
+        // The kernel dropped messages because we were too slow.
+        if (errno == ENOBUFS)
+            return false;
+        throw SystemError("Error in recvmsg(): ", errno);
+    }
+    if (msg.msg_flags & MSG_TRUNC)
+        return false;
+
+    // Only trust messages that were multicast by root.
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+        return false;
+    struct ucred cred;
+    memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+    if (cred.uid != 0 || addr.nl_groups != UDEV_MONITOR_UDEV)
+        return false;
+
+    return parse(buf, n, ev);
+}
@@ -0,0 +1,63 @@
+/** @file UEventMonitor.hpp
+ *
+ * @brief Device hotplug notifications from udev over netlink.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+/** A device event, with the properties that udev attached to it. */
+struct UEvent {
+    /** "add", "remove", "change", ... */
+    std::string action;
+    /** Path in /sys, without the /sys prefix. */
+    std::string devpath;
+    std::unordered_map<std::string, std::string> props;
+
+    /** Get a property, or an empty string if it is not set. */
+    inline const std::string &get(const std::string &key) const noexcept {
+        static const std::string none;
+        auto it = props.find(key);
+        return (it == props.end()) ? none : it->second;
+    }
+};
+
+/**
+ * Receive the device events that udev broadcasts once it has finished
+ * processing a device, i.e after device nodes have been created and their
+ * permissions and symlinks have been set up. This is the same source that
+ * libudev's udev_monitor uses.
+ */
+class UEventMonitor {
+    int fd = -1;
+
+public:
+    /**
+     * @throws SystemError If the netlink socket cannot be set up, e.g
+     *                     because the kernel does not support it.
+     */
+    UEventMonitor();
+    UEventMonitor(const UEventMonitor &) = delete;
+    UEventMonitor &operator=(const UEventMonitor &) = delete;
+    ~UEventMonitor();
+
+    /**
+     * Wait for the next event.
+     *
+     * @param ev Where to put the event.
+     * @param timeout Time to wait in milliseconds, -1 to wait forever.
+     * @throws SystemError On socket errors.
+     * @return False on timeout, or if a message that was not from udev
+     *         was received.
+     */
+    bool recv(UEvent *ev, int timeout);
+
+    /**
+     * Parse a message in the binary format sent by udev.
+     *
+     * @return False if the message is not a valid udev message.
+     */
+    static bool parse(const char *buf, size_t len, UEvent *ev);
+};
@@ -38,6 +38,7 @@ extern "C" {
     #include <sys/types.h>
     #include <sys/socket.h>
     #include <sys/un.h>
+    #include <sys/uio.h>
     #include <poll.h>
 }
 
@@ -49,8 +50,12 @@ extern "C" {
 #include <cstring>
 #include <vector>
 #include <chrono>
+#include <algorithm>
+#include <memory>
+#include <mutex>
 
 #include "SystemError.hpp"
+#include "ShmTransport.hpp"
 
 class SocketError : public std::exception {
 private:
@@ -105,6 +110,10 @@ inline void recvAll(int fd, char *dst, ssize_t sz, std::chrono::milliseconds tim
 
         switch (poll(&pfd, 1, timeout.count())) {
             case -1:
+                if (errno == EINTR) {
+                    n = 0;
+                    break;
+                }
                 throw SystemError("Error in poll(): ", errno);
 
             case 0:
@@ -158,33 +167,159 @@ class UNIXSocket {
 private:
     int fd;
     std::string addr = "";
+    /** Received data that has not been consumed yet lives in
+     *  rbuf[rbuf_start, rbuf_end) */
+    std::vector<char> rbuf;
+    size_t rbuf_start = 0;
+    size_t rbuf_end = 0;
+    /** Minimum amount of bytes to ask for in each read() */
+    static constexpr size_t read_chunk = 4096;
+    /** Sanity limit for the number of elements in a frame. */
+    static constexpr uint32_t max_frame_count = 1 << 16;
+    /** Shared memory transport, replaces the socket for
+     *  sending/receiving packets when set. */
+    std::unique_ptr<ShmTransport> shm;
+    /** How long to wait for room in the shared memory ring. */
+    static constexpr int shm_send_timeout = 1000;
+    /** Keeps packets sent from different threads from interleaving. */
+    std::mutex send_mtx;
+
+    inline size_t buffered() const noexcept {
+        return rbuf_end - rbuf_start;
+    }
 
-    int connectTo(const std::string& addr) {
+    /**
+     * Read from the socket until at least `need` bytes are buffered,
+     * taking whatever else is available in the same read().
+     *
+     * @param need Amount of bytes required.
+     * @param timeout Timeout in milliseconds, -1 for no timeout.
+     */
+    void fill(size_t need, int timeout) {
+        using namespace std::chrono;
+        auto deadline = steady_clock::now() + milliseconds(timeout);
+
+        while (buffered() < need) {
+            // Make room for the rest of the data.
+            if (rbuf.size() - rbuf_start < std::max(need, read_chunk)) {
+                memmove(rbuf.data(), rbuf.data() + rbuf_start, buffered());
+                rbuf_end -= rbuf_start;
+                rbuf_start = 0;
+                if (rbuf.size() < need + read_chunk)
+                    rbuf.resize(need + read_chunk);
+            }
+
+            if (shm) {
+                size_t n = shm->recvSome(rbuf.data() + rbuf_end, rbuf.size() - rbuf_end);
+                rbuf_end += n;
+                if (n)
+                    continue;
+                int left = -1;
+                if (timeout >= 0)
+                    left = std::max<int>(duration_cast<milliseconds>(deadline - steady_clock::now()).count(), 0);
+                if (!shm->wait(left, fd) && timeout >= 0 && steady_clock::now() >= deadline)
+                    throw SocketTimeout("Unable to receive packet: timeout");
+                continue;
+            }
+
+            if (timeout >= 0) {
+                int left = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                int ret = poll(&pfd, 1, std::max(left, 0));
+                if (ret == -1 && errno == EINTR)
+                    continue;
+                if (ret == -1)
+                    throw SystemError("Error in poll(): ", errno);
+                if (ret == 0)
+                    throw SocketTimeout("Unable to receive packet: timeout");
+            }
+
+            ssize_t n = ::read(fd, rbuf.data() + rbuf_end, rbuf.size() - rbuf_end);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw SocketError("Unable to receive packet: " +
+                                  (n == 0 ? std::string("Connection closed")
+                                          : SystemError::getErrorString(errno)));
+            rbuf_end += n;
+        }
+    }
+
+    /** Consume `n` buffered bytes. */
+    inline void take(void *dst, size_t n) noexcept {
+        memcpy(dst, rbuf.data() + rbuf_start, n);
+        rbuf_start += n;
+        if (rbuf_start == rbuf_end)
+            rbuf_start = rbuf_end = 0;
+    }
+
+    /** Write out all of `iov`, through the shared memory
+     *  transport if there is one. `iov` is modified. */
+    void writeAll(struct iovec *iov, int iovcnt, const char *errmsg) {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (shm) {
+            shm->send(iov, iovcnt, shm_send_timeout);
+            return;
+        }
+        // A signal may interrupt the write part of the way through, the
+        // rest is written after it so that the peer never sees half a frame.
+        while (iovcnt > 0) {
+            ssize_t n = ::writev(fd, iov, iovcnt);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw SocketError(errmsg);
+            while (iovcnt > 0 && size_t(n) >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = (char *) iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+    }
+
+    /**
+     * Make a single connection attempt.
+     *
+     * @return The connected socket, or -1 with errno set.
+     */
+    static int tryConnectTo(const std::string& addr) {
         int fd;
         struct sockaddr_un saun;
-        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
             throw SocketError("Unable to create socket");
         }
         memset(&saun, 0, sizeof(saun));
         saun.sun_family = AF_UNIX;
         strncpy(saun.sun_path, addr.c_str(), sizeof(saun.sun_path) - 1);
         const size_t len = sizeof(saun.sun_family) + strlen(saun.sun_path);
-        errno = 0;
-        int last_errno = 0;
-        while (::connect(fd, (sockaddr*)&saun, len) != 0) {
-            auto exc = SystemError("", errno);
-            // Only print the error if it changed.
-            if (errno != last_errno) {
-                //fprintf(stderr, "Could not connect to '%s': %s\n", addr.c_str(), exc.what());
-                last_errno = errno;
-            }
-            usleep(250000);
-            errno = 0;
+        if (::connect(fd, (sockaddr*)&saun, len) != 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return -1;
         }
+        return fd;
+    }
+
+    int connectTo(const std::string& addr) {
+        int fd;
+        while ((fd = tryConnectTo(addr)) == -1)
+            usleep(250000);
         fprintf(stderr, "Connection established!\n");
         return fd;
     }
 
+    inline void resetState() noexcept {
+        shm.reset();
+        rbuf_start = rbuf_end = 0;
+    }
+
 public:
     /**
      * Create a socket from a file descriptor.
@@ -205,13 +340,40 @@ public:
         this->addr = addr;
     }
 
+    /**
+     * Create a socket for an address, connecting only if `wait` is set.
+     * Otherwise it starts out closed, see tryRecon().
+     */
+    UNIXSocket(const std::string& addr, bool wait) : fd(-1), addr(addr) {
+        if (wait)
+            fd = connectTo(addr);
+    }
+
     /** Reconnect to the server, this only works for UNIXSockets
      *  that have addr set. */
     void recon() {
         close();
+        resetState();
         fd = connectTo(addr);
     }
 
+    /**
+     * Make a single attempt at reconnecting to the server, without
+     * waiting for it to come up.
+     *
+     * @return True if the socket is connected.
+     */
+    bool tryRecon() {
+        close();
+        resetState();
+        fd = tryConnectTo(addr);
+        return fd != -1;
+    }
+
+    inline bool isConnected() const noexcept {
+        return fd != -1;
+    }
+
     /**
      * Closes the connection.
      */
@@ -223,7 +385,148 @@ public:
      * Closes the connection.
      */
     void close() noexcept {
-        ::close(fd);
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+    }
+
+    /** Get the file descriptor of the socket. */
+    inline int getfd() const noexcept {
+        return fd;
+    }
+
+    /**
+     * Get a file descriptor that becomes readable when packets arrive,
+     * this is the socket itself unless shared memory is in use.
+     *
+     * With shared memory this is only reliable after waitReadable() has
+     * returned false.
+     */
+    inline int getWakeFd() const noexcept {
+        return shm ? shm->getfd() : fd;
+    }
+
+    /**
+     * Send and receive packets through shared memory from now on, the
+     * socket is then only used to detect that the other side hung up.
+     */
+    inline void useShm(std::unique_ptr<ShmTransport> transport) noexcept {
+        shm = std::move(transport);
+    }
+
+    inline bool usingShm() const noexcept {
+        return shm != nullptr;
+    }
+
+    /**
+     * Send data along with file descriptors.
+     *
+     * @param data Data to send, must be non-empty.
+     * @param len Length of data.
+     * @param fds File descriptors to pass to the other side.
+     */
+    void sendFds(const void *data, size_t len, const std::vector<int> &fds) {
+        struct iovec iov;
+        iov.iov_base = (void *) data;
+        iov.iov_len = len;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        std::vector<char> cbuf(CMSG_SPACE(sizeof(int) * fds.size()));
+        if (fds.size()) {
+            msg.msg_control = cbuf.data();
+            msg.msg_controllen = cbuf.size();
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (::sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) len)
+            throw SocketError("Unable to send message: " + SystemError::getErrorString(errno));
+    }
+
+    /**
+     * Receive data sent with sendFds(), received file descriptors are
+     * owned by the caller.
+     *
+     * @param data Where to put the data.
+     * @param len Exact length of the data.
+     * @param fds Where to put received file descriptors.
+     * @param max_fds Maximum number of file descriptors to accept.
+     * @param timeout Timeout in milliseconds.
+     */
+    void recvFds(void *data, size_t len, std::vector<int> *fds, size_t max_fds, int timeout) {
+        if (buffered())
+            throw SocketError("Unable to receive file descriptors: data was already buffered");
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int ret;
+        while ((ret = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+            ;
+        if (ret == -1)
+            throw SystemError("Error in poll(): ", errno);
+        if (ret == 0)
+            throw SocketTimeout("Unable to receive message: timeout");
+
+        struct iovec iov;
+        iov.iov_base = data;
+        iov.iov_len = len;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        std::vector<char> cbuf(CMSG_SPACE(sizeof(int) * max_fds));
+        msg.msg_control = cbuf.data();
+        msg.msg_controllen = cbuf.size();
+
+        ssize_t n = ::recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        int err = errno;
+
+        fds->clear();
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *recv_fds = (const int *) CMSG_DATA(cmsg);
+            fds->insert(fds->end(), recv_fds, recv_fds + num);
+        }
+
+        if (n != (ssize_t) len || (msg.msg_flags & MSG_CTRUNC)) {
+            for (int rfd : *fds)
+                ::close(rfd);
+            fds->clear();
+            throw SocketError("Unable to receive message: " +
+                              (n == -1 ? SystemError::getErrorString(err)
+                                       : std::string("Message was truncated")));
+        }
+    }
+
+    /**
+     * Wait for the socket to become readable.
+     *
+     * @param timeout Timeout in milliseconds, 0 to return immediately.
+     * @return True if there is data to be read, or the connection was closed.
+     *         Also true if received data is already buffered.
+     */
+    bool waitReadable(int timeout) {
+        if (buffered())
+            return true;
+        if (shm)
+            return shm->wait(timeout, fd);
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, timeout);
+        if (ret == -1 && errno != EINTR)
+            throw SystemError("Error in poll(): ", errno);
+        return ret > 0;
     }
 
     /**
@@ -235,7 +538,8 @@ public:
      * @param p The buffer to insert the packet into.
      */
     void recv(Packet *p) {
-        recvAll(fd, p);
+        fill(sizeof(*p), -1);
+        take(p, sizeof(*p));
     }
 
     /**
@@ -247,7 +551,67 @@ public:
      * @param p The buffer to insert the packet into.
      */
     void recv(Packet *p, std::chrono::milliseconds timeout) {
-        recvAll(fd, p, timeout);
+        fill(sizeof(*p), timeout.count());
+        take(p, sizeof(*p));
+    }
+
+    /**
+     * Wait for the header of the next frame and look at it without
+     * consuming it, so that the payload type can be chosen before
+     * calling recvFrame().
+     *
+     * @param hdr Where to put the header.
+     * @param timeout Time to wait for the header.
+     */
+    template <class Header>
+    void peekHeader(Header *hdr, std::chrono::milliseconds timeout) {
+        fill(sizeof(*hdr), timeout.count());
+        memcpy(hdr, rbuf.data() + rbuf_start, sizeof(*hdr));
+    }
+
+    /**
+     * Receive a frame, consisting of a header followed by `hdr->count`
+     * packed items.
+     *
+     * All or nothing, bytes that arrive along with the frame are kept for
+     * the next call, so a batch is usually received with a single read().
+     *
+     * @param hdr Where to put the header, must have a `count` field.
+     * @param items Where to put the payload, previous contents are replaced.
+     * @param timeout Time to wait for the complete frame.
+     */
+    template <class Header, class Item>
+    void recvFrame(Header *hdr, std::vector<Item> *items, std::chrono::milliseconds timeout) {
+        fill(sizeof(*hdr), timeout.count());
+        memcpy(hdr, rbuf.data() + rbuf_start, sizeof(*hdr));
+        if (hdr->count > max_frame_count)
+            throw SocketError("Frame too large: " + std::to_string(hdr->count));
+        fill(sizeof(*hdr) + hdr->count * sizeof(Item), timeout.count());
+        rbuf_start += sizeof(*hdr);
+        items->resize(hdr->count);
+        if (hdr->count)
+            take(items->data(), hdr->count * sizeof(Item));
+        else if (rbuf_start == rbuf_end)
+            rbuf_start = rbuf_end = 0;
+    }
+
+    /**
+     * Send a frame, the header and the items are sent together with
+     * writev().
+     *
+     * @param hdr Header of the frame, its `count` field is set here.
+     * @param items Payload of the frame.
+     * @param count Number of items.
+     */
+    template <class Header, class Item>
+    void sendFrame(Header hdr, const Item *items, size_t count) {
+        hdr.count = count;
+        struct iovec iov[2];
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = (void *) items;
+        iov[1].iov_len = count * sizeof(Item);
+        writeAll(iov, count ? 2 : 1, "Unable to send frame.");
     }
 
     /**
@@ -256,9 +620,10 @@ public:
      * @param action The buffer to send.
      */
     void send(const Packet *action) {
-        if (::send(fd, action, sizeof(*action), 0) != sizeof(*action)) {
-            throw SocketError("Unable to send the packet.");
-        }
+        struct iovec iov;
+        iov.iov_base = (void *) action;
+        iov.iov_len = sizeof(*action);
+        writeAll(&iov, 1, "Unable to send the packet.");
     }
 
     /**
@@ -269,10 +634,10 @@ public:
     void send(const std::vector<Packet> &packets) {
         if (packets.size() == 0)
             return;
-        ssize_t len = sizeof(packets[0])*packets.size();
-        if (::send(fd, &packets[0], len, 0) != len) {
-            throw SocketError("Unable to send packet");
-        }
+        struct iovec iov;
+        iov.iov_base = (void *) &packets[0];
+        iov.iov_len = sizeof(packets[0])*packets.size();
+        writeAll(&iov, 1, "Unable to send packet");
     }
 };
 
@@ -316,6 +681,11 @@ public:
         close(fd);
     }
 
+    /** Get the listening socket, for use with poll(). */
+    inline int getfd() const noexcept {
+        return fd;
+    }
+
     /**
      * Listen for a connection.
      *
@@ -0,0 +1,34 @@
+/** @file UTF8.hpp
+ *
+ * @brief Decoding of UTF-8 text, one character at a time.
+ */
+
+#pragma once
+
+extern "C" {
+    #include <stdint.h>
+}
+
+#include <string>
+
+/**
+ * Decode the UTF-8 character at `pos` of `s`.
+ *
+ * @param cp Set to the code point of the character.
+ * @return Length of the character in bytes, 0 if it is malformed or cut
+ *         off by the end of `s`.
+ */
+inline size_t decodeUTF8(const std::string &s, size_t pos, uint32_t *cp) noexcept {
+    unsigned char c = s[pos];
+    size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+    if (len == 0 || pos + len > s.size())
+        return 0;
+    *cp = len == 1 ? c : (c & (0x7f >> len));
+    for (size_t i = 1; i < len; i++) {
+        unsigned char cc = s[pos + i];
+        if ((cc >> 6) != 0x2)
+            return 0;
+        *cp = (*cp << 6) | (cc & 0x3f);
+    }
+    return len;
+}
@@ -5,6 +5,7 @@
 #include "KBDDaemon.hpp"
 #include "Daemon.hpp"
 #include "utils.hpp"
+#include "Log.hpp"
 
 #if MESON_COMPILE
 #include <hawck_config.h>
@@ -60,7 +61,16 @@ int main(int argc, char *argv[]) {
 
     string HELP =
         "Usage: hawck-inputd [--udev-event-delay <us>] [--no-fork] [--socket-timeout]\n"
+        "                    [--udev-flush-mode <mode>] [--no-udev-thread]\n"
+        "                    [--pipeline-depth <n>] [--shm-transport]\n"
         "                    [--kbd-device <device>] [--no-hotplug]\n"
+        "                    [--record-trace <file>] [--trace-keys]\n"
+        "                    [--replay-trace <file>] [--replay-max-speed]\n"
+        "                    [--log-level <n>]\n"
+        "                    [--rt-priority <n>] [--rt-policy <policy>]\n"
+        "                    [--cpus <list>] [--mlock]\n"
+        "                    [--route <pattern>=<socket>] [--pointers]\n"
+        "                    [--handover]\n"
         "\n"
         "Examples:\n"
         "  Listen on a single device:\n"
@@ -69,24 +79,78 @@ int main(int argc, char *argv[]) {
         "    hawck-inputd -k{/dev/input/event13,/dev/input/event15}\n\n"
         "  Listen on all keyboard devices automatically:\n"
         "    hawck-inputd\n\n"
+        "  Send a second keyboard to the MacroD of another seat:\n"
+        "    hawck-inputd --route '1133:49970:*=seat1.sock'\n\n"
         "Options:\n"
         "  --no-fork           Don't daemonize/fork.\n"
         "  -h, --help          Display this help information.\n"
         "  --version           Display version and exit.\n"
         "  -k, --kbd-device    Add a keyboard to listen to.\n"
         "  --udev-event-delay  Delay between events sent on the udevice in µs.\n"
+        "  --udev-flush-mode   How output is written to the udevice, one of:\n"
+        "                        frames: One write per frame, delay between frames (default)\n"
+        "                        batch:  Everything in one write, no delay.\n"
+        "                        events: One write per event, delay after each.\n"
+        "  --no-udev-thread    Write to the udevice from the main thread.\n"
         "  --socket-timeout    Time in milliseconds until timeout on sockets.\n"
+        "  --pipeline-depth    Number of keys that may be waiting on MacroD at once.\n"
+        "  --shm-transport     Talk to MacroD through shared memory instead of the socket.\n"
         "  --no-hotplug        Only listen to devices that were explicitly added with --kbd-device\n"
+        "  --record-trace      Record the events that are read to a file, redacted so that\n"
+        "                      what was typed is not stored.\n"
+        "  --trace-keys        Do not redact the recorded trace, it will contain everything\n"
+        "                      that is typed, including passwords. Only use this for debugging.\n"
+        "  --replay-trace      Replay a recorded trace, only listens to keyboards given with\n"
+        "                      --kbd-device and implies --no-hotplug.\n"
+        "  --replay-max-speed  Replay the trace as fast as it is handled, instead of in realtime.\n"
+        "  --log-level         Highest syslog priority that is logged, from 0 (emerg) to\n"
+        "                      7 (debug, the default).\n"
+        "  --rt-priority       Real-time priority of the threads that handle keys, 0 (the\n"
+        "                      default) keeps the normal scheduler.\n"
+        "  --rt-policy         Real-time scheduling policy, fifo (default) or rr.\n"
+        "  --cpus              CPUs to run the threads that handle keys on, e.g 2,3 or 2-3.\n"
+        "  --mlock             Lock all memory, so that it is never swapped out.\n"
+        "  --pointers          Grab mice and trackpoints too, so that their buttons can be\n"
+        "                      remapped and seen by scripts.\n"
+        "  --route             Send keyboards whose id matches a glob pattern to the MacroD\n"
+        "                      listening on another socket, relative to /var/lib/hawck-input.\n"
+        "                      Ids are vendor:product:Name as in the MacroD log, and keyboards\n"
+        "                      that match no route go to kbd.sock. May be given several times.\n"
+        "  --handover          Take over the grabbed keyboards and the udevice of a running\n"
+        "                      hawck-inputd, which then exits, instead of opening them again.\n"
     ;
 
     int no_hotplug = false;
+    int no_udev_thread = false;
+    int shm_transport = false;
+    int trace_keys = false;
+    int replay_max_speed = false;
+    int mlock = false;
+    int pointers = false;
+    int handover = false;
     static struct option long_options[] =
         {
             /* These options set a flag. */
             {"no-fork", no_argument,       &no_fork, 1},
             {"no-hotplug", no_argument,       &no_hotplug, 1},
+            {"no-udev-thread", no_argument,       &no_udev_thread, 1},
+            {"shm-transport", no_argument,       &shm_transport, 1},
+            {"trace-keys", no_argument,       &trace_keys, 1},
+            {"replay-max-speed", no_argument,       &replay_max_speed, 1},
+            {"mlock", no_argument,       &mlock, 1},
+            {"pointers", no_argument,       &pointers, 1},
+            {"handover", no_argument,       &handover, 1},
+            {"record-trace", required_argument,       0, 0},
+            {"replay-trace", required_argument,       0, 0},
             {"udev-event-delay", required_argument,       0, 0},
             {"socket-timeout", required_argument,       0, 0},
+            {"udev-flush-mode", required_argument,       0, 0},
+            {"pipeline-depth", required_argument,       0, 0},
+            {"log-level", required_argument,       0, 0},
+            {"rt-priority", required_argument,       0, 0},
+            {"rt-policy", required_argument,       0, 0},
+            {"cpus", required_argument,       0, 0},
+            {"route", required_argument,       0, 0},
             {"version", no_argument, 0, 0},
             /* These options don’t set a flag.
                We distinguish them by their indices. */
@@ -100,8 +164,16 @@ int main(int argc, char *argv[]) {
 
     int udev_event_delay = 3800;
     int socket_timeout = 1024;
+    int pipeline_depth = 16;
+    int log_level = LOG_DEBUG;
+    int rt_priority = 0;
+    RealtimeOptions rt;
+    UDeviceFlushMode udev_flush_mode = FLUSH_FRAMES;
+    string record_trace;
+    string replay_trace;
     vector<string> kbd_names;
     vector<string> kbd_devices;
+    vector<pair<string, string>> routes;
     unordered_map<string, function<void(const string& opt)>> long_handlers = {
         {"version", [&](const string&) {
                         cout << "hawck-inputd v" INPUTD_VERSION << endl;
@@ -109,6 +181,43 @@ int main(int argc, char *argv[]) {
                     }},
         NUM_OPTION(udev_event_delay)
         NUM_OPTION(socket_timeout)
+        NUM_OPTION(pipeline_depth)
+        NUM_OPTION(log_level)
+        NUM_OPTION(rt_priority)
+        STR_OPTION(record_trace),
+        STR_OPTION(replay_trace),
+        {"rt-policy", [&](const string& opt) {
+                          try {
+                              rt.policy = RealtimeOptions::parsePolicy(opt);
+                          } catch (const invalid_argument &e) {
+                              cout << "--rt-policy: " << e.what() << endl;
+                              exit(0);
+                          }
+                      }},
+        {"cpus", [&](const string& opt) {
+                     try {
+                         rt.cpus = RealtimeOptions::parseCPUs(opt);
+                     } catch (const invalid_argument &e) {
+                         cout << "--cpus: " << e.what() << endl;
+                         exit(0);
+                     }
+                 }},
+        {"route", [&](const string& opt) {
+                      size_t eq = opt.rfind('=');
+                      if (eq == string::npos || eq == 0 || eq + 1 == opt.size()) {
+                          cout << "--route: Expected <pattern>=<socket>" << endl;
+                          exit(0);
+                      }
+                      routes.push_back({opt.substr(0, eq), opt.substr(eq + 1)});
+                  }},
+        {"udev-flush-mode", [&](const string& opt) {
+                                try {
+                                    udev_flush_mode = UDevice::parseFlushMode(opt);
+                                } catch (const invalid_argument &e) {
+                                    cout << "--udev-flush-mode: " << e.what() << endl;
+                                    exit(0);
+                                }
+                            }},
     };
 
     do {
@@ -154,15 +263,26 @@ int main(int argc, char *argv[]) {
         }
     } while (true);
 
+    // Replaying a trace should not be mixed up with whatever is typed.
+    if (replay_trace.size())
+        no_hotplug = true;
+    // The working directory changes when daemonizing.
+    if (record_trace.size())
+        record_trace = fs::absolute(record_trace);
+    if (replay_trace.size())
+        replay_trace = fs::absolute(replay_trace);
+
     // If no devices were specified, we listen to all of them
-    if (kbd_devices.size() == 0) {
+    if (kbd_devices.size() == 0 && replay_trace.empty()) {
         // FIXME: All the "is this a keyboard" detection done in Hawck is very
         //        brittle, and I should probably do a deep-dive into whatever
         //        documentation I can find on this to develop a better method.
 
         try {
             for (auto d : fs::directory_iterator("/dev/input/by-id"))
-                if (KBDManager::byIDIsKeyboard(d.path()))
+                if (KBDManager::byIDIsKeyboard(d.path()) ||
+                    (pointers && KBDManager::byIDIsPointer(d.path()) &&
+                     KBDManager::isRelativePointer(realpath_safe(d.path()))))
                     kbd_devices.push_back(realpath_safe(d.path()));
         } catch (const system_error& err) {
             syslog(LOG_ERR, "Unable to query by-id: %s", err.what());
@@ -189,16 +309,53 @@ int main(int argc, char *argv[]) {
         daemonize("/tmp/hawck-inputd.log");
     }
 
+    // The running InputD exits by itself once it has handed over, so this
+    // is done before the pid file is taken.
+    HandoverState taken;
+    bool took_over = false;
+    if (handover) {
+        try {
+            took_over = receiveHandover("/var/lib/hawck-input/handover.sock", pointers,
+                                        &taken, socket_timeout);
+            if (took_over)
+                syslog(LOG_INFO, "Took over %zu keyboards", taken.kbds.size());
+            else
+                syslog(LOG_INFO, "No running InputD to take over from");
+        } catch (const SocketError &e) {
+            syslog(LOG_ERR, "Unable to take over from the running InputD: %s", e.what());
+        }
+    }
+
     const string pid_file = "/var/lib/hawck-input/pid";
     killPretender(pid_file);
 
+    // Memory locks and threads would be lost in the fork.
+    rt.priority = rt_priority;
+    rt.lock_memory = mlock;
+    rt.setupProcess();
+    Log::setLevel(log_level);
+    Log::start();
+
     try {
-        KBDDaemon daemon;
+        KBDDaemon daemon(pointers, took_over ? &taken : nullptr);
         daemon.kbman.setHotplug(!no_hotplug);
         for (const auto& dev : kbd_devices)
-            daemon.kbman.addDevice(dev);
+            if (!took_over || !daemon.kbman.hasDevice(dev))
+                daemon.kbman.addDevice(dev);
         daemon.setEventDelay(udev_event_delay);
+        daemon.setFlushMode(udev_flush_mode);
+        daemon.setEmitterThread(!no_udev_thread);
         daemon.setSocketTimeout(socket_timeout);
+        daemon.setPipelineDepth(pipeline_depth);
+        daemon.setShmTransport(shm_transport);
+        daemon.setRealtime(rt);
+        for (const auto &[pattern, sock] : routes)
+            daemon.addRoute(pattern, sock);
+        if (record_trace.size())
+            daemon.setTrace(record_trace, !trace_keys);
+        if (replay_trace.size())
+            daemon.kbman.setReplay(make_unique<EventTraceReader>(replay_trace),
+                                   !replay_max_speed);
         syslog(LOG_INFO, "Running Hawck InputD ...");
         daemon.run();
     } catch (const SystemError &e) {
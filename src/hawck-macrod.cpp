@@ -1,6 +1,7 @@
 #include "MacroDaemon.hpp"
 #include "Daemon.hpp"
 #include "XDG.hpp"
+#include "Log.hpp"
 #include <iostream>
 #include <fstream>
 #include "utils.hpp"
@@ -20,15 +21,31 @@ extern "C" {
 using namespace std;
 
 static int no_fork;
+static int shared_lua;
+static int mlock;
 
 int main(int argc, char *argv[]) {
     string HELP =
-        "Usage: hawck-macrod [--no-fork]\n"
+        "Usage: hawck-macrod [--no-fork] [--shared-lua]\n"
+        "                    [--rt-priority <n>] [--rt-policy <policy>]\n"
+        "                    [--cpus <list>] [--mlock] [--socket <path>]\n"
+        "                    [--parallel-scripts <n>]\n"
         "\n"
         "Options:\n"
-        "  --no-fork   Don't daemonize/fork.\n"
-        "  -h, --help  Display this help information.\n"
-        "  --version   Display version and exit.\n"
+        "  --no-fork      Don't daemonize/fork.\n"
+        "  --shared-lua   Run all scripts in a single Lua state.\n"
+        "  --rt-priority  Real-time priority of the thread that handles keys, 0 (the\n"
+        "                 default) keeps the normal scheduler.\n"
+        "  --rt-policy    Real-time scheduling policy, fifo (default) or rr.\n"
+        "  --cpus         CPUs to run the thread that handles keys on, e.g 2,3 or 2-3.\n"
+        "  --mlock        Lock all memory, so that it is never swapped out.\n"
+        "  --socket       Socket that InputD connects to, see --route in hawck-inputd.\n"
+        "                 Defaults to /var/lib/hawck-input/kbd.sock\n"
+        "  --parallel-scripts\n"
+        "                 Test which scripts react to a key on n threads, and only run\n"
+        "                 those. 0 (the default) runs the scripts one by one.\n"
+        "  -h, --help     Display this help information.\n"
+        "  --version      Display version and exit.\n"
     ;
     XDG xdg("hawck");
 
@@ -37,6 +54,13 @@ int main(int argc, char *argv[]) {
         {
             /* These options set a flag. */
             {"no-fork", no_argument,       &no_fork, 1},
+            {"shared-lua", no_argument,       &shared_lua, 1},
+            {"mlock", no_argument,       &mlock, 1},
+            {"rt-priority", required_argument, 0, 0},
+            {"rt-policy", required_argument, 0, 0},
+            {"cpus", required_argument, 0, 0},
+            {"socket", required_argument, 0, 0},
+            {"parallel-scripts", required_argument, 0, 0},
             {"version", no_argument, 0, 0},
             /* These options don’t set a flag.
                We distinguish them by their indices. */
@@ -46,11 +70,52 @@ int main(int argc, char *argv[]) {
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
+    RealtimeOptions rt;
+    string socket = "/var/lib/hawck-input/kbd.sock";
+    unsigned parallel_scripts = 0;
     unordered_map<string, function<void(const string& opt)>> long_handlers = {
         {"version", [&](const string&) {
                         cout << "hawck-macrod v" MACROD_VERSION << endl;
                         exit(0);
                     }},
+        {"rt-priority", [&](const string& opt) {
+                            try {
+                                rt.priority = stoi(opt);
+                            } catch (const exception &e) {
+                                cout << "--rt-priority: Require an integer" << endl;
+                                exit(0);
+                            }
+                        }},
+        {"rt-policy", [&](const string& opt) {
+                          try {
+                              rt.policy = RealtimeOptions::parsePolicy(opt);
+                          } catch (const invalid_argument &e) {
+                              cout << "--rt-policy: " << e.what() << endl;
+                              exit(0);
+                          }
+                      }},
+        {"socket", [&](const string& opt) {
+                       socket = opt;
+                   }},
+        {"parallel-scripts", [&](const string& opt) {
+                                 try {
+                                     int n = stoi(opt);
+                                     if (n < 0)
+                                         throw invalid_argument("negative");
+                                     parallel_scripts = n;
+                                 } catch (const exception &e) {
+                                     cout << "--parallel-scripts: Require a number of threads" << endl;
+                                     exit(0);
+                                 }
+                             }},
+        {"cpus", [&](const string& opt) {
+                     try {
+                         rt.cpus = RealtimeOptions::parseCPUs(opt);
+                     } catch (const invalid_argument &e) {
+                         cout << "--cpus: " << e.what() << endl;
+                         exit(0);
+                     }
+                 }},
     };
 
     do {
@@ -100,7 +165,14 @@ int main(int argc, char *argv[]) {
     string pid_file = xdg.path(XDG_RUNTIME_DIR, "macrod.pid");
     killPretender(pid_file);
 
-    MacroDaemon daemon;
+    // Memory locks and threads would be lost in the fork.
+    rt.lock_memory = mlock;
+    rt.setupProcess();
+    Log::start();
+
+    MacroDaemon daemon(shared_lua, socket);
+    daemon.setRealtime(rt);
+    daemon.setParallelScripts(parallel_scripts);
     try {
         daemon.run();
     } catch (exception &e) {
@@ -1,5 +1,10 @@
 #include <catch2/catch.hpp>
 #include "CSV.hpp"
+#include "SystemError.hpp"
+
+extern "C" {
+    #include <unistd.h>
+}
 
 // TODO: Test with random data.
 
@@ -51,3 +56,46 @@ TEST_CASE("Retrieve columns by name", "[csv]") {
         delete vec;
     }
 }
+
+TEST_CASE("View columns of a mapped file", "[csv]") {
+    CSVView csv(test02_path);
+    REQUIRE( csv.nCols() == 3 );
+    REQUIRE( csv.getColIndex("charlie,delta") == 1 );
+    REQUIRE( csv.getColIndex("golf") == -1 );
+
+    vector<string> expect = {"1,2", "3\"4", "5,6"};
+    for (int i = 0; i < csv.nCols(); i++) {
+        int rows = 0;
+        csv.forEachCell(i, [&](string_view cell) {
+            REQUIRE( cell == expect[i] );
+            rows++;
+        });
+        REQUIRE( rows == 3 );
+    }
+}
+
+TEST_CASE("Parse numeric columns of a mapped file", "[csv]") {
+    const string path = "./CSV-tests/numbers.csv";
+    {
+        ofstream out(path);
+        out << "key_code,name\r\n"
+               "30,a\r\n"
+               " 31 ,b\n"
+               "abc,c\n"
+               "\n"
+               "32\n";
+    }
+    CSVView csv(path);
+    vector<int> codes;
+    size_t invalid = csv.forEachNumber<int>(csv.getColIndex("key_code"),
+                                            [&](int code) { codes.push_back(code); });
+    REQUIRE( codes == vector<int>({30, 31, 32}) );
+    REQUIRE( invalid == 2 );
+
+    vector<string> names;
+    csv.forEachCell(1, [&](string_view name) { names.emplace_back(name); });
+    REQUIRE( names == vector<string>({"a", "b", "c", "", ""}) );
+    unlink(path.c_str());
+
+    REQUIRE_THROWS_AS( CSVView("./CSV-tests/does-not-exist.csv"), SystemError );
+}
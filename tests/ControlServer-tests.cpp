@@ -0,0 +1,74 @@
+#include <catch2/catch.hpp>
+#include "ControlServer.hpp"
+
+extern "C" {
+    #include <unistd.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+static const string control_path = "./control-test.sock";
+
+static void sendRequest(int fd, const string &msg) {
+    uint32_t sz = msg.size();
+    REQUIRE( ::write(fd, &sz, sizeof(sz)) == sizeof(sz) );
+    REQUIRE( ::write(fd, msg.data(), sz) == (ssize_t) sz );
+}
+
+static pair<uint32_t, string> recvFrame(int fd) {
+    ControlServer::Header hdr;
+    recvAll(fd, &hdr, milliseconds(1000));
+    string json(hdr.len, '\0');
+    if (hdr.len)
+        recvAll(fd, json.data(), hdr.len, milliseconds(1000));
+    return {hdr.kind, json};
+}
+
+TEST_CASE("Requests are pipelined and events pushed", "[ControlServer]") {
+    ControlServer srv(control_path, [](const char *msg, size_t sz) {
+        return "[\"" + string(msg, sz) + "\"]";
+    });
+    srv.start();
+
+    UNIXSocket<char> a(control_path), b(control_path);
+    sendRequest(a.getfd(), "first");
+    sendRequest(a.getfd(), "second");
+    sendRequest(b.getfd(), "other");
+
+    REQUIRE( recvFrame(a.getfd()) == make_pair(uint32_t(ControlServer::CONTROL_REPLY), string("[\"first\"]")) );
+    REQUIRE( recvFrame(a.getfd()) == make_pair(uint32_t(ControlServer::CONTROL_REPLY), string("[\"second\"]")) );
+    REQUIRE( recvFrame(b.getfd()).second == "[\"other\"]" );
+
+    srv.broadcast("{\"event\":\"test\"}");
+    auto [kind, json] = recvFrame(a.getfd());
+    REQUIRE( kind == ControlServer::CONTROL_EVENT );
+    REQUIRE( json == "{\"event\":\"test\"}" );
+    REQUIRE( recvFrame(b.getfd()).first == ControlServer::CONTROL_EVENT );
+
+    unlink(control_path.c_str());
+}
+
+TEST_CASE("Clients that send faster than they are served", "[ControlServer]") {
+    ControlServer srv(control_path, [](const char *, size_t sz) {
+        return to_string(sz);
+    });
+    srv.start();
+
+    // More than is read in one go, the rest is read once it is handled.
+    UNIXSocket<char> a(control_path);
+    string msg(1000, 'x');
+    const size_t num = 4 * ControlServer::max_buffered / msg.size();
+    for (size_t i = 0; i < num; i++)
+        sendRequest(a.getfd(), msg);
+    for (size_t i = 0; i < num; i++)
+        REQUIRE( recvFrame(a.getfd()).second == "1000" );
+
+    unlink(control_path.c_str());
+}
+
+TEST_CASE("Strings are quoted for JSON", "[ControlServer]") {
+    REQUIRE( ControlServer::jsonString("plain") == "\"plain\"" );
+    REQUIRE( ControlServer::jsonString("a \"b\"\\\n") == "\"a \\\"b\\\"\\\\\\n\"" );
+    REQUIRE( ControlServer::jsonString(string("\x01", 1)) == "\"\\u0001\"" );
+}
@@ -0,0 +1,85 @@
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <chrono>
+#include "DesktopIndex.hpp"
+#include "SystemError.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static const string index_dir = "./desktop-index-test";
+
+static void writeFile(const string &path, const string &contents) {
+    fs::create_directories(fs::path(path).parent_path());
+    ofstream out(path);
+    out << contents;
+}
+
+TEST_CASE("Desktop files are parsed", "[DesktopIndex]") {
+    writeFile(index_dir + "/test.desktop",
+              "# A comment\n"
+              "[Desktop Entry]\n"
+              "Name=Test\n"
+              "Name[de]=Prüfung\n"
+              "Exec = test %u  \n"
+              "\n"
+              "[Desktop Action new-window]\n"
+              "Exec=test --new-window\n"
+              "[X-Something Else]\n"
+              "Exec=nope\n");
+    DesktopEntry ent = DesktopIndex::parse(index_dir + "/test.desktop");
+    REQUIRE( ent.entry.size() == 3 );
+    REQUIRE( ent.entry["Exec"] == "test %u" );
+    REQUIRE( ent.entry["Name[de]"] == "Prüfung" );
+    REQUIRE( ent.actions.size() == 1 );
+    REQUIRE( ent.actions["new-window"]["Exec"] == "test --new-window" );
+
+    REQUIRE_THROWS_AS( DesktopIndex::parse(index_dir + "/missing.desktop"), SystemError );
+    fs::remove_all(index_dir);
+}
+
+TEST_CASE("Earlier directories hide later ones", "[DesktopIndex]") {
+    string home = index_dir + "/home/applications";
+    string usr = index_dir + "/usr/applications";
+    writeFile(home + "/editor.desktop", "[Desktop Entry]\nExec=my-editor\n");
+    writeFile(usr + "/editor.desktop", "[Desktop Entry]\nExec=editor\n");
+    writeFile(usr + "/kde4/kate.desktop", "[Desktop Entry]\nExec=kate\n");
+    writeFile(usr + "/README", "Not a desktop file\n");
+
+    DesktopIndex index({home, usr, index_dir + "/does-not-exist"});
+    index.build();
+    REQUIRE( index.size() == 2 );
+
+    DesktopEntry ent;
+    REQUIRE( index.find("editor", &ent) );
+    REQUIRE( ent.entry["Exec"] == "my-editor" );
+    REQUIRE( index.find("kde4-kate", &ent) );
+    REQUIRE( ent.entry["Exec"] == "kate" );
+    REQUIRE( !index.find("README", &ent) );
+
+    fs::remove(home + "/editor.desktop");
+    index.build();
+    REQUIRE( index.find("editor", &ent) );
+    REQUIRE( ent.entry["Exec"] == "editor" );
+    fs::remove_all(index_dir);
+}
+
+TEST_CASE("Changes in subdirectories are picked up", "[DesktopIndex]") {
+    string usr = index_dir + "/usr/applications";
+    writeFile(usr + "/kde4/kate.desktop", "[Desktop Entry]\nExec=kate\n");
+
+    DesktopIndex index({usr});
+    index.start();
+    DesktopEntry ent;
+    REQUIRE( index.find("kde4-kate", &ent) );
+
+    writeFile(usr + "/kde4/konsole.desktop", "[Desktop Entry]\nExec=konsole\n");
+    writeFile(usr + "/kde4/dolphin.desktop", "[Desktop Entry]\nExec=dolphin\n");
+    for (int i = 0; i < 50 && index.size() < 3; i++)
+        this_thread::sleep_for(chrono::milliseconds(100));
+    REQUIRE( index.find("kde4-konsole", &ent) );
+    REQUIRE( index.find("kde4-dolphin", &ent) );
+    fs::remove_all(index_dir);
+}
@@ -0,0 +1,115 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include "DropFilter.hpp"
+
+using namespace std;
+
+static struct input_event mkEvent(int type, int code, int value) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+}
+
+static struct input_event key(int code, int value) {
+    return mkEvent(EV_KEY, code, value);
+}
+
+static struct input_event syn(int code = SYN_REPORT) {
+    return mkEvent(EV_SYN, code, 0);
+}
+
+/** Codes and values of the events, SYN_REPORT as -1. */
+static vector<pair<int, int>> summary(const struct input_event *evs, size_t num) {
+    vector<pair<int, int>> out;
+    for (size_t i = 0; i < num; i++)
+        out.push_back(evs[i].type == EV_SYN ? make_pair(-1, 0) : make_pair(int(evs[i].code), evs[i].value));
+    return out;
+}
+
+using Summary = vector<pair<int, int>>;
+
+TEST_CASE("Events are dropped until the SYN_REPORT after a SYN_DROPPED", "[DropFilter]") {
+    DropFilter drops;
+    KeyState keys;
+    KeyState real;
+    real.set(KEY_A, true);
+    real.set(KEY_B, true);
+    auto real_keys = [&](KeyState *out) { *out = real; return true; };
+
+    vector<struct input_event> buf = {
+        key(KEY_A, 1), syn(),
+        syn(SYN_DROPPED), key(KEY_X, 1), key(KEY_B, 1), syn(),
+        key(KEY_C, 1), syn(),
+    };
+    size_t num = drops.filter(buf.data(), buf.size(), keys, real_keys);
+    REQUIRE( summary(buf.data(), num) == Summary{{KEY_A, 1}, {-1, 0}} );
+    REQUIRE( drops.numDrops() == 1 );
+    REQUIRE( drops.numResyncs() == 1 );
+    REQUIRE( drops.lastCorrected() == 1 );
+    REQUIRE( !drops.isDropping() );
+    REQUIRE( keys.isDown(KEY_B) );
+    REQUIRE( !keys.isDown(KEY_X) );
+
+    // The resync frame goes out before anything that was read after it.
+    REQUIRE( drops.hasHeld() );
+    struct input_event out[16];
+    num = drops.takeHeld(out, 16, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{KEY_B, 1}, {-1, 0}} );
+    num = drops.takeHeld(out, 16, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{KEY_C, 1}, {-1, 0}} );
+    REQUIRE( !drops.hasHeld() );
+}
+
+TEST_CASE("A drop that spans reads keeps dropping", "[DropFilter]") {
+    DropFilter drops;
+    KeyState keys;
+    auto real_keys = [](KeyState *) { return false; };
+
+    vector<struct input_event> buf = {key(KEY_A, 1), syn(), syn(SYN_DROPPED), key(KEY_B, 1)};
+    size_t num = drops.filter(buf.data(), buf.size(), keys, real_keys);
+    REQUIRE( num == 2 );
+    REQUIRE( drops.isDropping() );
+
+    buf = {key(KEY_B, 0), syn(), key(KEY_C, 1), syn()};
+    num = drops.filter(buf.data(), buf.size(), keys, real_keys);
+    REQUIRE( num == 0 );
+    REQUIRE( !drops.isDropping() );
+    // Without the real state nothing is corrected, the rest still goes out.
+    struct input_event out[16];
+    num = drops.takeHeld(out, 16, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{KEY_C, 1}, {-1, 0}} );
+}
+
+TEST_CASE("Resync releases go first, and repeated events are filtered", "[DropFilter]") {
+    DropFilter drops;
+    KeyState keys;
+    KeyState real;
+    real.set(KEY_D, true);
+    auto real_keys = [&](KeyState *out) { *out = real; return true; };
+
+    vector<struct input_event> buf = {key(KEY_A, 1), syn(), syn(SYN_DROPPED), syn(),
+                                      key(KEY_D, 1), key(KEY_D, 2), key(KEY_A, 0), syn()};
+    size_t num = drops.filter(buf.data(), buf.size(), keys, real_keys);
+    REQUIRE( num == 2 );
+
+    struct input_event out[16];
+    num = drops.takeHeld(out, 16, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{KEY_A, 0}, {KEY_D, 1}, {-1, 0}} );
+    // The press and release were already reported by the resync, repeats
+    // are passed on.
+    num = drops.takeHeld(out, 16, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{KEY_D, 2}, {-1, 0}} );
+
+    // Held back events are handed out in pieces that fit.
+    buf = {syn(SYN_DROPPED), syn(), key(KEY_E, 1), syn(), key(KEY_F, 1), syn()};
+    drops.filter(buf.data(), buf.size(), keys, real_keys);
+    REQUIRE( drops.lastCorrected() == 0 );
+    num = drops.takeHeld(out, 3, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{KEY_E, 1}, {-1, 0}, {KEY_F, 1}} );
+    num = drops.takeHeld(out, 3, keys, real_keys);
+    REQUIRE( summary(out, num) == Summary{{-1, 0}} );
+    REQUIRE( !drops.hasHeld() );
+}
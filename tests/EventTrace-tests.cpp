@@ -0,0 +1,83 @@
+#include <catch2/catch.hpp>
+#include <fstream>
+#include "EventTrace.hpp"
+#include "SystemError.hpp"
+
+extern "C" {
+    #include <string.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+}
+
+using namespace std;
+
+static const string trace_path = "./event-trace-test.hwkt";
+
+static KBDAction mkAction(uint64_t time, int type, int code, int value) {
+    KBDAction action;
+    memset(&action, 0, sizeof(action));
+    action.ts.read = time;
+    action.dev_id.vendor = 0x1234;
+    action.ev.type = type;
+    action.ev.code = code;
+    action.ev.value = value;
+    return action;
+}
+
+/** Record a key press followed by a release of Shift. */
+static void writeTrace(bool redact) {
+    EventTraceWriter writer(trace_path, redact);
+    writer.record(mkAction(1000, EV_MSC, MSC_SCAN, 0x1e));
+    writer.record(mkAction(1000, EV_KEY, KEY_A, 1));
+    writer.record(mkAction(1000, EV_SYN, SYN_REPORT, 0));
+    writer.record(mkAction(5000, EV_KEY, KEY_LEFTSHIFT, 0));
+    writer.record(mkAction(5000, EV_SYN, SYN_REPORT, 0));
+}
+
+TEST_CASE("Recorded events are read back", "[EventTrace]") {
+    writeTrace(false);
+    {
+        EventTraceReader trace(trace_path);
+        REQUIRE( !trace.isRedacted() );
+        REQUIRE( trace.size() == 5 );
+        REQUIRE( trace[0].time == 0 );
+        REQUIRE( trace[0].value == 0x1e );
+        REQUIRE( trace[1].code == KEY_A );
+        REQUIRE( trace[1].dev_id.vendor == 0x1234 );
+        REQUIRE( trace[3].time == 4000 );
+        REQUIRE( trace[3].code == KEY_LEFTSHIFT );
+
+        REQUIRE( trace.frameEnd(0) == 3 );
+        REQUIRE( trace.frameEnd(3) == 5 );
+    }
+
+    struct stat stbuf;
+    REQUIRE( stat(trace_path.c_str(), &stbuf) == 0 );
+    REQUIRE( (stbuf.st_mode & 0777) == 0600 );
+    unlink(trace_path.c_str());
+}
+
+TEST_CASE("Traces are redacted", "[EventTrace]") {
+    writeTrace(true);
+    {
+        EventTraceReader trace(trace_path);
+        REQUIRE( trace.isRedacted() );
+        REQUIRE( trace.size() == 5 );
+        REQUIRE( trace[0].value == 0 );
+        REQUIRE( trace[1].code == KEY_UNKNOWN );
+        REQUIRE( trace[1].value == 1 );
+        REQUIRE( trace[3].code == KEY_LEFTSHIFT );
+    }
+    unlink(trace_path.c_str());
+}
+
+TEST_CASE("Invalid traces are rejected", "[EventTrace]") {
+    REQUIRE_THROWS_AS( EventTraceReader("./does-not-exist.hwkt"), SystemError );
+
+    {
+        ofstream out(trace_path);
+        out << "this is not a trace file, but it is long enough to be one\n";
+    }
+    REQUIRE_THROWS_AS( EventTraceReader(trace_path), SystemError );
+    unlink(trace_path.c_str());
+}
@@ -160,3 +160,49 @@ TEST_CASE("Watch whole directory", "[FSWatcher]") {
     vector<string> cmds = mkModCMDs(paths);
     runTestsCMD(&watcher, paths, cmds);
 }
+
+TEST_CASE("Coalesce event storms", "[FSWatcher]") {
+    vector<string> paths = mkTestFiles(3, true);
+    FSWatcher watcher;
+    watcher.setWatchDirs(true);
+    watcher.setCoalesce(200);
+    delete watcher.addFrom("/tmp/hwk-tests");
+
+    mutex mtx;
+    vector<FSEvent> events;
+    watcher.asyncWatch([&](FSEvent &ev) {
+        lock_guard<mutex> lock(mtx);
+        events.push_back(ev);
+        return true;
+    });
+    usleep(100000);
+
+    // What an editor might do when saving a file.
+    string p = paths[0];
+    system_s("echo a >> " + p);
+    system_s("echo b >> " + p);
+    system_s("rm " + p + " && echo c > " + p);
+    system_s("chmod +x " + p);
+    // Created and then deleted again.
+    system_s("touch /tmp/hwk-tests/tmp-file && rm /tmp/hwk-tests/tmp-file");
+    // Moving a file away counts as deleting it.
+    system_s("touch /tmp/hwk-tests/tmp-moved && mv /tmp/hwk-tests/tmp-moved /tmp/hwk-moved");
+
+    usleep(600000);
+    watcher.stop();
+
+    lock_guard<mutex> lock(mtx);
+    REQUIRE( events.size() == 3 );
+    REQUIRE( events[0].path == p );
+    REQUIRE( events[0].name == pathBasename(p) );
+    REQUIRE( (events[0].mask & IN_MODIFY) );
+    REQUIRE( !(events[0].mask & IN_DELETE) );
+    REQUIRE( events[0].stbuf.st_size == 2 );
+    REQUIRE( events[1].path == "/tmp/hwk-tests/tmp-file" );
+    REQUIRE( events[1].mask & IN_DELETE );
+    REQUIRE( !(events[1].mask & IN_CREATE) );
+    REQUIRE( events[2].path == "/tmp/hwk-tests/tmp-moved" );
+    REQUIRE( events[2].mask & IN_MOVED_FROM );
+    REQUIRE( !(events[2].mask & (IN_CREATE | IN_MODIFY)) );
+    unlink("/tmp/hwk-moved");
+}
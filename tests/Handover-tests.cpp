@@ -0,0 +1,107 @@
+#include <catch2/catch.hpp>
+#include <thread>
+#include "Handover.hpp"
+
+extern "C" {
+    #include <unistd.h>
+}
+
+using namespace std;
+
+static const string handover_path = "./handover-test.sock";
+
+/** Hand `state` over from a thread, the way the main loop of InputD does,
+ *  and report whether the successor acknowledged it. */
+static thread handOver(HandoverServer &srv, const HandoverState &state, bool *ok) {
+    return thread([&srv, &state, ok]() {
+        while (!srv.requested())
+            usleep(100);
+        try {
+            sendHandover(srv.take(), state, 1000);
+            *ok = true;
+        } catch (const SocketError &) {
+            *ok = false;
+        }
+    });
+}
+
+TEST_CASE("Devices are handed over with their state", "[Handover]") {
+    int pipes[3][2];
+    for (auto &p : pipes)
+        REQUIRE( pipe(p) == 0 );
+
+    HandoverState old;
+    old.pointers = true;
+    old.ufd = pipes[0][1];
+    old.dfd = pipes[1][1];
+    HandoverKeyboard kbd;
+    kbd.fd = pipes[2][1];
+    kbd.state = KBDState::LOCKING;
+    kbd.keys.set(KEY_LEFTSHIFT, true);
+    old.kbds.push_back(kbd);
+    HandoverClient client;
+    client.path = "/var/lib/hawck-input/kbd.sock";
+    client.keys_down.set(KEY_A);
+    client.direct_held.set(KEY_LEFTSHIFT);
+    old.clients.push_back(client);
+
+    HandoverServer srv(handover_path);
+    srv.start();
+    bool ok = false;
+    thread sender = handOver(srv, old, &ok);
+
+    HandoverState st;
+    REQUIRE( receiveHandover(handover_path, true, &st, 1000) );
+    sender.join();
+    REQUIRE( ok );
+
+    REQUIRE( st.pointers );
+    REQUIRE( st.kbds.size() == 1 );
+    REQUIRE( st.kbds[0].state == KBDState::LOCKING );
+    REQUIRE( st.kbds[0].keys.isDown(KEY_LEFTSHIFT) );
+    REQUIRE( st.kbds[0].keys.numDown() == 1 );
+    REQUIRE( st.clients.size() == 1 );
+    REQUIRE( st.clients[0].path == client.path );
+    REQUIRE( st.clients[0].keys_down == client.keys_down );
+    REQUIRE( st.clients[0].direct_held == client.direct_held );
+
+    // The received descriptors refer to the same files.
+    int received[] = {st.ufd, st.dfd, st.kbds[0].fd};
+    for (int i = 0; i < 3; i++) {
+        char c = 'a' + i, got = 0;
+        REQUIRE( write(received[i], &c, 1) == 1 );
+        REQUIRE( read(pipes[i][0], &got, 1) == 1 );
+        REQUIRE( got == c );
+        close(received[i]);
+    }
+    for (auto &p : pipes) {
+        close(p[0]);
+        close(p[1]);
+    }
+    unlink(handover_path.c_str());
+}
+
+TEST_CASE("Handovers to an incompatible InputD are declined", "[Handover]") {
+    int p[2];
+    REQUIRE( pipe(p) == 0 );
+    HandoverState old;
+    old.ufd = p[0];
+    old.dfd = p[1];
+
+    HandoverServer srv(handover_path);
+    srv.start();
+    bool ok = true;
+    thread sender = handOver(srv, old, &ok);
+
+    HandoverState st;
+    REQUIRE_THROWS_AS( receiveHandover(handover_path, true, &st, 1000), SocketError );
+    sender.join();
+    REQUIRE( !ok );
+    REQUIRE( st.ufd == -1 );
+
+    close(p[0]);
+    close(p[1]);
+    unlink(handover_path.c_str());
+
+    REQUIRE( !receiveHandover(handover_path, false, &st, 1000) );
+}
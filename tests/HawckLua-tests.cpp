@@ -0,0 +1,91 @@
+#include <catch2/catch.hpp>
+#include <memory>
+#include "LuaUtils.hpp"
+#include "RemoteUDevice.hpp"
+
+extern "C" {
+    #include <linux/input.h>
+}
+
+using namespace std;
+
+/** Set up a Lua state like MacroD does, with the keymap of the benchmarks,
+ *  and run `src` as the script. */
+static unique_ptr<Lua::Script> loadScript(RemoteUDevice *udev, const string &src) {
+    auto sc = make_unique<Lua::Script>();
+    sc->exec("setup", "package.path = '../src/Lua/?.lua;../?.lua;' .. package.path\n"
+                      "package.loaded.cfg = {keymap = 'us'}\n"
+                      "__keymap = dofile('bench/keymap.lua')\n"
+                      "interest_changes = 0\n"
+                      "function __interestChanged() interest_changes = interest_changes + 1 end\n");
+    sc->call("require", "init");
+    sc->open(udev, "udev");
+    sc->exec("test", src);
+    return sc;
+}
+
+static tuple<bool, bool> test(Lua::Script *sc, int value, int code) {
+    return sc->call<bool, bool>("__test", value, code, (int) EV_KEY, string("test"));
+}
+
+TEST_CASE("Scripts are tested without running their actions", "[HawckLua]") {
+    RemoteUDevice udev;
+    auto sc = loadScript(&udev,
+        "local ran = false\n"
+        "function didRun() return ran end\n"
+        "__match[down + key 'a'] = function () ran = true end\n"
+        "__match[down] = MatchScope.new(function (m)\n"
+        "  m[key 'b'] = function () ran = true end\n"
+        "end)\n");
+
+    REQUIRE( test(sc.get(), 1, KEY_A) == make_tuple(true, true) );
+    REQUIRE( test(sc.get(), 0, KEY_A) == make_tuple(true, false) );
+    // Nested scopes are tested as well.
+    REQUIRE( test(sc.get(), 1, KEY_B) == make_tuple(true, true) );
+    REQUIRE( test(sc.get(), 1, KEY_C) == make_tuple(true, false) );
+    REQUIRE( !get<0>(sc->call<bool>("didRun")) );
+
+    // The outcome agrees with __match.
+    sc->call("__match", 1, (int) KEY_A, (int) EV_KEY, string("test"));
+    REQUIRE( get<0>(sc->call<bool>("didRun")) );
+}
+
+TEST_CASE("Conditions that may have side effects are not tested", "[HawckLua]") {
+    RemoteUDevice udev;
+    auto sc = loadScript(&udev,
+        "__match[key 'a'] = function () end\n"
+        "__match[Cond.new(function () return true end)] = function () end\n");
+    // Known as long as an earlier pattern decides the outcome.
+    REQUIRE( test(sc.get(), 1, KEY_A) == make_tuple(true, true) );
+    REQUIRE( get<0>(test(sc.get(), 1, KEY_B)) == false );
+
+    auto custom = loadScript(&udev,
+        "__match[key 'a'] = function () end\n"
+        "__match.prepare = function () return true end\n");
+    REQUIRE( get<0>(test(custom.get(), 1, KEY_A)) == false );
+}
+
+TEST_CASE("Actions waiting for a key see keys outside of the patterns", "[HawckLua]") {
+    RemoteUDevice udev;
+    auto sc = loadScript(&udev,
+        "got = false\n"
+        "__match[down + key 'a'] = function ()\n"
+        "  local code, value = nextKey()\n"
+        "  got = {code, value}\n"
+        "end\n"
+        "function gotKey() if got then return got[1], got[2] end return -1, -1 end\n"
+        "function interestChanges() return interest_changes end\n");
+    auto interest = [&]() { return get<0>(sc->call<bool, vector<int>>("__interest")); };
+    auto changes = [&]() { return get<0>(sc->call<int>("interestChanges")); };
+
+    REQUIRE( !interest() );
+    sc->call("__match", 1, (int) KEY_A, (int) EV_KEY, string("test"));
+    // MacroD is told to index the script again, which now wants every key.
+    REQUIRE( changes() == 1 );
+    REQUIRE( interest() );
+
+    sc->call("__match", 1, (int) KEY_B, (int) EV_KEY, string("test"));
+    REQUIRE( sc->call<int, int>("gotKey") == make_tuple((int) KEY_B, 1) );
+    REQUIRE( changes() == 2 );
+    REQUIRE( !interest() );
+}
@@ -0,0 +1,27 @@
+#include <catch2/catch.hpp>
+#include "Hwk2Lua.hpp"
+
+using namespace std;
+
+TEST_CASE("Patterns become matches", "[Hwk2Lua]") {
+    REQUIRE( hwk2lua("key \"a\" => insert \"b\"\n") ==
+             "__match[key \"a\"] = insert \"b\"\n" );
+    REQUIRE( hwk2lua("shift => {\n"
+                     "    key \"f\" => function () local t = {1} end\n"
+                     "}\n") ==
+             "__match[shift] = MatchScope.new(function (__match)\n"
+             "    __match[key \"f\"] = function () local t = {1} end\n"
+             "end)\n" );
+    REQUIRE( hwk2lua("a => b\r\nc => d\r") == "__match[a] = b\n__match[c] = d\n" );
+}
+
+TEST_CASE("Strings and comments are left alone", "[Hwk2Lua]") {
+    REQUIRE( hwk2lua("key \"v\" => write \"key \\\"a\\\" => {\"\n") ==
+             "__match[key \"v\"] = write \"key \\\"a\\\" => {\"\n" );
+    REQUIRE( hwk2lua("-- a => {\nx => y\n") == "-- a => {\n__match[x] = y\n" );
+    string long_string = "s = [==[\n a => { ]] }\n]==]\n";
+    REQUIRE( hwk2lua(long_string) == long_string );
+
+    REQUIRE_THROWS_AS( hwk2lua("a => {\n"), Hwk2LuaError );
+    REQUIRE_THROWS_AS( hwk2lua("}\n"), Hwk2LuaError );
+}
@@ -0,0 +1,87 @@
+#include <catch2/catch.hpp>
+#include "KeyCombo.hpp"
+
+extern "C" {
+    #include <string.h>
+}
+
+using namespace std;
+
+static struct input_event keyEvent(int code, int value, int ms = 0) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.time.tv_sec = ms / 1000;
+    ev.time.tv_usec = (ms % 1000) * 1000;
+    ev.type = EV_KEY;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+}
+
+/** Press and release a key, returning what the press matched. */
+static int tap(ComboAutomaton &combos, int code, int ms = 0) {
+    int id = combos.check(keyEvent(code, 1, ms));
+    combos.check(keyEvent(code, 0, ms));
+    return id;
+}
+
+TEST_CASE("Chords match while their keys are held", "[KeyCombo]") {
+    ComboAutomaton combos;
+    int ks = combos.addChord({KEY_ESC, KEY_SPACE});
+    int copy = combos.addChord({KEY_LEFTCTRL, KEY_C});
+    int copy_all = combos.addChord({KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_C});
+
+    REQUIRE( tap(combos, KEY_SPACE) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_C) == ComboAutomaton::NO_MATCH );
+
+    combos.check(keyEvent(KEY_ESC, 1));
+    REQUIRE( combos.check(keyEvent(KEY_SPACE, 1)) == ks );
+    REQUIRE( combos.check(keyEvent(KEY_SPACE, 2)) == ComboAutomaton::NO_MATCH );
+    combos.check(keyEvent(KEY_SPACE, 0));
+    combos.check(keyEvent(KEY_ESC, 0));
+    REQUIRE( tap(combos, KEY_SPACE) == ComboAutomaton::NO_MATCH );
+
+    combos.check(keyEvent(KEY_LEFTCTRL, 1));
+    REQUIRE( tap(combos, KEY_C) == copy );
+    // The most specific chord wins.
+    combos.check(keyEvent(KEY_LEFTSHIFT, 1));
+    REQUIRE( tap(combos, KEY_C) == copy_all );
+    combos.check(keyEvent(KEY_LEFTSHIFT, 0));
+    REQUIRE( tap(combos, KEY_C) == copy );
+    combos.check(keyEvent(KEY_LEFTCTRL, 0));
+    REQUIRE( tap(combos, KEY_C) == ComboAutomaton::NO_MATCH );
+}
+
+TEST_CASE("Sequences match overlapping input", "[KeyCombo]") {
+    ComboAutomaton combos;
+    int aab = combos.addSequence({KEY_A, KEY_A, KEY_B});
+    int ab = combos.addSequence({KEY_A, KEY_B});
+    int xyz = combos.addSequence({KEY_X, KEY_Y, KEY_Z});
+
+    REQUIRE( tap(combos, KEY_A, 0) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_A, 10) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_A, 20) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_B, 30) == aab );
+
+    REQUIRE( tap(combos, KEY_X, 40) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_A, 50) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_B, 60) == ab );
+
+    REQUIRE( tap(combos, KEY_X, 70) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_Y, 80) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_Z, 90) == xyz );
+}
+
+TEST_CASE("Sequences time out", "[KeyCombo]") {
+    ComboAutomaton combos;
+    int ab = combos.addSequence({KEY_A, KEY_B});
+    combos.setSequenceTimeout(500);
+
+    REQUIRE( tap(combos, KEY_A, 1000) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_B, 2000) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_A, 3000) == ComboAutomaton::NO_MATCH );
+    REQUIRE( tap(combos, KEY_B, 3100) == ab );
+
+    REQUIRE_THROWS_AS( combos.addSequence({}), invalid_argument );
+    REQUIRE_THROWS_AS( combos.addChord({KEY_CNT}), invalid_argument );
+}
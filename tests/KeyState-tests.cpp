@@ -0,0 +1,63 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include "KeyState.hpp"
+
+using namespace std;
+
+static struct input_event keyEvent(int code, int value) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_KEY;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+}
+
+TEST_CASE("Key states follow events", "[KeyState]") {
+    KeyState keys;
+    REQUIRE( keys.numDown() == 0 );
+
+    keys.update(keyEvent(KEY_A, 1));
+    keys.update(keyEvent(KEY_LEFTSHIFT, 1));
+    keys.update(keyEvent(KEY_MAX, 1));
+    REQUIRE( keys.isDown(KEY_A) );
+    REQUIRE( keys.isDown(KEY_LEFTSHIFT) );
+    REQUIRE( keys.isDown(KEY_MAX) );
+    REQUIRE( !keys.isDown(KEY_B) );
+    REQUIRE( !keys.isDown(-1) );
+    REQUIRE( !keys.isDown(KEY_CNT) );
+    REQUIRE( keys.numDown() == 3 );
+
+    // Repeats and other event types don't change anything.
+    keys.update(keyEvent(KEY_B, 2));
+    struct input_event ev = keyEvent(KEY_B, 1);
+    ev.type = EV_MSC;
+    keys.update(ev);
+    REQUIRE( !keys.isDown(KEY_B) );
+
+    vector<int> down;
+    keys.forEachDown([&](int code) { down.push_back(code); });
+    REQUIRE( down == vector<int>({KEY_A, KEY_LEFTSHIFT, KEY_MAX}) );
+
+    keys.update(keyEvent(KEY_A, 0));
+    REQUIRE( !keys.isDown(KEY_A) );
+    REQUIRE( keys.numDown() == 2 );
+}
+
+TEST_CASE("Key states are read from EVIOCGKEY bitmaps", "[KeyState]") {
+    uint8_t bitmap[KEY_MAX/8 + 1] = {0};
+    bitmap[KEY_A / 8] |= 1 << (KEY_A % 8);
+    bitmap[KEY_MAX / 8] |= 1 << (KEY_MAX % 8);
+
+    KeyState keys;
+    keys.set(KEY_B, true);
+    keys.setFromBitmap(bitmap, sizeof(bitmap));
+    REQUIRE( keys.isDown(KEY_A) );
+    REQUIRE( keys.isDown(KEY_MAX) );
+    REQUIRE( !keys.isDown(KEY_B) );
+    REQUIRE( keys.numDown() == 2 );
+
+    uint8_t out[KEY_MAX/8 + 1];
+    keys.toBitmap(out, sizeof(out));
+    REQUIRE( memcmp(out, bitmap, sizeof(bitmap)) == 0 );
+}
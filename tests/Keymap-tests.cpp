@@ -0,0 +1,99 @@
+#include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include "Keymap.hpp"
+#include "SystemError.hpp"
+
+extern "C" {
+    #include <stdlib.h>
+}
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static void checkKeymap(const Keymap &km) {
+    int code = 0, mod_code = 0, root_code = 0;
+
+    REQUIRE( km.getKeysym("q", &code) );
+    REQUIRE( code == 16 );
+    REQUIRE( km.getName(16) == "q" );
+    REQUIRE( km.getKeysym("1", &code) );
+    REQUIRE( code == 2 );
+    REQUIRE( km.getKeysym("space", &code) );
+    REQUIRE( code == 57 );
+    REQUIRE( !km.getKeysym("nosuchkey", &code) );
+    REQUIRE( km.getName(99).empty() );
+
+    // Included keys and the right versions of keys.
+    REQUIRE( km.getKeysym("Shift", &code) );
+    REQUIRE( code == 42 );
+    REQUIRE( km.getKeysym("Shift_R", &code) );
+    REQUIRE( code == 54 );
+    REQUIRE( km.getName(54).empty() );
+
+    REQUIRE( km.getCombo("Q", &mod_code, &root_code) );
+    REQUIRE( mod_code == 42 );
+    REQUIRE( root_code == 16 );
+    REQUIRE( km.getCombo("exclam", &mod_code, &root_code) );
+    REQUIRE( root_code == 2 );
+    REQUIRE( km.getCombo("at", &mod_code, &root_code) );
+    REQUIRE( mod_code == 100 );
+    // Letters without a shifted variant get one.
+    REQUIRE( km.getCombo("A", &mod_code, &root_code) );
+    REQUIRE( root_code == 30 );
+    REQUIRE( !km.getCombo("a", &mod_code, &root_code) );
+
+    REQUIRE( km.isModifier(42) );
+    REQUIRE( km.isModifier(100) );
+    REQUIRE( !km.isModifier(16) );
+}
+
+TEST_CASE("Keymaps are parsed and stored", "[Keymap]") {
+    char tmpl[] = "/tmp/hawck-keymap-test-XXXXXX";
+    REQUIRE( mkdtemp(tmpl) != nullptr );
+    string dir = tmpl;
+    fs::create_directories(dir + "/i386/qwerty");
+    fs::create_directories(dir + "/i386/include");
+
+    ofstream(dir + "/i386/include/base.inc")
+        << "keycode 42 = Shift\n"
+        << "keycode 54 = Shift\n"
+        << "keycode 29 = Control\n";
+    ofstream(dir + "/i386/qwerty/xx.map")
+        << "# Comment\n"
+        << "include \"base\"\n"
+        << "keycode  16 = +q  +Q\n"
+        << "keycode  30 = +a\n"
+        << "keycode   2 = one exclam at ! Comment\n"
+        << "plain keycode 57 = space\n"
+        << "shift keycode 57 = nul\n"
+        << "keycode 100 = AltGr\n";
+
+    auto km = Keymap::parse(dir + "/i386/qwerty/xx.map");
+    checkKeymap(*km);
+
+    SECTION("Tables can be loaded again") {
+        checkKeymap(*Keymap::fromData(string(km->data())));
+
+        string path = dir + "/xx.kmap";
+        ofstream(path, ios::binary) << km->data();
+        auto mapped = Keymap::open(path);
+        checkKeymap(*mapped);
+        REQUIRE( mapped->data() == km->data() );
+    }
+
+    SECTION("Invalid tables are rejected") {
+        string data(km->data());
+        REQUIRE_THROWS_AS( Keymap::fromData(data.substr(0, data.size() - 1)), SystemError );
+        REQUIRE_THROWS_AS( Keymap::fromData(data.substr(0, 4)), SystemError );
+        data[0] ^= 0xff;
+        REQUIRE_THROWS_AS( Keymap::fromData(data), SystemError );
+    }
+
+    SECTION("Missing includes are an error") {
+        ofstream(dir + "/i386/qwerty/bad.map") << "include \"nonexistent\"\n";
+        REQUIRE_THROWS_AS( Keymap::parse(dir + "/i386/qwerty/bad.map"), SystemError );
+    }
+
+    fs::remove_all(dir);
+}
@@ -0,0 +1,55 @@
+#include <catch2/catch.hpp>
+#include "Latency.hpp"
+
+using namespace std;
+
+TEST_CASE("Empty histogram", "[Latency]") {
+    LatencyHistogram h;
+    REQUIRE( h.count() == 0 );
+    REQUIRE( h.percentile(50) == 0 );
+    REQUIRE( h.max() == 0 );
+}
+
+TEST_CASE("Small values are exact", "[Latency]") {
+    LatencyHistogram h;
+    for (uint64_t i = 1; i <= 15; i++)
+        h.record(i);
+    REQUIRE( h.count() == 15 );
+    REQUIRE( h.percentile(0) == 1 );
+    REQUIRE( h.percentile(100) == 15 );
+    REQUIRE( h.max() == 15 );
+    REQUIRE( h.mean() == 8 );
+}
+
+TEST_CASE("Percentiles within bucket precision", "[Latency]") {
+    LatencyHistogram h;
+    // 1..10000 µs
+    for (uint64_t i = 1; i <= 10000; i++)
+        h.record(i * 1000);
+    auto within = [](uint64_t got, uint64_t expect) {
+        return got >= expect && got <= expect + expect / 8;
+    };
+    REQUIRE( within(h.percentile(50), 5000 * 1000) );
+    REQUIRE( within(h.percentile(99), 9900 * 1000) );
+    REQUIRE( h.percentile(100) == 10000 * 1000 );
+    REQUIRE( h.max() == 10000 * 1000 );
+}
+
+TEST_CASE("Stage timestamps", "[Latency]") {
+    LatencyStats stats;
+    auto &h = stats.stage("a");
+    REQUIRE( &h == &stats.stage("a") );
+    h.between(0, 100);
+    h.between(200, 100);
+    REQUIRE( h.count() == 0 );
+    h.between(100, 300);
+    REQUIRE( h.count() == 1 );
+    REQUIRE( h.max() == 200 );
+
+    auto tbl = stats.table();
+    REQUIRE( tbl["a"]["count"] == 1 );
+    REQUIRE( tbl["a"]["max_us"] == Approx(0.2) );
+
+    stats.reset();
+    REQUIRE( h.count() == 0 );
+}
@@ -0,0 +1,48 @@
+#include <catch2/catch.hpp>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "Log.hpp"
+
+using namespace std;
+
+TEST_CASE("Call sites are rate limited", "[Log]") {
+    static Log::Site site(LOG_DEBUG, "Rate limited message %d");
+    for (uint32_t i = 0; i < Log::rate_burst + 5; i++)
+        Log::write(&site, i);
+    REQUIRE( site.suppressed == 5 );
+    REQUIRE( site.listed );
+}
+
+TEST_CASE("Messages below the level are dropped", "[Log]") {
+    static Log::Site site(LOG_DEBUG, "Dropped message");
+    Log::setLevel(LOG_INFO);
+    Log::write(&site);
+    REQUIRE( site.count == 0 );
+    Log::setLevel(LOG_DEBUG);
+    Log::write(&site);
+    REQUIRE( site.count == 1 );
+}
+
+TEST_CASE("Many threads log through the drain thread", "[Log]") {
+    Log::start();
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([t]() {
+            for (int i = 0; i < 100; i++)
+                HAWCK_LOG(LOG_DEBUG, "Thread %d message %d", t, i);
+        });
+    for (auto &t : threads)
+        t.join();
+    Log::stop();
+}
+
+TEST_CASE("The drain thread is woken up to stop", "[Log]") {
+    Log::start();
+    // Let it go to sleep.
+    this_thread::sleep_for(chrono::milliseconds(50));
+    HAWCK_LOG(LOG_DEBUG, "Message to a sleeping drain thread");
+    auto t0 = chrono::steady_clock::now();
+    Log::stop();
+    REQUIRE( chrono::steady_clock::now() - t0 < chrono::milliseconds(500) );
+}
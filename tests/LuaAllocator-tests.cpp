@@ -0,0 +1,80 @@
+#include <catch2/catch.hpp>
+#include <cstring>
+#include "LuaAllocator.hpp"
+
+using namespace std;
+using namespace Lua;
+
+static void *la(Allocator &a, void *ptr, size_t osize, size_t nsize) {
+    return Allocator::alloc(&a, ptr, osize, nsize);
+}
+
+TEST_CASE("Blocks are pooled and reused", "[LuaAllocator]") {
+    Allocator a;
+    // Lua passes the object type as osize for new blocks.
+    void *p = la(a, nullptr, 5, 40);
+    REQUIRE( p != nullptr );
+    REQUIRE( a.stats().in_use == 40 );
+    REQUIRE( la(a, p, 40, 0) == nullptr );
+    REQUIRE( a.stats().in_use == 0 );
+
+    // Freed blocks go back to the pool of their class.
+    void *q = la(a, nullptr, 0, 33);
+    REQUIRE( q == p );
+
+    void *big = la(a, nullptr, 0, 4096);
+    REQUIRE( big != nullptr );
+    auto st = a.stats();
+    REQUIRE( st.allocs == 3 );
+    REQUIRE( st.pool_allocs == 2 );
+    REQUIRE( st.frees == 1 );
+    REQUIRE( st.in_use == 33 + 4096 );
+    REQUIRE( st.peak == 33 + 4096 );
+
+    la(a, q, 33, 0);
+    la(a, big, 4096, 0);
+    REQUIRE( a.stats().in_use == 0 );
+}
+
+TEST_CASE("Reallocation keeps the contents", "[LuaAllocator]") {
+    Allocator a;
+    char *p = (char *) la(a, nullptr, 0, 10);
+    memcpy(p, "0123456789", 10);
+
+    // Within the same class, larger class, out of the pools and back.
+    p = (char *) la(a, p, 10, 16);
+    REQUIRE( memcmp(p, "0123456789", 10) == 0 );
+    p = (char *) la(a, p, 16, 100);
+    REQUIRE( memcmp(p, "0123456789", 10) == 0 );
+    p = (char *) la(a, p, 100, 1000);
+    REQUIRE( memcmp(p, "0123456789", 10) == 0 );
+    p = (char *) la(a, p, 1000, 2000);
+    REQUIRE( memcmp(p, "0123456789", 10) == 0 );
+    p = (char *) la(a, p, 2000, 12);
+    REQUIRE( memcmp(p, "0123456789", 10) == 0 );
+    REQUIRE( a.stats().in_use == 12 );
+    la(a, p, 12, 0);
+}
+
+TEST_CASE("Limits only stop growth", "[LuaAllocator]") {
+    Allocator a;
+    a.setLimit(1024);
+    void *p = la(a, nullptr, 0, 512);
+    REQUIRE( p != nullptr );
+    REQUIRE( la(a, nullptr, 0, 1024) == nullptr );
+    REQUIRE( a.numFailed() == 1 );
+    REQUIRE( la(a, p, 512, 2048) == nullptr );
+    REQUIRE( a.numFailed() == 2 );
+
+    // Shrinking always works, even while above the limit.
+    a.setLimit(256);
+    p = la(a, p, 512, 300);
+    REQUIRE( p != nullptr );
+    REQUIRE( a.stats().in_use == 300 );
+
+    a.setLimit(0);
+    void *q = la(a, nullptr, 0, 1 << 20);
+    REQUIRE( q != nullptr );
+    la(a, q, 1 << 20, 0);
+    la(a, p, 300, 0);
+}
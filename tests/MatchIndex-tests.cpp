@@ -0,0 +1,63 @@
+#include <catch2/catch.hpp>
+#include "MatchIndex.hpp"
+
+static struct input_event keyEvent(int code, int value) {
+    struct input_event ev = {};
+    ev.type = EV_KEY;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+}
+
+TEST_CASE("Index from __interest entries", "[MatchIndex]") {
+    // KEY_A on key down, KEY_B on any value.
+    MatchIndex index({(KEY_A << 3) | (1 << 1), (KEY_B << 3) | MatchIndex::all_values});
+    REQUIRE( !index.matchesAll() );
+    REQUIRE( index.size() == 2 );
+
+    REQUIRE( index.wants(keyEvent(KEY_A, 1)) );
+    REQUIRE( !index.wants(keyEvent(KEY_A, 0)) );
+    REQUIRE( !index.wants(keyEvent(KEY_A, 2)) );
+    REQUIRE( index.wants(keyEvent(KEY_B, 0)) );
+    REQUIRE( index.wants(keyEvent(KEY_B, 2)) );
+    REQUIRE( !index.wants(keyEvent(KEY_C, 1)) );
+    REQUIRE( index.wantsCode(KEY_A) );
+    REQUIRE( !index.wantsCode(KEY_C) );
+
+    // Anything that isn't a plain key event is passed on.
+    struct input_event rel = {};
+    rel.type = EV_REL;
+    REQUIRE( index.wants(rel) );
+    REQUIRE( index.wants(keyEvent(KEY_C, 7)) );
+}
+
+TEST_CASE("Merging indices", "[MatchIndex]") {
+    MatchIndex global;
+    global.clear();
+    REQUIRE( !global.wants(keyEvent(KEY_A, 1)) );
+
+    global.merge(MatchIndex({(KEY_A << 3) | 1}));
+    global.merge(MatchIndex({(KEY_A << 3) | 2}));
+    REQUIRE( global.wants(keyEvent(KEY_A, 0)) );
+    REQUIRE( global.wants(keyEvent(KEY_A, 1)) );
+    REQUIRE( !global.wants(keyEvent(KEY_A, 2)) );
+
+    // A script without an index makes everything interesting.
+    global.merge(MatchIndex());
+    REQUIRE( global.matchesAll() );
+    REQUIRE( global.wants(keyEvent(KEY_Z, 2)) );
+}
+
+TEST_CASE("Key code bitmap", "[MatchIndex]") {
+    MatchIndex index({(KEY_A << 3) | 1, (KEY_SPACE << 3) | 2});
+    auto bits = index.codeBitmap();
+    REQUIRE( bits.size() * 8 >= KEY_CNT );
+    auto isSet = [&](int code) { return bits[code / 8] & (1 << (code % 8)); };
+    REQUIRE( isSet(KEY_A) );
+    REQUIRE( isSet(KEY_SPACE) );
+    REQUIRE( !isSet(KEY_B) );
+
+    index.setAll();
+    for (auto b : index.codeBitmap())
+        REQUIRE( b == 0xff );
+}
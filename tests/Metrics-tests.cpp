@@ -0,0 +1,66 @@
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vector>
+#include "Metrics.hpp"
+#include "StatsServer.hpp"
+
+extern "C" {
+    #include <unistd.h>
+}
+
+using namespace std;
+
+TEST_CASE("Counters are summed over threads", "[Metrics]") {
+    MetricCounter counter;
+    vector<thread> threads;
+    for (int i = 0; i < 20; i++)
+        threads.emplace_back([&]() {
+            for (int j = 0; j < 1000; j++)
+                counter.add();
+        });
+    for (auto &t : threads)
+        t.join();
+    counter.add(5);
+    REQUIRE( counter.value() == 20005 );
+}
+
+TEST_CASE("Metrics are formatted for Prometheus", "[Metrics]") {
+    Metrics metrics;
+    metrics.counter("test_events_total", "Events", {{"device", "a\"b"}}).add(3);
+    // Registering it again gives back the same counter.
+    metrics.counter("test_events_total", "Events", {{"device", "a\"b"}}).add(1);
+    metrics.counter("test_events_total", "Events", {{"device", "c"}});
+    metrics.addGauge("test_scripts", "Scripts", []() { return 2.0; });
+    metrics.histogram("test_rtt_seconds", "Round trips").record(1500);
+
+    string text = metrics.format();
+    REQUIRE( text.find("# TYPE test_events_total counter\n") != string::npos );
+    REQUIRE( text.find("test_events_total{device=\"a\\\"b\"} 4\n") != string::npos );
+    REQUIRE( text.find("test_events_total{device=\"c\"} 0\n") != string::npos );
+    REQUIRE( text.find("# TYPE test_scripts gauge\ntest_scripts 2\n") != string::npos );
+    REQUIRE( text.find("# TYPE test_rtt_seconds summary\n") != string::npos );
+    REQUIRE( text.find("test_rtt_seconds{quantile=\"0.99\"} 1.5") != string::npos );
+    REQUIRE( text.find("test_rtt_seconds_count 1\n") != string::npos );
+
+    REQUIRE_THROWS_AS( metrics.histogram("test_scripts", "Scripts"), invalid_argument );
+}
+
+TEST_CASE("Stats are served to every client", "[Metrics]") {
+    static const string stats_path = "./stats-test.sock";
+    Metrics metrics;
+    metrics.counter("test_total", "Test").add(7);
+    StatsServer srv(stats_path, metrics);
+    srv.start();
+
+    for (int i = 0; i < 2; i++) {
+        UNIXSocket<char> sock(stats_path);
+        string text;
+        char buf[256];
+        ssize_t n;
+        while ((n = ::read(sock.getfd(), buf, sizeof(buf))) > 0)
+            text.append(buf, n);
+        REQUIRE( text == metrics.format() );
+    }
+
+    unlink(stats_path.c_str());
+}
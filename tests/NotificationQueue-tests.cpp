@@ -0,0 +1,69 @@
+#include <catch2/catch.hpp>
+#include <mutex>
+#include <vector>
+#include "NotificationQueue.hpp"
+
+extern "C" {
+    #include <unistd.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+struct Shown {
+    mutex mtx;
+    vector<Notification> all;
+
+    size_t size() {
+        lock_guard<mutex> lock(mtx);
+        return all.size();
+    }
+
+    /** Wait for at least n notifications to have been shown. */
+    bool waitFor(size_t n) {
+        for (int i = 0; i < 200 && size() < n; i++)
+            usleep(5000);
+        return size() >= n;
+    }
+};
+
+TEST_CASE("Duplicates are dropped", "[NotificationQueue]") {
+    Shown shown;
+    {
+        NotificationQueue q([&](const Notification &n) {
+            lock_guard<mutex> lock(shown.mtx);
+            shown.all.push_back(n);
+        }, milliseconds(0));
+        REQUIRE( q.push("a", "error", "hawck") );
+        REQUIRE( !q.push("a", "error", "hawck") );
+        REQUIRE( shown.waitFor(1) );
+        REQUIRE( !q.push("a", "error", "hawck") );
+        REQUIRE( q.push("b", "error", "hawck") );
+        REQUIRE( shown.waitFor(2) );
+    }
+    REQUIRE( shown.all[0].title == "a" );
+    REQUIRE( shown.all[1].title == "b" );
+}
+
+TEST_CASE("Titles are rate limited", "[NotificationQueue]") {
+    Shown shown;
+    {
+        NotificationQueue q([&](const Notification &n) {
+            lock_guard<mutex> lock(shown.mtx);
+            shown.all.push_back(n);
+        }, milliseconds(200));
+        REQUIRE( q.push("a", "1", "hawck") );
+        REQUIRE( shown.waitFor(1) );
+        REQUIRE( q.push("a", "2", "hawck") );
+        REQUIRE( q.push("a", "3", "hawck") );
+        REQUIRE( q.push("b", "1", "hawck") );
+        // Other titles are not held back.
+        REQUIRE( shown.waitFor(2) );
+        REQUIRE( shown.size() == 2 );
+        REQUIRE( shown.waitFor(3) );
+    }
+    REQUIRE( shown.all[1].title == "b" );
+    REQUIRE( shown.all[2].title == "a" );
+    REQUIRE( shown.all[2].msg == "3" );
+    REQUIRE( shown.all[2].suppressed == 1 );
+}
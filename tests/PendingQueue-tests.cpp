@@ -0,0 +1,88 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include "PendingQueue.hpp"
+
+using namespace std;
+
+static KBDAction keyAction(int code, int value) {
+    KBDAction action = {};
+    action.ev.type = EV_KEY;
+    action.ev.code = code;
+    action.ev.value = value;
+    return action;
+}
+
+TEST_CASE("Output is emitted in the order events were read", "[PendingQueue]") {
+    PendingQueue q(16);
+    vector<KBDAction> sent;
+    REQUIRE( q.pushMacroD(keyAction(KEY_A, 1)) );
+    q.pushLocal(keyAction(KEY_B, 1), {keyAction(KEY_B, 1).ev});
+    q.sendQueued(16, [&](KBDAction &a) { sent.push_back(a); });
+    REQUIRE( sent.size() == 1 );
+    REQUIRE( sent[0].seq != 0 );
+    REQUIRE( q.inFlight() == 1 );
+
+    // Nothing goes out before the reply to the event in front.
+    vector<int> codes;
+    auto emit = [&](const PendingEvent &p) {
+        for (const auto &ev : p.out)
+            codes.push_back(ev.code);
+    };
+    REQUIRE( !q.popDone(emit) );
+    REQUIRE( q.oldestInFlight()->seq == sent[0].seq );
+
+    PendingEvent *p = q.findInFlight(sent[0].seq);
+    REQUIRE( p != nullptr );
+    REQUIRE( q.findInFlight(0) == nullptr );
+    p->out.push_back(keyAction(KEY_C, 1).ev);
+    q.complete(p);
+    REQUIRE( q.popDone(emit) );
+    REQUIRE( codes == vector<int>{KEY_C, KEY_B} );
+    REQUIRE( q.empty() );
+    REQUIRE( q.inFlight() == 0 );
+}
+
+TEST_CASE("Events wait while the pipeline is full", "[PendingQueue]") {
+    PendingQueue q(16);
+    vector<uint32_t> sent;
+    for (int i = 0; i < 4; i++)
+        q.pushMacroD(keyAction(KEY_A, 1));
+    q.sendQueued(2, [&](KBDAction &a) { sent.push_back(a.seq); });
+    REQUIRE( sent.size() == 2 );
+
+    q.complete(q.findInFlight(sent[0]));
+    q.sendQueued(2, [&](KBDAction &a) { sent.push_back(a.seq); });
+    REQUIRE( sent.size() == 3 );
+    REQUIRE( sent[2] > sent[1] );
+    REQUIRE( q.inFlight() == 2 );
+}
+
+TEST_CASE("Events past max_pending are still emitted when drained", "[PendingQueue]") {
+    const size_t max_pending = 8;
+    PendingQueue q(max_pending);
+    for (size_t i = 0; i < max_pending; i++)
+        REQUIRE( q.pushMacroD(keyAction(KEY_A + i, 1)) );
+    // The release that overflows the queue must not be lost, or the key
+    // stays down.
+    REQUIRE( !q.pushMacroD(keyAction(KEY_A, 0)) );
+    REQUIRE( q.size() == max_pending + 1 );
+
+    q.sendQueued(4, [](KBDAction &) {});
+    PendingEvent *p = q.findInFlight(1);
+    REQUIRE( p != nullptr );
+    p->out.push_back(keyAction(KEY_Z, 1).ev);
+    q.complete(p);
+
+    vector<struct input_event> out;
+    q.drain([&](const struct input_event &ev) { out.push_back(ev); });
+    REQUIRE( out.size() == max_pending + 1 );
+    // Complete output replaces the event, the rest goes out unchanged.
+    REQUIRE( out[0].code == KEY_Z );
+    for (size_t i = 1; i < max_pending; i++)
+        REQUIRE( out[i].code == KEY_A + i );
+    REQUIRE( out.back().code == KEY_A );
+    REQUIRE( out.back().value == 0 );
+    REQUIRE( q.empty() );
+    REQUIRE( q.inFlight() == 0 );
+    REQUIRE( q.pushMacroD(keyAction(KEY_A, 1)) );
+}
@@ -0,0 +1,69 @@
+#include <catch2/catch.hpp>
+#include "Pointer.hpp"
+
+extern "C" {
+    #include <string.h>
+}
+
+using namespace std;
+
+static struct input_event event(int type, int code, int value) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+}
+
+static void motion(vector<struct input_event> *evs, int dx, int dy) {
+    evs->push_back(event(EV_REL, REL_X, dx));
+    evs->push_back(event(EV_REL, REL_Y, dy));
+    evs->push_back(event(EV_SYN, SYN_REPORT, 0));
+}
+
+TEST_CASE("Consecutive motion frames are merged", "[Pointer]") {
+    vector<struct input_event> evs;
+    motion(&evs, 1, 2);
+    motion(&evs, 3, -2);
+    evs.push_back(event(EV_REL, REL_WHEEL, 1));
+    evs.push_back(event(EV_SYN, SYN_REPORT, 0));
+
+    REQUIRE( coalesceMotion(&evs) );
+    // REL_Y summed up to zero, so it is left out.
+    REQUIRE( evs.size() == 3 );
+    REQUIRE( evs[0].type == EV_REL );
+    REQUIRE( evs[0].code == REL_X );
+    REQUIRE( evs[0].value == 4 );
+    REQUIRE( evs[1].code == REL_WHEEL );
+    REQUIRE( evs[1].value == 1 );
+    REQUIRE( isFrameEnd(evs[2]) );
+}
+
+TEST_CASE("Button frames are not merged", "[Pointer]") {
+    vector<struct input_event> evs;
+    motion(&evs, 1, 1);
+    evs.push_back(event(EV_KEY, BTN_LEFT, 1));
+    evs.push_back(event(EV_REL, REL_X, 5));
+    evs.push_back(event(EV_SYN, SYN_REPORT, 0));
+    motion(&evs, 2, 2);
+    motion(&evs, 2, 2);
+    // A partial frame at the end stays as it is.
+    evs.push_back(event(EV_REL, REL_X, 7));
+
+    REQUIRE( coalesceMotion(&evs) );
+    REQUIRE( evs.size() == 3 + 3 + 3 + 1 );
+    REQUIRE( evs[0].value == 1 );
+    REQUIRE( evs[3].code == BTN_LEFT );
+    REQUIRE( evs[4].value == 5 );
+    REQUIRE( evs[6].code == REL_X );
+    REQUIRE( evs[6].value == 4 );
+    REQUIRE( evs[7].code == REL_Y );
+    REQUIRE( evs[7].value == 4 );
+    REQUIRE( evs[9].value == 7 );
+
+    vector<struct input_event> single;
+    motion(&single, 1, 1);
+    REQUIRE( !coalesceMotion(&single) );
+    REQUIRE( single.size() == 3 );
+}
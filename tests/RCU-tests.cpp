@@ -0,0 +1,52 @@
+#include <catch2/catch.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "RCU.hpp"
+
+using namespace std;
+
+struct Cell {
+    int value;
+    /** Cleared when the writer gets the cell back. */
+    atomic<bool> alive {true};
+};
+
+TEST_CASE("Replaced objects are handed back", "[RCU]") {
+    RCUPtr<Cell> rcu(unique_ptr<Cell>(new Cell{1}));
+    REQUIRE( rcu.read()->value == 1 );
+
+    auto old = rcu.replace(unique_ptr<Cell>(new Cell{2}));
+    REQUIRE( old->value == 1 );
+    REQUIRE( rcu.read()->value == 2 );
+}
+
+TEST_CASE("Readers never see retired objects", "[RCU]") {
+    RCUPtr<Cell> rcu(unique_ptr<Cell>(new Cell{0}));
+    atomic<bool> done(false);
+    atomic<int> bad(0);
+
+    vector<thread> readers;
+    for (int i = 0; i < 3; i++) {
+        readers.emplace_back([&]() {
+            int last = 0;
+            while (!done) {
+                auto cell = rcu.read();
+                if (!cell->alive || cell->value < last)
+                    bad++;
+                last = cell->value;
+            }
+        });
+    }
+
+    for (int i = 1; i <= 500; i++) {
+        auto old = rcu.replace(unique_ptr<Cell>(new Cell{i}));
+        old->alive = false;
+    }
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    REQUIRE( bad == 0 );
+    REQUIRE( rcu.read()->value == 500 );
+}
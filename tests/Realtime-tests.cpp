@@ -0,0 +1,24 @@
+#include <catch2/catch.hpp>
+#include "Realtime.hpp"
+
+using namespace std;
+
+TEST_CASE("Parse realtime options", "[Realtime]") {
+    REQUIRE( RealtimeOptions::parsePolicy("fifo") == SCHED_FIFO );
+    REQUIRE( RealtimeOptions::parsePolicy("rr") == SCHED_RR );
+    REQUIRE_THROWS_AS( RealtimeOptions::parsePolicy("other"), invalid_argument );
+
+    REQUIRE( RealtimeOptions::parseCPUs("3") == vector<int>({3}) );
+    REQUIRE( RealtimeOptions::parseCPUs("0,2-4") == vector<int>({0, 2, 3, 4}) );
+    REQUIRE( RealtimeOptions::parseCPUs("") == vector<int>() );
+    REQUIRE_THROWS_AS( RealtimeOptions::parseCPUs("a"), invalid_argument );
+    REQUIRE_THROWS_AS( RealtimeOptions::parseCPUs("1-"), invalid_argument );
+    REQUIRE_THROWS_AS( RealtimeOptions::parseCPUs("3-1"), invalid_argument );
+    REQUIRE_THROWS_AS( RealtimeOptions::parseCPUs("1x"), invalid_argument );
+}
+
+TEST_CASE("Options without a priority keep the normal scheduler", "[Realtime]") {
+    RealtimeOptions rt;
+    rt.applyToThisThread("test");
+    REQUIRE( sched_getscheduler(0) == SCHED_OTHER );
+}
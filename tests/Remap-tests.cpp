@@ -0,0 +1,92 @@
+#include <catch2/catch.hpp>
+#include <fstream>
+#include "Remap.hpp"
+
+extern "C" {
+    #include <string.h>
+    #include <unistd.h>
+}
+
+using namespace std;
+
+static const string remap_path = "./remap-test.remap.csv";
+
+static vector<RemapRule> loadRules(const string &contents) {
+    {
+        ofstream out(remap_path);
+        out << contents;
+    }
+    CSV csv(remap_path);
+    auto rules = RemapTable::load(csv);
+    unlink(remap_path.c_str());
+    return rules;
+}
+
+static struct input_event keyEvent(int code, int value) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_KEY;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+}
+
+TEST_CASE("Remap files are parsed", "[Remap]") {
+    auto rules = loadRules("from,to,device\n"
+                           "58,29,\n"
+                           "125,29+56,046d:c52b\n"
+                           "abc,29,\n"
+                           "30,1+2+3+4+5,\n");
+    REQUIRE( rules.size() == 2 );
+    REQUIRE( rules[0].from == KEY_CAPSLOCK );
+    REQUIRE( rules[0].to.num == 1 );
+    REQUIRE( rules[0].to.keys[0] == KEY_LEFTCTRL );
+    REQUIRE( rules[0].vendor == 0 );
+    REQUIRE( rules[1].to.num == 2 );
+    REQUIRE( rules[1].to.keys[1] == KEY_LEFTALT );
+    REQUIRE( rules[1].vendor == 0x046d );
+    REQUIRE( rules[1].product == 0xc52b );
+
+    REQUIRE_THROWS_AS( loadRules("key_code\n58\n"), CSV::CSVError );
+}
+
+TEST_CASE("Devices override remaps", "[Remap]") {
+    RemapTable tbl;
+    REQUIRE( tbl.empty() );
+    for (const auto &rule : loadRules("from,to,device\n"
+                                      "58,29,\n"
+                                      "58,58,1234:0001\n"
+                                      "56,125,1234:0001\n"))
+        tbl.add(rule);
+    REQUIRE( !tbl.empty() );
+
+    struct input_id other = {}, dev = {};
+    dev.vendor = 0x1234;
+    dev.product = 0x0001;
+    REQUIRE( tbl.lookup(other, KEY_CAPSLOCK).keys[0] == KEY_LEFTCTRL );
+    REQUIRE( tbl.lookup(dev, KEY_CAPSLOCK).keys[0] == KEY_CAPSLOCK );
+    REQUIRE( tbl.lookup(dev, KEY_LEFTALT).keys[0] == KEY_LEFTMETA );
+    REQUIRE( tbl.lookup(other, KEY_LEFTALT).num == 0 );
+    REQUIRE( tbl.lookup(other, KEY_A).num == 0 );
+}
+
+TEST_CASE("Chords are pressed in order and released in reverse", "[Remap]") {
+    KeyRemap remap;
+    remap.num = 2;
+    remap.keys[0] = KEY_LEFTCTRL;
+    remap.keys[1] = KEY_C;
+
+    vector<struct input_event> out;
+    RemapTable::apply(remap, keyEvent(KEY_F1, 1), &out);
+    RemapTable::apply(remap, keyEvent(KEY_F1, 2), &out);
+    RemapTable::apply(remap, keyEvent(KEY_F1, 0), &out);
+    vector<pair<int, int>> expect = {{KEY_LEFTCTRL, 1}, {KEY_C, 1},
+                                     {KEY_C, 2},
+                                     {KEY_C, 0}, {KEY_LEFTCTRL, 0}};
+    REQUIRE( out.size() == expect.size() );
+    for (size_t i = 0; i < out.size(); i++) {
+        REQUIRE( out[i].type == EV_KEY );
+        REQUIRE( out[i].code == expect[i].first );
+        REQUIRE( out[i].value == expect[i].second );
+    }
+}
@@ -0,0 +1,59 @@
+#include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include "RemoteUDevice.hpp"
+
+extern "C" {
+    #include <stdlib.h>
+    #include <sys/socket.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+/** A keymap with q, Q and exclam, parsed from a temporary directory. */
+static shared_ptr<Keymap> mkKeymap() {
+    char tmpl[] = "/tmp/hawck-udev-test-XXXXXX";
+    REQUIRE( mkdtemp(tmpl) != nullptr );
+    string dir = tmpl;
+    fs::create_directories(dir + "/i386/qwerty");
+    ofstream(dir + "/i386/qwerty/xx.map")
+        << "keycode 42 = Shift\n"
+        << "keycode 16 = +q +Q\n"
+        << "keycode  2 = one exclam\n";
+    auto km = Keymap::parse(dir + "/i386/qwerty/xx.map");
+    fs::remove_all(dir);
+    return km;
+}
+
+/** Codes of the key presses in the frame waiting on `sock`. */
+static vector<int> recvPresses(UNIXSocket<KBDAction> &sock) {
+    KBDFrame frame;
+    vector<KBDAction> actions;
+    sock.recvFrame(&frame, &actions, milliseconds(100));
+    vector<int> codes;
+    for (const auto &a : actions)
+        if (a.ev.type == EV_KEY && a.ev.value == 1)
+            codes.push_back(a.ev.code);
+    return codes;
+}
+
+TEST_CASE("Text is typed with the keymap of the caller", "[RemoteUDevice]") {
+    int fds[2];
+    REQUIRE( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0 );
+    UNIXSocket<KBDAction> a(fds[0]), b(fds[1]);
+    RemoteUDevice udev(&a);
+    udev.addKeymap("xx", mkKeymap());
+
+    // Typing stops at the first character that is not in the keymap.
+    string text = "qQ!\xc3\xa6q";
+    REQUIRE( udev.typeString(text, 1, "xx") == 4 );
+    REQUIRE( recvPresses(b) == vector<int>{16, 42, 16, 42, 2} );
+    REQUIRE( udev.typeString(text, 6, "xx") == int(text.size()) + 1 );
+    REQUIRE( recvPresses(b) == vector<int>{16} );
+
+    // Other scripts may use a keymap that has not been added.
+    REQUIRE( udev.typeString(text, 1, "yy") == 1 );
+    REQUIRE( !b.waitReadable(0) );
+}
@@ -0,0 +1,51 @@
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vector>
+#include "SPSCQueue.hpp"
+
+using namespace std;
+
+TEST_CASE("Push and pop in order", "[SPSCQueue]") {
+    SPSCQueue<int, 4> q;
+    int x;
+    REQUIRE( q.empty() );
+    REQUIRE( !q.pop(&x) );
+    for (int i = 0; i < 4; i++)
+        REQUIRE( q.push(int(i)) );
+    REQUIRE( !q.push(4) );
+    REQUIRE( q.size() == 4 );
+    for (int i = 0; i < 4; i++) {
+        REQUIRE( q.pop(&x) );
+        REQUIRE( x == i );
+    }
+    REQUIRE( q.empty() );
+}
+
+TEST_CASE("Elements are moved", "[SPSCQueue]") {
+    SPSCQueue<vector<int>, 2> q;
+    vector<int> v = {1, 2, 3};
+    REQUIRE( q.push(std::move(v)) );
+    vector<int> got;
+    REQUIRE( q.pop(&got) );
+    REQUIRE( got == vector<int>({1, 2, 3}) );
+}
+
+TEST_CASE("Producer and consumer threads", "[SPSCQueue]") {
+    SPSCQueue<int, 64> q;
+    const int num = 100000;
+    thread producer([&]() {
+        for (int i = 0; i < num; i++)
+            while (!q.push(int(i)))
+                this_thread::yield();
+    });
+    bool in_order = true;
+    for (int i = 0; i < num; i++) {
+        int x;
+        while (!q.pop(&x))
+            this_thread::yield();
+        in_order = in_order && x == i;
+    }
+    producer.join();
+    REQUIRE( in_order );
+    REQUIRE( q.empty() );
+}
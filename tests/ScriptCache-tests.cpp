@@ -0,0 +1,101 @@
+#include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include "ScriptCache.hpp"
+
+extern "C" {
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <sys/stat.h>
+}
+
+using namespace std;
+namespace fs = std::filesystem;
+
+TEST_CASE("Keys depend on all inputs", "[ScriptCache]") {
+    string k = ScriptCache::key("lua", "@a.lua", "print(1)");
+    REQUIRE( k == ScriptCache::key("lua", "@a.lua", "print(1)") );
+    REQUIRE( k != ScriptCache::key("hwk", "@a.lua", "print(1)") );
+    REQUIRE( k != ScriptCache::key("lua", "@b.lua", "print(1)") );
+    REQUIRE( k != ScriptCache::key("lua", "@a.lua", "print(2)") );
+    REQUIRE( k.size() == 64 );
+}
+
+TEST_CASE("SHA-256 matches the test vectors", "[ScriptCache]") {
+    auto hex = [](const string &d) {
+        string out;
+        char buf[3];
+        for (unsigned char c : d) {
+            snprintf(buf, sizeof(buf), "%02x", c);
+            out += buf;
+        }
+        return out;
+    };
+    REQUIRE( hex(sha256("")) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" );
+    REQUIRE( hex(sha256("abc")) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" );
+    REQUIRE( hex(sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")) ==
+             "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" );
+}
+
+TEST_CASE("Entries are stored and pruned", "[ScriptCache]") {
+    char tmpl[] = "/tmp/hawck-cache-test-XXXXXX";
+    REQUIRE( mkdtemp(tmpl) != nullptr );
+    string dir = string(tmpl) + "/scripts";
+
+    {
+        ScriptCache cache(dir);
+        REQUIRE( fs::is_directory(dir) );
+
+        string key = ScriptCache::key("lua", "@a.lua", "print(1)");
+        string out;
+        REQUIRE( !cache.get(key, "luac", &out) );
+
+        string data("\x1bLua\0binary", 11);
+        cache.put(key, "luac", data);
+        REQUIRE( cache.get(key, "luac", &out) );
+        REQUIRE( out == data );
+        REQUIRE( !cache.get(key, "lua", &out) );
+
+        // Fresh entries survive, old ones do not.
+        cache.prune(chrono::hours(1));
+        REQUIRE( cache.get(key, "luac", &out) );
+        fs::last_write_time(dir + "/" + key + ".luac",
+                            fs::file_time_type::clock::now() - chrono::hours(2));
+        cache.prune(chrono::hours(1));
+        REQUIRE( !cache.get(key, "luac", &out) );
+    }
+
+    fs::remove_all(tmpl);
+}
+
+TEST_CASE("Corrupt entries are not loaded", "[ScriptCache]") {
+    char tmpl[] = "/tmp/hawck-cache-test-XXXXXX";
+    REQUIRE( mkdtemp(tmpl) != nullptr );
+    string dir = string(tmpl) + "/scripts";
+    REQUIRE( fs::create_directory(dir) );
+    REQUIRE( chmod(dir.c_str(), 0755) == 0 );
+
+    {
+        ScriptCache cache(dir);
+        REQUIRE( (fs::status(dir).permissions() & fs::perms::all) == fs::perms::owner_all );
+
+        string key = ScriptCache::key("lua", "@a.lua", "print(1)");
+        string out;
+        cache.put(key, "luac", "\x1bLua bytecode");
+        {
+            fstream f(dir + "/" + key + ".luac", ios::in | ios::out | ios::binary);
+            f.seekp(-1, ios::end);
+            f.put('X');
+        }
+        REQUIRE( !cache.get(key, "luac", &out) );
+        REQUIRE( !fs::exists(dir + "/" + key + ".luac") );
+
+        // Mapped entries are stored as they are.
+        string path;
+        cache.putMapped(key, "kmap", "table");
+        REQUIRE( cache.lookup(key, "kmap", &path) );
+        REQUIRE( fs::file_size(path) == 5 );
+    }
+
+    fs::remove_all(tmpl);
+}
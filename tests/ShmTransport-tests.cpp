@@ -0,0 +1,119 @@
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vector>
+#include "UNIXSocket.hpp"
+#include "ShmTransport.hpp"
+
+extern "C" {
+    #include <sys/socket.h>
+    #include <unistd.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+struct TestHeader {
+    uint32_t seq;
+    uint32_t count;
+};
+
+struct TestPacket {
+    int a, b;
+};
+
+/** Connected sockets that have both attached to the same transport. */
+static pair<UNIXSocket<TestPacket>*, UNIXSocket<TestPacket>*> mkpair() {
+    int fds[2];
+    REQUIRE( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0 );
+    auto *a = new UNIXSocket<TestPacket>(fds[0]);
+    auto *b = new UNIXSocket<TestPacket>(fds[1]);
+
+    auto shm = ShmTransport::create();
+    uint32_t hello = 1;
+    a->sendFds(&hello, sizeof(hello), shm->fds());
+    vector<int> recv_fds;
+    b->recvFds(&hello, sizeof(hello), &recv_fds, 3, 100);
+    REQUIRE( recv_fds.size() == 3 );
+    a->useShm(std::move(shm));
+    b->useShm(ShmTransport::attach(recv_fds[0], recv_fds[1], recv_fds[2]));
+    return {a, b};
+}
+
+TEST_CASE("Frames through shared memory", "[ShmTransport]") {
+    auto [a, b] = mkpair();
+    vector<TestPacket> out = {{1, 2}, {3, 4}, {5, 6}};
+
+    REQUIRE( !b->waitReadable(0) );
+    a->sendFrame(TestHeader{1, 0}, out.data(), out.size());
+    b->sendFrame(TestHeader{2, 0}, out.data(), 1);
+
+    TestHeader hdr;
+    vector<TestPacket> in;
+    REQUIRE( b->waitReadable(0) );
+    b->recvFrame(&hdr, &in, milliseconds(100));
+    REQUIRE( hdr.seq == 1 );
+    REQUIRE( in.size() == 3 );
+    REQUIRE( in[2].b == 6 );
+    REQUIRE( !b->waitReadable(0) );
+
+    a->recvFrame(&hdr, &in, milliseconds(100));
+    REQUIRE( hdr.seq == 2 );
+    REQUIRE( in.size() == 1 );
+
+    REQUIRE_THROWS_AS( b->recvFrame(&hdr, &in, milliseconds(10)), SocketTimeout );
+
+    delete a;
+    delete b;
+}
+
+TEST_CASE("Frames larger than the ring", "[ShmTransport]") {
+    auto [a, b] = mkpair();
+    size_t num = 3 * ShmTransport::ring_size / sizeof(TestPacket);
+    vector<TestPacket> out(num);
+    for (size_t i = 0; i < num; i++)
+        out[i] = {(int) i, -(int) i};
+
+    thread writer([&, a = a]() {
+        a->sendFrame(TestHeader{7, 0}, out.data(), out.size());
+    });
+
+    TestHeader hdr;
+    vector<TestPacket> in;
+    b->recvFrame(&hdr, &in, milliseconds(1000));
+    writer.join();
+    REQUIRE( hdr.seq == 7 );
+    REQUIRE( in.size() == num );
+    REQUIRE( in[num - 1].a == (int) num - 1 );
+    REQUIRE( in[num - 1].b == -((int) num - 1) );
+
+    delete a;
+    delete b;
+}
+
+TEST_CASE("Wakeup through eventfd", "[ShmTransport]") {
+    auto [a, b] = mkpair();
+
+    // Arm the ring, then check that a write makes the wake fd readable.
+    REQUIRE( !b->waitReadable(0) );
+    TestPacket p = {1, 2};
+    a->send(&p);
+    struct pollfd pfd;
+    pfd.fd = b->getWakeFd();
+    pfd.events = POLLIN;
+    REQUIRE( poll(&pfd, 1, 100) == 1 );
+
+    TestPacket q;
+    b->recv(&q, milliseconds(100));
+    REQUIRE( q.b == 2 );
+
+    delete a;
+    delete b;
+}
+
+TEST_CASE("Closed peer is detected", "[ShmTransport]") {
+    auto [a, b] = mkpair();
+    delete a;
+    TestPacket q;
+    REQUIRE_THROWS_AS( b->recv(&q, milliseconds(100)), SocketError );
+    delete b;
+}
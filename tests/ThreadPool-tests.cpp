@@ -0,0 +1,32 @@
+#include <catch2/catch.hpp>
+#include <atomic>
+#include <stdexcept>
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+TEST_CASE("Results come back through futures", "[ThreadPool]") {
+    ThreadPool pool(4);
+    REQUIRE( pool.size() == 4 );
+    vector<future<int>> results;
+    for (int i = 0; i < 100; i++)
+        results.push_back(pool.submit([i]() { return i * i; }));
+    for (int i = 0; i < 100; i++)
+        REQUIRE( results[i].get() == i * i );
+}
+
+TEST_CASE("Exceptions are passed to the future", "[ThreadPool]") {
+    ThreadPool pool(2);
+    auto fut = pool.submit([]() -> int { throw runtime_error("fail"); });
+    REQUIRE_THROWS_AS( fut.get(), runtime_error );
+}
+
+TEST_CASE("Destructor finishes queued jobs", "[ThreadPool]") {
+    atomic<int> done(0);
+    {
+        ThreadPool pool(2);
+        for (int i = 0; i < 50; i++)
+            pool.submit([&done]() { done++; });
+    }
+    REQUIRE( done == 50 );
+}
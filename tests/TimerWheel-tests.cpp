@@ -0,0 +1,83 @@
+#include <catch2/catch.hpp>
+#include "TimerWheel.hpp"
+
+using namespace std;
+
+TEST_CASE("Timers fire in order of their expiry", "[TimerWheel]") {
+    TimerWheel wheel(1000);
+    vector<pair<TimerWheel::Id, uint64_t>> fired;
+    auto fire = [&](TimerWheel::Id id) { fired.push_back({id, wheel.now()}); };
+
+    // One for each level, and some beyond the top.
+    wheel.add(1, 1010);
+    wheel.add(2, 1000 + 5000);
+    wheel.add(3, 1000 + 300000);
+    wheel.add(4, 1000 + 20000000);
+    wheel.add(5, 1000 + 40000000000ULL);
+    wheel.add(6, 1010);
+    REQUIRE( wheel.size() == 6 );
+    REQUIRE( wheel.nextExpiry() == 1010 );
+
+    wheel.advance(1009, fire);
+    REQUIRE( fired.empty() );
+    wheel.advance(1010, fire);
+    REQUIRE( fired.size() == 2 );
+    REQUIRE( wheel.nextExpiry() == 6000 );
+
+    wheel.advance(1000 + 50000000000ULL, fire);
+    vector<pair<TimerWheel::Id, uint64_t>> expect = {
+        {1, 1010}, {6, 1010}, {2, 6000}, {3, 301000},
+        {4, 20001000}, {5, 40000001000ULL}
+    };
+    REQUIRE( fired == expect );
+    REQUIRE( wheel.empty() );
+}
+
+TEST_CASE("Timers can be added while firing", "[TimerWheel]") {
+    TimerWheel wheel(0);
+    vector<uint64_t> fired;
+    wheel.add(1, 100);
+    // Already due, fires on the first tick.
+    wheel.add(2, 0);
+    wheel.advance(1000, [&](TimerWheel::Id id) {
+        fired.push_back(wheel.now());
+        if (id == 1 && fired.size() < 5)
+            wheel.add(1, wheel.now() + 100);
+    });
+    vector<uint64_t> expect = {1, 100, 200, 300, 400};
+    REQUIRE( fired == expect );
+    REQUIRE( wheel.empty() );
+    REQUIRE( wheel.now() == 1000 );
+}
+
+TEST_CASE("Cancelled timers leave the wheel", "[TimerWheel]") {
+    TimerWheel wheel(1000);
+    vector<TimerWheel::Id> fired;
+    auto fire = [&](TimerWheel::Id id) { fired.push_back(id); };
+
+    for (TimerWheel::Id id = 1; id <= 100; id++) {
+        wheel.add(id, 1000 + 1000000000ULL);
+        REQUIRE( wheel.cancel(id, 1000 + 1000000000ULL) );
+    }
+    REQUIRE( wheel.empty() );
+
+    wheel.add(1, 1050);
+    wheel.add(2, 1000 + 5000);
+    wheel.add(3, 500);
+    wheel.add(4, 1000 + 300000);
+    // Timers are found after they have been cascaded, and when they were
+    // due already.
+    wheel.advance(1000 + 4100, fire);
+    REQUIRE( fired == vector<TimerWheel::Id>{3, 1} );
+    REQUIRE( wheel.cancel(2, 1000 + 5000) );
+    REQUIRE( !wheel.cancel(2, 1000 + 5000) );
+    REQUIRE( !wheel.cancel(1, 1050) );
+    REQUIRE( wheel.size() == 1 );
+    REQUIRE( wheel.nextExpiry() == 1000 + 300000 );
+
+    wheel.add(5, 990);
+    REQUIRE( wheel.cancel(5, 990) );
+    wheel.advance(1000 + 400000, fire);
+    REQUIRE( fired == vector<TimerWheel::Id>{3, 1, 4} );
+    REQUIRE( wheel.empty() );
+}
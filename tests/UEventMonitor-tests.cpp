@@ -0,0 +1,50 @@
+#include <catch2/catch.hpp>
+#include <string>
+#include "UEventMonitor.hpp"
+
+extern "C" {
+    #include <arpa/inet.h>
+    #include <string.h>
+}
+
+using namespace std;
+
+static string udevMessage(const string &props) {
+    unsigned hdr[10] = {0};
+    memcpy(hdr, "libudev", 8);
+    hdr[2] = htonl(0xfeedcafe);
+    hdr[3] = sizeof(hdr);
+    hdr[4] = sizeof(hdr);
+    hdr[5] = props.size();
+    return string((const char *) hdr, sizeof(hdr)) + props;
+}
+
+TEST_CASE("udev messages are parsed", "[UEventMonitor]") {
+    const char props[] = "ACTION=add\0DEVPATH=/devices/virtual/input/input9/event5\0"
+                         "SUBSYSTEM=input\0DEVNAME=/dev/input/event5\0ID_INPUT_KEYBOARD=1\0"
+                         "EMPTY=\0NOEQUALS";
+    string msg = udevMessage(string(props, sizeof(props)));
+    UEvent ev;
+
+    REQUIRE( UEventMonitor::parse(msg.data(), msg.size(), &ev) );
+    REQUIRE( ev.action == "add" );
+    REQUIRE( ev.devpath == "/devices/virtual/input/input9/event5" );
+    REQUIRE( ev.get("SUBSYSTEM") == "input" );
+    REQUIRE( ev.get("DEVNAME") == "/dev/input/event5" );
+    REQUIRE( ev.get("ID_INPUT_KEYBOARD") == "1" );
+    REQUIRE( ev.get("EMPTY") == "" );
+    REQUIRE( ev.props.count("EMPTY") == 1 );
+    REQUIRE( ev.props.count("NOEQUALS") == 0 );
+    REQUIRE( ev.get("NOSUCHKEY") == "" );
+
+    SECTION("Invalid messages are rejected") {
+        REQUIRE( !UEventMonitor::parse(msg.data(), 20, &ev) );
+        REQUIRE( !UEventMonitor::parse(msg.data(), msg.size() - 1, &ev) );
+        string bad = msg;
+        bad[8] ^= 0xff;
+        REQUIRE( !UEventMonitor::parse(bad.data(), bad.size(), &ev) );
+        // Raw kernel events are not accepted.
+        const char kernel[] = "add@/devices/virtual/input/input9\0ACTION=add";
+        REQUIRE( !UEventMonitor::parse(kernel, sizeof(kernel), &ev) );
+    }
+}
@@ -0,0 +1,153 @@
+#include <catch2/catch.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "UNIXSocket.hpp"
+
+extern "C" {
+    #include <pthread.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+struct TestHeader {
+    uint32_t seq;
+    uint32_t count;
+};
+
+struct TestPacket {
+    int a, b;
+};
+
+static pair<UNIXSocket<TestPacket>*, UNIXSocket<TestPacket>*> mkpair() {
+    int fds[2];
+    REQUIRE( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0 );
+    return {new UNIXSocket<TestPacket>(fds[0]), new UNIXSocket<TestPacket>(fds[1])};
+}
+
+TEST_CASE("Send and receive frames", "[UNIXSocket]") {
+    auto [a, b] = mkpair();
+    vector<TestPacket> out = {{1, 2}, {3, 4}, {5, 6}};
+
+    // Several frames queued up before the first one is read.
+    a->sendFrame(TestHeader{1, 0}, out.data(), out.size());
+    a->sendFrame(TestHeader{2, 0}, out.data(), 0);
+    a->sendFrame(TestHeader{3, 0}, out.data(), 1);
+
+    TestHeader hdr;
+    vector<TestPacket> in;
+    b->recvFrame(&hdr, &in, milliseconds(100));
+    REQUIRE( hdr.seq == 1 );
+    REQUIRE( hdr.count == 3 );
+    REQUIRE( in.size() == 3 );
+    REQUIRE( in[2].a == 5 );
+    REQUIRE( in[2].b == 6 );
+
+    // The remaining frames are already buffered.
+    REQUIRE( b->waitReadable(0) );
+    b->recvFrame(&hdr, &in, milliseconds(100));
+    REQUIRE( hdr.seq == 2 );
+    REQUIRE( in.size() == 0 );
+    b->recvFrame(&hdr, &in, milliseconds(100));
+    REQUIRE( hdr.seq == 3 );
+    REQUIRE( in.size() == 1 );
+    REQUIRE( in[0].a == 1 );
+
+    REQUIRE( !b->waitReadable(0) );
+    delete a;
+    delete b;
+}
+
+static void ignoreSignal(int) {}
+
+TEST_CASE("Frames are sent whole when a signal interrupts the write", "[UNIXSocket]") {
+    auto [a, b] = mkpair();
+    // Without SA_RESTART the signal cuts writev() short.
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ignoreSignal;
+    REQUIRE( sigaction(SIGUSR2, &sa, &old_sa) == 0 );
+
+    // Much larger than the socket buffer, so that the writer blocks.
+    vector<TestPacket> out(60000);
+    for (size_t i = 0; i < out.size(); i++)
+        out[i] = {int(i), -int(i)};
+    atomic<bool> failed(false), sent(false);
+    thread writer([&, a = a]() {
+        try {
+            a->sendFrame(TestHeader{7, 0}, out.data(), out.size());
+        } catch (const SocketError &) {
+            failed = true;
+        }
+        sent = true;
+    });
+    for (int i = 0; i < 5 && !sent; i++) {
+        usleep(20000);
+        pthread_kill(writer.native_handle(), SIGUSR2);
+    }
+
+    TestHeader hdr;
+    vector<TestPacket> in;
+    b->recvFrame(&hdr, &in, milliseconds(1000));
+    writer.join();
+    sigaction(SIGUSR2, &old_sa, nullptr);
+
+    REQUIRE( !failed );
+    REQUIRE( hdr.seq == 7 );
+    REQUIRE( in.size() == out.size() );
+    REQUIRE( in.back().a == int(out.size() - 1) );
+    REQUIRE( in.back().b == -int(out.size() - 1) );
+
+    delete a;
+    delete b;
+}
+
+TEST_CASE("Packets and timeouts", "[UNIXSocket]") {
+    auto [a, b] = mkpair();
+    TestPacket p = {7, 8};
+    a->send(&p);
+    a->send(&p);
+
+    TestPacket got;
+    b->recv(&got, milliseconds(100));
+    REQUIRE( got.a == 7 );
+    b->recv(&got);
+    REQUIRE( got.b == 8 );
+
+    REQUIRE_THROWS_AS( b->recv(&got, milliseconds(10)), SocketTimeout );
+
+    // Closing the other end is an error.
+    delete a;
+    REQUIRE( b->waitReadable(0) );
+    REQUIRE_THROWS_AS( b->recv(&got, milliseconds(10)), SocketError );
+    delete b;
+}
+
+TEST_CASE("Reconnect without waiting", "[UNIXSocket]") {
+    const string path = "./unixsocket-test.sock";
+    unlink(path.c_str());
+    UNIXSocket<TestPacket> sock(path, false);
+    REQUIRE( !sock.isConnected() );
+    REQUIRE( !sock.tryRecon() );
+    REQUIRE( !sock.isConnected() );
+
+    {
+        UNIXServer srv(path);
+        REQUIRE( sock.tryRecon() );
+        REQUIRE( sock.isConnected() );
+        int fd = srv.accept();
+        TestPacket p = {7, 8};
+        sock.send(&p);
+        TestPacket got;
+        recvAll(fd, &got, milliseconds(100));
+        REQUIRE( got.a == 7 );
+        ::close(fd);
+    }
+    sock.close();
+    REQUIRE( !sock.isConnected() );
+    unlink(path.c_str());
+}
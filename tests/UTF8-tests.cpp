@@ -0,0 +1,27 @@
+#include <catch2/catch.hpp>
+#include "UTF8.hpp"
+
+using namespace std;
+
+TEST_CASE("Characters of every length are decoded", "[UTF8]") {
+    string s = "a\xc3\xa6\xe2\x82\xac\xf0\x9f\x98\x80";
+    uint32_t cp = 0;
+    REQUIRE( decodeUTF8(s, 0, &cp) == 1 );
+    REQUIRE( cp == 'a' );
+    REQUIRE( decodeUTF8(s, 1, &cp) == 2 );
+    REQUIRE( cp == 0xe6 );
+    REQUIRE( decodeUTF8(s, 3, &cp) == 3 );
+    REQUIRE( cp == 0x20ac );
+    REQUIRE( decodeUTF8(s, 6, &cp) == 4 );
+    REQUIRE( cp == 0x1f600 );
+}
+
+TEST_CASE("Malformed characters are rejected", "[UTF8]") {
+    uint32_t cp;
+    // A continuation byte on its own, and a byte that never starts one.
+    REQUIRE( decodeUTF8("\x80", 0, &cp) == 0 );
+    REQUIRE( decodeUTF8("\xff", 0, &cp) == 0 );
+    // Missing continuation bytes.
+    REQUIRE( decodeUTF8("\xe2\x82", 0, &cp) == 0 );
+    REQUIRE( decodeUTF8("\xe2" "a" "\xac", 0, &cp) == 0 );
+}
@@ -0,0 +1,57 @@
+--[====================================================================================[
+   US keymap for the benchmarks, so that they do not depend on the keymaps
+   installed on the system. Returned in the same shape as the __keymap
+   function of hawck-macrod.
+--]====================================================================================]
+
+local keymap = {
+  Escape = 1, BackSpace = 14, Tab = 15, Return = 28, space = 57,
+  Control = 29, Control_R = 97, Shift = 42, Shift_R = 54, Alt = 56, AltGr = 100,
+  minus = 12, equal = 13, comma = 51, period = 52, slash = 53,
+  apostrophe = 40, semicolon = 39,
+}
+local combo_map = {}
+
+local function addRow(chars, first_code)
+  for i = 1, #chars do
+    local c = chars:sub(i, i)
+    local code = first_code + i - 1
+    keymap[c] = code
+    if c:match("%a") then
+      combo_map[c:upper()] = {keymap.Shift, code}
+    end
+  end
+end
+
+addRow("1234567890", 2)
+addRow("qwertyuiop", 16)
+addRow("asdfghjkl", 30)
+addRow("zxcvbnm", 44)
+
+for i = 1, 10 do
+  keymap["F" .. i] = 58 + i
+end
+keymap.F11 = 87
+keymap.F12 = 88
+
+combo_map.exclam = {keymap.Shift, keymap["1"]}
+combo_map.question = {keymap.Shift, keymap.slash}
+combo_map.colon = {keymap.Shift, keymap.semicolon}
+combo_map.quotedbl = {keymap.Shift, keymap.apostrophe}
+
+local names = {}
+for name, code in pairs(keymap) do
+  names[code] = name
+end
+for code, name in pairs(names) do
+  keymap[code] = name
+end
+
+local mod_codes = {}
+for _, name in ipairs({"Control", "Control_R", "Shift", "Shift_R", "Alt", "AltGr"}) do
+  mod_codes[keymap[name]] = true
+end
+
+return function (lang)
+  return keymap, combo_map, mod_codes
+end
@@ -0,0 +1,324 @@
+/** @file pipeline-bench.cpp
+ *
+ * @brief Benchmark of the key pipeline between InputD and MacroD.
+ *
+ * A mock keyboard types a text, and every key event goes through the
+ * socket protocol to a MacroD loop running real scripts with the Hawck
+ * library. The replies are emitted on a mock IUDevice. Both sides use the
+ * code of the daemons for the protocol, RemoteUDevice and Lua::Script,
+ * but not the daemons themselves, which need a uinput device and the
+ * sockets in /var/lib/hawck-input.
+ *
+ * Usage: hawck-bench <source dir> <bench dir> <results.json> [trace]
+ *
+ * When a trace recorded with `hawck-inputd --record-trace` is given, it is
+ * also run through all the scripts, as fast as it is handled.
+ *
+ * Every result records the Lua implementation it was run with, so that
+ * the results of hawck-bench and hawck-bench-luajit can be compared.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EventTrace.hpp"
+#include "IUDevice.hpp"
+#include "KBDAction.hpp"
+#include "Latency.hpp"
+#include "LuaUtils.hpp"
+#include "RemoteUDevice.hpp"
+#include "UNIXSocket.hpp"
+
+extern "C" {
+    #include <sys/socket.h>
+    #include <string.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+/** Text typed in every scenario. */
+static const char *corpus =
+    "hello world this is a benchmark of the hawck key pipeline "
+    "pack my box with five dozen liquor jugs ";
+/** Times that the corpus is typed. */
+static const int corpus_repeats = 20;
+
+/** IUDevice that only counts what it is given. */
+class MockUDevice : public IUDevice {
+public:
+    size_t num_events = 0;
+    size_t num_flushes = 0;
+
+    virtual void emit(const input_event *) override {
+        num_events++;
+    }
+
+    virtual void emit(int, int, int) override {
+        num_events++;
+    }
+
+    virtual void done() override {}
+
+    virtual void flush() override {
+        num_flushes++;
+    }
+};
+
+/** Keyboard that types a text, in SYN_REPORT frames like evdev. Only
+ *  lower case letters, digits and spaces are typed. */
+class MockKeyboard {
+    vector<vector<input_event>> frames;
+    size_t pos = 0;
+
+    static input_event mkEvent(int type, int code, int value) {
+        input_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = type;
+        ev.code = code;
+        ev.value = value;
+        return ev;
+    }
+
+    static int keyCode(char c) {
+        static const char *rows[] = {"1234567890", "qwertyuiop", "asdfghjkl", "zxcvbnm"};
+        static const int first[] = {KEY_1, KEY_Q, KEY_A, KEY_Z};
+        if (c == ' ')
+            return KEY_SPACE;
+        for (int r = 0; r < 4; r++)
+            if (const char *p = strchr(rows[r], c))
+                return first[r] + int(p - rows[r]);
+        return -1;
+    }
+
+public:
+    MockKeyboard(const string &text, int repeats) {
+        for (int i = 0; i < repeats; i++) {
+            for (char c : text) {
+                int code = keyCode(c);
+                if (code < 0)
+                    continue;
+                for (int value : {1, 0})
+                    frames.push_back({mkEvent(EV_MSC, MSC_SCAN, code),
+                                      mkEvent(EV_KEY, code, value),
+                                      mkEvent(EV_SYN, SYN_REPORT, 0)});
+            }
+        }
+    }
+
+    /** Replay the frames of a trace instead. */
+    explicit MockKeyboard(const EventTraceReader &trace) {
+        for (size_t i = 0; i < trace.size();) {
+            size_t end = trace.frameEnd(i);
+            frames.emplace_back();
+            for (; i < end; i++)
+                frames.back().push_back(mkEvent(trace[i].type, trace[i].code, trace[i].value));
+        }
+    }
+
+    /** @return The next frame, or nullptr when the text has been typed. */
+    const vector<input_event> *next() {
+        return pos < frames.size() ? &frames[pos++] : nullptr;
+    }
+};
+
+struct Scenario {
+    string name;
+    /** Scripts from the bench directory, run in this order. */
+    vector<string> scripts;
+    /** Trace to replay instead of typing the corpus. */
+    shared_ptr<EventTraceReader> trace;
+};
+
+struct Results {
+    size_t keys = 0;
+    size_t frames = 0;
+    size_t events_out = 0;
+    double seconds = 0;
+    /** From reading a key to emitting the reply. */
+    LatencyHistogram key_lat;
+    /** Time spent in Lua by MacroD. */
+    LatencyHistogram lua_lat;
+};
+
+/** Set up a Lua state the way MacroD does, with the keymap of the
+ *  benchmarks instead of the system ones. */
+static unique_ptr<Lua::Script> loadScript(const string &src_dir, const string &bench_dir,
+                                          const string &path, RemoteUDevice *udev)
+{
+    auto sc = make_unique<Lua::Script>();
+    sc->src = path;
+    sc->exec("bench", "package.path = '" + src_dir + "/src/Lua/?.lua;" + src_dir + "/?.lua;' .. package.path\n"
+                      "package.loaded.cfg = {keymap = 'us'}\n"
+                      "__keymap = dofile('" + bench_dir + "/keymap.lua')\n");
+    sc->call("require", "init");
+    sc->open(udev, "udev");
+    sc->from(path);
+    return sc;
+}
+
+/** The main loop of MacroD, until InputD hangs up. */
+static void macrodLoop(UNIXSocket<KBDAction> *conn, RemoteUDevice *udev,
+                       vector<unique_ptr<Lua::Script>> *scripts, Results *res)
+{
+    static string kbd_name = "bench";
+    Lua::InternedString kbd_hid {0, &kbd_name};
+    using MatchSig = std::tuple<bool>(int, int, int, Lua::InternedString);
+    vector<Lua::Script::Prepared<MatchSig>> matches;
+    for (auto &sc : *scripts)
+        matches.push_back(sc->prepare<MatchSig>("__match"));
+    KBDAction action;
+    for (;;) {
+        try {
+            conn->recv(&action);
+        } catch (const SocketError &) {
+            return;
+        }
+        action.ts.recv = monotonicNanos();
+        udev->begin(action);
+
+        bool repeat = true;
+        for (const auto &match : matches) {
+            try {
+                auto [succ] = match((int) action.ev.value,
+                                    (int) action.ev.code,
+                                    (int) action.ev.type,
+                                    kbd_hid);
+                if (!(repeat = !succ))
+                    break;
+            } catch (const Lua::LuaError &e) {
+                cerr << "Lua error: " << e.fmtReport() << endl;
+            }
+        }
+        res->lua_lat.since(action.ts.recv);
+
+        if (repeat)
+            udev->emit(&action.ev);
+        udev->done();
+    }
+}
+
+/** The InputD side, keys go to MacroD and everything else is emitted
+ *  directly. Waits for the reply to each key before going on. */
+static void inputdLoop(UNIXSocket<KBDAction> *conn, MockKeyboard *kbd,
+                       MockUDevice *out, Results *res)
+{
+    uint32_t seq = 0;
+    KBDFrame frame;
+    vector<input_event> reply;
+    auto start = steady_clock::now();
+    while (const vector<input_event> *evs = kbd->next()) {
+        res->frames++;
+        for (const auto &ev : *evs) {
+            if (ev.type != EV_KEY) {
+                out->emit(&ev);
+                continue;
+            }
+            KBDAction action;
+            memset(&action, 0, sizeof(action));
+            action.seq = ++seq;
+            action.ev = ev;
+            action.ts.read = action.ts.sent = monotonicNanos();
+            conn->send(&action);
+            do {
+                conn->recvFrame(&frame, &reply, milliseconds(1024));
+                for (const auto &rev : reply)
+                    out->emit(&rev);
+            } while (!(frame.flags & KBD_FRAME_DONE));
+            res->key_lat.since(action.ts.read);
+            res->keys++;
+        }
+        out->flush();
+    }
+    res->seconds = duration<double>(steady_clock::now() - start).count();
+    res->events_out = out->num_events;
+}
+
+static void writeLatency(ostream &os, const LatencyHistogram &h) {
+    os << "{\"p50_us\": " << h.percentile(50) / 1e3
+       << ", \"p90_us\": " << h.percentile(90) / 1e3
+       << ", \"p99_us\": " << h.percentile(99) / 1e3
+       << ", \"max_us\": " << h.max() / 1e3
+       << ", \"mean_us\": " << h.mean() / 1e3 << "}";
+}
+
+static void runScenario(const Scenario &sn, const string &src_dir,
+                        const string &bench_dir, ostream &json)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw SystemError("Unable to create socket pair: ", errno);
+    auto inputd_conn = make_unique<UNIXSocket<KBDAction>>(fds[0]);
+    auto macrod_conn = make_unique<UNIXSocket<KBDAction>>(fds[1]);
+
+    RemoteUDevice udev(macrod_conn.get());
+    vector<unique_ptr<Lua::Script>> scripts;
+    for (const auto &name : sn.scripts)
+        scripts.push_back(loadScript(src_dir, bench_dir,
+                                     bench_dir + "/scripts/" + name, &udev));
+
+    Results res;
+    MockKeyboard kbd = sn.trace ? MockKeyboard(*sn.trace) : MockKeyboard(corpus, corpus_repeats);
+    MockUDevice out;
+    thread macrod(macrodLoop, macrod_conn.get(), &udev, &scripts, &res);
+    inputdLoop(inputd_conn.get(), &kbd, &out, &res);
+    inputd_conn.reset();
+    macrod.join();
+
+    double keys_per_sec = res.keys / res.seconds;
+    cout << sn.name << ": " << res.keys << " keys, "
+         << keys_per_sec << " keys/s, p99 "
+         << res.key_lat.percentile(99) / 1e3 << " us" << endl;
+
+    json << "  {\"scenario\": \"" << sn.name << "\""
+         << ", \"backend\": \"" << HAWCK_LUA_RELEASE << "\""
+         << ", \"keys\": " << res.keys
+         << ", \"frames\": " << res.frames
+         << ", \"events_out\": " << res.events_out
+         << ", \"seconds\": " << res.seconds
+         << ", \"keys_per_sec\": " << keys_per_sec
+         << ", \"events_out_per_sec\": " << res.events_out / res.seconds
+         << ", \"key_latency\": ";
+    writeLatency(json, res.key_lat);
+    json << ", \"lua_latency\": ";
+    writeLatency(json, res.lua_lat);
+    json << "}";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4 && argc != 5) {
+        cerr << "Usage: " << argv[0] << " <source dir> <bench dir> <results.json> [trace]" << endl;
+        return 1;
+    }
+    string src_dir = argv[1], bench_dir = argv[2];
+
+    vector<Scenario> scenarios = {
+        {"passthrough", {}},
+        {"example", {"example.lua"}},
+        {"patterns", {"patterns.lua"}},
+        {"typing", {"typing.lua"}},
+        {"all", {"example.lua", "patterns.lua", "typing.lua"}},
+    };
+
+    cout << "Running scripts with " << HAWCK_LUA_RELEASE << endl;
+    ofstream json(argv[3]);
+    json << "[\n";
+    try {
+        if (argc == 5)
+            scenarios.push_back({"trace", {"example.lua", "patterns.lua", "typing.lua"},
+                                 make_shared<EventTraceReader>(argv[4])});
+        for (size_t i = 0; i < scenarios.size(); i++) {
+            runScenario(scenarios[i], src_dir, bench_dir, json);
+            json << (i + 1 < scenarios.size() ? ",\n" : "\n");
+        }
+    } catch (const exception &e) {
+        cerr << "Benchmark failed: " << e.what() << endl;
+        return 1;
+    }
+    json << "]\n";
+    return 0;
+}
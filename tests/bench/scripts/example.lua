@@ -0,0 +1,12 @@
+-- The generated code of macro-scripts/example.hwk, with the actions
+-- replaced by ones that do not start any processes.
+
+require "init"
+
+__match[down] = MatchScope.new(function (__match)
+  __match[ctrl  + alt + key "h"] = function () end
+
+  __match[shift + alt + key "w"] = function () end
+
+  __match[ctrl  + alt + key "k"] = function () end
+end)
@@ -0,0 +1,26 @@
+-- A large set of patterns, none of which match what is being typed.
+
+require "init"
+
+local letters = "qwertyuiopasdfghjklzxcvbnm"
+local count = 0
+
+__match[down] = MatchScope.new(function (__match)
+  for i = 1, #letters do
+    local c = letters:sub(i, i)
+    __match[ctrl + alt + key(c)] = function () count = count + 1 end
+    __match[ctrl + shift + key(c)] = function () count = count + 1 end
+    __match[alt + shift + key(c)] = function () count = count + 1 end
+    __match[ctrl + alt + shift + key(c)] = function () count = count + 1 end
+  end
+  for i = 1, 12 do
+    __match[ctrl + key("F" .. i)] = function () count = count + 1 end
+    __match[alt + key("F" .. i)] = function () count = count + 1 end
+  end
+end)
+
+__match[up] = MatchScope.new(function (__match)
+  for i = 1, #letters do
+    __match[ctrl + alt + key(letters:sub(i, i))] = function () count = count + 1 end
+  end
+end)
@@ -0,0 +1,6 @@
+-- Text macros, every "e" is replaced with a whole sentence.
+
+require "init"
+
+__match[down + key "e"] = write "The quick brown fox jumps over the lazy dog."
+__match[key "e"] = function () end